@@ -0,0 +1,249 @@
+#include "capture.h"
+#include "adaptiverate.h"
+#include "motion.h"
+#include "events.h"
+
+/*
+
+Motion adaptive frame rate and GOP length.
+
+While motion detection sees nothing, a static scene is encoded over and
+over at the full frame rate. After idle_after_ms without motion every
+H.264 channel drops to idle_fps with a GOP of idle_gop_seconds; as soon as
+motion_status shows motion again the configured frame rate and GOP come
+back and an IDR is requested, so a viewer gets a clean picture at once.
+
+The saving is judged against what the same quiet scene cost at the full
+frame rate, measured in the idle_after_ms before every switch to idle.
+It is logged and published per channel every report_interval_s.
+
+A motion thread that stopped delivering results looks like a quiet
+scene, so motion_status.updated_ms is checked as well: until the first
+result and while it is stale the channels are treated as if there was
+motion.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+static AdaptiveRateChannel channels[MAX_ENCODERS];
+static int num_channels = 0;
+
+
+static uint32_t monotonic_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+static int set_channel_rate(EncoderSetting *encoder, uint32_t fps_num, uint32_t fps_den, int gop)
+{
+  int ret;
+  IMPEncoderFrmRate frame_rate;
+  IMPEncoderGOPSizeCfg gop_size;
+
+  frame_rate.frmRateNum = fps_num;
+  frame_rate.frmRateDen = fps_den;
+  ret = IMP_Encoder_SetChnFrmRate(encoder->channel, &frame_rate);
+  if (ret < 0) {
+    log_error("IMP_Encoder_SetChnFrmRate(%d) failed", encoder->channel);
+    return -1;
+  }
+
+  gop_size.gopsize = gop;
+  ret = IMP_Encoder_SetGOPSize(encoder->channel, &gop_size);
+  if (ret < 0) {
+    log_error("IMP_Encoder_SetGOPSize(%d) failed", encoder->channel);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static void enter_idle(AdaptiveRateSettings *settings, uint32_t now)
+{
+  int i;
+  uint32_t bytes;
+  AdaptiveRateChannel *channel;
+
+  for (i = 0; i < num_channels; i++) {
+    channel = &channels[i];
+    bytes = channel->encoder->stats.bytes;
+
+    if (now != channel->quiet_ms) {
+      channel->static_rate = (double)(bytes - channel->quiet_bytes) / (now - channel->quiet_ms);
+    }
+    channel->idle_bytes = bytes;
+    channel->idle_ms = now;
+
+    set_channel_rate(channel->encoder, settings->idle_fps, 1,
+                     settings->idle_fps * settings->idle_gop_seconds);
+  }
+
+  publish_event("adaptive_rate", "\"state\":\"idle\",\"fps\":%d", settings->idle_fps);
+}
+
+
+// Add the idle time since idle_ms to the totals
+static void account_idle(AdaptiveRateChannel *channel, uint32_t now)
+{
+  uint32_t bytes = channel->encoder->stats.bytes;
+  uint32_t idle_bytes = bytes - channel->idle_bytes;
+  uint32_t idle_ms = now - channel->idle_ms;
+
+  channel->total_idle_ms += idle_ms;
+  channel->total_idle_bytes += idle_bytes;
+  channel->saved_bytes += channel->static_rate * idle_ms - idle_bytes;
+
+  channel->idle_bytes = bytes;
+  channel->idle_ms = now;
+}
+
+
+static void leave_idle(uint32_t now)
+{
+  int i;
+  EncoderSetting *encoder;
+
+  for (i = 0; i < num_channels; i++) {
+    encoder = channels[i].encoder;
+
+    // The frame rate first, the IDR is then sent at the full rate
+    if (set_channel_rate(encoder, encoder->frame_rate_numerator, encoder->frame_rate_denominator,
+                         encoder->max_group_of_pictures) == 0) {
+      IMP_Encoder_RequestIDR(encoder->channel);
+    }
+    account_idle(&channels[i], now);
+  }
+
+  publish_event("adaptive_rate", "\"state\":\"active\"");
+}
+
+
+static void report_savings(uint32_t now, uint32_t start_ms, int idle)
+{
+  int i;
+  AdaptiveRateChannel *channel;
+  uint32_t idle_percent, saved_percent;
+
+  for (i = 0; i < num_channels; i++) {
+    channel = &channels[i];
+    if (idle) {
+      account_idle(channel, now);
+    }
+
+    idle_percent = now != start_ms ? channel->total_idle_ms * 100 / (now - start_ms) : 0;
+    // Of what the idle periods would have cost at the full frame rate
+    saved_percent = 0;
+    if (channel->saved_bytes > 0) {
+      saved_percent = channel->saved_bytes * 100 / (channel->saved_bytes + channel->total_idle_bytes);
+    }
+
+    log_info("Adaptive rate channel %d: idle %u%% of the time, saved %.0f KB (%u%% while idle)",
+             channel->encoder->channel, idle_percent, channel->saved_bytes / 1024, saved_percent);
+    publish_event("adaptive_rate", "\"channel\":%d,\"idle_percent\":%u,\"saved_kbytes\":%.0f,\"saved_percent\":%u",
+                  channel->encoder->channel, idle_percent, channel->saved_bytes / 1024, saved_percent);
+  }
+}
+
+
+// This is the entrypoint for the adaptive rate thread. It follows
+// motion_status every poll_interval_ms.
+void *adaptive_rate_entry_start(void *adaptive_rate_thread_params)
+{
+  int i;
+  int idle = 0;
+  int quiet = 0;
+  int stale = 0;
+  uint32_t now, start_ms, last_report_ms, motion_ms, motion_timeout_ms;
+  CameraConfig *camera_config = (CameraConfig *)adaptive_rate_thread_params;
+  AdaptiveRateSettings *settings = &camera_config->adaptive_rate;
+  MotionSettings *motion = &camera_config->motion;
+  EncoderSetting *encoder;
+
+  // Lowering the frame rate of MJPEG channels would only make snapshots
+  // stale, channels already at idle_fps have nothing to save and
+  // replayed channels have no encoder
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    encoder = &camera_config->encoders[i];
+    if (strcmp(encoder->payload_type, "PT_H264") != 0 || encoder->replay_file[0] != '\0' ||
+        encoder->frame_rate_numerator <= settings->idle_fps * encoder->frame_rate_denominator) {
+      continue;
+    }
+    memset(&channels[num_channels], 0, sizeof(AdaptiveRateChannel));
+    channels[num_channels].encoder = encoder;
+    num_channels++;
+  }
+
+  if (num_channels == 0) {
+    log_warn("No encoder channel can use an adaptive frame rate");
+    return NULL;
+  }
+
+  // The motion thread looks at a result every poll_interval_ms (IVS) or
+  // frame (software)
+  motion_timeout_ms = 3 * (motion->method == MOTION_METHOD_SOFTWARE && motion->fps > 0 ?
+                           1000 / motion->fps : motion->poll_interval_ms);
+  if (motion_timeout_ms < ADAPTIVE_RATE_MOTION_TIMEOUT_MS) {
+    motion_timeout_ms = ADAPTIVE_RATE_MOTION_TIMEOUT_MS;
+  }
+
+  start_ms = monotonic_ms();
+  last_report_ms = start_ms;
+
+  while(!sigint_received) {
+    usleep(settings->poll_interval_ms * 1000);
+    now = monotonic_ms();
+
+    // Nothing is known before the first result, the timeout is counted
+    // from the start until then
+    motion_ms = motion_status.updated_ms;
+    if (motion_ms != 0 && now - motion_ms < motion_timeout_ms) {
+      if (stale) {
+        log_info("Motion results are back");
+      }
+      stale = 0;
+    }
+    else {
+      if (!stale && now - (motion_ms != 0 ? motion_ms : start_ms) >= motion_timeout_ms) {
+        log_warn("No motion results for %u ms, keeping the full frame rate",
+                 now - (motion_ms != 0 ? motion_ms : start_ms));
+        stale = 1;
+      }
+      motion_ms = 0;
+    }
+
+    if (motion_status.active_rois || motion_ms == 0) {
+      quiet = 0;
+      if (idle) {
+        idle = 0;
+        leave_idle(now);
+      }
+    }
+    else if (!quiet) {
+      quiet = 1;
+      for (i = 0; i < num_channels; i++) {
+        channels[i].quiet_bytes = channels[i].encoder->stats.bytes;
+        channels[i].quiet_ms = now;
+      }
+    }
+    else if (!idle && now - channels[0].quiet_ms >= settings->idle_after_ms) {
+      idle = 1;
+      enter_idle(settings, now);
+    }
+
+    if (settings->report_interval_s > 0 && now - last_report_ms >= settings->report_interval_s * 1000) {
+      last_report_ms = now;
+      report_savings(now, start_ms, idle);
+    }
+  }
+
+  if (idle) {
+    leave_idle(monotonic_ms());
+  }
+
+  return NULL;
+}
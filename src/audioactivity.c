@@ -0,0 +1,274 @@
+#include "audioactivity.h"
+#include "events.h"
+#include "log.h"
+#include <math.h>
+#include <stdlib.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+
+Sound activity detection on the PCM frames as they are captured. Each
+frame is reduced to its RMS and peak level and its zero crossing rate,
+which are compared against a slowly adapting noise floor. The result is
+debounced and published as "sound" start/stop events.
+
+*/
+
+#define LEVELS_BLOCK_SIZE   256
+
+// The block kernels add up the squares (scaled down to fit a 32 bit block
+// sum), the peak and the zero crossings of samples[start .. end). All
+// variants give bit identical results:
+//
+//   block_squares += (value * value) >> 8
+//   peak = max(peak, |value|)
+//   crossings += i > 0 && (samples[i - 1] ^ samples[i]) < 0
+//
+// The portable version is what runs on the T20. SSE2 and NEON builds take
+// 8 samples at a time, with min / max for the peak so -32768 needs no
+// abs, and a sign compare against the samples shifted by one for the
+// crossings.
+
+static inline void levels_block_c(const int16_t *samples, uint32_t start, uint32_t end,
+                                  int32_t *block_squares, int32_t *peak, uint32_t *crossings)
+{
+  uint32_t i;
+  int32_t value;
+
+  for (i = start; i < end; i++) {
+    value = samples[i];
+    *block_squares += (value * value) >> 8;
+    *peak = abs(value) > *peak ? abs(value) : *peak;
+    *crossings += i > 0 && (samples[i - 1] ^ samples[i]) < 0;
+  }
+}
+
+#if defined(__SSE2__)
+
+static void levels_block(const int16_t *samples, uint32_t start, uint32_t end,
+                         int32_t *block_squares, int32_t *peak, uint32_t *crossings)
+{
+  int j;
+  uint32_t i = start;
+  int32_t squares_lanes[4];
+  int16_t high_lanes[8], low_lanes[8], crossing_lanes[8];
+  __m128i squares = _mm_setzero_si128();
+  __m128i high = _mm_setzero_si128();
+  __m128i low = _mm_setzero_si128();
+  __m128i crossing = _mm_setzero_si128();
+
+  // The first sample has none before it to cross from
+  if (i == 0 && i < end) {
+    levels_block_c(samples, 0, 1, block_squares, peak, crossings);
+    i = 1;
+  }
+
+  for (; i + 8 <= end; i += 8) {
+    __m128i value = _mm_loadu_si128((const __m128i *)(samples + i));
+    __m128i previous = _mm_loadu_si128((const __m128i *)(samples + i - 1));
+    __m128i product_low = _mm_mullo_epi16(value, value);
+    __m128i product_high = _mm_mulhi_epi16(value, value);
+
+    squares = _mm_add_epi32(squares, _mm_srli_epi32(_mm_unpacklo_epi16(product_low, product_high), 8));
+    squares = _mm_add_epi32(squares, _mm_srli_epi32(_mm_unpackhi_epi16(product_low, product_high), 8));
+    high = _mm_max_epi16(high, value);
+    low = _mm_min_epi16(low, value);
+    // -1 in the lanes where the sign changed
+    crossing = _mm_sub_epi16(crossing, _mm_srai_epi16(_mm_xor_si128(value, previous), 15));
+  }
+
+  _mm_storeu_si128((__m128i *)squares_lanes, squares);
+  _mm_storeu_si128((__m128i *)high_lanes, high);
+  _mm_storeu_si128((__m128i *)low_lanes, low);
+  _mm_storeu_si128((__m128i *)crossing_lanes, crossing);
+
+  for (j = 0; j < 4; j++) {
+    *block_squares += squares_lanes[j];
+  }
+  for (j = 0; j < 8; j++) {
+    *peak = high_lanes[j] > *peak ? high_lanes[j] : *peak;
+    *peak = -low_lanes[j] > *peak ? -low_lanes[j] : *peak;
+    *crossings += crossing_lanes[j];
+  }
+
+  levels_block_c(samples, i, end, block_squares, peak, crossings);
+}
+
+#elif defined(__ARM_NEON)
+
+static void levels_block(const int16_t *samples, uint32_t start, uint32_t end,
+                         int32_t *block_squares, int32_t *peak, uint32_t *crossings)
+{
+  int j;
+  uint32_t i = start;
+  uint32_t squares_lanes[4];
+  int16_t high_lanes[8], low_lanes[8], crossing_lanes[8];
+  uint32x4_t squares = vdupq_n_u32(0);
+  int16x8_t high = vdupq_n_s16(0);
+  int16x8_t low = vdupq_n_s16(0);
+  int16x8_t crossing = vdupq_n_s16(0);
+
+  // The first sample has none before it to cross from
+  if (i == 0 && i < end) {
+    levels_block_c(samples, 0, 1, block_squares, peak, crossings);
+    i = 1;
+  }
+
+  for (; i + 8 <= end; i += 8) {
+    int16x8_t value = vld1q_s16(samples + i);
+    int16x8_t previous = vld1q_s16(samples + i - 1);
+    int32x4_t product_low = vmull_s16(vget_low_s16(value), vget_low_s16(value));
+    int32x4_t product_high = vmull_s16(vget_high_s16(value), vget_high_s16(value));
+
+    squares = vaddq_u32(squares, vshrq_n_u32(vreinterpretq_u32_s32(product_low), 8));
+    squares = vaddq_u32(squares, vshrq_n_u32(vreinterpretq_u32_s32(product_high), 8));
+    high = vmaxq_s16(high, value);
+    low = vminq_s16(low, value);
+    // -1 in the lanes where the sign changed
+    crossing = vsubq_s16(crossing, vshrq_n_s16(veorq_s16(value, previous), 15));
+  }
+
+  vst1q_u32(squares_lanes, squares);
+  vst1q_s16(high_lanes, high);
+  vst1q_s16(low_lanes, low);
+  vst1q_s16(crossing_lanes, crossing);
+
+  for (j = 0; j < 4; j++) {
+    *block_squares += squares_lanes[j];
+  }
+  for (j = 0; j < 8; j++) {
+    *peak = high_lanes[j] > *peak ? high_lanes[j] : *peak;
+    *peak = -low_lanes[j] > *peak ? -low_lanes[j] : *peak;
+    *crossings += crossing_lanes[j];
+  }
+
+  levels_block_c(samples, i, end, block_squares, peak, crossings);
+}
+
+#else
+
+static void levels_block(const int16_t *samples, uint32_t start, uint32_t end,
+                         int32_t *block_squares, int32_t *peak, uint32_t *crossings)
+{
+  levels_block_c(samples, start, end, block_squares, peak, crossings);
+}
+
+#endif
+
+
+// One pass over the frame in fixed size blocks, each block sum of squares
+// stays within 32 bits
+void audio_frame_levels(const int16_t *samples, uint32_t count, AudioLevels *levels)
+{
+  uint32_t block, block_end;
+  uint64_t sum_squares = 0;
+  int32_t block_squares;
+  int32_t peak = 0;
+  uint32_t crossings = 0;
+  double rms;
+
+  for (block = 0; block < count; block += LEVELS_BLOCK_SIZE) {
+    block_end = block + LEVELS_BLOCK_SIZE < count ? block + LEVELS_BLOCK_SIZE : count;
+    block_squares = 0;
+    levels_block(samples, block, block_end, &block_squares, &peak, &crossings);
+    sum_squares += block_squares;
+  }
+
+  rms = count > 0 ? sqrt((double)sum_squares * 256 / count) : 0;
+
+  // Digital silence would be -inf
+  levels->rms_db = rms > 1 ? 20 * log10(rms / 32768.0) : -90.3;
+  levels->peak_db = peak > 1 ? 20 * log10(peak / 32768.0) : -90.3;
+  levels->zero_crossings = crossings;
+}
+
+
+// Frame counts and floor steps come from the frame length, which depends
+// on samples_per_frame and sample_rate
+void audio_activity_init(AudioActivity *activity, int samples_per_frame, int sample_rate)
+{
+  double frame_ms = (double)samples_per_frame * 1000 / sample_rate;
+
+  activity->on_frames = (int)ceil(AUDIO_ACTIVITY_ON_MS / frame_ms);
+  activity->off_frames = (int)ceil(AUDIO_ACTIVITY_OFF_MS / frame_ms);
+  if (activity->on_frames < 1) activity->on_frames = 1;
+  if (activity->off_frames < 1) activity->off_frames = 1;
+  activity->floor_fall = 1 - exp(-frame_ms / AUDIO_NOISE_FLOOR_FALL_MS);
+  activity->floor_rise_db = AUDIO_NOISE_FLOOR_RISE_DB_PER_S * frame_ms / 1000;
+
+  activity->noise_floor_db = -60.0;
+  activity->active = 0;
+  activity->voice = 0;
+  activity->on_count = 0;
+  activity->off_count = 0;
+  activity->event_peak_db = -90.3;
+}
+
+
+void audio_activity_update(AudioActivity *activity, const int16_t *samples, uint32_t count, int sample_rate)
+{
+  AudioLevels levels;
+  int above_floor;
+  uint32_t crossings_per_second;
+
+  if (count == 0) {
+    return;
+  }
+
+  audio_frame_levels(samples, count, &levels);
+  crossings_per_second = (uint64_t)levels.zero_crossings * sample_rate / count;
+
+  above_floor = levels.rms_db > activity->noise_floor_db + AUDIO_ACTIVITY_MARGIN_DB;
+
+  // The floor follows quiet frames down quickly and creeps up slowly
+  // (1 dB every 4 seconds) so a long sound is not learned as noise
+  // straight away
+  if (levels.rms_db < activity->noise_floor_db) {
+    activity->noise_floor_db += (levels.rms_db - activity->noise_floor_db) * activity->floor_fall;
+  }
+  else if (!above_floor) {
+    activity->noise_floor_db += activity->floor_rise_db;
+  }
+
+  if (above_floor) {
+    activity->off_count = 0;
+    activity->on_count++;
+    if (levels.peak_db > activity->event_peak_db) {
+      activity->event_peak_db = levels.peak_db;
+    }
+    if (crossings_per_second < AUDIO_VOICE_MAX_CROSSINGS) {
+      activity->voice = 1;
+    }
+  }
+  else {
+    activity->on_count = 0;
+    activity->off_count++;
+
+    // Forget short blips that never became an event
+    if (!activity->active) {
+      activity->voice = 0;
+      activity->event_peak_db = -90.3;
+    }
+  }
+
+  if (!activity->active && activity->on_count >= activity->on_frames) {
+    activity->active = 1;
+    publish_event("sound", "\"state\":\"start\",\"rms_db\":%.1f,\"peak_db\":%.1f,"
+                  "\"noise_floor_db\":%.1f,\"voice\":%d",
+                  levels.rms_db, levels.peak_db, activity->noise_floor_db,
+                  crossings_per_second < AUDIO_VOICE_MAX_CROSSINGS);
+  }
+  else if (activity->active && activity->off_count >= activity->off_frames) {
+    publish_event("sound", "\"state\":\"stop\",\"peak_db\":%.1f,"
+                  "\"noise_floor_db\":%.1f,\"voice\":%d",
+                  activity->event_peak_db, activity->noise_floor_db, activity->voice);
+    activity->active = 0;
+    activity->voice = 0;
+    activity->event_peak_db = -90.3;
+  }
+}
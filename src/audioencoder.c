@@ -0,0 +1,139 @@
+#include "capture.h"
+#include "audioencoder.h"
+#include <errno.h>
+#include <sys/uio.h>
+
+/*
+
+Compressed audio output. PCM frames from the AI channel are handed to an
+IMP audio encoder channel (G.711 A-law/u-law or G.726) and the encoded
+frames are written to audio.output_path, usually a FIFO read by the
+process that muxes audio with the video streams.
+
+*/
+
+static int audio_output_fd = -1;
+static int audio_output_refused = 0;
+static uint32_t audio_packet_seq = 0;
+
+
+// Opening a FIFO for writing fails until somebody reads it, so the output
+// is (re)opened lazily from the audio thread instead of blocking startup.
+// Nothing is created: a regular file in the RAM backed /tmp would grow
+// until the camera runs out of memory.
+static int open_audio_output(AudioSettings *audio_settings)
+{
+  struct stat output_stat;
+
+  if (audio_output_fd >= 0) {
+    return 0;
+  }
+
+  audio_output_fd = open(audio_settings->output_path, O_WRONLY | O_NONBLOCK);
+  if (audio_output_fd < 0) {
+    return -1;
+  }
+
+  if (fstat(audio_output_fd, &output_stat) != 0 ||
+      (!S_ISFIFO(output_stat.st_mode) && !S_ISSOCK(output_stat.st_mode))) {
+    if (!audio_output_refused) {
+      log_error("Audio output %s is not a FIFO, nothing is written to it", audio_settings->output_path);
+      audio_output_refused = 1;
+    }
+    close(audio_output_fd);
+    audio_output_fd = -1;
+    return -1;
+  }
+  audio_output_refused = 0;
+
+  log_info("Opened audio output %s", audio_settings->output_path);
+
+  return 0;
+}
+
+
+int initialize_audio_encoder(AudioSettings *audio_settings)
+{
+  int ret;
+  IMPAudioEncChnAttr encoder_attr;
+
+  if (audio_settings->payload_type == PT_PCM) {
+    log_info("Audio encoding not configured.");
+    return 0;
+  }
+
+  log_info("Initializing %s audio encoder", audio_settings->codec);
+
+  memset(&encoder_attr, 0, sizeof(IMPAudioEncChnAttr));
+  encoder_attr.type = audio_settings->payload_type;
+  encoder_attr.bufSize = 20;
+
+  ret = IMP_AENC_CreateChn(AUDIO_ENCODER_CHANNEL, &encoder_attr);
+  if (ret != 0) {
+    log_error("IMP_AENC_CreateChn(%d) failed", AUDIO_ENCODER_CHANNEL);
+    return -1;
+  }
+
+  open_audio_output(audio_settings);
+
+  return 0;
+}
+
+
+// Encode one PCM frame and write the result with its header. The frame
+// keeps the timestamp IMP_AI_GetFrame gave it.
+int encode_audio_frame(AudioSettings *audio_settings, IMPAudioFrame *audio_frame)
+{
+  int ret;
+  IMPAudioStream stream;
+  AudioPacketHeader header;
+  struct iovec iov[2];
+
+  if (audio_settings->payload_type == PT_PCM) {
+    return 0;
+  }
+
+  ret = IMP_AENC_SendFrame(AUDIO_ENCODER_CHANNEL, audio_frame);
+  if (ret != 0) {
+    log_error("IMP_AENC_SendFrame failed");
+    return -1;
+  }
+
+  ret = IMP_AENC_PollingStream(AUDIO_ENCODER_CHANNEL, 1000);
+  if (ret != 0) {
+    log_error("Timeout while polling for encoded audio");
+    return -1;
+  }
+
+  ret = IMP_AENC_GetStream(AUDIO_ENCODER_CHANNEL, &stream, BLOCK);
+  if (ret != 0) {
+    log_error("IMP_AENC_GetStream failed");
+    return -1;
+  }
+
+  if (open_audio_output(audio_settings) == 0) {
+    header.magic = AUDIO_PACKET_MAGIC;
+    header.payload_type = audio_settings->payload_type;
+    header.timestamp = audio_frame->timeStamp;
+    header.seq = audio_packet_seq++;
+    header.length = stream.len;
+
+    iov[0].iov_base = &header;
+    iov[0].iov_len = sizeof(header);
+    iov[1].iov_base = stream.stream;
+    iov[1].iov_len = stream.len;
+
+    // A full FIFO means the reader is not keeping up, drop the frame
+    // rather than stalling capture. A reader that went away is reopened
+    // on the next frame.
+    ret = writev(audio_output_fd, iov, 2);
+    if (ret < 0 && errno == EPIPE) {
+      close(audio_output_fd);
+      audio_output_fd = -1;
+    }
+  }
+
+  IMP_AENC_ReleaseStream(AUDIO_ENCODER_CHANNEL, &stream);
+
+  return 0;
+}
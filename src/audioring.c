@@ -0,0 +1,315 @@
+#include "audioring.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+
+The IMP audio input and the ALSA device each run from their own clock,
+so over time one of them consumes samples slightly faster than the other
+produces them. The ring buffer absorbs the short term jitter between the
+two threads and the resampler stretches or squeezes the stream by a few
+hundred ppm to keep the amount of buffered audio constant.
+
+*/
+
+// size must be a power of two so positions can wrap freely
+int audio_ring_init(AudioRing *ring, uint32_t size)
+{
+  if (size == 0 || (size & (size - 1)) != 0) {
+    return -1;
+  }
+
+  ring->samples = calloc(size, sizeof(int16_t));
+  if (ring->samples == NULL) {
+    return -1;
+  }
+
+  ring->size = size;
+  ring->write_pos = 0;
+  ring->read_pos = 0;
+
+  return 0;
+}
+
+uint32_t audio_ring_fill(AudioRing *ring)
+{
+  return ring->write_pos - ring->read_pos;
+}
+
+// Returns the number of samples stored, less than count when the ring is full
+uint32_t audio_ring_write(AudioRing *ring, const int16_t *samples, uint32_t count)
+{
+  uint32_t write_pos = ring->write_pos;
+  uint32_t space = ring->size - (write_pos - ring->read_pos);
+  uint32_t offset, first;
+
+  if (count > space) {
+    count = space;
+  }
+
+  offset = write_pos & (ring->size - 1);
+  first = ring->size - offset;
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(&ring->samples[offset], samples, first * sizeof(int16_t));
+  memcpy(&ring->samples[0], samples + first, (count - first) * sizeof(int16_t));
+
+  // The samples have to be visible before the reader sees the new position
+  __sync_synchronize();
+  ring->write_pos = write_pos + count;
+
+  return count;
+}
+
+// Returns the number of samples read, less than count when the ring runs dry
+uint32_t audio_ring_read(AudioRing *ring, int16_t *samples, uint32_t count)
+{
+  uint32_t read_pos = ring->read_pos;
+  uint32_t fill = ring->write_pos - read_pos;
+  uint32_t offset, first;
+
+  __sync_synchronize();
+
+  if (count > fill) {
+    count = fill;
+  }
+
+  offset = read_pos & (ring->size - 1);
+  first = ring->size - offset;
+  if (first > count) {
+    first = count;
+  }
+
+  memcpy(samples, &ring->samples[offset], first * sizeof(int16_t));
+  memcpy(samples + first, &ring->samples[0], (count - first) * sizeof(int16_t));
+
+  // Done with the samples before the writer may reuse their slots
+  __sync_synchronize();
+  ring->read_pos = read_pos + count;
+
+  return count;
+}
+
+
+// Linear interpolation of count output samples from x[0 .. available),
+// starting pos (Q24) past x[0]. Stops early where the next output would
+// need x[available], and returns how many were produced. All variants give
+// bit identical results:
+//
+//   frac = (pos >> 10) & 0x3fff
+//   out = (x[pos >> 24] * (16384 - frac) + x[(pos >> 24) + 1] * frac) >> 14
+//
+// The portable version is what runs on the T20. The SSE2 and NEON ones
+// take 8 outputs at a time whenever their inputs are 8 consecutive
+// samples, which is almost always since step stays within a few hundred
+// ppm of one input sample per output sample.
+
+static inline uint32_t interpolate_c(const int16_t *x, uint32_t available, uint32_t *pos,
+                                     uint32_t step, int16_t *output, uint32_t count)
+{
+  uint32_t i, index, frac;
+  uint32_t p = *pos;
+
+  for (i = 0; i < count; i++) {
+    index = p >> 24;
+    if (index + 1 >= available) {
+      break;
+    }
+    frac = (p >> 10) & 0x3fff;
+    output[i] = (x[index] * (int32_t)(16384 - frac) + x[index + 1] * (int32_t)frac) >> 14;
+    p += step;
+  }
+
+  *pos = p;
+  return i;
+}
+
+// Whether the next 8 outputs can be done in one go: inputs x[first] to
+// x[first + 8] exist and follow each other
+static inline int interpolate_block_ready(uint32_t available, uint32_t p, uint32_t step)
+{
+  uint32_t first = p >> 24;
+  uint64_t last = ((uint64_t)p + 7 * (uint64_t)step) >> 24;
+
+  return last + 1 < available && last - first == 7;
+}
+
+#if defined(__SSE2__)
+
+static uint32_t interpolate(const int16_t *x, uint32_t available, uint32_t *pos,
+                            uint32_t step, int16_t *output, uint32_t count)
+{
+  uint32_t i = 0;
+  uint32_t p = *pos;
+  const __m128i offsets = _mm_setr_epi32(0, step, 2 * step, 3 * step);
+  const __m128i frac_mask = _mm_set1_epi32(0x3fff);
+  const __m128i unity = _mm_set1_epi32(16384);
+
+  while (i + 8 <= count) {
+    if (!interpolate_block_ready(available, p, step)) {
+      // Across a skipped or repeated input sample, or at the end
+      if (interpolate_c(x, available, &p, step, output + i, 1) == 0) {
+        break;
+      }
+      i++;
+      continue;
+    }
+
+    const int16_t *in = x + (p >> 24);
+    __m128i a = _mm_loadu_si128((const __m128i *)in);
+    __m128i b = _mm_loadu_si128((const __m128i *)(in + 1));
+    __m128i p_low = _mm_add_epi32(_mm_set1_epi32(p), offsets);
+    __m128i p_high = _mm_add_epi32(_mm_set1_epi32(p + 4 * step), offsets);
+    __m128i frac_low = _mm_and_si128(_mm_srli_epi32(p_low, 10), frac_mask);
+    __m128i frac_high = _mm_and_si128(_mm_srli_epi32(p_high, 10), frac_mask);
+    // (16384 - frac, frac) pairs to go with the (a, b) pairs in madd
+    __m128i weights_low = _mm_or_si128(_mm_sub_epi32(unity, frac_low), _mm_slli_epi32(frac_low, 16));
+    __m128i weights_high = _mm_or_si128(_mm_sub_epi32(unity, frac_high), _mm_slli_epi32(frac_high, 16));
+    __m128i out_low = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(a, b), weights_low), 14);
+    __m128i out_high = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(a, b), weights_high), 14);
+
+    _mm_storeu_si128((__m128i *)(output + i), _mm_packs_epi32(out_low, out_high));
+    p += 8 * step;
+    i += 8;
+  }
+
+  i += interpolate_c(x, available, &p, step, output + i, count - i);
+  *pos = p;
+  return i;
+}
+
+#elif defined(__ARM_NEON)
+
+static uint32_t interpolate(const int16_t *x, uint32_t available, uint32_t *pos,
+                            uint32_t step, int16_t *output, uint32_t count)
+{
+  uint32_t i = 0;
+  uint32_t p = *pos;
+  const uint32_t offset_values[4] = { 0, step, 2 * step, 3 * step };
+  const uint32x4_t offsets = vld1q_u32(offset_values);
+  const uint32x4_t frac_mask = vdupq_n_u32(0x3fff);
+  const uint32x4_t unity = vdupq_n_u32(16384);
+
+  while (i + 8 <= count) {
+    if (!interpolate_block_ready(available, p, step)) {
+      // Across a skipped or repeated input sample, or at the end
+      if (interpolate_c(x, available, &p, step, output + i, 1) == 0) {
+        break;
+      }
+      i++;
+      continue;
+    }
+
+    const int16_t *in = x + (p >> 24);
+    int16x8_t a = vld1q_s16(in);
+    int16x8_t b = vld1q_s16(in + 1);
+    uint32x4_t frac_low = vandq_u32(vshrq_n_u32(vaddq_u32(vdupq_n_u32(p), offsets), 10), frac_mask);
+    uint32x4_t frac_high = vandq_u32(vshrq_n_u32(vaddq_u32(vdupq_n_u32(p + 4 * step), offsets), 10), frac_mask);
+    int16x4_t f_low = vreinterpret_s16_u16(vmovn_u32(frac_low));
+    int16x4_t f_high = vreinterpret_s16_u16(vmovn_u32(frac_high));
+    int16x4_t w_low = vreinterpret_s16_u16(vmovn_u32(vsubq_u32(unity, frac_low)));
+    int16x4_t w_high = vreinterpret_s16_u16(vmovn_u32(vsubq_u32(unity, frac_high)));
+    int32x4_t out_low = vmlal_s16(vmull_s16(vget_low_s16(a), w_low), vget_low_s16(b), f_low);
+    int32x4_t out_high = vmlal_s16(vmull_s16(vget_high_s16(a), w_high), vget_high_s16(b), f_high);
+
+    vst1q_s16(output + i, vcombine_s16(vshrn_n_s32(out_low, 14), vshrn_n_s32(out_high, 14)));
+    p += 8 * step;
+    i += 8;
+  }
+
+  i += interpolate_c(x, available, &p, step, output + i, count - i);
+  *pos = p;
+  return i;
+}
+
+#else
+
+static uint32_t interpolate(const int16_t *x, uint32_t available, uint32_t *pos,
+                            uint32_t step, int16_t *output, uint32_t count)
+{
+  return interpolate_c(x, available, pos, step, output, count);
+}
+
+#endif
+
+
+void audio_resampler_init(AudioResampler *resampler, AudioRing *ring)
+{
+  memset(resampler, 0, sizeof(AudioResampler));
+  resampler->ring = ring;
+  resampler->step = AUDIO_RESAMPLER_ONE;
+  // Two silent samples to start from, like the ring was primed with them
+  resampler->input_len = 2;
+}
+
+// Positive ppm consumes input faster than real time, which drains the ring
+void audio_resampler_set_ppm(AudioResampler *resampler, int32_t ppm)
+{
+  resampler->step = AUDIO_RESAMPLER_ONE + (int32_t)(((int64_t)AUDIO_RESAMPLER_ONE * ppm) / 1000000);
+}
+
+// Samples taken out of the ring but not played yet
+uint32_t audio_resampler_buffered(AudioResampler *resampler)
+{
+  uint32_t next = resampler->input_pos + (resampler->phase >> 24) + 1;
+
+  return resampler->input_len > next ? resampler->input_len - next : 0;
+}
+
+// Move the window up to the input sample before the current position
+static void audio_resampler_advance(AudioResampler *resampler)
+{
+  uint32_t skip = resampler->phase >> 24;
+
+  resampler->input_pos += skip;
+  resampler->phase -= skip << 24;
+}
+
+// Keep the samples still needed and append what the ring has. One slot
+// stays unused: the position after the last output may be two samples
+// past it, and that has to fit in 32 bits as well.
+static int audio_resampler_refill(AudioResampler *resampler)
+{
+  uint32_t keep = resampler->input_len - resampler->input_pos;
+  uint32_t count;
+
+  memmove(resampler->input, &resampler->input[resampler->input_pos], keep * sizeof(int16_t));
+  count = audio_ring_read(resampler->ring, &resampler->input[keep], AUDIO_RESAMPLER_INPUT_SIZE - 1 - keep);
+  resampler->input_pos = 0;
+  resampler->input_len = keep + count;
+
+  return count == 0 ? -1 : 0;
+}
+
+// Fill output with count samples. Returns how many could be produced
+// before the ring ran dry, the caller pads the rest.
+uint32_t audio_resample(AudioResampler *resampler, int16_t *output, uint32_t count)
+{
+  uint32_t produced = 0;
+
+  for (;;) {
+    audio_resampler_advance(resampler);
+    produced += interpolate(&resampler->input[resampler->input_pos],
+                            resampler->input_len - resampler->input_pos,
+                            &resampler->phase, resampler->step,
+                            output + produced, count - produced);
+    if (produced == count) {
+      break;
+    }
+
+    audio_resampler_advance(resampler);
+    if (audio_resampler_refill(resampler) < 0) {
+      break;
+    }
+  }
+
+  return produced;
+}
@@ -31,6 +31,8 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <string.h>
+#include <stdint.h>
+#include <time.h>
 #include <math.h>
 
 const char *device = "/dev/jz_adc_aux_0";
@@ -38,14 +40,75 @@ const char *nightModeCmd = "/system/sdcard/scripts/nightmode.sh";
 const char *dayChangeCmd = NULL;
 const char *nightChangeCmd = NULL;
 int readAverageCount = 25;
-int delayBetweenReads = 3;
+double delayBetweenReads = 3.0;
+double sampleRate = 0.0;
 int windowSize = 5;
 double thresholdOn = 40.0;
 double thresholdOff = 45.0;
 int verbose = 0;
 bool nightModeEnabled = false;
 
+// Built in actuator. The IR-cut filter is a latching coil driven by a pair
+// of GPIOs that are pulsed, the IR LEDs are a GPIO (active low) or a PWM
+// channel. -1 disables an output.
+bool useNightModeCmd = false;
+int irCutDayGpio = 25;
+int irCutNightGpio = 26;
+int irCutPulseMs = 150;
+int irLedGpio = 49;
+int irLedPwmChip = -1;
+int irLedPwmChannel = 0;
+int irLedPwmPeriodNs = 1000000;
+int irLedPwmDutyPercent = 100;
+// The ISP colour / night mode belongs to videocapture, it is handed over
+// through videocapture's override file. Empty disables.
+const char *ispModeFile = "/tmp/night_vision_enabled";
+// Transitions closer together than this are refused
+double minSwitchInterval = 10.0;
+
+// Traces of the ADC / ISP readings for tuning the decision parameters.
+// -R records them while running, -Y replays a recording through the same
+// decision code and prints the transitions it would have made.
+//
+// File layout, little endian: a TraceHeader, then TraceRecords. An ISP
+// record (value = iridix) is followed by a TraceIsp.
+#define TRACE_MAGIC   "ANTR"
+#define TRACE_VERSION 1
+#define TRACE_ADC     1
+#define TRACE_ISP     2
+
+typedef struct __attribute__((packed)) {
+        char magic[4];
+        uint16_t version;
+        uint16_t reserved;
+        // ADC reads per second, in mHz
+        uint32_t sampleRate;
+} TraceHeader;
+
+typedef struct __attribute__((packed)) {
+        // Milliseconds since the start of the recording
+        uint32_t timeMs;
+        uint16_t type;
+        uint16_t value;
+} TraceRecord;
+
+typedef struct __attribute__((packed)) {
+        uint32_t exposure;
+        uint32_t colortemp;
+} TraceIsp;
+
+const char *recordFile = NULL;
+const char *replayFile = NULL;
+FILE *traceFile = NULL;
+double traceStartTime = 0.0;
+// Time of the record being replayed, replaces the clock while replaying
+bool replaying = false;
+double replayTime = 0.0;
+int replayTransitions = 0;
+
 int software_method(void);
+int adc_method(void);
+int replay(const char *path, bool use_software_method);
 // Configuration parameters for software method
 int jitter_percent = 3;
 int eq1_user_exposure = 1200000;
@@ -60,33 +123,201 @@ int sec_wait = 3;
 int mode_switch_wait_count=0;
 
 
+// The ADC device stays open between samples, it is only reopened after
+// a read error.
+int adcFd = -1;
+
 int jzAuxReadSample(const char *device, unsigned int *buffer) {
-        int fd = open(device, O_RDONLY);
-        if(fd == -1) return -1;
         int size = sizeof(*buffer);
-        int ct = read(fd, (void *)buffer, size);
+        int ct;
+        if(adcFd == -1) {
+                adcFd = open(device, O_RDONLY);
+                if(adcFd == -1) return -1;
+        }
+        lseek(adcFd, 0, SEEK_SET);
+        ct = read(adcFd, (void *)buffer, size);
+        if(ct != size) {
+                close(adcFd);
+                adcFd = -1;
+                return 0;
+        }
+        return 1;
+}
+
+// Moving sum over the last size values. Samples are integers so the sum is
+// exact, and every push is O(1) however long the average is.
+typedef struct {
+        uint64_t *values;
+        int size;
+        int index;
+        int count;
+        uint64_t sum;
+} RunningSum;
+
+int runningSumInit(RunningSum *rs, int size) {
+        if(size < 1) return 0;
+        rs->values = (uint64_t *)calloc(size, sizeof(uint64_t));
+        if(rs->values == NULL) return 0;
+        rs->size = size;
+        rs->index = 0;
+        rs->count = 0;
+        rs->sum = 0;
+        return 1;
+}
+
+void runningSumPush(RunningSum *rs, uint64_t value) {
+        rs->sum -= rs->values[rs->index];
+        rs->sum += value;
+        rs->values[rs->index] = value;
+        rs->index++;
+        if(rs->index >= rs->size) rs->index = 0;
+        if(rs->count < rs->size) rs->count++;
+}
+
+bool runningSumFull(RunningSum *rs) {
+        return rs->count == rs->size;
+}
+
+double monotonicSeconds() {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+double nowSeconds() {
+        if(replaying) return replayTime;
+        return monotonicSeconds();
+}
+
+int traceOpen(const char *path) {
+        TraceHeader header;
+        traceFile = fopen(path, "wb");
+        if(traceFile == NULL) return 0;
+        memcpy(header.magic, TRACE_MAGIC, 4);
+        header.version = TRACE_VERSION;
+        header.reserved = 0;
+        header.sampleRate = (uint32_t)(sampleRate * 1000.0 + 0.5);
+        fwrite(&header, sizeof(header), 1, traceFile);
+        traceStartTime = monotonicSeconds();
+        return 1;
+}
+
+void traceWrite(uint16_t type, uint16_t value, TraceIsp *isp) {
+        TraceRecord record;
+        if(traceFile == NULL) return;
+        record.timeMs = (uint32_t)((monotonicSeconds() - traceStartTime) * 1000.0);
+        record.type = type;
+        record.value = value;
+        fwrite(&record, sizeof(record), 1, traceFile);
+        if(isp) fwrite(isp, sizeof(*isp), 1, traceFile);
+}
+
+int writeSysfs(const char *path, const char *value) {
+        int fd = open(path, O_WRONLY);
+        int ct;
+        if(fd == -1) return 0;
+        ct = write(fd, value, strlen(value));
         close(fd);
-        return ct == size;
+        return ct == (int)strlen(value);
 }
 
-int jzAuxReadAverage(const char *device, double *value, int count) {
-        int i = 0;
-        if(count < 1) return 0;
-        double valret = 0.0;
-        for(i = 0; i < count; i++) {
-                unsigned int sample;
-                if(!jzAuxReadSample(device, &sample)) return 0;
-                valret += sample;
+// Exports the GPIO as an output once and keeps its value file open
+int gpioValueFds[256];
+bool gpioValueFdsInitialized = false;
+
+int gpioSet(int gpio, int value) {
+        char path[64];
+        int fd;
+        if(gpio < 0) return 1;
+        if(gpio >= 256) return 0;
+        if(!gpioValueFdsInitialized) {
+                int i;
+                for(i = 0; i < 256; i++) gpioValueFds[i] = -1;
+                gpioValueFdsInitialized = true;
         }
-        valret /= count;
-        if(value) *value = valret;
-        return 1;
+        fd = gpioValueFds[gpio];
+        if(fd == -1) {
+                snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", gpio);
+                if(access(path, F_OK) != 0) {
+                        snprintf(path, sizeof(path), "%d", gpio);
+                        writeSysfs("/sys/class/gpio/export", path);
+                }
+                snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/direction", gpio);
+                if(!writeSysfs(path, "out")) return 0;
+                snprintf(path, sizeof(path), "/sys/class/gpio/gpio%d/value", gpio);
+                fd = open(path, O_WRONLY);
+                if(fd == -1) return 0;
+                gpioValueFds[gpio] = fd;
+        }
+        return pwrite(fd, value ? "1" : "0", 1, 0) == 1;
 }
 
-void updateNightMode() {
+int pwmSet(bool on) {
+        char path[96];
+        char value[16];
+        snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%d/pwm%d/enable", irLedPwmChip, irLedPwmChannel);
+        if(access(path, F_OK) != 0) {
+                snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%d/export", irLedPwmChip);
+                snprintf(value, sizeof(value), "%d", irLedPwmChannel);
+                writeSysfs(path, value);
+        }
+        snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%d/pwm%d/period", irLedPwmChip, irLedPwmChannel);
+        snprintf(value, sizeof(value), "%d", irLedPwmPeriodNs);
+        if(!writeSysfs(path, value)) return 0;
+        snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%d/pwm%d/duty_cycle", irLedPwmChip, irLedPwmChannel);
+        snprintf(value, sizeof(value), "%d", (int)((long long)irLedPwmPeriodNs * irLedPwmDutyPercent / 100));
+        if(!writeSysfs(path, value)) return 0;
+        snprintf(path, sizeof(path), "/sys/class/pwm/pwmchip%d/pwm%d/enable", irLedPwmChip, irLedPwmChannel);
+        return writeSysfs(path, on ? "1" : "0");
+}
+
+// Replaces the file in one rename so videocapture never reads it half
+// written
+int ispModeSet(bool night) {
+        char path[256];
+        int fd;
+        int ok;
+        if(ispModeFile == NULL || ispModeFile[0] == '\0') return 1;
+        snprintf(path, sizeof(path), "%s.tmp", ispModeFile);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd == -1) return 0;
+        ok = write(fd, night ? "1\n" : "0\n", 2) == 2;
+        close(fd);
+        if(ok) ok = rename(path, ispModeFile) == 0;
+        if(!ok) unlink(path);
+        return ok;
+}
+
+// Night: IR-cut filter out of the light path, ISP in night mode and IR LEDs
+// on. Day: the other way around.
+int actuateNightMode(bool night) {
+        int ok = 1;
+        int pulseGpio = night ? irCutNightGpio : irCutDayGpio;
+        int otherGpio = night ? irCutDayGpio : irCutNightGpio;
+
+        // Switch the LEDs off before the filter goes back in, and on after
+        // it has moved out, so the picture never sees both at once
+        if(!night) {
+                if(irLedPwmChip >= 0) ok &= pwmSet(false);
+                else ok &= gpioSet(irLedGpio, 1);
+        }
+
+        ok &= gpioSet(otherGpio, 0);
+        ok &= gpioSet(pulseGpio, 1);
+        usleep(irCutPulseMs * 1000);
+        ok &= gpioSet(pulseGpio, 0);
+        ok &= ispModeSet(night);
+
+        if(night) {
+                if(irLedPwmChip >= 0) ok &= pwmSet(true);
+                else ok &= gpioSet(irLedGpio, 0);
+        }
+        return ok;
+}
+
+int runNightModeCmd() {
         char buf[256];
         int ret;
-        if(verbose) printf("Night Mode %s\n", nightModeEnabled ? "Enabled" : "Disabled");
         if(nightModeEnabled && nightChangeCmd != NULL){
               strncpy(buf, nightChangeCmd, sizeof(buf));
         }else if(!nightModeEnabled && dayChangeCmd != NULL){
@@ -96,6 +327,42 @@ void updateNightMode() {
         }
         ret = system(buf);
         if(ret) fprintf(stderr, "WARNING: %s returned %d\n", buf, ret);
+        return ret == 0;
+}
+
+double lastSwitchTime = -1.0;
+
+void updateNightMode() {
+        double start = nowSeconds();
+        const char *how = "gpio";
+
+        // Debounce: keep the current mode, the caller asks again later
+        if(lastSwitchTime >= 0.0 && start - lastSwitchTime < minSwitchInterval) {
+                if(verbose) printf("Night Mode change ignored, last change %.1lf s ago\n", start - lastSwitchTime);
+                nightModeEnabled = !nightModeEnabled;
+                return;
+        }
+
+        if(replaying) {
+                printf("%.3lf %s\n", replayTime, nightModeEnabled ? "night" : "day");
+                lastSwitchTime = start;
+                replayTransitions++;
+                mode_switch_wait_count = sec_wait;
+                return;
+        }
+
+        if(verbose) printf("Night Mode %s\n", nightModeEnabled ? "Enabled" : "Disabled");
+        if(useNightModeCmd || dayChangeCmd != NULL || nightChangeCmd != NULL) {
+                how = "command";
+                runNightModeCmd();
+        } else if(!actuateNightMode(nightModeEnabled)) {
+                fprintf(stderr, "WARNING: GPIO actuation failed, falling back to %s\n", nightModeCmd);
+                how = "command";
+                runNightModeCmd();
+        }
+        lastSwitchTime = monotonicSeconds();
+        printf("Night Mode %s by %s in %.0lf ms\n", nightModeEnabled ? "on" : "off", how, (lastSwitchTime - start) * 1000.0);
+        fflush(stdout);
         mode_switch_wait_count = sec_wait;
         return;
 }
@@ -104,7 +371,14 @@ void usage() {
         printf("Usage: autonight [options]\n\n");
         printf("Options:\n");
         printf("-v              Increase verbosity\n");
-        printf("-c <str>        Sets the command to call to set night mode (default: %s)\n", nightModeCmd);
+        printf("-c <str>        Sets the command to call to set night mode, used when the GPIOs can't be driven (default: %s)\n", nightModeCmd);
+        printf("-C              Always use the -c command instead of driving the GPIOs\n");
+        printf("-i <int>,<int>  IR-cut GPIOs pulsed for day and night, -1 to disable (default: %d,%d)\n", irCutDayGpio, irCutNightGpio);
+        printf("-p <int>        IR-cut pulse length in ms (default: %d)\n", irCutPulseMs);
+        printf("-l <int>        IR LED GPIO (active low), -1 to disable (default: %d)\n", irLedGpio);
+        printf("-P <chip>,<channel>,<duty%%>  Drive the IR LEDs with a PWM channel instead of -l\n");
+        printf("-I <file>       File videocapture reads the ISP night mode from, empty to disable (default: %s)\n", ispModeFile);
+        printf("-m <float>      Minimum seconds between mode changes (default: %.1lf)\n", minSwitchInterval);
         printf("-y <str>        Sets the command to run for day mode (default: disabled, use %s for both day and night)\n", nightModeCmd);
         printf("-g <str>        Sets the command to run for night mode (default: disabled, use %s for both day and night)\n", nightModeCmd);
         printf("-S              uses software to determine day/night\n");
@@ -112,22 +386,22 @@ void usage() {
         printf("                    use sw_night_configure.html for more software mode options\n");
         printf("-D <str>        Sets jz_adc_aux device (default: %s)\n", device);
         printf("-a <int>        Sets the number of ADC reads to average into a single sample (default: %d)\n", readAverageCount);
-        printf("-d <int>        Delay (in seconds) between averaged reads (default: %d)\n", delayBetweenReads);
+        printf("-d <float>      Delay (in seconds) between averaged samples (default: %.2lf)\n", delayBetweenReads);
+        printf("-r <float>      ADC reads per second (default: -a reads spread over each -d delay)\n");
         printf("-n <int>        Number of averaged samples to window average for thresholding (default: %d)\n", windowSize);
         printf("-O <float>      Turn on night mode when window average value drops below this threshold (default: %.2lf)\n", thresholdOn);
         printf("-F <floag>      Turn off night mode when window average value goes above this threshold (default: %.2lf)\n", thresholdOff);
+        printf("-R <file>       Record the ADC (or with -S the ISP) readings to a trace file\n");
+        printf("-Y <file>       Replay a trace file and print the transitions as \"<seconds> day|night\"\n");
         printf("-h              Print this usage statement and exit\n");
         return;
 }
 
 int main(int argc, char *argv[]) {
         int opt;
-        int windowIndex = 0;
-        bool windowFull = false;
-        double *window = (double *)malloc(sizeof(double) * windowSize);
         bool use_software_method = false;
 
-        while((opt = getopt(argc, argv, "D:c:y:g:a:d:n:O:F:vShj:w:1:2:3:")) != -1) {
+        while((opt = getopt(argc, argv, "D:c:Ci:p:l:P:I:m:y:g:a:d:r:n:O:F:R:Y:vShj:w:1:2:3:")) != -1) {
                 switch (opt) {
                         case 'D': device = optarg;
                                   break;
@@ -135,6 +409,35 @@ int main(int argc, char *argv[]) {
                         case 'c': nightModeCmd = optarg;
                                   break;
 
+                        case 'C': useNightModeCmd = true;
+                                  break;
+
+                        case 'i':
+                                  if(sscanf(optarg, "%d,%d", &irCutDayGpio, &irCutNightGpio) != 2){
+                                    fprintf(stderr, "invalid argument: %s\n", optarg);
+                                    usage();
+                                  }
+                                  break;
+
+                        case 'p': irCutPulseMs = atoi(optarg);
+                                  break;
+
+                        case 'l': irLedGpio = atoi(optarg);
+                                  break;
+
+                        case 'P':
+                                  if(sscanf(optarg, "%d,%d,%d", &irLedPwmChip, &irLedPwmChannel, &irLedPwmDutyPercent) != 3){
+                                    fprintf(stderr, "invalid argument: %s\n", optarg);
+                                    usage();
+                                  }
+                                  break;
+
+                        case 'I': ispModeFile = optarg;
+                                  break;
+
+                        case 'm': minSwitchInterval = atof(optarg);
+                                  break;
+
                         case 'y': dayChangeCmd = optarg;
                                   break;
 
@@ -144,7 +447,16 @@ int main(int argc, char *argv[]) {
                         case 'a': readAverageCount = atoi(optarg);
                                   break;
 
-                        case 'd': delayBetweenReads = atoi(optarg);
+                        case 'd':
+                                  delayBetweenReads = atof(optarg);
+                                  if(delayBetweenReads <= 0.0){
+                                    fprintf(stderr, "invalid argument: %s\n", optarg);
+                                    usage();
+                                    return 1;
+                                  }
+                                  break;
+
+                        case 'r': sampleRate = atof(optarg);
                                   break;
 
                         case 'n': windowSize = atoi(optarg);
@@ -156,6 +468,12 @@ int main(int argc, char *argv[]) {
                         case 'F': thresholdOff = atof(optarg);
                                   break;
 
+                        case 'R': recordFile = optarg;
+                                  break;
+
+                        case 'Y': replayFile = optarg;
+                                  break;
+
                         case 'v':
                                   verbose++;
                                   break;
@@ -194,30 +512,57 @@ int main(int argc, char *argv[]) {
                                   return 1;
                 }
         }
+        if(replayFile != NULL){
+          return replay(replayFile, use_software_method);
+        }
+
+        if(recordFile != NULL){
+          if(!use_software_method && sampleRate <= 0.0) sampleRate = readAverageCount / delayBetweenReads;
+          if(!traceOpen(recordFile)){
+            fprintf(stderr, "ERROR: unable to create %s: %m\n", recordFile);
+            return 1;
+          }
+        }
+
         if(use_software_method){
           return software_method();
         }
 
-        while(true) {
-                double value;
-                int ret = jzAuxReadAverage(device, &value, readAverageCount);
-                if(!ret) {
-                        fprintf(stderr, "ERROR: jzAuxReadAverage(%d) failed: %m\n", readAverageCount);
-                        sleep(delayBetweenReads);
-                        continue;
-                }
-                if(verbose) printf("Current value: %.2lf\n", value);
-                window[windowIndex] = value;
-                windowIndex++;
-                if(windowIndex >= windowSize) {
-                        windowFull = true;
-                        windowIndex = 0;
-                }
-                if(windowFull) {
-                        double windowAvg = 0.0;
-                        int i = 0;
-                        for(i = 0; i < windowSize; i++) windowAvg += window[i];
-                        windowAvg /= windowSize;
+        return adc_method();
+}
+
+RunningSum adcBurst, adcWindow;
+int adcReads = 0;
+int adcReadsPerSample = 1;
+
+int adcInit(void)
+{
+        if(sampleRate <= 0.0) sampleRate = readAverageCount / delayBetweenReads;
+        adcReadsPerSample = (int)(sampleRate * delayBetweenReads + 0.5);
+        if(adcReadsPerSample < 1) adcReadsPerSample = 1;
+
+        if(!runningSumInit(&adcBurst, readAverageCount) || !runningSumInit(&adcWindow, windowSize)) {
+                fprintf(stderr, "ERROR: invalid -a %d or -n %d\n", readAverageCount, windowSize);
+                return 0;
+        }
+        return 1;
+}
+
+// Decision for one ADC read, shared by the live loop and replay
+void adcProcessSample(unsigned int sample)
+{
+        runningSumPush(&adcBurst, sample);
+        adcReads++;
+
+        if(adcReads >= adcReadsPerSample && runningSumFull(&adcBurst)) {
+                adcReads = 0;
+                // Window entries are burst sums, so the window average
+                // is exact integer arithmetic until this division
+                runningSumPush(&adcWindow, adcBurst.sum);
+                if(verbose) printf("Current value: %.2lf\n", (double)adcBurst.sum / readAverageCount);
+                if(traceFile) fflush(traceFile);
+                if(runningSumFull(&adcWindow)) {
+                        double windowAvg = (double)adcWindow.sum / ((double)windowSize * readAverageCount);
                         if(verbose) printf("Window (%d) Avg: %.2lf\n", windowSize, windowAvg);
                         if(!nightModeEnabled && windowAvg <= thresholdOn) {
                                 nightModeEnabled = true;
@@ -228,7 +573,34 @@ int main(int argc, char *argv[]) {
                                 updateNightMode();
                         }
                 }
-                sleep(delayBetweenReads);
+        }
+}
+
+// Reads the ADC sampleRate times per second. Every read updates the
+// average of the last readAverageCount reads, and every delayBetweenReads
+// seconds that average goes into the window of the last windowSize values
+// that is compared against the thresholds.
+int adc_method(void)
+{
+        unsigned int sample;
+        int ret;
+        useconds_t readDelay;
+
+        if(!adcInit()) return 1;
+        readDelay = (useconds_t)(1000000.0 / sampleRate);
+
+        if(verbose) printf("Reading %s at %.2lf Hz, threshold check every %d reads\n", device, sampleRate, adcReadsPerSample);
+
+        while(true) {
+                ret = jzAuxReadSample(device, &sample);
+                if(ret != 1) {
+                        fprintf(stderr, "ERROR: jzAuxReadSample(%s) failed: %m\n", device);
+                        sleep(1);
+                        continue;
+                }
+                traceWrite(TRACE_ADC, sample, NULL);
+                adcProcessSample(sample);
+                usleep(readDelay);
         }
 
         return 0;
@@ -296,33 +668,13 @@ typedef enum {
 } States;
 
 
-int software_method(void)
-{
-  int last_exposure = 0;
-  int eq2_wait_count = 0;
-  int eq3_wait_count = 0; 
-  int exposure, iridix, colortemp;
-  
-  if(verbose){
-    printf("Starting software method using \n");
-    printf("jitter_percent = %d\n", jitter_percent);
-    printf("eq1_user_exposure = %d\n", eq1_user_exposure);
-    printf("eq2_user_exposure = %d\n", eq2_user_exposure);
-    printf("eq2_user_iridix = %d\n", eq2_user_iridix);
-    printf("eq2_count = %d\n", eq2_count);
-    printf("eq3_user_wb = %d\n", eq3_user_wb);
-    printf("eq3_user_iridix = %d\n", eq3_user_iridix);
-    printf("eq3_count = %d\n", eq3_count);
-    printf("sec_wait = %d\n", sec_wait);
-  }
-  // Start with day
-  nightModeEnabled = false;
-  updateNightMode();
+int last_exposure = 0;
+int eq2_wait_count = 0;
+int eq3_wait_count = 0;
 
-  while(1){
-    double exp_diff;
-    sleep(1);
-    if(readIspInfo(&exposure, &iridix, &colortemp) == 3){
+// Decision for one set of ISP readings, shared by the live loop and replay
+void softwareProcessSample(int exposure, int iridix, int colortemp)
+{
       if(verbose >= 2) printf("(%d, %d, %d)\n", exposure, iridix, colortemp);
       // Jitter equation
       if( (int)((fabs((double)exposure - (double)last_exposure)/(double)exposure)*100.0 - (double) jitter_percent) > 0  ){
@@ -330,7 +682,7 @@ int software_method(void)
         eq3_wait_count = 0;
         last_exposure = exposure;
         if(verbose >= 1) printf("jitter active\n");
-        continue;
+        return;
       }
       last_exposure = exposure;
 
@@ -338,7 +690,7 @@ int software_method(void)
       if(mode_switch_wait_count){
         mode_switch_wait_count--;
         if(verbose >= 1) printf("mode switch wait active\n");
-        continue;
+        return;
       }
 
       // Eq1
@@ -348,7 +700,7 @@ int software_method(void)
         eq2_wait_count = 0;
         eq3_wait_count = 0;
         updateNightMode();
-        continue;
+        return;
       }
 
       // Eq2
@@ -358,7 +710,7 @@ int software_method(void)
           if(verbose >= 1) printf("Eq2 switching to day mode exp=%d iridix=%d\n", exposure, iridix);
           nightModeEnabled = false;
           updateNightMode();
-          continue;
+          return;
         }else{
           if(verbose >= 1) printf("Eq2 wait_count active exp=%d iridix=%d\n", exposure, iridix);
         }
@@ -373,16 +725,109 @@ int software_method(void)
           if(verbose >= 1) printf("Eq3 switching to day mode wb=%d iridix=%d\n", colortemp, iridix);
           nightModeEnabled = false;
           updateNightMode();
-          continue;
+          return;
         }else{
           if(verbose >= 1) printf("Eq3 wait_count active wb=%d iridix=%d\n", colortemp, iridix);
         }
       }else{
         eq3_wait_count = 0;
       }
+}
+
+void printSoftwareParameters(void)
+{
+    printf("Starting software method using \n");
+    printf("jitter_percent = %d\n", jitter_percent);
+    printf("eq1_user_exposure = %d\n", eq1_user_exposure);
+    printf("eq2_user_exposure = %d\n", eq2_user_exposure);
+    printf("eq2_user_iridix = %d\n", eq2_user_iridix);
+    printf("eq2_count = %d\n", eq2_count);
+    printf("eq3_user_wb = %d\n", eq3_user_wb);
+    printf("eq3_user_iridix = %d\n", eq3_user_iridix);
+    printf("eq3_count = %d\n", eq3_count);
+    printf("sec_wait = %d\n", sec_wait);
+}
+
+int software_method(void)
+{
+  unsigned int exposure, iridix, colortemp;
+  TraceIsp isp;
+
+  if(verbose){
+    printSoftwareParameters();
+  }
+  // Start with day
+  nightModeEnabled = false;
+  updateNightMode();
+
+  while(1){
+    sleep(1);
+    if(readIspInfo(&exposure, &iridix, &colortemp) == 3){
+      if(traceFile){
+        isp.exposure = exposure;
+        isp.colortemp = colortemp;
+        traceWrite(TRACE_ISP, iridix, &isp);
+        fflush(traceFile);
+      }
+      softwareProcessSample(exposure, iridix, colortemp);
     }else{
       // Unable to read isp_info
       fprintf(stderr, "Unable to read isp_info\n");
     }
   }
 }
+
+// Runs a recorded trace through the decision code as fast as it can be
+// read. Only the timestamps from the file are used, so the debounce and
+// wait times behave as they did on the camera.
+int replay(const char *path, bool use_software_method)
+{
+  FILE *fp;
+  TraceHeader header;
+  TraceRecord record;
+  TraceIsp isp;
+  unsigned long records = 0;
+
+  fp = fopen(path, "rb");
+  if(fp == NULL){
+    fprintf(stderr, "ERROR: unable to open %s: %m\n", path);
+    return 1;
+  }
+
+  if(fread(&header, sizeof(header), 1, fp) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) != 0 ||
+     header.version != TRACE_VERSION){
+    fprintf(stderr, "ERROR: %s is not an autonight trace\n", path);
+    fclose(fp);
+    return 1;
+  }
+
+  replaying = true;
+  nightModeEnabled = false;
+
+  if(use_software_method){
+    if(verbose) printSoftwareParameters();
+  }else{
+    // The ADC decision depends on the read rate the trace was taken at
+    if(sampleRate <= 0.0 && header.sampleRate > 0) sampleRate = header.sampleRate / 1000.0;
+    if(!adcInit()){
+      fclose(fp);
+      return 1;
+    }
+  }
+
+  while(fread(&record, sizeof(record), 1, fp) == 1){
+    if(record.type == TRACE_ISP && fread(&isp, sizeof(isp), 1, fp) != 1) break;
+    replayTime = record.timeMs / 1000.0;
+    records++;
+
+    if(record.type == TRACE_ADC && !use_software_method){
+      adcProcessSample(record.value);
+    }else if(record.type == TRACE_ISP && use_software_method){
+      softwareProcessSample(isp.exposure, record.value, isp.colortemp);
+    }
+  }
+  fclose(fp);
+
+  fprintf(stderr, "%lu records, %.0lf seconds, %d transitions\n", records, replayTime, replayTransitions);
+  return 0;
+}
@@ -0,0 +1,190 @@
+#include <stdlib.h>
+#include <string.h>
+#include "blockmotion.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/*
+
+The row kernels add the SAD of every 16 pixel chunk of a row to the cell
+it belongs to and, when update is set, step the background towards the
+frame. All variants give bit identical results:
+
+  sad += |frame - background|
+  background += (frame > background) - (frame < background)
+
+The portable version is what runs on the T20, the Ingenic toolchain does
+not expose the MXU through intrinsics. It is written so gcc can unroll
+the inner loop. SSE2 and NEON builds use psadbw / vabd.
+
+*/
+
+#if defined(__SSE2__)
+
+static void sad_row(const uint8_t *frame, uint8_t *background, int width,
+                    int chunks_per_cell, uint32_t *cell_sad, int update)
+{
+  int x, chunk = 0;
+  const __m128i one = _mm_set1_epi8(1);
+
+  for (x = 0; x < width; x += 16, chunk++) {
+    __m128i f = _mm_loadu_si128((const __m128i *)(frame + x));
+    __m128i b = _mm_loadu_si128((const __m128i *)(background + x));
+    __m128i sad = _mm_sad_epu8(f, b);
+
+    cell_sad[chunk / chunks_per_cell] += _mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4);
+
+    if (update) {
+      __m128i up = _mm_min_epu8(_mm_subs_epu8(f, b), one);
+      __m128i down = _mm_min_epu8(_mm_subs_epu8(b, f), one);
+      _mm_storeu_si128((__m128i *)(background + x), _mm_sub_epi8(_mm_add_epi8(b, up), down));
+    }
+  }
+}
+
+const char *block_motion_kernel_name(void) { return "sse2"; }
+
+#elif defined(__ARM_NEON)
+
+static void sad_row(const uint8_t *frame, uint8_t *background, int width,
+                    int chunks_per_cell, uint32_t *cell_sad, int update)
+{
+  int x, chunk = 0;
+  const uint8x16_t one = vdupq_n_u8(1);
+
+  for (x = 0; x < width; x += 16, chunk++) {
+    uint8x16_t f = vld1q_u8(frame + x);
+    uint8x16_t b = vld1q_u8(background + x);
+    uint16x8_t sad16 = vpaddlq_u8(vabdq_u8(f, b));
+    uint64x2_t sad64 = vpaddlq_u32(vpaddlq_u16(sad16));
+
+    cell_sad[chunk / chunks_per_cell] += vgetq_lane_u64(sad64, 0) + vgetq_lane_u64(sad64, 1);
+
+    if (update) {
+      uint8x16_t up = vminq_u8(vqsubq_u8(f, b), one);
+      uint8x16_t down = vminq_u8(vqsubq_u8(b, f), one);
+      vst1q_u8(background + x, vsubq_u8(vaddq_u8(b, up), down));
+    }
+  }
+}
+
+const char *block_motion_kernel_name(void) { return "neon"; }
+
+#else
+
+static void sad_row(const uint8_t *frame, uint8_t *background, int width,
+                    int chunks_per_cell, uint32_t *cell_sad, int update)
+{
+  int x, i, chunk = 0;
+  uint32_t sad;
+  int f, b;
+
+  for (x = 0; x < width; x += 16, chunk++) {
+    sad = 0;
+    for (i = x; i < x + 16; i++) {
+      f = frame[i];
+      b = background[i];
+      sad += f > b ? f - b : b - f;
+      if (update) {
+        background[i] = b + (f > b) - (f < b);
+      }
+    }
+    cell_sad[chunk / chunks_per_cell] += sad;
+  }
+}
+
+const char *block_motion_kernel_name(void) { return "c"; }
+
+#endif
+
+
+int block_motion_init(BlockMotion *bm, int width, int height, int cell_size,
+                      int threshold, int learn_interval)
+{
+  memset(bm, 0, sizeof(BlockMotion));
+
+  // Pixels right of and below the last whole cell are not looked at
+  if (cell_size <= 0 || cell_size % BLOCK_MOTION_ALIGN != 0 ||
+      width < cell_size || height < cell_size) {
+    return -1;
+  }
+
+  bm->width = width;
+  bm->height = height;
+  bm->cell_size = cell_size;
+  bm->cells_x = width / cell_size;
+  bm->cells_y = height / cell_size;
+  bm->threshold = threshold;
+  bm->learn_interval = learn_interval > 0 ? learn_interval : 1;
+
+  bm->background = malloc(width * height);
+  bm->cell_sad = calloc(bm->cells_x * bm->cells_y, sizeof(uint32_t));
+  bm->activity = calloc(bm->cells_x * bm->cells_y, 1);
+
+  if (bm->background == NULL || bm->cell_sad == NULL || bm->activity == NULL) {
+    block_motion_free(bm);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void block_motion_free(BlockMotion *bm)
+{
+  free(bm->background);
+  free(bm->cell_sad);
+  free(bm->activity);
+  bm->background = NULL;
+  bm->cell_sad = NULL;
+  bm->activity = NULL;
+}
+
+
+// Compare a frame with the background and refresh the activity map.
+// Returns the number of active cells. The first frame only seeds the
+// background.
+uint32_t block_motion_update(BlockMotion *bm, const uint8_t *luma, int stride)
+{
+  int y, cy, c;
+  int update;
+  int num_cells = bm->cells_x * bm->cells_y;
+  int cell_pixels = bm->cell_size * bm->cell_size;
+  uint32_t mean;
+  uint32_t *row_sad;
+
+  if (bm->frames++ == 0) {
+    for (y = 0; y < bm->height; y++) {
+      memcpy(bm->background + y * bm->width, luma + y * stride, bm->width);
+    }
+    memset(bm->activity, 0, num_cells);
+    bm->active_cells = 0;
+    return 0;
+  }
+
+  update = (bm->frames % bm->learn_interval) == 0;
+  memset(bm->cell_sad, 0, num_cells * sizeof(uint32_t));
+
+  for (y = 0; y < bm->cells_y * bm->cell_size; y++) {
+    row_sad = bm->cell_sad + (y / bm->cell_size) * bm->cells_x;
+    sad_row(luma + y * stride, bm->background + y * bm->width,
+            bm->cells_x * bm->cell_size, bm->cell_size / 16, row_sad, update);
+  }
+
+  bm->active_cells = 0;
+  for (cy = 0; cy < bm->cells_y; cy++) {
+    for (c = cy * bm->cells_x; c < (cy + 1) * bm->cells_x; c++) {
+      mean = bm->cell_sad[c] / cell_pixels;
+      bm->activity[c] = mean > 255 ? 255 : mean;
+      if ((int)mean > bm->threshold) {
+        bm->active_cells++;
+      }
+    }
+  }
+
+  return bm->active_cells;
+}
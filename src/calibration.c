@@ -0,0 +1,493 @@
+#include "capture.h"
+#include "calibration.h"
+#include "events.h"
+#include "motion.h"
+#include "plan.h"
+#include <math.h>
+
+/*
+
+Buffer calibration. For duration_s the encoder threads record the size
+of every frame by its position in the GOP, and this thread samples
+IMP_Encoder_Query for the pictures waiting to be encoded and the bytes
+waiting in each stream buffer. At the end the buffers that would cover
+the 99.9th percentile of those, plus CALIBRATION_MARGIN_PERCENT, are
+worked out:
+
+- encoder bufSize: the stream backlog plus the largest frames. The SDK
+  does not accept less than 1.5 times the picture, so that is the floor.
+
+- frame source nrVBs: the pictures waiting for the slowest encoder fed
+  by it, plus the one being captured, plus the frames the software
+  motion detector holds on to.
+
+The numbers go to the log, a "calibration" event and CALIBRATION_FILE,
+together with the histograms. With apply set they are also written to
+the buffer_size keys of the settings file (the old one is kept as .bak),
+to take effect on the next start.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+static CalibrationChannel calibration_channels[MAX_ENCODERS];
+static volatile int calibration_active = 0;
+
+
+static int size_bin(uint32_t size)
+{
+  int bin;
+
+  if (size <= CALIBRATION_MIN_SIZE) {
+    return 0;
+  }
+
+  bin = (int)(4 * log2((double)size / CALIBRATION_MIN_SIZE));
+  return bin < CALIBRATION_SIZE_BINS ? bin : CALIBRATION_SIZE_BINS - 1;
+}
+
+
+static uint32_t size_bin_upper(int bin)
+{
+  return (uint32_t)(CALIBRATION_MIN_SIZE * pow(2, (bin + 1) / 4.0));
+}
+
+
+// Upper edge of the bin holding the percentile, but never more than the
+// largest value seen
+static uint32_t size_percentile(const uint32_t *histogram, double percentile, uint32_t max_value)
+{
+  int bin;
+  uint32_t count = 0, target, cumulative = 0;
+
+  for (bin = 0; bin < CALIBRATION_SIZE_BINS; bin++) {
+    count += histogram[bin];
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  target = (uint32_t)ceil(count * percentile);
+  for (bin = 0; bin < CALIBRATION_SIZE_BINS; bin++) {
+    cumulative += histogram[bin];
+    if (cumulative >= target) {
+      break;
+    }
+  }
+
+  return size_bin_upper(bin) < max_value ? size_bin_upper(bin) : max_value;
+}
+
+
+static uint32_t pics_percentile(const uint32_t *histogram, double percentile)
+{
+  int pics;
+  uint32_t count = 0, target, cumulative = 0;
+
+  for (pics = 0; pics <= CALIBRATION_MAX_BACKLOG_PICS; pics++) {
+    count += histogram[pics];
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  target = (uint32_t)ceil(count * percentile);
+  for (pics = 0; pics < CALIBRATION_MAX_BACKLOG_PICS; pics++) {
+    cumulative += histogram[pics];
+    if (cumulative >= target) {
+      break;
+    }
+  }
+
+  return pics;
+}
+
+
+// Called by the encoder threads for every frame
+void calibration_record_frame(int channel, uint32_t bytes, int intra)
+{
+  CalibrationChannel *calibration;
+  int position;
+
+  if (!calibration_active || channel < 0 || channel >= MAX_ENCODERS) {
+    return;
+  }
+  calibration = &calibration_channels[channel];
+
+  if (intra) {
+    calibration->gop_position = 0;
+  }
+
+  position = calibration->gop_position;
+  if (position >= CALIBRATION_GOP_POSITIONS) {
+    position = CALIBRATION_GOP_POSITIONS - 1;
+  }
+
+  calibration->size_histogram[position][size_bin(bytes)]++;
+  calibration->frames++;
+  if (bytes > calibration->max_size) {
+    calibration->max_size = bytes;
+  }
+  if (calibration->gop_position > calibration->max_gop_position) {
+    calibration->max_gop_position = calibration->gop_position;
+  }
+  calibration->gop_position++;
+}
+
+
+static void sample_backlog(CameraConfig *camera_config)
+{
+  int i;
+  EncoderSetting *encoder;
+  CalibrationChannel *calibration;
+  IMPEncoderCHNStat status;
+
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    encoder = &camera_config->encoders[i];
+    if (encoder->replay_file[0] != '\0' || encoder->channel < 0 || encoder->channel >= MAX_ENCODERS) {
+      continue;
+    }
+    if (IMP_Encoder_Query(encoder->channel, &status) != 0) {
+      continue;
+    }
+
+    calibration = &calibration_channels[encoder->channel];
+    calibration->samples++;
+    calibration->pics_histogram[status.leftPics < CALIBRATION_MAX_BACKLOG_PICS ? status.leftPics : CALIBRATION_MAX_BACKLOG_PICS]++;
+    calibration->bytes_histogram[size_bin(status.leftStreamBytes)]++;
+
+    if (status.leftPics > calibration->peak_pics) {
+      calibration->peak_pics = status.leftPics;
+    }
+    if (status.leftStreamBytes > calibration->peak_bytes) {
+      calibration->peak_bytes = status.leftStreamBytes;
+    }
+  }
+}
+
+
+static uint32_t add_margin(uint32_t value)
+{
+  return value + (value * CALIBRATION_MARGIN_PERCENT + 99) / 100;
+}
+
+
+static cJSON *gop_positions_json(CalibrationChannel *calibration)
+{
+  int position, bin;
+  uint32_t count;
+  cJSON *json_positions = cJSON_CreateArray();
+  cJSON *json_position;
+
+  for (position = 0; position < CALIBRATION_GOP_POSITIONS; position++) {
+    count = 0;
+    for (bin = 0; bin < CALIBRATION_SIZE_BINS; bin++) {
+      count += calibration->size_histogram[position][bin];
+    }
+    if (count == 0) {
+      continue;
+    }
+
+    json_position = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json_position, "position", position);
+    cJSON_AddNumberToObject(json_position, "frames", count);
+    cJSON_AddNumberToObject(json_position, "p50", size_percentile(calibration->size_histogram[position], 0.5, calibration->max_size));
+    cJSON_AddNumberToObject(json_position, "p999", size_percentile(calibration->size_histogram[position], CALIBRATION_PERCENTILE, calibration->max_size));
+    cJSON_AddItemToArray(json_positions, json_position);
+  }
+
+  return json_positions;
+}
+
+
+static int write_json_file(const char *filename, cJSON *json)
+{
+  FILE *fp;
+  char *text;
+  char temp_file[300];
+
+  text = cJSON_Print(json);
+  if (text == NULL) {
+    return -1;
+  }
+
+  snprintf(temp_file, sizeof(temp_file), "%s.tmp", filename);
+  fp = fopen(temp_file, "w");
+  if (fp == NULL) {
+    log_error("Unable to open %s", temp_file);
+    free(text);
+    return -1;
+  }
+  fprintf(fp, "%s\n", text);
+  fclose(fp);
+  free(text);
+
+  if (rename(temp_file, filename) != 0) {
+    log_error("Unable to rename %s to %s", temp_file, filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static void set_buffer_size(cJSON *json_array, const char *key, int value, int buffer_size)
+{
+  cJSON *item;
+  cJSON *id;
+
+  cJSON_ArrayForEach(item, json_array) {
+    id = cJSON_GetObjectItemCaseSensitive(item, key);
+    if (id != NULL && id->valueint == value) {
+      cJSON_ReplaceItemInObjectCaseSensitive(item, "buffer_size", cJSON_CreateNumber(buffer_size));
+    }
+  }
+}
+
+
+// Write the recommendations into the settings file, keeping the old one
+static int apply_calibration(CameraConfig *camera_config, int fs_buffers[], int encoder_buffers[])
+{
+  FILE *fp;
+  long file_size;
+  char *file_contents;
+  char backup_file[300];
+  cJSON *json;
+  int i, ret;
+  const char *filename = camera_config->calibration.settings_file;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    log_error("Unable to open %s", filename);
+    return -1;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  file_size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  file_contents = malloc(file_size + 1);
+  if (file_contents == NULL || fread(file_contents, 1, file_size, fp) != file_size) {
+    log_error("Unable to read contents of %s", filename);
+    fclose(fp);
+    free(file_contents);
+    return -1;
+  }
+  fclose(fp);
+
+  json = cJSON_ParseWithLength(file_contents, file_size);
+  if (json == NULL) {
+    log_error("Unable to parse %s", filename);
+    free(file_contents);
+    return -1;
+  }
+
+  snprintf(backup_file, sizeof(backup_file), "%s.bak", filename);
+  fp = fopen(backup_file, "w");
+  if (fp == NULL || fwrite(file_contents, 1, file_size, fp) != file_size) {
+    log_error("Unable to write %s, not changing %s", backup_file, filename);
+    if (fp != NULL) {
+      fclose(fp);
+    }
+    free(file_contents);
+    cJSON_Delete(json);
+    return -1;
+  }
+  fclose(fp);
+  free(file_contents);
+
+  for (i = 0; i < camera_config->num_framesources; i++) {
+    if (fs_buffers[i] > 0) {
+      set_buffer_size(cJSON_GetObjectItemCaseSensitive(json, "frame_sources"), "id",
+                      camera_config->frame_sources[i].id, fs_buffers[i]);
+    }
+  }
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    if (encoder_buffers[i] > 0) {
+      set_buffer_size(cJSON_GetObjectItemCaseSensitive(json, "encoders"), "channel",
+                      camera_config->encoders[i].channel, encoder_buffers[i]);
+    }
+  }
+
+  ret = write_json_file(filename, json);
+  cJSON_Delete(json);
+
+  if (ret == 0) {
+    log_info("Calibrated buffer sizes written to %s, the old settings are in %s", filename, backup_file);
+  }
+
+  return ret;
+}
+
+
+static void report_calibration(CameraConfig *camera_config, int elapsed_s, int complete)
+{
+  int i, j, bin;
+  int fs_buffers[MAX_FRAMESOURCES];
+  int encoder_buffers[MAX_ENCODERS];
+  int64_t saved = 0;
+  uint32_t frame_bytes, minimum, current, needed, recommended;
+  uint32_t idr_p999, p_p999, backlog_bytes, backlog_pics;
+  uint32_t p_histogram[CALIBRATION_SIZE_BINS];
+  EncoderSetting *encoder;
+  FrameSource *framesource;
+  CalibrationChannel *calibration;
+  cJSON *json, *json_encoders, *json_framesources, *json_item;
+
+  json = cJSON_CreateObject();
+  cJSON_AddNumberToObject(json, "duration_s", elapsed_s);
+  json_encoders = cJSON_AddArrayToObject(json, "encoders");
+  json_framesources = cJSON_AddArrayToObject(json, "frame_sources");
+
+  for (i = 0; i < camera_config->num_framesources; i++) {
+    fs_buffers[i] = 0;
+  }
+
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    encoder = &camera_config->encoders[i];
+    encoder_buffers[i] = 0;
+
+    if (encoder->replay_file[0] != '\0' || encoder->channel < 0 || encoder->channel >= MAX_ENCODERS) {
+      continue;
+    }
+    calibration = &calibration_channels[encoder->channel];
+    if (calibration->frames == 0) {
+      log_warn("Calibration saw no frames on channel %d", encoder->channel);
+      continue;
+    }
+
+    // Everything after the first GOP position is a P frame
+    memset(p_histogram, 0, sizeof(p_histogram));
+    for (j = 1; j < CALIBRATION_GOP_POSITIONS; j++) {
+      for (bin = 0; bin < CALIBRATION_SIZE_BINS; bin++) {
+        p_histogram[bin] += calibration->size_histogram[j][bin];
+      }
+    }
+
+    idr_p999 = size_percentile(calibration->size_histogram[0], CALIBRATION_PERCENTILE, calibration->max_size);
+    p_p999 = size_percentile(p_histogram, CALIBRATION_PERCENTILE, calibration->max_size);
+    backlog_bytes = size_percentile(calibration->bytes_histogram, CALIBRATION_PERCENTILE, calibration->peak_bytes);
+    backlog_pics = pics_percentile(calibration->pics_histogram, CALIBRATION_PERCENTILE);
+
+    // The stream buffer holds the backlog and the frame being written
+    needed = add_margin(backlog_bytes + (idr_p999 > p_p999 ? idr_p999 : p_p999));
+    needed = (needed + 4095) & ~4095;
+    minimum = encoder->pic_width * encoder->pic_height * 3 / 2;
+    recommended = needed > minimum ? needed : minimum;
+    current = encoder->buffer_size > 0 ? encoder->buffer_size : minimum;
+    encoder_buffers[i] = recommended;
+    saved += (int64_t)current - recommended;
+
+    log_info("Calibration channel %d: %u frames, IDR p99.9 %u bytes, P p99.9 %u bytes, "
+             "largest %u bytes, backlog p99.9 %u pictures %u bytes (peak %u / %u)",
+             encoder->channel, calibration->frames, idr_p999, p_p999, calibration->max_size,
+             backlog_pics, backlog_bytes, calibration->peak_pics, calibration->peak_bytes);
+    log_info("Calibration channel %d: buffer_size %u needed, %u recommended (SDK minimum %u), configured %d",
+             encoder->channel, needed, recommended, minimum, encoder->buffer_size);
+
+    json_item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json_item, "channel", encoder->channel);
+    cJSON_AddNumberToObject(json_item, "frames", calibration->frames);
+    cJSON_AddNumberToObject(json_item, "idr_p999", idr_p999);
+    cJSON_AddNumberToObject(json_item, "p_p999", p_p999);
+    cJSON_AddNumberToObject(json_item, "max_frame", calibration->max_size);
+    cJSON_AddNumberToObject(json_item, "backlog_pics_p999", backlog_pics);
+    cJSON_AddNumberToObject(json_item, "backlog_bytes_p999", backlog_bytes);
+    cJSON_AddNumberToObject(json_item, "buffer_size", encoder->buffer_size);
+    cJSON_AddNumberToObject(json_item, "needed_buffer_size", needed);
+    cJSON_AddNumberToObject(json_item, "recommended_buffer_size", recommended);
+    cJSON_AddItemToObject(json_item, "gop_positions", gop_positions_json(calibration));
+    cJSON_AddItemToArray(json_encoders, json_item);
+
+    // The frame source has to hold what its slowest encoder has queued
+    framesource = plan_encoder_framesource(camera_config, encoder);
+    if (framesource != NULL) {
+      j = framesource - camera_config->frame_sources;
+      if ((int)backlog_pics + 1 > fs_buffers[j]) {
+        fs_buffers[j] = backlog_pics + 1;
+      }
+    }
+  }
+
+  for (i = 0; i < camera_config->num_framesources; i++) {
+    framesource = &camera_config->frame_sources[i];
+    if (fs_buffers[i] == 0) {
+      continue;
+    }
+
+    if (camera_config->motion.enabled && camera_config->motion.method == MOTION_METHOD_SOFTWARE &&
+        camera_config->motion.framesource == framesource->id) {
+      fs_buffers[i] += MOTION_FRAME_DEPTH;
+    }
+
+    frame_bytes = framesource->pic_width * framesource->pic_height * 3 / 2;
+    saved += (int64_t)(framesource->buffer_size - fs_buffers[i]) * frame_bytes;
+
+    log_info("Calibration frame source %d: buffer_size %d recommended, configured %d (%u bytes each)",
+             framesource->id, fs_buffers[i], framesource->buffer_size, frame_bytes);
+
+    json_item = cJSON_CreateObject();
+    cJSON_AddNumberToObject(json_item, "id", framesource->id);
+    cJSON_AddNumberToObject(json_item, "buffer_size", framesource->buffer_size);
+    cJSON_AddNumberToObject(json_item, "recommended_buffer_size", fs_buffers[i]);
+    cJSON_AddNumberToObject(json_item, "bytes_per_buffer", frame_bytes);
+    cJSON_AddItemToArray(json_framesources, json_item);
+  }
+
+  cJSON_AddNumberToObject(json, "saved_bytes", (double)saved);
+
+  log_info("Calibration after %d s: the recommended buffers %s %lld bytes of DDR",
+           elapsed_s, saved >= 0 ? "save" : "need", (long long)(saved >= 0 ? saved : -saved));
+
+  if (write_json_file(CALIBRATION_FILE, json) == 0) {
+    log_info("Calibration results written to %s", CALIBRATION_FILE);
+  }
+  cJSON_Delete(json);
+
+  publish_event("calibration", "\"duration_s\":%d,\"complete\":%s,\"saved_bytes\":%lld,\"file\":\"%s\"",
+                elapsed_s, complete ? "true" : "false", (long long)saved, CALIBRATION_FILE);
+
+  if (camera_config->calibration.apply) {
+    if (!complete) {
+      log_warn("Calibration was cut short, not applying it");
+    }
+    else {
+      apply_calibration(camera_config, fs_buffers, encoder_buffers);
+    }
+  }
+}
+
+
+// This is the entrypoint for the calibration thread. It runs once for
+// duration_s and then reports.
+void *calibration_entry_start(void *calibration_thread_params)
+{
+  CameraConfig *camera_config = (CameraConfig *)calibration_thread_params;
+  CalibrationSettings *settings = &camera_config->calibration;
+  struct timespec start, now;
+  int elapsed_s = 0;
+  int i;
+
+  // Until the first IDR the frames are P frames of an unknown position
+  memset(calibration_channels, 0, sizeof(calibration_channels));
+  for (i = 0; i < MAX_ENCODERS; i++) {
+    calibration_channels[i].gop_position = 1;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  calibration_active = 1;
+
+  log_info("Calibrating buffer sizes for %d s", settings->duration_s);
+
+  while(!sigint_received && elapsed_s < settings->duration_s) {
+    sample_backlog(camera_config);
+    usleep(CALIBRATION_QUERY_INTERVAL_MS * 1000);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_s = now.tv_sec - start.tv_sec;
+  }
+
+  calibration_active = 0;
+  report_calibration(camera_config, elapsed_s, elapsed_s >= settings->duration_s);
+
+  return NULL;
+}
@@ -1,5 +1,9 @@
 #include "capture.h"
 #include "bgramapinfo.h"
+#include "audioencoder.h"
+#include "audioring.h"
+#include "audioactivity.h"
+#include "trace.h"
 
 /*
 
@@ -14,6 +18,14 @@ extern pthread_mutex_t frame_generator_mutex;
 
 int FrameSourceEnabled[5] = {0,0,0,0,0};
 IMPRgnHandle osdRegion;
+IMPRgnHandle perfHudRegion;
+AudioStats audio_stats;
+AudioRing audio_ring;
+
+// The PCM is written through mmap, where the start threshold does not
+// apply, so audio_mmap_write starts it once this many frames are queued
+static snd_pcm_uframes_t pcm_start_frames;
+static snd_pcm_uframes_t pcm_buffer_frames;
 
 int initialize_sensor(IMPSensorInfo *sensor_info)
 {
@@ -140,50 +152,52 @@ int configure_video_tuning_parameters(CameraConfig *camera_config)
   return 0;
 }
 
-int initialize_audio()
+int initialize_audio(AudioSettings *audio_settings)
 {
   int ret;
-  int device_id = 1;
-  int audio_channel_id = 0;
+  int device_id = audio_settings->device_id;
+  int audio_channel_id = audio_settings->channel_id;
 
-  IMPAudioIOAttr audio_settings;
+  IMPAudioIOAttr audio_attr;
   IMPAudioIChnParam audio_channel_params;
+  IMPAudioAgcConfig agc_config;
 
   log_info("Initializing audio settings");
 
-  audio_settings.samplerate = AUDIO_SAMPLE_RATE_48000;
-  audio_settings.bitwidth = AUDIO_BIT_WIDTH_16;
-  audio_settings.soundmode = AUDIO_SOUND_MODE_MONO; 
+  audio_attr.samplerate = audio_settings->sample_rate;
+  audio_attr.bitwidth = AUDIO_BIT_WIDTH_16;
+  audio_attr.soundmode = AUDIO_SOUND_MODE_MONO; 
 
   // Number of audio frames to cache (max is 50) 
-  audio_settings.frmNum = MAX_AUDIO_FRAME_NUM;
+  audio_attr.frmNum = audio_settings->frame_num;
 
   // Number of sampling points per frame
-  audio_settings.numPerFrm = 1920;
-  audio_settings.chnCnt = 1;
+  audio_attr.numPerFrm = audio_settings->samples_per_frame;
+  audio_attr.chnCnt = 1;
 
 
 
   // ALSA
   snd_pcm_hw_params_t *pcm_hw_params;
-  snd_pcm_uframes_t pcm_frames;
-  int sample_rate, audio_channels;
+  snd_pcm_sw_params_t *pcm_sw_params;
+  snd_pcm_uframes_t period_size, buffer_size;
+  unsigned int sample_rate, audio_channels;
 
 
 
 
-  ret = IMP_AI_SetPubAttr(device_id, &audio_settings);
+  ret = IMP_AI_SetPubAttr(device_id, &audio_attr);
 
   if(ret < 0){
     log_error("Error in setting attributes for audio encoder\n");
     return -1;
   }
 
-  log_info("Sample rate: %d", audio_settings.samplerate);
-  log_info("Bit width: %d", audio_settings.bitwidth);
-  log_info("Sound mode: %d", audio_settings.soundmode);
-  log_info("Max frames to cache: %d", audio_settings.frmNum);
-  log_info("Samples per frame: %d", audio_settings.numPerFrm);
+  log_info("Sample rate: %d", audio_attr.samplerate);
+  log_info("Bit width: %d", audio_attr.bitwidth);
+  log_info("Sound mode: %d", audio_attr.soundmode);
+  log_info("Max frames to cache: %d", audio_attr.frmNum);
+  log_info("Samples per frame: %d", audio_attr.numPerFrm);
 
   /* Step 2: enable AI device. */
   ret = IMP_AI_Enable(device_id);
@@ -196,7 +210,8 @@ int initialize_audio()
   // Set audio channel attributes of device
 
   // Audio frame buffer depth
-  audio_channel_params.usrFrmDepth = 20;
+  memset(&audio_channel_params, 0, sizeof(IMPAudioIChnParam));
+  audio_channel_params.usrFrmDepth = audio_settings->usr_frame_depth;
 
   ret = IMP_AI_SetChnParam(device_id, audio_channel_id, &audio_channel_params);
   if(ret != 0) {
@@ -212,13 +227,16 @@ int initialize_audio()
   }
 
   /* Step 5: Set audio channel volume. */
-  ret = IMP_AI_SetVol(device_id, audio_channel_id, 70);
+  ret = IMP_AI_SetVol(device_id, audio_channel_id, audio_settings->volume);
   if(ret != 0) {
     log_error("Error setting the audio channel volume");
     return -1;
   }  
 
 
+  // The SDK only implements the voice processing at some sample rates, so
+  // a failure here leaves the audio unprocessed instead of disabling it.
+
   // Enable hardware noise suppression
   // 4 levels to pick from:
   //
@@ -226,11 +244,28 @@ int initialize_audio()
   // NS_MODERATE
   // NS_HIGH
   // NS_VERYHIGH
-  ret = IMP_AI_EnableNs(&audio_settings, NS_HIGH);
-  if(ret != 0) {
-    log_error("Error enable hardware noise suppression.");
-    return -1;
-  }  
+  if (audio_settings->ns) {
+    ret = IMP_AI_EnableNs(&audio_attr, audio_settings->ns_level);
+    if(ret != 0) {
+      log_error("Error enable hardware noise suppression.");
+    }
+  }
+
+  if (audio_settings->agc) {
+    agc_config.TargetLevelDbfs = audio_settings->agc_target_level;
+    agc_config.CompressionGaindB = audio_settings->agc_compression_gain;
+    ret = IMP_AI_EnableAgc(&audio_attr, agc_config);
+    if(ret != 0) {
+      log_error("Error enabling automatic gain control.");
+    }
+  }
+
+  if (audio_settings->hpf) {
+    ret = IMP_AI_EnableHpf(&audio_attr);
+    if(ret != 0) {
+      log_error("Error enabling the high pass filter.");
+    }
+  }
 
   // ALSA loopback device setup
   // Found good sample code here: https://gist.github.com/ghedo/963382/98f730d61dad5b6fdf0c4edb7a257c5f9700d83b
@@ -250,51 +285,63 @@ int initialize_audio()
 
 
   audio_channels = 1;
-  sample_rate = 48000;
+  sample_rate = audio_settings->sample_rate;
 
 
   /* Set parameters */
-  if (ret = snd_pcm_hw_params_set_access(pcm_handle, pcm_hw_params, SND_PCM_ACCESS_RW_INTERLEAVED) < 0) {    
-    log_error("ERROR: Can't set interleaved mode. %s\n", snd_strerror(ret));
+  // The audio thread writes straight into the ring buffer of the device
+  // through snd_pcm_mmap_begin/commit, so ask for mmap access.
+  if ((ret = snd_pcm_hw_params_set_access(pcm_handle, pcm_hw_params, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0) {
+    log_error("ERROR: Can't set mmap interleaved mode. %s\n", snd_strerror(ret));
+    return -1;
   }
 
-  if (ret = snd_pcm_hw_params_set_format(pcm_handle, pcm_hw_params, SND_PCM_FORMAT_S16_LE) < 0)  {
+  if ((ret = snd_pcm_hw_params_set_format(pcm_handle, pcm_hw_params, SND_PCM_FORMAT_S16_LE)) < 0)  {
     log_error("ERROR: Can't set format. %s\n", snd_strerror(ret));
   }
 
-  if (ret = snd_pcm_hw_params_set_channels(pcm_handle, pcm_hw_params, audio_channels) < 0) {
+  if ((ret = snd_pcm_hw_params_set_channels(pcm_handle, pcm_hw_params, audio_channels)) < 0) {
     log_error("ERROR: Can't set channels number. %s\n", snd_strerror(ret));
   }
 
-  if (ret = snd_pcm_hw_params_set_rate_near(pcm_handle, pcm_hw_params, &sample_rate, 0) < 0) {    
+  if ((ret = snd_pcm_hw_params_set_rate_near(pcm_handle, pcm_hw_params, &sample_rate, 0)) < 0) {
     log_error("ERROR: Can't set rate. %s\n", snd_strerror(ret));  
   }
 
+  // One ALSA period per IMP audio frame, so every frame we get from the
+  // IMP fills exactly one period.
+  period_size = audio_settings->samples_per_frame;
+  if ((ret = snd_pcm_hw_params_set_period_size_near(pcm_handle, pcm_hw_params, &period_size, 0)) < 0) {
+    log_error("ERROR: Can't set period size. %s\n", snd_strerror(ret));
+  }
 
-  // snd_pcm_uframes_t frames = 1920;
-
-  // if (ret = snd_pcm_hw_params_set_period_size(pcm_handle, pcm_hw_params, frames, 0) < 0) {
-  //   log_error("ERROR: Can't set period size. %s\n", snd_strerror(ret));
-  // }
-
-
-
-  /* Set number of periods. Periods used to be called fragments. */ 
-  // if (ret = snd_pcm_hw_params_set_periods(pcm_handle, pcm_hw_params, 2, 0) < 0) {
-  //   log_error("ERROR: Can't set periods. %s\n", snd_strerror(ret));
-  // }
-
-  // /* Set buffer size (in frames). The resulting latency is given by */
-  // /* latency = periodsize * periods / (rate * bytes_per_frame)     */
-  // if (ret = snd_pcm_hw_params_set_buffer_size(pcm_handle, pcm_hw_params, 960 * 2) < 0) {
-  //   log_error("ERROR: Can't set buffer size. %s\n", snd_strerror(ret));  
-  // }
+  /* Set buffer size (in frames). The resulting latency is given by */
+  /* latency = periodsize * periods / (rate * bytes_per_frame)     */
+  buffer_size = period_size * AUDIO_ALSA_PERIODS;
+  if ((ret = snd_pcm_hw_params_set_buffer_size_near(pcm_handle, pcm_hw_params, &buffer_size)) < 0) {
+    log_error("ERROR: Can't set buffer size. %s\n", snd_strerror(ret));  
+  }
 
   /* Write parameters */
-  if (ret = snd_pcm_hw_params(pcm_handle, pcm_hw_params) < 0) {    
+  if ((ret = snd_pcm_hw_params(pcm_handle, pcm_hw_params)) < 0) {    
     log_error("ERROR: Can't set hardware parameters. %s\n", snd_strerror(ret));
+    return -1;
   }
 
+  snd_pcm_hw_params_get_period_size(pcm_hw_params, &period_size, 0);
+  snd_pcm_hw_params_get_buffer_size(pcm_hw_params, &buffer_size);
+
+  // Start playback once two periods are queued. That leaves a period of
+  // slack for jitter in the IMP capture side, without adding more delay.
+  snd_pcm_sw_params_alloca(&pcm_sw_params);
+  snd_pcm_sw_params_current(pcm_handle, pcm_sw_params);
+  snd_pcm_sw_params_set_start_threshold(pcm_handle, pcm_sw_params, period_size * 2);
+  snd_pcm_sw_params_set_avail_min(pcm_handle, pcm_sw_params, period_size);
+  if ((ret = snd_pcm_sw_params(pcm_handle, pcm_sw_params)) < 0) {
+    log_error("ERROR: Can't set software parameters. %s\n", snd_strerror(ret));
+  }
+  pcm_start_frames = period_size * 2;
+  pcm_buffer_frames = buffer_size;
 
 
   log_info("PCM name: %s", snd_pcm_name(pcm_handle));
@@ -306,6 +353,13 @@ int initialize_audio()
   snd_pcm_hw_params_get_rate(pcm_hw_params, &sample_rate, 0);
   log_info("PCM sample rate: %d bps", sample_rate);
 
+  log_info("PCM period size: %lu frames", period_size);
+  log_info("PCM buffer size: %lu frames", buffer_size);
+
+  if (audio_ring_init(&audio_ring, AUDIO_RING_SIZE) != 0) {
+    log_error("Unable to allocate the audio ring buffer");
+    return -1;
+  }
 
   log_info("Audio initialization complete");
 
@@ -524,6 +578,77 @@ void print_stream_settings(StreamSettings *stream_settings)
 
 
 
+// Place a region of the given size (in pixels) in one of the corners
+// of the sensor image, 10 pixels away from the edges.
+void osd_region_rect(int location, int width, int height, IMPRect *rect)
+{
+  switch(location) {
+    case 1: //top right
+      rect->p1.x = SENSOR_WIDTH - 10;
+      rect->p0.x = rect->p1.x - width + 1;
+      rect->p0.y = 10;
+      rect->p1.y = rect->p0.y + height - 1;
+      break;
+    case 2: //bottom left
+      rect->p0.x = 10;
+      rect->p1.x = rect->p0.x + width - 1;
+      rect->p1.y = SENSOR_HEIGHT - 10;
+      rect->p0.y = rect->p1.y - height + 1;
+      break;
+    case 3: //bottom right
+      rect->p1.x = SENSOR_WIDTH - 10;
+      rect->p0.x = rect->p1.x - width + 1;
+      rect->p1.y = SENSOR_HEIGHT - 10;
+      rect->p0.y = rect->p1.y - height + 1;
+      break;
+    default: //top left
+      rect->p0.x = 10;
+      rect->p0.y = 10;
+      rect->p1.x = rect->p0.x + width - 1;   //p0 is start，and p1 well be epual p0+width(or heigth)-1
+      rect->p1.y = rect->p0.y + height - 1;
+      break;
+  }
+}
+
+// Blit text into a BGRA picture that is line_width pixels wide, starting
+// at its first row. The font only has glyphs for [0-9] [-] [ ] [:], any
+// other character is drawn as a blank. Text that does not fit is cut off.
+void osd_draw_text(uint32_t *picture, int line_width, const char *text)
+{
+  int i, j;
+  int glyph;
+  int penpos = 0;
+  int fontadv;
+
+  for (i = 0; text[i] != '\0'; i++) {
+    switch(text[i]) {
+      case '0' ... '9':
+        glyph = text[i] - '0';
+        break;
+      case '-':
+        glyph = 10;
+        break;
+      case ':':
+        glyph = 12;
+        break;
+      default:
+        glyph = 11;
+        break;
+    }
+
+    fontadv = gBgramap[glyph].width;
+    if (penpos + fontadv > line_width) {
+      break;
+    }
+
+    for (j = 0; j < OSD_REGION_HEIGHT; j++) {
+      memcpy((void *)(picture + j*line_width + penpos),
+          (void *)(gBgramap[glyph].pdata + j*fontadv), fontadv*4);
+    }
+    penpos += fontadv;
+  }
+}
+
 int initialize_osd(int osdLoc)
 {
   int ret = 0;
@@ -548,32 +673,7 @@ int initialize_osd(int osdLoc)
   IMPOSDRgnAttr rAttrFont;
   memset(&rAttrFont, 0, sizeof(IMPOSDRgnAttr));
   rAttrFont.type = OSD_REG_PIC;
-  switch(osdLoc) {
-    case 1: //top right
-      rAttrFont.rect.p1.x = SENSOR_WIDTH - 10;
-      rAttrFont.rect.p0.x = rAttrFont.rect.p1.x - 20 * OSD_REGION_WIDTH + 1;
-      rAttrFont.rect.p0.y = 10;
-      rAttrFont.rect.p1.y = rAttrFont.rect.p0.y + OSD_REGION_HEIGHT - 1;
-      break;
-    case 2: //bottom left
-      rAttrFont.rect.p0.x = 10;
-      rAttrFont.rect.p1.x = rAttrFont.rect.p0.x + 20 * OSD_REGION_WIDTH - 1;
-      rAttrFont.rect.p1.y = SENSOR_HEIGHT - 10;
-      rAttrFont.rect.p0.y = rAttrFont.rect.p1.y - OSD_REGION_HEIGHT + 1;
-      break;
-    case 3: //bottom right
-      rAttrFont.rect.p1.x = SENSOR_WIDTH - 10;
-      rAttrFont.rect.p0.x = rAttrFont.rect.p1.x - 20 * OSD_REGION_WIDTH + 1;
-      rAttrFont.rect.p1.y = SENSOR_HEIGHT - 10;
-      rAttrFont.rect.p0.y = rAttrFont.rect.p1.y - OSD_REGION_HEIGHT + 1;
-      break;
-    default: //top left
-      rAttrFont.rect.p0.x = 10;
-      rAttrFont.rect.p0.y = 10;
-      rAttrFont.rect.p1.x = rAttrFont.rect.p0.x + 20 * OSD_REGION_WIDTH - 1;   //p0 is start，and p1 well be epual p0+width(or heigth)-1
-      rAttrFont.rect.p1.y = rAttrFont.rect.p0.y + OSD_REGION_HEIGHT - 1;
-      break;
-  }
+  osd_region_rect(osdLoc, 20 * OSD_REGION_WIDTH, OSD_REGION_HEIGHT, &rAttrFont.rect);
   rAttrFont.fmt = PIX_FMT_BGRA;
   rAttrFont.data.picData.pData = NULL;
 
@@ -619,11 +719,12 @@ void *timestamp_osd_entry_start(void *timestamp_osd_thread_params)
   char DateStr[40];
   time_t currTime;
   struct tm *currDate;
-  unsigned i = 0, j = 0;
-  void *dateData = NULL;
   uint32_t *timeStampData;
 
   IMPOSDRgnAttrData rAttrData;
+  uint64_t trace_stage;
+
+  trace_thread_name("timestamp osd");
 
   initialize_osd(camera_config->timestamp_location);
 
@@ -649,47 +750,17 @@ void *timestamp_osd_entry_start(void *timestamp_osd_thread_params)
 
 
   while(!sigint_received) {
-      int penpos_t = 0;
-      int fontadv = 0;
-
       time(&currTime);
       currDate = localtime(&currTime);
       memset(DateStr, 0, 40);
       // strftime(DateStr, 40, "%Y-%m-%d %H:%M:%S", currDate);
       strftime(DateStr, 40, DateFormat, currDate);
-      for (i = 0; i < 20; i++) {
-        switch(DateStr[i]) {
-          case '0' ... '9':
-            dateData = (void *)gBgramap[DateStr[i] - '0'].pdata;
-            fontadv = gBgramap[DateStr[i] - '0'].width;
-            penpos_t += gBgramap[DateStr[i] - '0'].width;
-            break;
-          case '-':
-            dateData = (void *)gBgramap[10].pdata;
-            fontadv = gBgramap[10].width;
-            penpos_t += gBgramap[10].width;
-            break;
-          case ' ':
-            dateData = (void *)gBgramap[11].pdata;
-            fontadv = gBgramap[11].width;
-            penpos_t += gBgramap[11].width;
-            break;
-          case ':':
-            dateData = (void *)gBgramap[12].pdata;
-            fontadv = gBgramap[12].width;
-            penpos_t += gBgramap[12].width;
-            break;
-          default:
-            break;
-        }
-
-        for (j = 0; j < OSD_REGION_HEIGHT; j++) {
-          memcpy((void *)((uint32_t *)timeStampData + j*20*OSD_REGION_WIDTH + penpos_t),
-              (void *)((uint32_t *)dateData + j*fontadv), fontadv*4);
-        }
-      }
+      trace_stage = trace_begin();
+      memset(timeStampData, 0, 20 * OSD_REGION_HEIGHT * OSD_REGION_WIDTH * 4);
+      osd_draw_text(timeStampData, 20 * OSD_REGION_WIDTH, DateStr);
       rAttrData.picData.pData = timeStampData;
       IMP_OSD_UpdateRgnAttrData(osdRegion, &rAttrData);
+      trace_end("timestamp OSD", trace_stage);
       // log_info("Updated osdRegion to: %s", DateStr);
 
       sleep(1);
@@ -701,353 +772,377 @@ void *timestamp_osd_entry_start(void *timestamp_osd_thread_params)
 
 }
 
-
-// This is the entrypoint for the audio thread
-void *audio_thread_entry_start(void *audio_thread_params)
+int initialize_perf_hud(CameraConfig *camera_config)
 {
   int ret;
+  IMPOSDRgnAttr rAttrHud;
 
-  // Audio device
-  int audio_device_id = 1;
-  int audio_channel_id = 0;
-  IMPAudioFrame audio_frame;
-  int num_samples;
-  short pcm_audio_data[1920 * 2];
-
-  while(!sigint_received) {
-
-    ret = IMP_AI_PollingFrame(audio_device_id, audio_channel_id, 1000);
-    if (ret < 0) {
-      log_error("Error or timeout polling for audio frame");
-      pthread_exit(NULL);
-    }
-
-    ret = IMP_AI_GetFrame(audio_device_id, audio_channel_id, &audio_frame, BLOCK);
-    if (ret < 0) {
-      log_error("Error getting audio frame data");
-      pthread_exit(NULL);
-    }
-
-    num_samples = audio_frame.len / sizeof(short);
-
-    memcpy(pcm_audio_data, (void *)audio_frame.virAddr, audio_frame.len );
-
-    ret = IMP_AI_ReleaseFrame(audio_device_id, audio_channel_id, &audio_frame);
-    if(ret != 0) {
-      log_error("Error releasing audio frame");
-      pthread_exit(NULL);
-    }
-
-    ret = snd_pcm_writei(pcm_handle, pcm_audio_data, num_samples);
-
-    if ( ret == -EPIPE) {
-      log_error("Buffer underrun when writing to ALSA loopback device");
-      snd_pcm_prepare(pcm_handle);
-    }
-
-    if (ret < 0) {
-      log_error("ERROR. Can't write to PCM device. %s\n", snd_strerror(ret));
-    }
+  log_info("Initializing performance HUD");
 
+  perfHudRegion = IMP_OSD_CreateRgn(NULL);
+  if (perfHudRegion < 0) {
+    log_error("IMP_OSD_CreateRgn failed for performance HUD");
+    return -1;
   }
-}
-
-// This is the entrypoint for the night vision thread
-void *night_vision_entry_start(void *night_vision_thread_params)
-{
-  // Default to day mode
-  IMPISPRunningMode ispRunningMode = IMPISP_RUNNING_MODE_DAY;
-  IMPISPSceneMode ispSceneMode = IMPISP_SCENE_MODE_AUTO;
-  IMPISPColorfxMode ispColorMode = IMPISP_COLORFX_MODE_AUTO;
-
-  bool NIGHT_VISION_ENABLED = 0;
-  bool NIGHT_VISION_PREVIOUS_STATE = 0;
 
-  while(!sigint_received) {
-    int ret;
-    // Save previous state
-    NIGHT_VISION_PREVIOUS_STATE = NIGHT_VISION_ENABLED;
-    // Read State file if it exists. Otherwise don't do anything.
-    if( access( NIGHT_VISION_FILE, F_OK ) == 0 ) {
-      char buffer[NIGHT_VISION_FILE_BUFFER_SIZE];
-      FILE *file = fopen(NIGHT_VISION_FILE, "r");
-      fscanf(file, "%d", &NIGHT_VISION_ENABLED);
-      fclose(file);
-    }
-    // Check if state has changed
-    if (NIGHT_VISION_PREVIOUS_STATE != NIGHT_VISION_ENABLED) {
-      if (NIGHT_VISION_ENABLED) {
-        ispRunningMode = IMPISP_RUNNING_MODE_NIGHT;
-        ispSceneMode = IMPISP_SCENE_MODE_NIGHT;
-        ispColorMode = IMPISP_COLORFX_MODE_BW;
-        log_info("Night Vision ENABLED (Value: (%d))\n", NIGHT_VISION_ENABLED);
-        
-      } else {
-        ispRunningMode = IMPISP_RUNNING_MODE_DAY;
-        ispSceneMode = IMPISP_SCENE_MODE_AUTO;
-        ispColorMode = IMPISP_COLORFX_MODE_AUTO;
-        log_info("Night Vision DISABLED (Value: (%d))\n", NIGHT_VISION_ENABLED);
-      }
-      ret = IMP_ISP_Tuning_SetISPRunningMode(ispRunningMode);
-      if (ret) {
-        log_error("ERROR on SetISPRunningMode!");
-      }
-
-      ret = IMP_ISP_Tuning_SetSceneMode(ispSceneMode);
-      if (ret) {
-        log_error("ERROR on SetSceneMode!");
-      }
-
-      ret = IMP_ISP_Tuning_SetColorfxMode(ispColorMode);
-      if (ret) {
-        log_error("ERROR on SetColorfxMode!");
-      }
-    }
-
-    sleep(1);
+  ret = IMP_OSD_RegisterRgn(perfHudRegion, 0, NULL);
+  if (ret < 0) {
+    log_error("IMP_OSD_RegisterRgn failed for performance HUD");
+    return -1;
   }
-}
 
+  memset(&rAttrHud, 0, sizeof(IMPOSDRgnAttr));
+  rAttrHud.type = OSD_REG_PIC;
+  osd_region_rect(camera_config->perf_hud_location, PERF_HUD_CHARS * OSD_REGION_WIDTH,
+                  camera_config->num_encoders * OSD_REGION_HEIGHT, &rAttrHud.rect);
+  rAttrHud.fmt = PIX_FMT_BGRA;
+  rAttrHud.data.picData.pData = NULL;
 
-// This is the entrypoint for the threads
-void *produce_frames(void *encoder_thread_params_ptr)
-{
-  int ret, i;
-  EncoderThreadParams *encoder_thread_params = encoder_thread_params_ptr;
-
-  // Unpack the EncoderThreadParams
-  EncoderSetting *encoder = encoder_thread_params->encoder;
-
-  log_info("Starting thread for encoder");
-
-  output_v4l2_frames(encoder);
+  ret = IMP_OSD_SetRgnAttr(perfHudRegion, &rAttrHud);
+  if (ret < 0) {
+    log_error("IMP_OSD_SetRgnAttr failed for performance HUD");
+    return -1;
+  }
 
+  return 0;
 }
 
-int output_v4l2_frames(EncoderSetting *encoder_setting)
+// This is the entrypoint for the performance HUD thread. Once a second it
+// samples the counters of every encoder and draws one line per channel:
+//
+//   <channel>: <fps> <kbit/s> <dropped frames> <poll timeouts>
+//
+// Dropped frames and poll timeouts are totals since startup.
+void *perf_hud_entry_start(void *perf_hud_thread_params)
 {
-  int ret;
-  int stream_packets;
-  int i;
-  int total;
-  char *v4l2_device_path = encoder_setting->v4l2_device_path;
-  int video_width = encoder_setting->pic_width;
-  int video_height = encoder_setting->pic_height;
-
-  int frames_written = 0;
-  float current_fps = 0;
-  float elapsed_seconds = 0;
-  struct timeval tval_before, tval_after, tval_result;
-  float delay_in_seconds = 0;
-  float adjusted_delay_in_seconds = 0;
-
-
-  struct v4l2_capability vid_caps;
-  struct v4l2_format vid_format;
-
-  IMPEncoderStream stream;
-
-  uint8_t *stream_chunk;
-  uint8_t *temp_chunk;
-
+  int ret, i;
+  CameraConfig *camera_config = (CameraConfig *)perf_hud_thread_params;
+  int line_width = PERF_HUD_CHARS * OSD_REGION_WIDTH;
+  int line_size = line_width * OSD_REGION_HEIGHT;
+  char line[PERF_HUD_CHARS + 1];
+  uint32_t *hudData;
+  uint32_t last_frames[MAX_ENCODERS];
+  uint32_t last_bytes[MAX_ENCODERS];
+  uint32_t frames, bytes;
+  struct timespec now, last;
+  float elapsed_seconds;
+  EncoderStats *stats;
+  IMPOSDRgnAttrData rAttrData;
+  uint64_t trace_stage;
 
-  // h264 NAL unit stuff
+  trace_thread_name("performance hud");
 
-  // h264_stream_t *h = h264_new();
-  // int nal_start, nal_end;
-  // uint8_t* buf;
-  // int len;
+  hudData = malloc(camera_config->num_encoders * line_size * 4);
+  if (hudData == NULL) {
+    log_error("Unable to allocate performance HUD buffer");
+    return NULL;
+  }
 
+  ret = IMP_OSD_ShowRgn(perfHudRegion, 0, 1);
+  if (ret < 0) {
+    log_error("IMP_OSD_ShowRgn failed for performance HUD");
+    free(hudData);
+    return NULL;
+  }
 
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    last_frames[i] = camera_config->encoders[i].stats.frames;
+    last_bytes[i] = camera_config->encoders[i].stats.bytes;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &last);
 
+  while(!sigint_received) {
+    sleep(1);
 
-  delay_in_seconds = (1.0 * encoder_setting->frame_rate_denominator) / encoder_setting->frame_rate_numerator;
-  log_info("Delay in seconds: %f", delay_in_seconds);
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed_seconds = (now.tv_sec - last.tv_sec) + (now.tv_nsec - last.tv_nsec) / 1000000000.0;
+    last = now;
 
+    trace_stage = trace_begin();
+    memset(hudData, 0, camera_config->num_encoders * line_size * 4);
 
+    for (i = 0; i < camera_config->num_encoders; i++) {
+      stats = &camera_config->encoders[i].stats;
 
+      frames = stats->frames;
+      bytes = stats->bytes;
 
+      snprintf(line, sizeof(line), "%d: %2.0f %5u %3u %3u",
+               camera_config->encoders[i].channel,
+               (frames - last_frames[i]) / elapsed_seconds,
+               (unsigned)((bytes - last_bytes[i]) * 8 / 1000 / elapsed_seconds),
+               stats->dropped_frames,
+               stats->poll_timeouts);
 
+      last_frames[i] = frames;
+      last_bytes[i] = bytes;
 
-  log_info("Opening V4L2 device: %s ", v4l2_device_path);
-  int v4l2_fd = open(v4l2_device_path, O_WRONLY, 0777);
+      osd_draw_text(hudData + i * line_size, line_width, line);
+    }
 
-  if (v4l2_fd < 0) {
-    log_error("Failed to open V4L2 device: %s", v4l2_device_path);
-    return -1;
+    rAttrData.picData.pData = hudData;
+    IMP_OSD_UpdateRgnAttrData(perfHudRegion, &rAttrData);
+    trace_end("performance HUD", trace_stage);
   }
 
+  free(hudData);
 
-  // ret = ioctl(v4l2_fd, VIDIOC_QUERYCAP, &vid_caps);
-
-  memset(&vid_format, 0, sizeof(vid_format));
-  vid_format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-  vid_format.fmt.pix.width = video_width;
-  vid_format.fmt.pix.height = video_height;
+  return NULL;
+}
 
-  if (strcmp(encoder_setting->payload_type, "PT_H264") == 0) {
-    vid_format.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
-    vid_format.fmt.pix.sizeimage = 0;
-    vid_format.fmt.pix.field = V4L2_FIELD_NONE;
-    vid_format.fmt.pix.bytesperline = 0;
-    vid_format.fmt.pix.colorspace = V4L2_PIX_FMT_YUV420;
-  }
-  else if(strcmp(encoder_setting->payload_type, "PT_JPEG") == 0) {
-    vid_format.fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
-    // TODO: Is this correct? Doc says needs to be set to maximum size of image
-    vid_format.fmt.pix.sizeimage = 0; 
-    vid_format.fmt.pix.field = V4L2_FIELD_NONE;
-    vid_format.fmt.pix.bytesperline = 0;
-    vid_format.fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
-  }
-  else {
-    log_error("Unknown payload type: %s", encoder_setting->payload_type);
-    return -1;
-  }
 
+// Starts a prepared PCM once pcm_start_frames are queued. snd_pcm_recover
+// only prepares the stream again, so this also restarts it after an xrun.
+static int audio_mmap_start(snd_pcm_t *pcm)
+{
+  snd_pcm_sframes_t avail;
 
-  ret = ioctl(v4l2_fd, VIDIOC_S_FMT, &vid_format);
-  if (ret < 0) {
-    log_error("Unable to set V4L2 device video format: %d", ret);
-    return -1;
+  if (snd_pcm_state(pcm) != SND_PCM_STATE_PREPARED) {
+    return 0;
   }
 
-  ret = ioctl(v4l2_fd, VIDIOC_STREAMON, &vid_format);
-  if (ret < 0) {
-    log_error("Unable to perform VIDIOC_STREAMON: %d", ret);
-    return -1;
+  avail = snd_pcm_avail_update(pcm);
+  if (avail < 0) {
+    return avail;
   }
-
-  log_info("V4L2 device opened and setup complete: VIDIOC_STREAMON");
-  
-
-  log_info("Sleeping 2 seconds before starting to send frames...");
-
-
-  ret = IMP_Encoder_StartRecvPic(encoder_setting->channel);
-  if (ret < 0) {
-    log_error("IMP_Encoder_StartRecvPic(%d) failed.", encoder_setting->channel);
-    return -1;
+  if (pcm_buffer_frames - avail < pcm_start_frames) {
+    return 0;
   }
 
-  // Every set number of frames calculate out how many frames per second we are getting
-  current_fps = 0;
-  frames_written = 0;
-  gettimeofday(&tval_before, NULL);
-
-
-  // int samples_file;
-  // samples_file = fopen("/tmp/samples.pcm", "w");
+  return snd_pcm_start(pcm);
+}
 
-  clock_t start, end;
-  double cpu_time_used;
+// Copy mono 16 bit samples straight into the mmap ring buffer of the PCM.
+// Returns 0 or a negative ALSA error code, -ETIMEDOUT when the device
+// stopped taking samples.
+static int audio_mmap_write(snd_pcm_t *pcm, const short *samples, snd_pcm_uframes_t num_frames)
+{
+  int ret;
+  const snd_pcm_channel_area_t *areas;
+  snd_pcm_uframes_t offset, frames;
+  snd_pcm_sframes_t avail, committed;
+
+  while (num_frames > 0) {
+    avail = snd_pcm_avail_update(pcm);
+    if (avail < 0) {
+      return avail;
+    }
 
+    if (avail == 0) {
+      // Ring buffer full, wait for the device to play a period
+      ret = snd_pcm_wait(pcm, 1000);
+      if (ret < 0) {
+        return ret;
+      }
+      if (ret == 0) {
+        return -ETIMEDOUT;
+      }
+      continue;
+    }
 
-  while(!sigint_received) {
-    start = clock();
+    // mmap_begin can return less than asked for when the area wraps
+    frames = num_frames;
+    ret = snd_pcm_mmap_begin(pcm, &areas, &offset, &frames);
+    if (ret < 0) {
+      return ret;
+    }
 
-    // Video Frames
-    if (frames_written == 200) {
-      gettimeofday(&tval_after, NULL);
-      timersub(&tval_after, &tval_before, &tval_result);
+    memcpy((char *)areas[0].addr + (areas[0].first + offset * areas[0].step) / 8,
+           samples, frames * sizeof(short));
 
-      elapsed_seconds =  (long int)tval_result.tv_sec + ((long int)tval_result.tv_usec / 1000000);
+    committed = snd_pcm_mmap_commit(pcm, offset, frames);
+    if (committed < 0) {
+      return committed;
+    }
+    if ((snd_pcm_uframes_t)committed != frames) {
+      return -EPIPE;
+    }
 
-      current_fps = 200 / elapsed_seconds;
-      log_info("Current FPS: %.2f / Channel %d", current_fps, encoder_setting->channel);
+    ret = audio_mmap_start(pcm);
+    if (ret < 0) {
+      return ret;
+    }
 
-      // if (strcmp(v4l2_device_path, "/dev/video3") == 0) {
-      //   log_info("Obtained %d 16-bit samples from this specific audio frame", num_samples);
-      // }
+    samples += frames;
+    num_frames -= frames;
+  }
 
-      // IMPEncoderCHNStat encoder_status;
+  return 0;
+}
 
-      // IMP_Encoder_Query(encoder_setting->channel, &encoder_status);
+// This is the entrypoint for the audio capture thread. Frames from the
+// IMP go into audio_ring, the playback thread takes them from there.
+void *audio_thread_entry_start(void *audio_thread_params)
+{
+  int ret;
+  CameraConfig *camera_config = (CameraConfig *)audio_thread_params;
 
-      // log_info("Registered: %u", encoder_status.registered);
-      // log_info("Work done (0 is running, 1 is not running): %u", encoder_status.work_done);
-      // log_info("Number of images to be encoded: %u", encoder_status.leftPics);
-      // log_info("Number of bytes remaining in the stream buffer: %u", encoder_status.leftStreamBytes);
+  // Audio device
+  int audio_device_id = camera_config->audio.device_id;
+  int audio_channel_id = camera_config->audio.channel_id;
+  IMPAudioFrame audio_frame;
+  uint32_t num_samples;
+  AudioActivity audio_activity;
+  uint64_t trace_frame, trace_stage;
 
-      frames_written = 0;
-      gettimeofday(&tval_before, NULL);
-    }
+  trace_thread_name("audio capture");
+  audio_activity_init(&audio_activity, camera_config->audio.samples_per_frame, camera_config->audio.sample_rate);
 
+  while(!sigint_received) {
 
-    ret = IMP_Encoder_PollingStream(encoder_setting->channel, 1000);
+    trace_stage = trace_begin();
+    ret = IMP_AI_PollingFrame(audio_device_id, audio_channel_id, 1000);
+    trace_end("AI PollingFrame", trace_stage);
     if (ret < 0) {
-      log_error("Timeout while polling for stream on channel %d.", encoder_setting->channel);
-      continue;
+      log_error("Error or timeout polling for audio frame");
+      pthread_exit(NULL);
     }
 
-
-    // Get H264 Stream on channel and enable a blocking call
-    ret = IMP_Encoder_GetStream(encoder_setting->channel, &stream, 1);
+    trace_frame = trace_begin();
+    ret = IMP_AI_GetFrame(audio_device_id, audio_channel_id, &audio_frame, BLOCK);
     if (ret < 0) {
-      log_error("IMP_Encoder_GetStream() failed");
-      return -1;
+      log_error("Error getting audio frame data");
+      pthread_exit(NULL);
     }
 
-    stream_packets = stream.packCount;
+    audio_stats.capture_delay_us = IMP_System_GetTimeStamp() - audio_frame.timeStamp;
 
-    total = 0;
-    stream_chunk = malloc(1);
-    if (stream_chunk == NULL) {
-      log_error("Malloc returned NULL.");
-      return -1;
+    num_samples = audio_frame.len / sizeof(short);
+    if (audio_ring_write(&audio_ring, (int16_t *)audio_frame.virAddr, num_samples) != num_samples) {
+      audio_stats.overruns++;
     }
 
-    for (i = 0; i < stream_packets; i++) {
-      log_debug("Processing packet %d of size %d.", total, i, stream.pack[i].length);
+    if (camera_config->audio.activity_detection) {
+      audio_activity_update(&audio_activity, (int16_t *)audio_frame.virAddr, num_samples, camera_config->audio.sample_rate);
+    }
 
-      temp_chunk = realloc(stream_chunk, total + stream.pack[i].length);
+    trace_stage = trace_begin();
+    encode_audio_frame(&camera_config->audio, &audio_frame);
+    trace_end("audio encode", trace_stage);
 
-      if (temp_chunk == NULL) {
-        log_error("realloc returned NULL for request of size: %d", total);
-        return -1;
-      }
+    ret = IMP_AI_ReleaseFrame(audio_device_id, audio_channel_id, &audio_frame);
+    if(ret != 0) {
+      log_error("Error releasing audio frame");
+      pthread_exit(NULL);
+    }
+    trace_end("audio frame", trace_frame);
 
-      log_debug("Allocated an additional %d bytes for packet %d.", total + stream.pack[i].length, i);
+    audio_stats.frames++;
+  }
 
-      // Allocating worked
-      stream_chunk = temp_chunk;
-      temp_chunk = NULL;
+  return NULL;
+}
 
-      memcpy(&stream_chunk[total], (void *)stream.pack[i].virAddr, stream.pack[i].length);
-      total = total + stream.pack[i].length;
+// This is the entrypoint for the audio playback thread. It is paced by the
+// ALSA device and resamples the audio in audio_ring so that the total
+// amount of buffered audio stays at AUDIO_TARGET_LATENCY_MS, whatever the
+// difference between the IMP and ALSA clocks.
+void *audio_playback_entry_start(void *audio_playback_thread_params)
+{
+  int ret;
+  CameraConfig *camera_config = (CameraConfig *)audio_playback_thread_params;
+  int32_t sample_rate = camera_config->audio.sample_rate;
+  uint32_t period_size = camera_config->audio.samples_per_frame;
+  int16_t period[AUDIO_MAX_SAMPLES_PER_FRAME];
+  uint32_t produced;
+  snd_pcm_sframes_t pcm_delay;
+  int32_t target = sample_rate / 1000 * AUDIO_TARGET_LATENCY_MS;
+  int32_t buffered, filtered, error;
+  int32_t correction_ppm, drift_ppm, ppm;
+  int32_t drift_accumulator = 0;
+  uint32_t last_xruns = 0;
+  uint32_t last_underruns = 0;
+  time_t last_report = time(NULL);
+  AudioResampler resampler;
+  uint64_t trace_stage;
+
+  trace_thread_name("audio playback");
+  audio_resampler_init(&resampler, &audio_ring);
+
+  // Prefill to the target before the device starts
+  while (!sigint_received && audio_ring_fill(&audio_ring) < target) {
+    usleep(10000);
+  }
+  filtered = target;
 
-      log_debug("Total size of chunk after concatenating: %d bytes.", total);
+  while(!sigint_received) {
+    trace_stage = trace_begin();
+    produced = audio_resample(&resampler, period, period_size);
+    trace_end("resample", trace_stage);
+    if (produced < period_size) {
+      // Capture fell behind, play silence rather than stopping the device
+      memset(&period[produced], 0, (period_size - produced) * sizeof(int16_t));
+      audio_stats.underruns++;
     }
 
-    // Write out to the V4L2 device (for example /dev/video0)
-    ret = write(v4l2_fd, (void *)stream_chunk, total);
-    if (ret != total) {
-      log_error("Stream write error: %s", ret);
-      return -1;
+    trace_stage = trace_begin();
+    ret = audio_mmap_write(pcm_handle, period, period_size);
+    trace_end("pcm write", trace_stage);
+    if (ret == -EPIPE) {
+      audio_stats.xruns++;
+      ret = snd_pcm_recover(pcm_handle, ret, 1);
+    }
+    else if (ret == -ETIMEDOUT) {
+      // Drop what is queued, the next writes start the device again
+      log_warn("PCM device stopped playing, restarting it");
+      snd_pcm_drop(pcm_handle);
+      ret = snd_pcm_prepare(pcm_handle);
+    }
+    if (ret < 0) {
+      log_error("ERROR. Can't write to PCM device. %s\n", snd_strerror(ret));
+      continue;
     }
-  
-    free(stream_chunk);
-
-    IMP_Encoder_ReleaseStream(encoder_setting->channel, &stream);
-
-    frames_written = frames_written + 1;
-
-    end = clock();
-    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
-
-    adjusted_delay_in_seconds = delay_in_seconds - cpu_time_used;
-    usleep(1000 * 1000 * delay_in_seconds);
 
-  }
+    if (snd_pcm_delay(pcm_handle, &pcm_delay) != 0) {
+      pcm_delay = 0;
+    }
 
+    buffered = audio_ring_fill(&audio_ring) + audio_resampler_buffered(&resampler) + pcm_delay;
+
+    // The fill level moves by a period at a time, smooth it before using
+    // it to steer the resampler
+    filtered += (buffered - filtered) / 16;
+    error = filtered - target;
+
+    // Proportional part removes the error over AUDIO_DRIFT_CORRECTION_SECONDS,
+    // the integral part converges on the actual clock drift
+    correction_ppm = (int64_t)error * 1000000 / (sample_rate * AUDIO_DRIFT_CORRECTION_SECONDS);
+    drift_accumulator += correction_ppm;
+    if (drift_accumulator > AUDIO_MAX_DRIFT_PPM * 256) drift_accumulator = AUDIO_MAX_DRIFT_PPM * 256;
+    if (drift_accumulator < -AUDIO_MAX_DRIFT_PPM * 256) drift_accumulator = -AUDIO_MAX_DRIFT_PPM * 256;
+    drift_ppm = drift_accumulator / 256;
+
+    ppm = correction_ppm + drift_ppm;
+    if (ppm > AUDIO_MAX_DRIFT_PPM) ppm = AUDIO_MAX_DRIFT_PPM;
+    if (ppm < -AUDIO_MAX_DRIFT_PPM) ppm = -AUDIO_MAX_DRIFT_PPM;
+    audio_resampler_set_ppm(&resampler, ppm);
+
+    audio_stats.ring_fill = audio_ring_fill(&audio_ring);
+    audio_stats.drift_ppm = drift_ppm;
+    audio_stats.latency_us = audio_stats.capture_delay_us + (int64_t)buffered * 1000000 / sample_rate;
+    if (audio_stats.latency_us > audio_stats.max_latency_us) {
+      audio_stats.max_latency_us = audio_stats.latency_us;
+    }
 
-  ret = IMP_Encoder_StopRecvPic(encoder_setting->channel);
-  if (ret < 0) {
-    log_error("IMP_Encoder_StopRecvPic(%d) failed", encoder_setting->channel);
-    return -1;
+    if (time(NULL) - last_report >= AUDIO_REPORT_INTERVAL) {
+      log_info("Audio latency %u ms (target %d ms, max %u ms), drift %d ppm, "
+               "xruns %u, underruns %u, overruns %u",
+               audio_stats.latency_us / 1000,
+               AUDIO_TARGET_LATENCY_MS,
+               audio_stats.max_latency_us / 1000,
+               audio_stats.drift_ppm,
+               audio_stats.xruns - last_xruns,
+               audio_stats.underruns - last_underruns,
+               audio_stats.overruns);
+
+      audio_stats.max_latency_us = 0;
+      last_xruns = audio_stats.xruns;
+      last_underruns = audio_stats.underruns;
+      last_report = time(NULL);
+    }
   }
 
-
+  return NULL;
 }
 
 int sensor_cleanup(IMPSensorInfo *sensor_info)
@@ -1,6 +1,10 @@
 #include "configparser.h"
 #include "streamsettings.h"
 #include "log.h"
+#include "seitimestamp.h"
+#include "talkback.h"
+#include "imp_osd.h"
+#include "imp_audio.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -150,6 +154,76 @@ int device_name_to_id(char* name) {
   return device_id;
 }
 
+int osd_color_to_int(char* name, uint32_t *color) {
+  if(strcmp(name, "OSD_BLACK") == 0) {
+    *color = OSD_BLACK;
+  }
+  else if(strcmp(name, "OSD_WHITE") == 0) {
+    *color = OSD_WHITE;
+  }
+  else if(strcmp(name, "OSD_RED") == 0) {
+    *color = OSD_RED;
+  }
+  else if(strcmp(name, "OSD_GREEN") == 0) {
+    *color = OSD_GREEN;
+  }
+  else if(strcmp(name, "OSD_BLUE") == 0) {
+    *color = OSD_BLUE;
+  }
+  else {
+    log_error("Unknown OSD color: %s", name);
+    return -1;
+  }
+
+  return 0;
+}
+
+int audio_codec_to_int(char* name) {
+  int payload_type = -1;
+
+  if(strcmp(name, "PT_PCM") == 0) {
+    payload_type = PT_PCM;
+  }
+  if(strcmp(name, "PT_G711A") == 0) {
+    payload_type = PT_G711A;
+  }
+  if(strcmp(name, "PT_G711U") == 0) {
+    payload_type = PT_G711U;
+  }
+  if(strcmp(name, "PT_G726") == 0) {
+    payload_type = PT_G726;
+  }
+
+  if (payload_type < 0) {
+    log_error("Unknown audio codec: %s", name);
+  }
+
+  return payload_type;
+}
+
+int noise_suppression_to_int(char* name) {
+  int level = -1;
+
+  if(strcmp(name, "NS_LOW") == 0) {
+    level = NS_LOW;
+  }
+  if(strcmp(name, "NS_MODERATE") == 0) {
+    level = NS_MODERATE;
+  }
+  if(strcmp(name, "NS_HIGH") == 0) {
+    level = NS_HIGH;
+  }
+  if(strcmp(name, "NS_VERYHIGH") == 0) {
+    level = NS_VERYHIGH;
+  }
+
+  if (level < 0) {
+    log_error("Unknown noise suppression level: %s", name);
+  }
+
+  return level;
+}
+
 void device_id_to_string(int device_id, char *dest, int buffer_size)
 {
   if (device_id == DEV_ID_FS) {
@@ -257,13 +331,17 @@ void print_general_settings(CameraConfig *camera_config)
                    "show_timestamp: %d\n"
                    "timestamp_24h: %d\n"
                    "timestamp_location: %d\n"
-                   "enable_audio: %d\n",
+                   "enable_audio: %d\n"
+                   "show_perf_hud: %d\n"
+                   "perf_hud_location: %d\n",
                     camera_config->flip_vertical,
                     camera_config->flip_horizontal,
                     camera_config->show_timestamp,
                     camera_config->timestamp_24h,
                     camera_config->timestamp_location,
-                    camera_config->enable_audio
+                    camera_config->enable_audio,
+                    camera_config->show_perf_hud,
+                    camera_config->perf_hud_location
                     );
   log_info("%s", buffer);
 }
@@ -386,6 +464,50 @@ int populate_encoder(EncoderSetting *encoder_setting, cJSON* json)
   cJSON *pic_height = cJSON_GetObjectItemCaseSensitive(json, "pic_height");
   encoder_setting->pic_height = pic_height->valueint;
 
+  // Optional
+  cJSON *activity_detection = cJSON_GetObjectItemCaseSensitive(json, "activity_detection");
+  encoder_setting->activity_detection = 0;
+  if (activity_detection) {
+    encoder_setting->activity_detection = activity_detection->valueint;
+  }
+
+  cJSON *scene_change_idr = cJSON_GetObjectItemCaseSensitive(json, "scene_change_idr");
+  encoder_setting->scene_change_idr = 0;
+  if (scene_change_idr) {
+    encoder_setting->scene_change_idr = scene_change_idr->valueint;
+  }
+
+  cJSON *sei_timestamps = cJSON_GetObjectItemCaseSensitive(json, "sei_timestamps");
+  encoder_setting->sei_timestamps = 0;
+  if (sei_timestamps) {
+    encoder_setting->sei_timestamps = sei_timestamps->valueint;
+  }
+
+  cJSON *sps_vui = cJSON_GetObjectItemCaseSensitive(json, "sps_vui");
+  encoder_setting->sps_vui = 0;
+  if (sps_vui) {
+    encoder_setting->sps_vui = sps_vui->valueint;
+  }
+
+  // Replay is optional and replaces the encoder channel
+  encoder_setting->replay_file[0] = '\0';
+  cJSON *replay_file = cJSON_GetObjectItemCaseSensitive(json, "replay_file");
+  if (cJSON_IsString(replay_file)) {
+    snprintf(encoder_setting->replay_file, sizeof(encoder_setting->replay_file), "%s", replay_file->valuestring);
+  }
+
+  cJSON *replay_fast = cJSON_GetObjectItemCaseSensitive(json, "replay_fast");
+  encoder_setting->replay_fast = 0;
+  if (replay_fast) {
+    encoder_setting->replay_fast = replay_fast->valueint;
+  }
+
+  cJSON *replay_loop = cJSON_GetObjectItemCaseSensitive(json, "replay_loop");
+  encoder_setting->replay_loop = 0;
+  if (replay_loop) {
+    encoder_setting->replay_loop = replay_loop->valueint;
+  }
+
   IMPEncoderAttr *enc_attr;
   IMPEncoderRcAttr *rc_attr;
 
@@ -411,6 +533,12 @@ int populate_encoder(EncoderSetting *encoder_setting, cJSON* json)
 
   enc_attr->bufSize = encoder_setting->buffer_size;
   enc_attr->profile = encoder_setting->profile;
+
+  // Without user data buffers IMP_Encoder_InsertUserData always fails
+  if (encoder_setting->sei_timestamps) {
+    enc_attr->userData.maxUserDataCnt = 2;
+    enc_attr->userData.maxUserDataSize = SEI_TIMESTAMP_UUID_SIZE + SEI_TIMESTAMP_MAX_SIZE;
+  }
   enc_attr->picWidth = encoder_setting->pic_width;
   enc_attr->picHeight = encoder_setting->pic_height;
 
@@ -464,7 +592,14 @@ void print_encoder(EncoderSetting *encoder_setting)
                    "profile: %d\n"
                    "mode: %s\n"
                    "frame_rate_numerator: %d\n"
-                   "frame_rate_denominator: %d\n",
+                   "frame_rate_denominator: %d\n"
+                   "activity_detection: %d\n"
+                   "scene_change_idr: %d\n"
+                   "sei_timestamps: %d\n"
+                   "sps_vui: %d\n"
+                   "replay_file: %s\n"
+                   "replay_fast: %d\n"
+                   "replay_loop: %d\n",
                     encoder_setting->channel,
                     encoder_setting->group,
                     encoder_setting->v4l2_device_path,
@@ -472,7 +607,14 @@ void print_encoder(EncoderSetting *encoder_setting)
                     encoder_setting->profile,
                     encoder_setting->mode,
                     encoder_setting->frame_rate_numerator,
-                    encoder_setting->frame_rate_denominator
+                    encoder_setting->frame_rate_denominator,
+                    encoder_setting->activity_detection,
+                    encoder_setting->scene_change_idr,
+                    encoder_setting->sei_timestamps,
+                    encoder_setting->sps_vui,
+                    encoder_setting->replay_file,
+                    encoder_setting->replay_fast,
+                    encoder_setting->replay_loop
                     );
   log_info("%s", buffer);
 }
@@ -545,6 +687,866 @@ void print_binding(Binding *binding)
 }
 
 
+int populate_privacy_mask(PrivacyMask *privacy_mask, cJSON* json)
+{
+  int i;
+  const char* attribute_names[] = {
+    "id",
+    "x",
+    "y",
+    "width",
+    "height"
+  };
+  cJSON *json_attribute;
+
+  // Code to check if top level attributes are defined
+  for (i = 0; i < sizeof(attribute_names) / sizeof(char *); i++) {
+    json_attribute = cJSON_GetObjectItemCaseSensitive(json, attribute_names[i]);
+
+    if (json_attribute == NULL) {
+      log_error("Attribute %s must be defined", attribute_names[i]);
+      return -1;
+    }
+  }
+
+  cJSON *id = cJSON_GetObjectItemCaseSensitive(json, "id");
+  cJSON *enabled = cJSON_GetObjectItemCaseSensitive(json, "enabled");
+  cJSON *x = cJSON_GetObjectItemCaseSensitive(json, "x");
+  cJSON *y = cJSON_GetObjectItemCaseSensitive(json, "y");
+  cJSON *width = cJSON_GetObjectItemCaseSensitive(json, "width");
+  cJSON *height = cJSON_GetObjectItemCaseSensitive(json, "height");
+  cJSON *color = cJSON_GetObjectItemCaseSensitive(json, "color");
+
+  privacy_mask->id = id->valueint;
+  privacy_mask->x = x->valueint;
+  privacy_mask->y = y->valueint;
+  privacy_mask->width = width->valueint;
+  privacy_mask->height = height->valueint;
+
+  if (privacy_mask->width <= 0 || privacy_mask->height <= 0) {
+    log_error("Privacy mask %d must have a positive width and height", privacy_mask->id);
+    return -1;
+  }
+
+  privacy_mask->enabled = 1;
+  if (enabled) {
+    privacy_mask->enabled = enabled->valueint;
+  }
+
+  // Masks are black unless configured otherwise
+  strcpy(privacy_mask->color_name, "OSD_BLACK");
+  if (cJSON_IsString(color)) {
+    snprintf(privacy_mask->color_name, sizeof(privacy_mask->color_name), "%s", color->valuestring);
+  }
+
+  if (osd_color_to_int(privacy_mask->color_name, &privacy_mask->color) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void print_privacy_mask(PrivacyMask *privacy_mask)
+{
+  char buffer[1024];
+  snprintf(buffer, sizeof(buffer), "PrivacyMask: \n"
+                   "id: %d\n"
+                   "enabled: %d\n"
+                   "x: %d\n"
+                   "y: %d\n"
+                   "width: %d\n"
+                   "height: %d\n"
+                   "color: %s\n",
+                    privacy_mask->id,
+                    privacy_mask->enabled,
+                    privacy_mask->x,
+                    privacy_mask->y,
+                    privacy_mask->width,
+                    privacy_mask->height,
+                    privacy_mask->color_name
+                    );
+  log_info("%s", buffer);
+}
+
+
+int populate_encoder_roi(EncoderRoi *encoder_roi, cJSON* json)
+{
+  int i;
+  const char* attribute_names[] = {
+    "id",
+    "x",
+    "y",
+    "width",
+    "height",
+    "qp_offset"
+  };
+  cJSON *json_attribute;
+
+  // Code to check if top level attributes are defined
+  for (i = 0; i < sizeof(attribute_names) / sizeof(char *); i++) {
+    json_attribute = cJSON_GetObjectItemCaseSensitive(json, attribute_names[i]);
+
+    if (json_attribute == NULL) {
+      log_error("Attribute %s must be defined", attribute_names[i]);
+      return -1;
+    }
+  }
+
+  cJSON *id = cJSON_GetObjectItemCaseSensitive(json, "id");
+  cJSON *enabled = cJSON_GetObjectItemCaseSensitive(json, "enabled");
+  cJSON *x = cJSON_GetObjectItemCaseSensitive(json, "x");
+  cJSON *y = cJSON_GetObjectItemCaseSensitive(json, "y");
+  cJSON *width = cJSON_GetObjectItemCaseSensitive(json, "width");
+  cJSON *height = cJSON_GetObjectItemCaseSensitive(json, "height");
+  cJSON *qp_offset = cJSON_GetObjectItemCaseSensitive(json, "qp_offset");
+
+  encoder_roi->id = id->valueint;
+  encoder_roi->x = x->valueint;
+  encoder_roi->y = y->valueint;
+  encoder_roi->width = width->valueint;
+  encoder_roi->height = height->valueint;
+  encoder_roi->qp_offset = qp_offset->valueint;
+
+  if (encoder_roi->width <= 0 || encoder_roi->height <= 0) {
+    log_error("Encoder ROI %d must have a positive width and height", encoder_roi->id);
+    return -1;
+  }
+
+  if (encoder_roi->qp_offset < -ENCODER_ROI_MAX_QP_OFFSET || encoder_roi->qp_offset > ENCODER_ROI_MAX_QP_OFFSET) {
+    log_error("Encoder ROI %d qp_offset must be from -%d to %d", encoder_roi->id,
+              ENCODER_ROI_MAX_QP_OFFSET, ENCODER_ROI_MAX_QP_OFFSET);
+    return -1;
+  }
+
+  encoder_roi->enabled = 1;
+  if (enabled) {
+    encoder_roi->enabled = enabled->valueint;
+  }
+
+  return 0;
+}
+
+void print_encoder_roi(EncoderRoi *encoder_roi)
+{
+  char buffer[1024];
+  snprintf(buffer, sizeof(buffer), "EncoderRoi: \n"
+                   "id: %d\n"
+                   "enabled: %d\n"
+                   "x: %d\n"
+                   "y: %d\n"
+                   "width: %d\n"
+                   "height: %d\n"
+                   "qp_offset: %d\n",
+                    encoder_roi->id,
+                    encoder_roi->enabled,
+                    encoder_roi->x,
+                    encoder_roi->y,
+                    encoder_roi->width,
+                    encoder_roi->height,
+                    encoder_roi->qp_offset
+                    );
+  log_info("%s", buffer);
+}
+
+// All audio settings are optional, a missing "audio" section leaves the
+// defaults: 48 kHz from device 1 with noise suppression, raw PCM to the
+// ALSA loopback only.
+int populate_audio_settings(AudioSettings *audio_settings, cJSON* json)
+{
+  audio_settings->device_id = AUDIO_DEFAULT_DEVICE_ID;
+  audio_settings->channel_id = AUDIO_DEFAULT_CHANNEL_ID;
+  audio_settings->sample_rate = AUDIO_DEFAULT_SAMPLE_RATE;
+  audio_settings->samples_per_frame = AUDIO_DEFAULT_SAMPLES_PER_FRAME;
+  audio_settings->frame_num = MAX_AUDIO_FRAME_NUM;
+  audio_settings->usr_frame_depth = AUDIO_DEFAULT_USR_FRAME_DEPTH;
+  audio_settings->volume = AUDIO_DEFAULT_VOLUME;
+  audio_settings->ns = 1;
+  strcpy(audio_settings->ns_level_name, "NS_HIGH");
+  audio_settings->ns_level = NS_HIGH;
+  audio_settings->agc = 0;
+  audio_settings->agc_target_level = 10;
+  audio_settings->agc_compression_gain = 0;
+  audio_settings->hpf = 0;
+  strcpy(audio_settings->codec, "PT_PCM");
+  audio_settings->payload_type = PT_PCM;
+  strcpy(audio_settings->output_path, "/tmp/audio_stream");
+  audio_settings->activity_detection = 0;
+  audio_settings->talkback = 0;
+  audio_settings->aec = 0;
+
+  if (json == NULL) {
+    return 0;
+  }
+
+  // Values are only stored once all of them are valid, so a bad
+  // configuration leaves the defaults above
+  AudioSettings parsed = *audio_settings;
+
+  cJSON *device_id = cJSON_GetObjectItemCaseSensitive(json, "device_id");
+  cJSON *channel_id = cJSON_GetObjectItemCaseSensitive(json, "channel_id");
+  cJSON *sample_rate = cJSON_GetObjectItemCaseSensitive(json, "sample_rate");
+  cJSON *samples_per_frame = cJSON_GetObjectItemCaseSensitive(json, "samples_per_frame");
+  cJSON *frame_num = cJSON_GetObjectItemCaseSensitive(json, "frame_num");
+  cJSON *usr_frame_depth = cJSON_GetObjectItemCaseSensitive(json, "usr_frame_depth");
+  cJSON *volume = cJSON_GetObjectItemCaseSensitive(json, "volume");
+  cJSON *ns = cJSON_GetObjectItemCaseSensitive(json, "ns");
+  cJSON *ns_level = cJSON_GetObjectItemCaseSensitive(json, "ns_level");
+  cJSON *agc = cJSON_GetObjectItemCaseSensitive(json, "agc");
+  cJSON *agc_target_level = cJSON_GetObjectItemCaseSensitive(json, "agc_target_level");
+  cJSON *agc_compression_gain = cJSON_GetObjectItemCaseSensitive(json, "agc_compression_gain");
+  cJSON *hpf = cJSON_GetObjectItemCaseSensitive(json, "hpf");
+  cJSON *codec = cJSON_GetObjectItemCaseSensitive(json, "codec");
+  cJSON *output_path = cJSON_GetObjectItemCaseSensitive(json, "output_path");
+  cJSON *activity_detection = cJSON_GetObjectItemCaseSensitive(json, "activity_detection");
+  cJSON *talkback = cJSON_GetObjectItemCaseSensitive(json, "talkback");
+  cJSON *aec = cJSON_GetObjectItemCaseSensitive(json, "aec");
+
+  if (device_id) {
+    parsed.device_id = device_id->valueint;
+  }
+
+  if (channel_id) {
+    parsed.channel_id = channel_id->valueint;
+  }
+
+  if (sample_rate) {
+    parsed.sample_rate = sample_rate->valueint;
+  }
+
+  switch (parsed.sample_rate) {
+    case AUDIO_SAMPLE_RATE_8000:
+    case AUDIO_SAMPLE_RATE_16000:
+    case AUDIO_SAMPLE_RATE_44100:
+    case AUDIO_SAMPLE_RATE_48000:
+    case AUDIO_SAMPLE_RATE_96000:
+      break;
+    default:
+      log_error("Unsupported audio sample_rate: %d", parsed.sample_rate);
+      return -1;
+  }
+
+  if (samples_per_frame) {
+    parsed.samples_per_frame = samples_per_frame->valueint;
+  }
+
+  if (parsed.samples_per_frame <= 0 ||
+      parsed.samples_per_frame > AUDIO_MAX_SAMPLES_PER_FRAME) {
+    log_error("audio samples_per_frame must be between 1 and %d", AUDIO_MAX_SAMPLES_PER_FRAME);
+    return -1;
+  }
+
+  if (frame_num) {
+    parsed.frame_num = frame_num->valueint;
+  }
+
+  if (usr_frame_depth) {
+    parsed.usr_frame_depth = usr_frame_depth->valueint;
+  }
+
+  if (parsed.frame_num < 2 || parsed.frame_num > MAX_AUDIO_FRAME_NUM ||
+      parsed.usr_frame_depth < 2 || parsed.usr_frame_depth > MAX_AUDIO_FRAME_NUM) {
+    log_error("audio frame_num and usr_frame_depth must be between 2 and %d", MAX_AUDIO_FRAME_NUM);
+    return -1;
+  }
+
+  if (volume) {
+    parsed.volume = volume->valueint;
+  }
+
+  if (ns) {
+    parsed.ns = ns->valueint;
+  }
+
+  if (cJSON_IsString(ns_level)) {
+    snprintf(parsed.ns_level_name, sizeof(parsed.ns_level_name), "%s", ns_level->valuestring);
+    parsed.ns_level = noise_suppression_to_int(parsed.ns_level_name);
+    if (parsed.ns_level < 0) {
+      return -1;
+    }
+  }
+
+  if (agc) {
+    parsed.agc = agc->valueint;
+  }
+
+  if (agc_target_level) {
+    parsed.agc_target_level = agc_target_level->valueint;
+  }
+
+  if (agc_compression_gain) {
+    parsed.agc_compression_gain = agc_compression_gain->valueint;
+  }
+
+  if (hpf) {
+    parsed.hpf = hpf->valueint;
+  }
+
+  if (cJSON_IsString(codec)) {
+    snprintf(parsed.codec, sizeof(parsed.codec), "%s", codec->valuestring);
+    parsed.payload_type = audio_codec_to_int(parsed.codec);
+    if (parsed.payload_type < 0) {
+      return -1;
+    }
+  }
+
+  // The IMP encoders are telephony codecs, they only take 8 kHz audio
+  if (parsed.payload_type != PT_PCM && parsed.sample_rate != AUDIO_SAMPLE_RATE_8000) {
+    log_error("audio codec %s needs sample_rate %d", parsed.codec, AUDIO_SAMPLE_RATE_8000);
+    return -1;
+  }
+
+  if (cJSON_IsString(output_path)) {
+    snprintf(parsed.output_path, sizeof(parsed.output_path), "%s", output_path->valuestring);
+  }
+
+  if (activity_detection) {
+    parsed.activity_detection = activity_detection->valueint;
+  }
+
+  if (talkback) {
+    parsed.talkback = talkback->valueint;
+  }
+
+  if (aec) {
+    parsed.aec = aec->valueint;
+  }
+
+  // The speaker runs at the talkback rate and the SDK does not resample
+  // the echo reference, so both sides have to match
+  if (parsed.aec && parsed.sample_rate != TALKBACK_SAMPLE_RATE) {
+    log_error("audio aec needs sample_rate %d, the rate of the talkback output", TALKBACK_SAMPLE_RATE);
+    return -1;
+  }
+
+  *audio_settings = parsed;
+  return 0;
+}
+
+void print_audio_settings(AudioSettings *audio_settings)
+{
+  char buffer[1024];
+  snprintf(buffer, sizeof(buffer), "AudioSettings: \n"
+                   "device_id: %d\n"
+                   "channel_id: %d\n"
+                   "sample_rate: %d\n"
+                   "samples_per_frame: %d\n"
+                   "frame_num: %d\n"
+                   "usr_frame_depth: %d\n"
+                   "volume: %d\n"
+                   "ns: %d\n"
+                   "ns_level: %s\n"
+                   "agc: %d\n"
+                   "agc_target_level: %d\n"
+                   "agc_compression_gain: %d\n"
+                   "hpf: %d\n"
+                   "codec: %s\n"
+                   "output_path: %s\n"
+                   "activity_detection: %d\n"
+                   "talkback: %d\n"
+                   "aec: %d\n",
+                    audio_settings->device_id,
+                    audio_settings->channel_id,
+                    audio_settings->sample_rate,
+                    audio_settings->samples_per_frame,
+                    audio_settings->frame_num,
+                    audio_settings->usr_frame_depth,
+                    audio_settings->volume,
+                    audio_settings->ns,
+                    audio_settings->ns_level_name,
+                    audio_settings->agc,
+                    audio_settings->agc_target_level,
+                    audio_settings->agc_compression_gain,
+                    audio_settings->hpf,
+                    audio_settings->codec,
+                    audio_settings->output_path,
+                    audio_settings->activity_detection,
+                    audio_settings->talkback,
+                    audio_settings->aec
+                    );
+  log_info("%s", buffer);
+}
+
+
+
+int night_vision_mode_to_int(char* name) {
+  int mode = -1;
+
+  if(strcmp(name, "auto") == 0) {
+    mode = NIGHT_VISION_MODE_AUTO;
+  }
+  if(strcmp(name, "day") == 0) {
+    mode = NIGHT_VISION_MODE_DAY;
+  }
+  if(strcmp(name, "night") == 0) {
+    mode = NIGHT_VISION_MODE_NIGHT;
+  }
+
+  if (mode < 0) {
+    log_error("Unknown night vision mode: %s", name);
+  }
+
+  return mode;
+}
+
+// The night_vision section is optional as well, without it the mode is
+// picked automatically with these defaults.
+int populate_night_vision_settings(NightVisionSettings *night_vision, cJSON* json)
+{
+  strcpy(night_vision->mode_name, "auto");
+  night_vision->mode = NIGHT_VISION_MODE_AUTO;
+  night_vision->sample_interval_ms = 200;
+  night_vision->night_ev = 1000000;
+  night_vision->day_ev = 250000;
+  night_vision->night_delay_ms = 600;
+  night_vision->day_delay_ms = 3000;
+  night_vision->day_wb_ratio = 0;
+  night_vision->jitter_percent = 3;
+  night_vision->switch_wait_ms = 3000;
+
+  if (json == NULL) {
+    return 0;
+  }
+
+  cJSON *mode = cJSON_GetObjectItemCaseSensitive(json, "mode");
+  cJSON *sample_interval_ms = cJSON_GetObjectItemCaseSensitive(json, "sample_interval_ms");
+  cJSON *night_ev = cJSON_GetObjectItemCaseSensitive(json, "night_ev");
+  cJSON *day_ev = cJSON_GetObjectItemCaseSensitive(json, "day_ev");
+  cJSON *night_delay_ms = cJSON_GetObjectItemCaseSensitive(json, "night_delay_ms");
+  cJSON *day_delay_ms = cJSON_GetObjectItemCaseSensitive(json, "day_delay_ms");
+  cJSON *day_wb_ratio = cJSON_GetObjectItemCaseSensitive(json, "day_wb_ratio");
+  cJSON *jitter_percent = cJSON_GetObjectItemCaseSensitive(json, "jitter_percent");
+  cJSON *switch_wait_ms = cJSON_GetObjectItemCaseSensitive(json, "switch_wait_ms");
+
+  if (cJSON_IsString(mode)) {
+    snprintf(night_vision->mode_name, sizeof(night_vision->mode_name), "%s", mode->valuestring);
+    night_vision->mode = night_vision_mode_to_int(night_vision->mode_name);
+    if (night_vision->mode < 0) {
+      return -1;
+    }
+  }
+
+  if (sample_interval_ms) {
+    night_vision->sample_interval_ms = sample_interval_ms->valueint;
+  }
+
+  if (night_vision->sample_interval_ms <= 0) {
+    log_error("night_vision sample_interval_ms must be positive");
+    return -1;
+  }
+
+  if (night_ev) {
+    night_vision->night_ev = night_ev->valuedouble;
+  }
+
+  if (day_ev) {
+    night_vision->day_ev = day_ev->valuedouble;
+  }
+
+  if (night_vision->day_ev >= night_vision->night_ev) {
+    log_error("night_vision day_ev must be lower than night_ev");
+    return -1;
+  }
+
+  if (night_delay_ms) {
+    night_vision->night_delay_ms = night_delay_ms->valueint;
+  }
+
+  if (day_delay_ms) {
+    night_vision->day_delay_ms = day_delay_ms->valueint;
+  }
+
+  if (day_wb_ratio) {
+    night_vision->day_wb_ratio = day_wb_ratio->valueint;
+  }
+
+  if (jitter_percent) {
+    night_vision->jitter_percent = jitter_percent->valueint;
+  }
+
+  if (switch_wait_ms) {
+    night_vision->switch_wait_ms = switch_wait_ms->valueint;
+  }
+
+  return 0;
+}
+
+void print_night_vision_settings(NightVisionSettings *night_vision)
+{
+  char buffer[1024];
+  snprintf(buffer, sizeof(buffer), "NightVisionSettings: \n"
+                   "mode: %s\n"
+                   "sample_interval_ms: %d\n"
+                   "night_ev: %u\n"
+                   "day_ev: %u\n"
+                   "night_delay_ms: %d\n"
+                   "day_delay_ms: %d\n"
+                   "day_wb_ratio: %u\n"
+                   "jitter_percent: %d\n"
+                   "switch_wait_ms: %d\n",
+                    night_vision->mode_name,
+                    night_vision->sample_interval_ms,
+                    night_vision->night_ev,
+                    night_vision->day_ev,
+                    night_vision->night_delay_ms,
+                    night_vision->day_delay_ms,
+                    night_vision->day_wb_ratio,
+                    night_vision->jitter_percent,
+                    night_vision->switch_wait_ms
+                    );
+  log_info("%s", buffer);
+}
+
+
+
+int motion_method_to_int(char* name) {
+  int method = -1;
+
+  if(strcmp(name, "ivs") == 0) {
+    method = MOTION_METHOD_IVS;
+  }
+  if(strcmp(name, "software") == 0) {
+    method = MOTION_METHOD_SOFTWARE;
+  }
+
+  if (method < 0) {
+    log_error("Unknown motion method: %s", name);
+  }
+
+  return method;
+}
+
+// The motion section is optional, without it motion detection stays off.
+int populate_motion_settings(MotionSettings *motion, cJSON* json)
+{
+  int i;
+  int num_rois;
+  MotionRoi *roi;
+  cJSON *json_roi;
+
+  motion->enabled = 0;
+  strcpy(motion->method_name, "ivs");
+  motion->method = MOTION_METHOD_IVS;
+  motion->framesource = 1;
+  motion->skip_frames = 2;
+  motion->fps = 5;
+  motion->cell_size = 16;
+  motion->threshold = 10;
+  motion->learn_interval = 4;
+  motion->min_cells = 2;
+  motion->encoder_qp_offset = 0;
+  motion->poll_interval_ms = 200;
+  motion->hold_ms = 3000;
+  motion->num_rois = 0;
+
+  if (json == NULL) {
+    return 0;
+  }
+
+  cJSON *enabled = cJSON_GetObjectItemCaseSensitive(json, "enabled");
+  cJSON *method = cJSON_GetObjectItemCaseSensitive(json, "method");
+  cJSON *framesource = cJSON_GetObjectItemCaseSensitive(json, "framesource");
+  cJSON *skip_frames = cJSON_GetObjectItemCaseSensitive(json, "skip_frames");
+  cJSON *fps = cJSON_GetObjectItemCaseSensitive(json, "fps");
+  cJSON *cell_size = cJSON_GetObjectItemCaseSensitive(json, "cell_size");
+  cJSON *threshold = cJSON_GetObjectItemCaseSensitive(json, "threshold");
+  cJSON *learn_interval = cJSON_GetObjectItemCaseSensitive(json, "learn_interval");
+  cJSON *min_cells = cJSON_GetObjectItemCaseSensitive(json, "min_cells");
+  cJSON *encoder_qp_offset = cJSON_GetObjectItemCaseSensitive(json, "encoder_qp_offset");
+  cJSON *poll_interval_ms = cJSON_GetObjectItemCaseSensitive(json, "poll_interval_ms");
+  cJSON *hold_ms = cJSON_GetObjectItemCaseSensitive(json, "hold_ms");
+  cJSON *rois = cJSON_GetObjectItemCaseSensitive(json, "rois");
+
+  if (enabled) {
+    motion->enabled = enabled->valueint;
+  }
+
+  if (framesource) {
+    motion->framesource = framesource->valueint;
+  }
+
+  if (cJSON_IsString(method)) {
+    snprintf(motion->method_name, sizeof(motion->method_name), "%s", method->valuestring);
+    motion->method = motion_method_to_int(motion->method_name);
+    if (motion->method < 0) {
+      return -1;
+    }
+  }
+
+  if (skip_frames) {
+    motion->skip_frames = skip_frames->valueint;
+  }
+
+  if (fps) {
+    motion->fps = fps->valueint;
+  }
+
+  if (cell_size) {
+    motion->cell_size = cell_size->valueint;
+  }
+
+  if (threshold) {
+    motion->threshold = threshold->valueint;
+  }
+
+  if (learn_interval) {
+    motion->learn_interval = learn_interval->valueint;
+  }
+
+  if (min_cells) {
+    motion->min_cells = min_cells->valueint;
+  }
+
+  if (encoder_qp_offset) {
+    motion->encoder_qp_offset = encoder_qp_offset->valueint;
+  }
+
+  if (motion->encoder_qp_offset < -ENCODER_ROI_MAX_QP_OFFSET || motion->encoder_qp_offset > ENCODER_ROI_MAX_QP_OFFSET) {
+    log_error("motion encoder_qp_offset must be from -%d to %d",
+              ENCODER_ROI_MAX_QP_OFFSET, ENCODER_ROI_MAX_QP_OFFSET);
+    return -1;
+  }
+
+  if (motion->fps <= 0 || motion->learn_interval <= 0 || motion->min_cells <= 0) {
+    log_error("motion fps, learn_interval and min_cells must be positive");
+    return -1;
+  }
+
+  if (motion->cell_size <= 0 || motion->cell_size % 16 != 0) {
+    log_error("motion cell_size must be a multiple of 16");
+    return -1;
+  }
+
+  if (poll_interval_ms) {
+    motion->poll_interval_ms = poll_interval_ms->valueint;
+  }
+
+  if (hold_ms) {
+    motion->hold_ms = hold_ms->valueint;
+  }
+
+  if (motion->poll_interval_ms <= 0) {
+    log_error("motion poll_interval_ms must be positive");
+    return -1;
+  }
+
+  // Without any ROIs the whole picture is watched, see motion.c
+  if (rois == NULL) {
+    return 0;
+  }
+
+  num_rois = cJSON_GetArraySize(rois);
+  if (num_rois > MAX_MOTION_ROIS) {
+    log_warn("Found %d motion ROIs but only %d are supported.", num_rois, MAX_MOTION_ROIS);
+    num_rois = MAX_MOTION_ROIS;
+  }
+
+  for (i = 0; i < num_rois; i++) {
+    json_roi = cJSON_GetArrayItem(rois, i);
+    roi = &motion->rois[i];
+
+    cJSON *x = cJSON_GetObjectItemCaseSensitive(json_roi, "x");
+    cJSON *y = cJSON_GetObjectItemCaseSensitive(json_roi, "y");
+    cJSON *width = cJSON_GetObjectItemCaseSensitive(json_roi, "width");
+    cJSON *height = cJSON_GetObjectItemCaseSensitive(json_roi, "height");
+    cJSON *sensitivity = cJSON_GetObjectItemCaseSensitive(json_roi, "sensitivity");
+
+    if (x == NULL || y == NULL || width == NULL || height == NULL) {
+      log_error("Motion ROI %d needs x, y, width and height", i);
+      return -1;
+    }
+
+    roi->x = x->valueint;
+    roi->y = y->valueint;
+    roi->width = width->valueint;
+    roi->height = height->valueint;
+    roi->sensitivity = 3;
+    if (sensitivity) {
+      roi->sensitivity = sensitivity->valueint;
+    }
+
+    if (roi->width <= 0 || roi->height <= 0 || roi->sensitivity < 0 || roi->sensitivity > 4) {
+      log_error("Motion ROI %d needs a positive size and a sensitivity from 0 to 4", i);
+      return -1;
+    }
+  }
+  motion->num_rois = num_rois;
+
+  return 0;
+}
+
+void print_motion_settings(MotionSettings *motion)
+{
+  int i;
+  char buffer[1024];
+  int length;
+
+  length = snprintf(buffer, sizeof(buffer), "MotionSettings: \n"
+                   "enabled: %d\n"
+                   "method: %s\n"
+                   "framesource: %d\n"
+                   "skip_frames: %d\n"
+                   "fps: %d\n"
+                   "cell_size: %d\n"
+                   "threshold: %d\n"
+                   "learn_interval: %d\n"
+                   "min_cells: %d\n"
+                   "encoder_qp_offset: %d\n"
+                   "poll_interval_ms: %d\n"
+                   "hold_ms: %d\n",
+                    motion->enabled,
+                    motion->method_name,
+                    motion->framesource,
+                    motion->skip_frames,
+                    motion->fps,
+                    motion->cell_size,
+                    motion->threshold,
+                    motion->learn_interval,
+                    motion->min_cells,
+                    motion->encoder_qp_offset,
+                    motion->poll_interval_ms,
+                    motion->hold_ms
+                    );
+
+  for (i = 0; i < motion->num_rois && length < sizeof(buffer); i++) {
+    length += snprintf(buffer + length, sizeof(buffer) - length,
+                       "roi %d: %d,%d %dx%d sensitivity %d\n", i,
+                       motion->rois[i].x, motion->rois[i].y,
+                       motion->rois[i].width, motion->rois[i].height,
+                       motion->rois[i].sensitivity);
+  }
+  log_info("%s", buffer);
+}
+
+
+// The adaptive_rate section is optional, it only does something together
+// with motion detection.
+int populate_adaptive_rate_settings(AdaptiveRateSettings *adaptive_rate, cJSON* json)
+{
+  adaptive_rate->enabled = 0;
+  adaptive_rate->idle_after_ms = 10000;
+  adaptive_rate->idle_fps = 5;
+  adaptive_rate->idle_gop_seconds = 10;
+  adaptive_rate->poll_interval_ms = 100;
+  adaptive_rate->report_interval_s = 300;
+
+  if (json == NULL) {
+    return 0;
+  }
+
+  cJSON *enabled = cJSON_GetObjectItemCaseSensitive(json, "enabled");
+  cJSON *idle_after_ms = cJSON_GetObjectItemCaseSensitive(json, "idle_after_ms");
+  cJSON *idle_fps = cJSON_GetObjectItemCaseSensitive(json, "idle_fps");
+  cJSON *idle_gop_seconds = cJSON_GetObjectItemCaseSensitive(json, "idle_gop_seconds");
+  cJSON *poll_interval_ms = cJSON_GetObjectItemCaseSensitive(json, "poll_interval_ms");
+  cJSON *report_interval_s = cJSON_GetObjectItemCaseSensitive(json, "report_interval_s");
+
+  if (enabled) {
+    adaptive_rate->enabled = enabled->valueint;
+  }
+
+  if (idle_after_ms) {
+    adaptive_rate->idle_after_ms = idle_after_ms->valueint;
+  }
+
+  if (idle_fps) {
+    adaptive_rate->idle_fps = idle_fps->valueint;
+  }
+
+  if (idle_gop_seconds) {
+    adaptive_rate->idle_gop_seconds = idle_gop_seconds->valueint;
+  }
+
+  if (poll_interval_ms) {
+    adaptive_rate->poll_interval_ms = poll_interval_ms->valueint;
+  }
+
+  if (report_interval_s) {
+    adaptive_rate->report_interval_s = report_interval_s->valueint;
+  }
+
+  if (adaptive_rate->idle_fps <= 0 || adaptive_rate->idle_gop_seconds <= 0 ||
+      adaptive_rate->poll_interval_ms <= 0 || adaptive_rate->report_interval_s < 0) {
+    log_error("adaptive_rate idle_fps, idle_gop_seconds and poll_interval_ms must be positive");
+    return -1;
+  }
+
+  return 0;
+}
+
+void print_adaptive_rate_settings(AdaptiveRateSettings *adaptive_rate)
+{
+  char buffer[512];
+
+  snprintf(buffer, sizeof(buffer), "AdaptiveRateSettings: \n"
+                   "enabled: %d\n"
+                   "idle_after_ms: %d\n"
+                   "idle_fps: %d\n"
+                   "idle_gop_seconds: %d\n"
+                   "poll_interval_ms: %d\n"
+                   "report_interval_s: %d\n",
+                    adaptive_rate->enabled,
+                    adaptive_rate->idle_after_ms,
+                    adaptive_rate->idle_fps,
+                    adaptive_rate->idle_gop_seconds,
+                    adaptive_rate->poll_interval_ms,
+                    adaptive_rate->report_interval_s
+                    );
+  log_info("%s", buffer);
+}
+
+
+// The calibration section is optional
+int populate_calibration_settings(CalibrationSettings *calibration, cJSON* json)
+{
+  calibration->enabled = 0;
+  calibration->duration_s = 600;
+  calibration->apply = 0;
+
+  if (json == NULL) {
+    return 0;
+  }
+
+  cJSON *enabled = cJSON_GetObjectItemCaseSensitive(json, "enabled");
+  cJSON *duration_s = cJSON_GetObjectItemCaseSensitive(json, "duration_s");
+  cJSON *apply = cJSON_GetObjectItemCaseSensitive(json, "apply");
+
+  if (enabled) {
+    calibration->enabled = enabled->valueint;
+  }
+
+  if (duration_s) {
+    calibration->duration_s = duration_s->valueint;
+  }
+
+  if (apply) {
+    calibration->apply = apply->valueint;
+  }
+
+  if (calibration->duration_s <= 0) {
+    log_error("calibration duration_s must be positive");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+void print_calibration_settings(CalibrationSettings *calibration)
+{
+  char buffer[512];
+
+  snprintf(buffer, sizeof(buffer), "CalibrationSettings: \n"
+                   "enabled: %d\n"
+                   "duration_s: %d\n"
+                   "apply: %d\n",
+                    calibration->enabled,
+                    calibration->duration_s,
+                    calibration->apply
+                    );
+  log_info("%s", buffer);
+}
+
+
 
 int populate_stream_settings(StreamSettings *settings, cJSON *json)
 {
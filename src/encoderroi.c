@@ -0,0 +1,268 @@
+#include "capture.h"
+#include "encoderroi.h"
+#include "motion.h"
+
+/*
+
+Encoder ROIs shift the QP of the macroblocks in a rectangle relative to
+what the rate control picks for the rest of the picture. With a negative
+qp_offset on the parts that matter (a door, a till) the max_bitrate of
+the channel can be lowered without those parts losing detail, the rest
+of the picture absorbs the difference.
+
+The ROIs from settings.json can be replaced at runtime through
+ENCODER_ROI_FILE. When motion.encoder_qp_offset is set, every motion ROI
+also gets an encoder ROI that is only enabled while it has motion.
+
+Only H.264 channels have ROIs.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+
+int load_encoder_rois(cJSON *json, EncoderRoi encoder_rois[], uint32_t *num_encoder_rois)
+{
+  int i;
+  int num_rois;
+  cJSON *json_roi;
+  cJSON *json_encoder_rois;
+  // Parsed here first so a bad reload leaves the current ROIs in place
+  EncoderRoi parsed[MAX_ENCODER_ROIS];
+
+  // Encoder ROIs are optional
+  json_encoder_rois = cJSON_GetObjectItemCaseSensitive(json, "encoder_rois");
+  if (json_encoder_rois == NULL) {
+    *num_encoder_rois = 0;
+    return 0;
+  }
+
+  num_rois = cJSON_GetArraySize(json_encoder_rois);
+  if (num_rois > MAX_ENCODER_ROIS) {
+    log_warn("Found %d encoder ROIs but only %d are supported.", num_rois, MAX_ENCODER_ROIS);
+    num_rois = MAX_ENCODER_ROIS;
+  }
+  log_info("Found %d encoder ROI(s).", num_rois);
+
+  for (i = 0; i < num_rois; ++i) {
+    json_roi = cJSON_GetArrayItem(json_encoder_rois, i);
+
+    if (populate_encoder_roi(&parsed[i], json_roi) != 0) {
+      log_error("Error parsing encoder_rois[%d].", i);
+      return -1;
+    }
+    print_encoder_roi(&parsed[i]);
+  }
+
+  memcpy(encoder_rois, parsed, num_rois * sizeof(EncoderRoi));
+  *num_encoder_rois = num_rois;
+
+  return 0;
+}
+
+
+// Scale a rectangle from sensor coordinates to the encoder resolution.
+// The encoder works on 16x16 macroblocks, so the rectangle is grown
+// outwards to whole macroblocks.
+static void scale_encoder_roi(int x, int y, int width, int height, EncoderSetting *encoder, IMPRect *rect)
+{
+  int x0, y0, x1, y1;
+
+  x0 = (x * encoder->pic_width) / SENSOR_WIDTH;
+  y0 = (y * encoder->pic_height) / SENSOR_HEIGHT;
+  x1 = ((x + width) * encoder->pic_width + SENSOR_WIDTH - 1) / SENSOR_WIDTH;
+  y1 = ((y + height) * encoder->pic_height + SENSOR_HEIGHT - 1) / SENSOR_HEIGHT;
+
+  x0 &= ~15;
+  y0 &= ~15;
+  x1 = (x1 + 15) & ~15;
+  y1 = (y1 + 15) & ~15;
+
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > encoder->pic_width) x1 = encoder->pic_width;
+  if (y1 > encoder->pic_height) y1 = encoder->pic_height;
+
+  // p1 is inclusive
+  rect->p0.x = x0;
+  rect->p0.y = y0;
+  rect->p1.x = x1 - 1;
+  rect->p1.y = y1 - 1;
+}
+
+
+static int set_encoder_roi(EncoderSetting *encoder, int index, int enable, int qp_offset,
+                           int x, int y, int width, int height)
+{
+  int ret;
+  IMPEncoderROICfg roi_cfg;
+
+  memset(&roi_cfg, 0, sizeof(IMPEncoderROICfg));
+  roi_cfg.u32Index = index;
+  roi_cfg.bEnable = enable;
+  roi_cfg.bRelatedQp = 1;
+  roi_cfg.s32Qp = qp_offset;
+  if (enable) {
+    scale_encoder_roi(x, y, width, height, encoder, &roi_cfg.rect);
+  }
+
+  ret = IMP_Encoder_SetChnROI(encoder->channel, &roi_cfg);
+  if (ret < 0) {
+    log_error("IMP_Encoder_SetChnROI failed for ROI %d on channel %d", index, encoder->channel);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Replayed channels have no encoder to set ROIs on
+static int is_h264(EncoderSetting *encoder)
+{
+  return strcmp(encoder->payload_type, "PT_H264") == 0 && encoder->replay_file[0] == '\0';
+}
+
+
+// Set the configured ROIs on every H.264 channel and disable the unused
+// slots. Can be called again whenever the ROIs change.
+int setup_encoder_rois(CameraConfig *camera_config)
+{
+  int i, e;
+  int enable;
+  EncoderRoi *roi;
+  EncoderSetting *encoder;
+
+  for (e = 0; e < camera_config->num_encoders; e++) {
+    encoder = &camera_config->encoders[e];
+    if (!is_h264(encoder)) {
+      continue;
+    }
+
+    for (i = 0; i < MAX_ENCODER_ROIS; i++) {
+      roi = &camera_config->encoder_rois[i];
+      enable = i < camera_config->num_encoder_rois && roi->enabled;
+
+      if (set_encoder_roi(encoder, i, enable, roi->qp_offset,
+                          roi->x, roi->y, roi->width, roi->height) != 0) {
+        return -1;
+      }
+
+      if (enable) {
+        log_info("Encoder ROI %d on channel %d: qp offset %d", roi->id, encoder->channel, roi->qp_offset);
+      }
+    }
+  }
+
+  return 0;
+}
+
+
+// Enable the encoder ROI of every motion ROI in active_rois, disable the
+// others
+static void setup_motion_encoder_rois(CameraConfig *camera_config, uint32_t active_rois)
+{
+  int i, e;
+  MotionSettings *motion = &camera_config->motion;
+  EncoderSetting *encoder;
+
+  for (e = 0; e < camera_config->num_encoders; e++) {
+    encoder = &camera_config->encoders[e];
+    if (!is_h264(encoder)) {
+      continue;
+    }
+
+    for (i = 0; i < motion->num_rois; i++) {
+      set_encoder_roi(encoder, ENCODER_ROI_MOTION_INDEX + i, (active_rois >> i) & 1,
+                      motion->encoder_qp_offset, motion->rois[i].x, motion->rois[i].y,
+                      motion->rois[i].width, motion->rois[i].height);
+    }
+  }
+}
+
+
+static int reload_encoder_rois(CameraConfig *camera_config, const char *filename)
+{
+  FILE *fp;
+  long file_size;
+  char *file_contents;
+  cJSON *json;
+  int ret;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    log_error("Unable to open %s", filename);
+    return -1;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  file_size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  file_contents = malloc(file_size + 1);
+  if (file_contents == NULL) {
+    log_error("Memory error: unable to allocate %ld bytes", file_size + 1);
+    fclose(fp);
+    return -1;
+  }
+
+  if (fread(file_contents, 1, file_size, fp) != file_size) {
+    log_error("Unable to read contents of %s", filename);
+    fclose(fp);
+    free(file_contents);
+    return -1;
+  }
+  fclose(fp);
+
+  json = cJSON_ParseWithLength(file_contents, file_size);
+  free(file_contents);
+
+  if (json == NULL) {
+    log_error("Unable to parse encoder ROIs in %s", filename);
+    return -1;
+  }
+
+  ret = load_encoder_rois(json, camera_config->encoder_rois, &camera_config->num_encoder_rois);
+  cJSON_Delete(json);
+
+  if (ret != 0) {
+    return -1;
+  }
+
+  return setup_encoder_rois(camera_config);
+}
+
+
+// This is the entrypoint for the encoder ROI thread. It picks up changes
+// of ENCODER_ROI_FILE and follows the motion state when motion ROIs
+// have a QP offset.
+void *encoder_roi_entry_start(void *encoder_roi_thread_params)
+{
+  CameraConfig *camera_config = (CameraConfig *)encoder_roi_thread_params;
+  int follow_motion = camera_config->motion.enabled && camera_config->motion.encoder_qp_offset != 0;
+  struct stat filestatus;
+  time_t last_modified = 0;
+  uint32_t active_rois = 0;
+  int ticks = 0;
+
+  while(!sigint_received) {
+    // The file once a second, motion every 100 ms
+    if (ticks++ % 10 == 0 &&
+        stat(ENCODER_ROI_FILE, &filestatus) == 0 && filestatus.st_mtime != last_modified) {
+      last_modified = filestatus.st_mtime;
+      log_info("Reloading encoder ROIs from %s", ENCODER_ROI_FILE);
+
+      if (reload_encoder_rois(camera_config, ENCODER_ROI_FILE) != 0) {
+        log_error("Failed to apply encoder ROIs from %s", ENCODER_ROI_FILE);
+      }
+    }
+
+    if (follow_motion && motion_status.active_rois != active_rois) {
+      active_rois = motion_status.active_rois;
+      setup_motion_encoder_rois(camera_config, active_rois);
+    }
+
+    usleep(100000);
+  }
+
+  return NULL;
+}
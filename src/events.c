@@ -0,0 +1,227 @@
+#include "capture.h"
+#include "events.h"
+#include <errno.h>
+#include <poll.h>
+#include <stdarg.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+
+Event stream for local subscribers (recording, alerting, ...). Events are
+small, so each one is written as a single JSON line. A subscriber that
+cannot keep up loses events instead of stalling the thread publishing
+them, and is dropped when its connection breaks.
+
+Events are lost whole. When a send only takes part of a line, the rest
+is kept and finished before anything else goes to that subscriber, by
+the next publish or by the events thread; events published meanwhile are
+dropped for it.
+
+*/
+
+#define EVENT_MAX_SIZE          512
+// How often the events thread finishes partly sent lines
+#define EVENT_FLUSH_INTERVAL_MS 100
+
+extern sig_atomic_t sigint_received;
+
+typedef struct {
+  int fd;
+  char pending[EVENT_MAX_SIZE];
+  int pending_length;
+} Subscriber;
+
+static int event_socket = -1;
+static Subscriber subscribers[MAX_EVENT_SUBSCRIBERS];
+static int num_subscribers = 0;
+static pthread_mutex_t subscribers_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+// Send without blocking. Returns the bytes sent, 0 when the socket is
+// full, -1 when the connection broke.
+static int send_some(int fd, const char *data, int length)
+{
+  ssize_t sent = send(fd, data, length, MSG_DONTWAIT | MSG_NOSIGNAL);
+
+  if (sent < 0) {
+    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+  }
+  return sent;
+}
+
+// Finish the partly sent line of a subscriber. Returns 0 once nothing is
+// pending, 1 while it still is, -1 when the connection broke. Called with
+// subscribers_mutex held.
+static int flush_pending(Subscriber *subscriber)
+{
+  int sent;
+
+  if (subscriber->pending_length == 0) {
+    return 0;
+  }
+
+  sent = send_some(subscriber->fd, subscriber->pending, subscriber->pending_length);
+  if (sent < 0) {
+    return -1;
+  }
+
+  subscriber->pending_length -= sent;
+  memmove(subscriber->pending, subscriber->pending + sent, subscriber->pending_length);
+
+  return subscriber->pending_length > 0;
+}
+
+// Called with subscribers_mutex held
+static void remove_subscriber(int i)
+{
+  close(subscribers[i].fd);
+  subscribers[i] = subscribers[--num_subscribers];
+}
+
+
+int initialize_events(const char *socket_path)
+{
+  struct sockaddr_un address;
+
+  event_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (event_socket < 0) {
+    log_error("Unable to create event socket");
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", socket_path);
+
+  // Left over from a previous run
+  unlink(socket_path);
+
+  if (bind(event_socket, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+      listen(event_socket, MAX_EVENT_SUBSCRIBERS) < 0) {
+    log_error("Unable to listen on event socket %s", socket_path);
+    close(event_socket);
+    event_socket = -1;
+    return -1;
+  }
+
+  log_info("Publishing events on %s", socket_path);
+
+  return 0;
+}
+
+
+// type is the event type, format/... the rest of the JSON members
+// without the surrounding braces.
+void publish_event(const char *type, const char *format, ...)
+{
+  int i, length, sent;
+  char event[EVENT_MAX_SIZE];
+  struct timespec now;
+  va_list args;
+
+  clock_gettime(CLOCK_REALTIME, &now);
+
+  length = snprintf(event, sizeof(event), "{\"time\":%ld.%03ld,\"type\":\"%s\",",
+                    (long)now.tv_sec, now.tv_nsec / 1000000, type);
+
+  va_start(args, format);
+  length += vsnprintf(event + length, sizeof(event) - length, format, args);
+  va_end(args);
+
+  if (length > sizeof(event) - 3) {
+    log_error("Event too long, dropping %s event", type);
+    return;
+  }
+  event[length++] = '}';
+  event[length++] = '\n';
+
+  log_debug("Event: %.*s", length - 1, event);
+
+  pthread_mutex_lock(&subscribers_mutex);
+
+  for (i = 0; i < num_subscribers; ) {
+    // Still busy with an earlier line, this event is dropped for it
+    sent = flush_pending(&subscribers[i]);
+    if (sent == 0) {
+      sent = send_some(subscribers[i].fd, event, length);
+      if (sent > 0 && sent < length) {
+        subscribers[i].pending_length = length - sent;
+        memcpy(subscribers[i].pending, event + sent, length - sent);
+      }
+    }
+
+    if (sent < 0) {
+      remove_subscriber(i);
+      continue;
+    }
+    i++;
+  }
+
+  pthread_mutex_unlock(&subscribers_mutex);
+}
+
+
+// Called with subscribers_mutex held
+static void flush_subscribers(void)
+{
+  int i;
+
+  for (i = 0; i < num_subscribers; ) {
+    if (flush_pending(&subscribers[i]) < 0) {
+      remove_subscriber(i);
+      continue;
+    }
+    i++;
+  }
+}
+
+
+// This is the entrypoint for the events thread. It accepts subscribers
+// and finishes lines publish_event could only partly send.
+void *events_entry_start(void *events_thread_params)
+{
+  int client;
+  struct pollfd listener;
+
+  if (event_socket < 0) {
+    return NULL;
+  }
+
+  listener.fd = event_socket;
+  listener.events = POLLIN;
+
+  while(!sigint_received) {
+    pthread_mutex_lock(&subscribers_mutex);
+    flush_subscribers();
+    pthread_mutex_unlock(&subscribers_mutex);
+
+    if (poll(&listener, 1, EVENT_FLUSH_INTERVAL_MS) <= 0) {
+      continue;
+    }
+
+    client = accept(event_socket, NULL, NULL);
+    if (client < 0) {
+      if (errno != EINTR) {
+        log_error("Error accepting event subscriber");
+        sleep(1);
+      }
+      continue;
+    }
+
+    pthread_mutex_lock(&subscribers_mutex);
+    if (num_subscribers < MAX_EVENT_SUBSCRIBERS) {
+      subscribers[num_subscribers].fd = client;
+      subscribers[num_subscribers].pending_length = 0;
+      num_subscribers++;
+      log_info("Event subscriber connected (%d total)", num_subscribers);
+    }
+    else {
+      log_warn("Too many event subscribers, rejecting connection");
+      close(client);
+    }
+    pthread_mutex_unlock(&subscribers_mutex);
+  }
+
+  return NULL;
+}
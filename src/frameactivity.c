@@ -0,0 +1,115 @@
+#include "frameactivity.h"
+#include <math.h>
+
+/*
+
+Activity detection from the size of the encoded frames alone. A still
+scene gives P frames of a fairly constant size, anything that moves makes
+them bigger. The sizes are tracked with an exponentially weighted mean and
+variance; a P frame well above that baseline (by its z-score) counts as
+activity, and a single huge one as a scene change.
+
+The baseline follows quiet frames and only creeps during activity and
+outliers, so a long event is not learned as normal straight away. I frames tell nothing
+about motion and are skipped. No pixel is looked at, so this costs nothing
+on channels without IVS or a frame tap.
+
+*/
+
+void frame_activity_init(FrameActivity *activity)
+{
+  activity->frames = 0;
+  activity->mean = 0;
+  activity->variance = 0;
+  activity->z = 0;
+  activity->active = 0;
+  activity->on_count = 0;
+  activity->off_count = 0;
+  activity->event_peak_z = 0;
+}
+
+
+static void update_baseline(FrameActivity *activity, double size, double alpha)
+{
+  double difference = size - activity->mean;
+
+  // West's incremental form of the weighted variance
+  activity->mean += alpha * difference;
+  activity->variance = (1 - alpha) * (activity->variance + alpha * difference * difference);
+}
+
+
+// Feed the size of one encoded frame. Returns a combination of the
+// FRAME_ACTIVITY_* flags, activity->z holds the z-score of the frame.
+int frame_activity_update(FrameActivity *activity, uint32_t frame_bytes, int intra)
+{
+  double size = frame_bytes;
+  double sd;
+  int result = 0;
+
+  if (intra) {
+    return 0;
+  }
+
+  // Plain averages while warming up, the first frames after startup are
+  // often odd
+  if (activity->frames < FRAME_ACTIVITY_WARMUP_FRAMES) {
+    activity->frames++;
+    update_baseline(activity, size, 1.0 / activity->frames);
+    activity->z = 0;
+    return 0;
+  }
+
+  sd = sqrt(activity->variance);
+  if (sd < activity->mean * FRAME_ACTIVITY_MIN_SD_SHARE) {
+    sd = activity->mean * FRAME_ACTIVITY_MIN_SD_SHARE;
+  }
+  if (sd < FRAME_ACTIVITY_MIN_SD_BYTES) {
+    sd = FRAME_ACTIVITY_MIN_SD_BYTES;
+  }
+  activity->z = (size - activity->mean) / sd;
+
+  // After a scene change the old baseline means nothing, learn again
+  if (size > activity->mean * FRAME_ACTIVITY_SCENE_RATIO && activity->z > FRAME_ACTIVITY_SCENE_Z) {
+    result |= FRAME_ACTIVITY_SCENE_CHANGE;
+    activity->frames = 0;
+    activity->mean = 0;
+    activity->variance = 0;
+  }
+  else {
+    // Outliers only creep in as well, or a few big frames would inflate
+    // the variance before activity is even declared
+    if (activity->active || activity->z > FRAME_ACTIVITY_Z_ON) {
+      update_baseline(activity, size, FRAME_ACTIVITY_ACTIVE_ALPHA);
+    }
+    else {
+      update_baseline(activity, size, FRAME_ACTIVITY_ALPHA);
+    }
+  }
+
+  if (activity->z > FRAME_ACTIVITY_Z_ON) {
+    activity->off_count = 0;
+    activity->on_count++;
+    if (activity->z > activity->event_peak_z) {
+      activity->event_peak_z = activity->z;
+    }
+  }
+  else if (activity->z < FRAME_ACTIVITY_Z_OFF) {
+    activity->on_count = 0;
+    activity->off_count++;
+    if (!activity->active) {
+      activity->event_peak_z = 0;
+    }
+  }
+
+  if (!activity->active && activity->on_count >= FRAME_ACTIVITY_ON_FRAMES) {
+    activity->active = 1;
+    result |= FRAME_ACTIVITY_STARTED;
+  }
+  else if (activity->active && activity->off_count >= FRAME_ACTIVITY_OFF_FRAMES) {
+    activity->active = 0;
+    result |= FRAME_ACTIVITY_STOPPED;
+  }
+
+  return result;
+}
@@ -1,6 +1,7 @@
 #define _GNU_SOURCE
 
 #include "log.h"
+#include "seitimestamp.h"
 #include <errno.h>
 #include <fcntl.h>
 #include <linux/videodev2.h>
@@ -12,6 +13,11 @@
 #include <unistd.h>
 #include <getopt.h>
 #include <stdlib.h>
+#include <time.h>
+
+// Latency probe: read size and number of latencies kept
+#define PROBE_READ_SIZE     (256 * 1024)
+#define PROBE_MAX_SAMPLES   65536
 
 uint8_t *buffer;
 
@@ -202,16 +208,136 @@ int capture_image(int fd, char *output_mode)
   return 0;
 }
 
+static int compare_int64(const void *a, const void *b)
+{
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+/*
+  Latency probe. Reads an H.264 stream from fd for the given number of
+  seconds and looks for the SEI timestamps videocapture puts in with
+  sei_timestamps (see seitimestamp.c). The latency of a frame is the
+  time it is read here minus the capture time in its SEI, so both ends
+  need the same clock: run it on the camera, or keep both in NTP sync.
+
+  Anything that ends up as an H.264 byte stream works, a v4l2loopback
+  device read with read(), a recording, or stdin (-d -), e.g.
+  ffmpeg -i rtsp://camera/stream -c copy -f h264 - | getimage -d - -p 60
+*/
+int probe_latency(int fd, int seconds)
+{
+  uint8_t *data;
+  uint8_t *position, *found, *end, *terminator;
+  char text[SEI_TIMESTAMP_MAX_SIZE + 1];
+  int carry = 0;
+  int num_samples = 0;
+  ssize_t bytes;
+  long long capture_s;
+  int capture_us;
+  uint32_t seq, last_seq = 0, missing = 0;
+  int64_t *samples;
+  int64_t now_us;
+  struct timespec start, now;
+
+  data = malloc(PROBE_READ_SIZE + SEI_TIMESTAMP_UUID_SIZE + SEI_TIMESTAMP_MAX_SIZE);
+  samples = malloc(PROBE_MAX_SAMPLES * sizeof(int64_t));
+  if (data == NULL || samples == NULL) {
+    log_error("Unable to allocate the probe buffers");
+    return 1;
+  }
+
+  log_info("Probing latency for %d seconds", seconds);
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  now = start;
+
+  while (now.tv_sec - start.tv_sec < seconds && num_samples < PROBE_MAX_SAMPLES) {
+    bytes = read(fd, data + carry, PROBE_READ_SIZE);
+    if (bytes < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytes <= 0) {
+      break;
+    }
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    now_us = (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+
+    position = data;
+    end = data + carry + bytes;
+
+    while (num_samples < PROBE_MAX_SAMPLES &&
+           (found = memmem(position, end - position, SEI_TIMESTAMP_UUID, SEI_TIMESTAMP_UUID_SIZE)) != NULL) {
+      // The rest of it comes with the next read
+      terminator = memchr(found + SEI_TIMESTAMP_UUID_SIZE, ';', end - found - SEI_TIMESTAMP_UUID_SIZE);
+      if (terminator == NULL) {
+        break;
+      }
+      position = found + SEI_TIMESTAMP_UUID_SIZE;
+
+      if (terminator - position > SEI_TIMESTAMP_MAX_SIZE - 1) {
+        continue;
+      }
+      memcpy(text, position, terminator - position + 1);
+      text[terminator - position + 1] = '\0';
+
+      if (sscanf(text, SEI_TIMESTAMP_SCAN_FORMAT, &capture_s, &capture_us, &seq) != 3) {
+        continue;
+      }
+
+      if (num_samples > 0 && seq > last_seq + 1) {
+        missing += seq - last_seq - 1;
+      }
+      last_seq = seq;
+
+      samples[num_samples++] = now_us - (capture_s * 1000000 + capture_us);
+      log_debug("seq %u latency %.2f ms", seq, samples[num_samples - 1] / 1000.0);
+    }
+
+    // Keep what could be the start of a timestamp split by the read
+    carry = end - position;
+    if (carry > SEI_TIMESTAMP_UUID_SIZE + SEI_TIMESTAMP_MAX_SIZE) {
+      carry = SEI_TIMESTAMP_UUID_SIZE + SEI_TIMESTAMP_MAX_SIZE;
+    }
+    memmove(data, end - carry, carry);
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+  }
+
+  if (num_samples == 0) {
+    log_error("No SEI timestamps found, is sei_timestamps enabled for the channel?");
+    free(data);
+    free(samples);
+    return 1;
+  }
+
+  qsort(samples, num_samples, sizeof(int64_t), compare_int64);
+
+  printf("frames %d  missing %u  latency ms: min %.2f  p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n",
+         num_samples, missing,
+         samples[0] / 1000.0,
+         samples[num_samples / 2] / 1000.0,
+         samples[num_samples * 90 / 100] / 1000.0,
+         samples[num_samples * 99 / 100] / 1000.0,
+         samples[num_samples - 1] / 1000.0);
+
+  free(data);
+  free(samples);
+  return 0;
+}
+
 int main(int argc, char *argv[])
 {
-  int fd;
+  int fd, ret;
   int option_index = 0;
   int verbosity_level = 3;
   char *v4l2_device = NULL;
   char *output_dest = NULL;
   char *output_mode = NULL;
+  int probe_seconds = 0;
 
-  while (( option_index = getopt(argc, argv, "v:d:o:f:")) != -1) {
+  while (( option_index = getopt(argc, argv, "v:d:o:f:p:")) != -1) {
 
     switch (option_index) {
       case 'v':
@@ -226,6 +352,9 @@ int main(int argc, char *argv[])
       case 'f':
         output_mode = optarg;
         break;
+      case 'p':
+        probe_seconds = atoi(optarg);
+        break;
       default:
         printf("Unknown option.\n");
         return 1;
@@ -257,13 +386,25 @@ int main(int argc, char *argv[])
   }  
 
   log_info("Opening v4l2_device: %s\n", v4l2_device);
-  fd = open(v4l2_device, O_RDWR);
+  if (v4l2_device != NULL && strcmp(v4l2_device, "-") == 0) {
+    fd = STDIN_FILENO;
+  }
+  else {
+    fd = open(v4l2_device, O_RDWR);
+  }
 
   if (fd < 0) {
     perror("Opening video device");
     return 1;
   }
 
+  // The probe reads the stream as it is, no capture setup
+  if (probe_seconds > 0) {
+    ret = probe_latency(fd, probe_seconds);
+    close(fd);
+    return ret;
+  }
+
   if(print_caps(fd)) {
     return 1;
   }
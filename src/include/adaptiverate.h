@@ -0,0 +1,29 @@
+#ifndef ADAPTIVERATE_H
+#define ADAPTIVERATE_H
+
+#include <stdint.h>
+#include "streamsettings.h"
+
+// Motion results older than this, or than three motion intervals, count
+// as motion detection not running, and the full frame rate is kept
+#define ADAPTIVE_RATE_MOTION_TIMEOUT_MS  2000
+
+// Per encoder channel bookkeeping of the adaptive rate thread
+typedef struct adaptive_rate_channel {
+	EncoderSetting *encoder;
+	// Encoder bytes and time when the scene went quiet or idle began
+	uint32_t quiet_bytes;
+	uint32_t quiet_ms;
+	uint32_t idle_bytes;
+	uint32_t idle_ms;
+	// Bytes per ms of a quiet scene at the full frame rate, measured
+	// between the end of motion and the switch to idle
+	double static_rate;
+	uint64_t total_idle_ms;
+	uint64_t total_idle_bytes;
+	double saved_bytes;
+} AdaptiveRateChannel;
+
+void *adaptive_rate_entry_start(void *adaptive_rate_thread_params);
+
+#endif /* ADAPTIVERATE_H */
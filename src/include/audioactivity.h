@@ -0,0 +1,43 @@
+#ifndef AUDIOACTIVITY_H
+#define AUDIOACTIVITY_H
+
+#include <stdint.h>
+
+// Time above the noise floor needed to start a sound event and time
+// below it needed to end one, rounded up to whole frames
+#define AUDIO_ACTIVITY_ON_MS        120
+#define AUDIO_ACTIVITY_OFF_MS       1000
+// The noise floor follows quieter frames down with this time constant and
+// creeps up at this rate otherwise
+#define AUDIO_NOISE_FLOOR_FALL_MS   180
+#define AUDIO_NOISE_FLOOR_RISE_DB_PER_S  0.25
+// Level above the noise floor that counts as activity
+#define AUDIO_ACTIVITY_MARGIN_DB    12.0
+// Zero crossings per second of voiced speech stay well below those of hiss
+#define AUDIO_VOICE_MAX_CROSSINGS   3000
+
+typedef struct audio_levels {
+	float rms_db;
+	float peak_db;
+	uint32_t zero_crossings;
+} AudioLevels;
+
+typedef struct audio_activity {
+	float noise_floor_db;
+	int active;
+	int voice;
+	int on_count;
+	int off_count;
+	float event_peak_db;
+	// The timings above in frames of the configured size
+	int on_frames;
+	int off_frames;
+	float floor_fall;
+	float floor_rise_db;
+} AudioActivity;
+
+void audio_frame_levels(const int16_t *samples, uint32_t count, AudioLevels *levels);
+void audio_activity_init(AudioActivity *activity, int samples_per_frame, int sample_rate);
+void audio_activity_update(AudioActivity *activity, const int16_t *samples, uint32_t count, int sample_rate);
+
+#endif /* AUDIOACTIVITY_H */
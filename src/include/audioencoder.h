@@ -0,0 +1,26 @@
+#ifndef AUDIOENCODER_H
+#define AUDIOENCODER_H
+
+#include <stdint.h>
+#include <imp_audio.h>
+#include "streamsettings.h"
+
+#define AUDIO_ENCODER_CHANNEL   0
+#define AUDIO_PACKET_MAGIC      0x31464149  /* "IAF1" in little endian */
+
+// Every encoded audio frame written to audio.output_path is preceded by
+// this header. The timestamp is in microseconds on the IMP system clock,
+// the same clock as IMPEncoderPack.timestamp on the video channels, so a
+// muxer can interleave both without resampling time.
+typedef struct __attribute__((packed)) audio_packet_header {
+	uint32_t magic;
+	uint32_t payload_type;
+	int64_t timestamp;
+	uint32_t seq;
+	uint32_t length;
+} AudioPacketHeader;
+
+int initialize_audio_encoder(AudioSettings *audio_settings);
+int encode_audio_frame(AudioSettings *audio_settings, IMPAudioFrame *audio_frame);
+
+#endif /* AUDIOENCODER_H */
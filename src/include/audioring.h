@@ -0,0 +1,44 @@
+#ifndef AUDIORING_H
+#define AUDIORING_H
+
+#include <stdint.h>
+
+// Single producer / single consumer ring of mono 16 bit samples. The
+// capture thread only moves write_pos and the playback thread only moves
+// read_pos, so neither side takes a lock.
+typedef struct audio_ring {
+	int16_t *samples;
+	uint32_t size;
+	volatile uint32_t write_pos;
+	volatile uint32_t read_pos;
+} AudioRing;
+
+// The Q24 position within input has to fit in 32 bits
+#define AUDIO_RESAMPLER_INPUT_SIZE  256
+
+// Linear interpolating resampler that pulls its input from an AudioRing.
+// step is the number of input samples per output sample in Q24, so
+// 1 << 24 means both clocks run at the same rate. The next output lies
+// phase (Q24) past input[input_pos].
+typedef struct audio_resampler {
+	AudioRing *ring;
+	int16_t input[AUDIO_RESAMPLER_INPUT_SIZE];
+	uint32_t input_pos;
+	uint32_t input_len;
+	uint32_t phase;
+	uint32_t step;
+} AudioResampler;
+
+#define AUDIO_RESAMPLER_ONE   (1 << 24)
+
+int audio_ring_init(AudioRing *ring, uint32_t size);
+uint32_t audio_ring_fill(AudioRing *ring);
+uint32_t audio_ring_write(AudioRing *ring, const int16_t *samples, uint32_t count);
+uint32_t audio_ring_read(AudioRing *ring, int16_t *samples, uint32_t count);
+
+void audio_resampler_init(AudioResampler *resampler, AudioRing *ring);
+void audio_resampler_set_ppm(AudioResampler *resampler, int32_t ppm);
+uint32_t audio_resampler_buffered(AudioResampler *resampler);
+uint32_t audio_resample(AudioResampler *resampler, int16_t *output, uint32_t count);
+
+#endif /* AUDIORING_H */
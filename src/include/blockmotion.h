@@ -0,0 +1,40 @@
+#ifndef BLOCKMOTION_H
+#define BLOCKMOTION_H
+
+#include <stdint.h>
+
+// Block SAD motion detection on 8 bit luma. The picture is split into
+// cells of cell_size x cell_size pixels. Every frame is compared with a
+// background that follows the scene slowly (sigma-delta: each background
+// pixel moves one level towards the frame every learn_interval frames),
+// and a cell is active when its mean absolute difference exceeds the
+// threshold. Does not depend on the IMP so it can run on a host.
+
+// Kernels work on 16 pixels at a time
+#define BLOCK_MOTION_ALIGN  16
+
+typedef struct block_motion {
+	int width;
+	int height;
+	int cell_size;
+	int cells_x;
+	int cells_y;
+	int threshold;
+	int learn_interval;
+	uint32_t frames;
+	// width x height
+	uint8_t *background;
+	// cells_x x cells_y, SAD of the last frame
+	uint32_t *cell_sad;
+	// cells_x x cells_y, mean absolute difference clamped to 255
+	uint8_t *activity;
+	uint32_t active_cells;
+} BlockMotion;
+
+int block_motion_init(BlockMotion *bm, int width, int height, int cell_size,
+                      int threshold, int learn_interval);
+void block_motion_free(BlockMotion *bm);
+uint32_t block_motion_update(BlockMotion *bm, const uint8_t *luma, int stride);
+const char *block_motion_kernel_name(void);
+
+#endif /* BLOCKMOTION_H */
@@ -0,0 +1,38 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <stdint.h>
+#include "streamsettings.h"
+
+// Recommendations of the last calibration run
+#define CALIBRATION_FILE                "/tmp/calibration.json"
+#define CALIBRATION_QUERY_INTERVAL_MS   20
+// Frame size bins, four per octave from 256 bytes up to 16MB
+#define CALIBRATION_SIZE_BINS           64
+#define CALIBRATION_MIN_SIZE            256
+// GOP positions with their own histogram, later ones share the last
+#define CALIBRATION_GOP_POSITIONS       32
+#define CALIBRATION_MAX_BACKLOG_PICS    32
+// Buffers cover the 99.9th percentile plus this margin
+#define CALIBRATION_PERCENTILE          0.999
+#define CALIBRATION_MARGIN_PERCENT      25
+
+typedef struct calibration_channel {
+	uint32_t frames;
+	uint32_t gop_position;
+	uint32_t max_size;
+	uint32_t max_gop_position;
+	uint32_t size_histogram[CALIBRATION_GOP_POSITIONS][CALIBRATION_SIZE_BINS];
+	// IMP_Encoder_Query samples: pictures waiting for the encoder and
+	// bytes waiting in the stream buffer
+	uint32_t samples;
+	uint32_t pics_histogram[CALIBRATION_MAX_BACKLOG_PICS + 1];
+	uint32_t bytes_histogram[CALIBRATION_SIZE_BINS];
+	uint32_t peak_pics;
+	uint32_t peak_bytes;
+} CalibrationChannel;
+
+void calibration_record_frame(int channel, uint32_t bytes, int intra);
+void *calibration_entry_start(void *calibration_thread_params);
+
+#endif /* CALIBRATION_H */
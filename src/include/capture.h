@@ -49,16 +49,29 @@
 #define OSD_REGION_WIDTH			16
 #define OSD_REGION_HEIGHT			34
 
+// The HUD shows one line per encoder: "channel: fps kbps dropped timeouts"
+#define PERF_HUD_CHARS				24
+
 #define MAX_STREAMS				2
 
 #define SENSOR_NAME_MAX_LENGTH	50
 
-#define NIGHT_VISION_FILE_BUFFER_SIZE  8
-#define NIGHT_VISION_FILE    "/tmp/night_vision_enabled"
+// Number of ALSA periods (one IMP audio frame each) in the playback buffer
+#define AUDIO_ALSA_PERIODS      3
+// Seconds between audio latency / xrun reports in the log
+#define AUDIO_REPORT_INTERVAL   60
+// Samples between the capture and playback threads, must be a power of two
+#define AUDIO_RING_SIZE         32768
+// Audio held in the ring and ALSA buffers together
+#define AUDIO_TARGET_LATENCY_MS 150
+// Time over which a latency error is corrected, and the largest rate
+// adjustment the resampler may apply
+#define AUDIO_DRIFT_CORRECTION_SECONDS  10
+#define AUDIO_MAX_DRIFT_PPM     2000
 
 
 int initialize_sensor(IMPSensorInfo *sensor_info);
-int initialize_audio();
+int initialize_audio(AudioSettings *audio_settings);
 int configure_video_tuning_parameters(CameraConfig *camera_config);
 int create_encoding_group(int group_id);
 int setup_encoding_engine(FrameSource* frame_source, EncoderSetting* encoder_setting);
@@ -67,8 +80,10 @@ int sensor_cleanup(IMPSensorInfo* sensor_info);
 void hexdump(const char * desc, const void * addr, const int len);
 void *produce_frames(void *ptr);
 void *audio_thread_entry_start(void *audio_thread_params);
+void *audio_playback_entry_start(void *audio_playback_thread_params);
 void *timestamp_osd_entry_start(void *timestamp_osd_thread_params);
-void *night_vision_entry_start(void *night_vision_thread_params);
+int initialize_perf_hud(CameraConfig *camera_config);
+void *perf_hud_entry_start(void *perf_hud_thread_params);
 void print_stream_settings(StreamSettings *stream_settings);
 void print_channel_attributes(IMPFSChnAttr *attr);
 void print_encoder_channel_attributes(IMPEncoderCHNAttr *attr);
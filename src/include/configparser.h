@@ -10,11 +10,25 @@ int populate_stream_settings(StreamSettings *settings, cJSON *json);
 int populate_framesource(FrameSource *framesource, cJSON* json);
 int populate_encoder(EncoderSetting *encoder_setting, cJSON* json);
 int populate_binding(Binding *binding, cJSON* json);
+int populate_privacy_mask(PrivacyMask *privacy_mask, cJSON* json);
+int populate_encoder_roi(EncoderRoi *encoder_roi, cJSON* json);
+int populate_audio_settings(AudioSettings *audio_settings, cJSON* json);
+int populate_night_vision_settings(NightVisionSettings *night_vision, cJSON* json);
+int populate_motion_settings(MotionSettings *motion, cJSON* json);
+int populate_adaptive_rate_settings(AdaptiveRateSettings *adaptive_rate, cJSON* json);
+int populate_calibration_settings(CalibrationSettings *calibration, cJSON* json);
 
 void print_general_settings(CameraConfig *camera_config);
 void print_framesource(FrameSource *framesource);
 void print_encoder(EncoderSetting *encoder_setting);
 void print_binding(Binding *binding);
+void print_privacy_mask(PrivacyMask *privacy_mask);
+void print_encoder_roi(EncoderRoi *encoder_roi);
+void print_audio_settings(AudioSettings *audio_settings);
+void print_night_vision_settings(NightVisionSettings *night_vision);
+void print_motion_settings(MotionSettings *motion);
+void print_adaptive_rate_settings(AdaptiveRateSettings *adaptive_rate);
+void print_calibration_settings(CalibrationSettings *calibration);
 
 
 #endif /* CONFIGPARSER_H */
@@ -0,0 +1,19 @@
+#ifndef ENCODERROI_H
+#define ENCODERROI_H
+
+#include <cJSON.h>
+#include "streamsettings.h"
+
+// Writing a JSON document with an "encoder_rois" array to this file
+// replaces the encoder ROIs from settings.json.
+#define ENCODER_ROI_FILE    "/tmp/encoder_rois.json"
+
+// The encoder has 8 ROIs per channel. The configured ones use the first
+// MAX_ENCODER_ROIS, the motion ROIs the ones after them.
+#define ENCODER_ROI_MOTION_INDEX   MAX_ENCODER_ROIS
+
+int load_encoder_rois(cJSON *json, EncoderRoi encoder_rois[], uint32_t *num_encoder_rois);
+int setup_encoder_rois(CameraConfig *camera_config);
+void *encoder_roi_entry_start(void *encoder_roi_thread_params);
+
+#endif /* ENCODERROI_H */
@@ -0,0 +1,15 @@
+#ifndef EVENTS_H
+#define EVENTS_H
+
+// Local clients connect to this UNIX socket and receive one JSON object
+// per line for every event, for example:
+//
+//   {"time":1700000000.123,"type":"sound","state":"start",...}
+#define EVENT_SOCKET_PATH       "/tmp/videocapture_events.sock"
+#define MAX_EVENT_SUBSCRIBERS   8
+
+int initialize_events(const char *socket_path);
+void publish_event(const char *type, const char *format, ...);
+void *events_entry_start(void *events_thread_params);
+
+#endif /* EVENTS_H */
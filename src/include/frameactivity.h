@@ -0,0 +1,46 @@
+#ifndef FRAMEACTIVITY_H
+#define FRAMEACTIVITY_H
+
+#include <stdint.h>
+
+// P frames used to learn the baseline before anything is reported
+#define FRAME_ACTIVITY_WARMUP_FRAMES   25
+// How fast the baseline follows quiet frames, and how slowly it creeps
+// towards the frame sizes during activity
+#define FRAME_ACTIVITY_ALPHA           0.05
+#define FRAME_ACTIVITY_ACTIVE_ALPHA    0.002
+// z-score that starts activity, and the one it has to stay below to end
+#define FRAME_ACTIVITY_Z_ON            3.0
+#define FRAME_ACTIVITY_Z_OFF           1.5
+// P frames above / below those needed to start / end activity
+#define FRAME_ACTIVITY_ON_FRAMES       3
+#define FRAME_ACTIVITY_OFF_FRAMES      25
+// A single P frame this many times the baseline is a scene change (cut,
+// lights switched, camera moved): most of it had to be intra coded
+#define FRAME_ACTIVITY_SCENE_RATIO     4.0
+#define FRAME_ACTIVITY_SCENE_Z         8.0
+// Floor of the standard deviation, as a share of the mean and in bytes,
+// so a very steady stream does not turn noise into huge z-scores
+#define FRAME_ACTIVITY_MIN_SD_SHARE    0.05
+#define FRAME_ACTIVITY_MIN_SD_BYTES    64.0
+
+// Returned by frame_activity_update
+#define FRAME_ACTIVITY_STARTED         1
+#define FRAME_ACTIVITY_STOPPED         2
+#define FRAME_ACTIVITY_SCENE_CHANGE    4
+
+typedef struct frame_activity {
+	uint32_t frames;
+	double mean;
+	double variance;
+	double z;
+	int active;
+	int on_count;
+	int off_count;
+	double event_peak_z;
+} FrameActivity;
+
+void frame_activity_init(FrameActivity *activity);
+int frame_activity_update(FrameActivity *activity, uint32_t frame_bytes, int intra);
+
+#endif /* FRAMEACTIVITY_H */
@@ -24,19 +24,49 @@ typedef struct {
   void *udata;
   int line;
   int level;
+  unsigned long thread;
 } log_Event;
 
+// Rate limiting state of one log call site, see log_log_site
+typedef struct {
+  time_t window_start;
+  unsigned int count;
+  unsigned int suppressed;
+} log_Site;
+
 typedef void (*log_LogFn)(log_Event *ev);
 typedef void (*log_LockFn)(bool lock, void *udata);
 
 enum { LOGC_TRACE, LOGC_DEBUG, LOGC_INFO, LOGC_WARN, LOGC_ERROR, LOGC_FATAL };
 
-#define log_trace(...) log_log(LOGC_TRACE, __FILE__, __LINE__, __VA_ARGS__)
-#define log_debug(...) log_log(LOGC_DEBUG, __FILE__, __LINE__, __VA_ARGS__)
-#define log_info(...)  log_log(LOGC_INFO,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_warn(...)  log_log(LOGC_WARN,  __FILE__, __LINE__, __VA_ARGS__)
-#define log_error(...) log_log(LOGC_ERROR, __FILE__, __LINE__, __VA_ARGS__)
-#define log_fatal(...) log_log(LOGC_FATAL, __FILE__, __LINE__, __VA_ARGS__)
+// Calls below LOG_MIN_LEVEL are compiled out, arguments included
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOGC_INFO
+#endif
+
+// Every call site logs at most LOG_RATE_BURST messages per
+// LOG_RATE_INTERVAL seconds, the rest are counted
+#define LOG_RATE_BURST     20
+#define LOG_RATE_INTERVAL  10
+
+// Records queued for the writer thread, a power of two. Messages are cut
+// at the size syslog_callback already used.
+#define LOG_RING_SIZE      128
+#define LOG_MESSAGE_SIZE   512
+
+#define log_at(level, ...) do { \
+    if ((level) >= LOG_MIN_LEVEL) { \
+      static log_Site log_site_; \
+      log_log_site(&log_site_, (level), __FILE__, __LINE__, __VA_ARGS__); \
+    } \
+  } while (0)
+
+#define log_trace(...) log_at(LOGC_TRACE, __VA_ARGS__)
+#define log_debug(...) log_at(LOGC_DEBUG, __VA_ARGS__)
+#define log_info(...)  log_at(LOGC_INFO,  __VA_ARGS__)
+#define log_warn(...)  log_at(LOGC_WARN,  __VA_ARGS__)
+#define log_error(...) log_at(LOGC_ERROR, __VA_ARGS__)
+#define log_fatal(...) log_at(LOGC_FATAL, __VA_ARGS__)
 
 const char* log_level_string(int level);
 void log_set_lock(log_LockFn fn, void *udata);
@@ -46,6 +76,9 @@ int log_add_callback(log_LogFn fn, void *udata, int level);
 int log_add_fp(FILE *fp, int level);
 
 void log_log(int level, const char *file, int line, const char *fmt, ...);
+void log_log_site(log_Site *site, int level, const char *file, int line, const char *fmt, ...);
+int log_start_async(void);
+void log_stop_async(void);
 int logc_to_syslog_level(int syslog_level);
 void log_init_syslog();
 
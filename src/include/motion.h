@@ -0,0 +1,31 @@
+#ifndef MOTION_H
+#define MOTION_H
+
+#include "streamsettings.h"
+
+#define MOTION_IVS_GROUP    0
+#define MOTION_IVS_CHANNEL  0
+
+// The software method keeps the latest activity map here, a binary PGM
+// with one pixel per cell (mean luma difference to the background)
+#define MOTION_MAP_FILE     "/tmp/motion_map.pgm"
+#define MOTION_FRAME_DEPTH  2
+
+// Current motion state, written by the motion thread only
+typedef struct motion_status {
+	// Bit n is set while ROI n has motion (including hold_ms after it)
+	volatile uint32_t active_rois;
+	// Detections with motion in any ROI
+	volatile uint32_t detections;
+	// Monotonic ms of the last result or timeout the thread looked at,
+	// stops moving when detection stops working
+	volatile uint32_t updated_ms;
+} MotionStatus;
+
+extern MotionStatus motion_status;
+
+int add_motion_binding(CameraConfig *camera_config);
+int initialize_motion_detection(CameraConfig *camera_config);
+void *motion_entry_start(void *motion_thread_params);
+
+#endif /* MOTION_H */
@@ -0,0 +1,40 @@
+#ifndef NIGHTVISION_H
+#define NIGHTVISION_H
+
+#include <stdint.h>
+#include "streamsettings.h"
+
+// While this file exists and holds 0 or 1 it forces day or night mode,
+// whatever the configured mode is
+#define NIGHT_VISION_FILE    "/tmp/night_vision_enabled"
+
+// Exposure figures of one sample, as read from the ISP
+typedef struct night_vision_sample {
+	// Integration time in microseconds
+	uint32_t exposure_us;
+	// Total gain in 24.8 fixed point
+	uint32_t total_gain;
+	// Auto white balance gains
+	uint32_t rgain;
+	uint32_t bgain;
+} NightVisionSample;
+
+// Controller state, only touched by night_vision_update
+typedef struct night_vision_state {
+	int night;
+	uint32_t last_ev;
+	uint32_t night_ms;
+	uint32_t day_ms;
+	uint32_t wb_ms;
+	uint32_t hold_ms;
+	// Brightness measure of the last sample, exposure_us * gain
+	uint32_t ev;
+	uint32_t wb_ratio;
+} NightVisionState;
+
+void night_vision_init(NightVisionState *state, int night);
+int night_vision_update(NightVisionState *state, NightVisionSettings *settings,
+                        NightVisionSample *sample, uint32_t elapsed_ms);
+void *night_vision_entry_start(void *night_vision_thread_params);
+
+#endif /* NIGHTVISION_H */
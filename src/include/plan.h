@@ -0,0 +1,22 @@
+#ifndef PLAN_H
+#define PLAN_H
+
+#include <stdint.h>
+#include "streamsettings.h"
+
+// Limits of the T20 the configuration is checked against, see the
+// comment above setup_binding in main.c
+#define PLAN_MAX_ENC_GROUPS             6
+#define PLAN_MAX_ENC_CHANNELS           6
+#define PLAN_FS_OUTPUTS                 2
+// H.264 encoder throughput of the T20, 1080p at 60 fps
+#define PLAN_H264_MACROBLOCKS_PER_SECOND  (120 * 68 * 60)
+// MJPEG has no rate control here, its bitrate is guessed from the
+// pixel rate at this many bits per pixel
+#define PLAN_JPEG_BITS_PER_PIXEL        1
+
+FrameSource *plan_encoder_framesource(CameraConfig *camera_config, EncoderSetting *encoder);
+int plan_encoder_group_replayed(CameraConfig *camera_config, int group);
+int plan_configuration(CameraConfig *camera_config, int load_errors);
+
+#endif /* PLAN_H */
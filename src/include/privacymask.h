@@ -0,0 +1,15 @@
+#ifndef PRIVACYMASK_H
+#define PRIVACYMASK_H
+
+#include <cJSON.h>
+#include "streamsettings.h"
+
+// Writing a JSON document with a "privacy_masks" array to this file
+// replaces the masks that are currently shown.
+#define PRIVACY_MASK_FILE    "/tmp/privacy_masks.json"
+
+int load_privacy_masks(cJSON *json, PrivacyMask privacy_masks[], uint32_t *num_privacy_masks);
+int setup_privacy_masks(CameraConfig *camera_config);
+void *privacy_mask_entry_start(void *privacy_mask_thread_params);
+
+#endif /* PRIVACYMASK_H */
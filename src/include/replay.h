@@ -0,0 +1,35 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <stdint.h>
+#include <imp_encoder.h>
+#include "streamsettings.h"
+
+// NAL units (packs) in one replayed H.264 access unit, more are merged
+// into the last pack
+#define REPLAY_MAX_PACKS      16
+
+// replay_get_stream() at the end of a file that is not looped
+#define REPLAY_END            1
+
+typedef struct replay_source {
+	const char *filename;
+	uint8_t *data;
+	size_t size;
+	size_t position;
+	int jpeg;
+	int fast;
+	int loop;
+	uint32_t seq;
+	// Frame n is due at start_us + n * interval_us
+	int64_t start_us;
+	int64_t interval_us;
+	IMPEncoderPack packs[REPLAY_MAX_PACKS];
+} ReplaySource;
+
+int replay_open(ReplaySource *replay, EncoderSetting *encoder_setting);
+int replay_poll(ReplaySource *replay, uint32_t timeout_ms);
+int replay_get_stream(ReplaySource *replay, IMPEncoderStream *stream);
+void replay_close(ReplaySource *replay);
+
+#endif /* REPLAY_H */
@@ -0,0 +1,20 @@
+#ifndef SEITIMESTAMP_H
+#define SEITIMESTAMP_H
+
+#include <stdint.h>
+
+// The user data SEI starts with this UUID, "videocapture-ts1", followed
+// by SEI_TIMESTAMP_FORMAT as text. Neither has a zero byte, so the
+// encoder never escapes them and readers can look for the UUID in the
+// raw stream.
+#define SEI_TIMESTAMP_UUID        "videocapture-ts1"
+#define SEI_TIMESTAMP_UUID_SIZE   16
+// Capture time on CLOCK_REALTIME in seconds and microseconds, and the
+// encoder sequence number of the frame
+#define SEI_TIMESTAMP_FORMAT      "t=%lld.%06d seq=%u;"
+#define SEI_TIMESTAMP_SCAN_FORMAT "t=%lld.%d seq=%u;"
+#define SEI_TIMESTAMP_MAX_SIZE    64
+
+int sei_timestamp_insert(int channel, int64_t frame_timestamp_us, uint32_t seq, uint32_t interval_us);
+
+#endif /* SEITIMESTAMP_H */
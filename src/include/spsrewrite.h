@@ -0,0 +1,28 @@
+#ifndef SPSREWRITE_H
+#define SPSREWRITE_H
+
+#include <stdint.h>
+#include <h264_stream.h>
+#include "streamsettings.h"
+
+// Largest SPS NAL unit handled, with its start code. The T20 writes
+// about 20 bytes, the VUI adds about 10.
+#define SPS_REWRITE_MAX_SIZE   256
+
+typedef struct sps_rewriter {
+	h264_stream_t *h264;
+	uint32_t num_units_in_tick;
+	uint32_t time_scale;
+	// The encoder repeats the same SPS with every IDR, so the last one
+	// and its rewrite are kept
+	uint8_t input[SPS_REWRITE_MAX_SIZE];
+	int input_size;
+	uint8_t output[SPS_REWRITE_MAX_SIZE];
+	int output_size;
+} SpsRewriter;
+
+int sps_rewriter_init(SpsRewriter *rewriter, EncoderSetting *encoder_setting);
+int sps_rewrite(SpsRewriter *rewriter, const uint8_t *data, int size, const uint8_t **output);
+void sps_rewriter_free(SpsRewriter *rewriter);
+
+#endif /* SPSREWRITE_H */
@@ -8,6 +8,10 @@
 #define MAX_FRAMESOURCES		4
 #define MAX_ENCODERS			10
 #define MAX_BINDINGS			10
+#define MAX_OSD_GROUPS			4
+#define MAX_PRIVACY_MASKS		4
+#define MAX_MOTION_ROIS			4
+#define MAX_ENCODER_ROIS		4
 
 typedef struct frame_source {
 	int id;
@@ -33,6 +37,32 @@ typedef struct frame_source {
 
 } FrameSource;
 
+// Counters for an encoder channel. They are only written by the thread
+// that owns the channel, other threads read them without locking. They
+// are 32 bit so that reads are atomic on the T20 and wrap around, so
+// readers should only look at the difference between two samples.
+typedef struct encoder_stats {
+	volatile uint32_t frames;
+	volatile uint32_t bytes;
+	volatile uint32_t dropped_frames;
+	volatile uint32_t poll_timeouts;
+} EncoderStats;
+
+// Counters for the audio threads, same rules as EncoderStats. Latencies
+// are from IMP capture to the sample leaving the ALSA buffer. underruns
+// and overruns count an empty or full ring between the two threads.
+typedef struct audio_stats {
+	volatile uint32_t frames;
+	volatile uint32_t xruns;
+	volatile uint32_t underruns;
+	volatile uint32_t overruns;
+	volatile uint32_t ring_fill;
+	volatile int32_t drift_ppm;
+	volatile uint32_t capture_delay_us;
+	volatile uint32_t latency_us;
+	volatile uint32_t max_latency_us;
+} AudioStats;
+
 typedef struct encoder_setting {
 	int channel;
 	int group;
@@ -50,9 +80,26 @@ typedef struct encoder_setting {
 	int gop_qp_step;
 	int pic_width;
 	int pic_height;
+	// Activity and scene change events from the P frame sizes (H.264),
+	// optionally with an IDR after every scene change
+	int activity_detection;
+	int scene_change_idr;
+	// Every frame carries a user data SEI with its capture time, see
+	// seitimestamp.c (H.264)
+	int sei_timestamps;
+	// SPS packs get VUI timing and no frame reordering added on the way
+	// out, see spsrewrite.c (H.264)
+	int sps_vui;
+	// Frames come from this Annex-B H.264 or MJPEG recording instead of
+	// the encoder, at the frame rate above or as fast as possible
+	char replay_file[255];
+	int replay_fast;
+	int replay_loop;
 	
 	IMPEncoderCHNAttr chn_attr;
 
+	EncoderStats stats;
+
 } EncoderSetting;
 
 typedef struct binding_parameter {
@@ -66,6 +113,152 @@ typedef struct binding {
 	BindingParameter target;
 } Binding;
 
+// Privacy mask rectangles are given in sensor coordinates
+// (SENSOR_WIDTH x SENSOR_HEIGHT) and scaled to the resolution
+// of each OSD group they are drawn on.
+typedef struct privacy_mask {
+	int id;
+	int enabled;
+	int x;
+	int y;
+	int width;
+	int height;
+	uint32_t color;
+	char color_name[32];
+} PrivacyMask;
+
+// Encoder ROIs are given in sensor coordinates as well. Macroblocks in
+// them are coded with qp_offset added to the QP the rate control picks,
+// so a negative offset spends more bits there.
+typedef struct encoder_roi {
+	int id;
+	int enabled;
+	int x;
+	int y;
+	int width;
+	int height;
+	int qp_offset;
+} EncoderRoi;
+
+#define ENCODER_ROI_MAX_QP_OFFSET  15
+
+// Defaults for the audio section of settings.json
+#define AUDIO_DEFAULT_DEVICE_ID         1
+#define AUDIO_DEFAULT_CHANNEL_ID        0
+#define AUDIO_DEFAULT_SAMPLE_RATE       48000
+#define AUDIO_DEFAULT_SAMPLES_PER_FRAME 1920
+#define AUDIO_DEFAULT_USR_FRAME_DEPTH   20
+#define AUDIO_DEFAULT_VOLUME            70
+// Largest IMP audio frame, sizes the playback period buffer
+#define AUDIO_MAX_SAMPLES_PER_FRAME     4096
+
+typedef struct audio_settings {
+	int device_id;
+	int channel_id;
+	int sample_rate;
+	int samples_per_frame;
+	int frame_num;
+	int usr_frame_depth;
+	int volume;
+	int ns;
+	char ns_level_name[32];
+	int ns_level;
+	int agc;
+	int agc_target_level;
+	int agc_compression_gain;
+	int hpf;
+	char codec[32];
+	int payload_type;
+	char output_path[255];
+	int activity_detection;
+	int talkback;
+	int aec;
+} AudioSettings;
+
+// Rectangle in sensor coordinates, like the privacy masks
+typedef struct motion_roi {
+	int x;
+	int y;
+	int width;
+	int height;
+	// IVS sensitivity, 0 (least) to 4 (most)
+	int sensitivity;
+} MotionRoi;
+
+#define MOTION_METHOD_IVS        0
+#define MOTION_METHOD_SOFTWARE   1
+
+typedef struct motion_settings {
+	int enabled;
+	char method_name[16];
+	int method;
+	// Frame source the IVS group is put behind, or that is read directly
+	int framesource;
+	// Frames skipped between detections (ivs)
+	int skip_frames;
+	// Software method: cells of cell_size x cell_size luma pixels are
+	// active when their mean difference to the background is above
+	// threshold, a ROI has motion with at least min_cells active cells
+	int fps;
+	int cell_size;
+	int threshold;
+	int learn_interval;
+	int min_cells;
+	// QP offset for the encoder while a ROI has motion, 0 disables
+	int encoder_qp_offset;
+	int poll_interval_ms;
+	// A ROI counts as still for events once it had no motion this long
+	int hold_ms;
+	MotionRoi rois[MAX_MOTION_ROIS];
+	uint32_t num_rois;
+} MotionSettings;
+
+// Encoders drop to idle_fps with a GOP of idle_gop_seconds once there
+// was no motion for idle_after_ms, and go back as soon as there is
+typedef struct adaptive_rate_settings {
+	int enabled;
+	int idle_after_ms;
+	int idle_fps;
+	int idle_gop_seconds;
+	int poll_interval_ms;
+	// Savings are logged and published this often, 0 disables
+	int report_interval_s;
+} AdaptiveRateSettings;
+
+// Calibration watches the frame sizes and encoder backlog for duration_s
+// and recommends frame source buffer_size (nrVBs) and encoder
+// buffer_size (bufSize) values; with apply they are written back to
+// settings_file for the next start
+typedef struct calibration_settings {
+	int enabled;
+	int duration_s;
+	int apply;
+	char settings_file[255];
+} CalibrationSettings;
+
+#define NIGHT_VISION_MODE_AUTO    0
+#define NIGHT_VISION_MODE_DAY     1
+#define NIGHT_VISION_MODE_NIGHT   2
+
+typedef struct night_vision_settings {
+	char mode_name[16];
+	int mode;
+	int sample_interval_ms;
+	// Switch to night when exposure_us * gain stays above night_ev for
+	// night_delay_ms, and back when it stays below day_ev for day_delay_ms
+	uint32_t night_ev;
+	uint32_t day_ev;
+	int night_delay_ms;
+	int day_delay_ms;
+	// Also back to day when rgain * 256 / bgain stays above day_wb_ratio
+	// for day_delay_ms, 0 disables
+	uint32_t day_wb_ratio;
+	// Changes between samples larger than this mean the AE is still moving
+	int jitter_percent;
+	// Time for the AE to settle after a switch
+	int switch_wait_ms;
+} NightVisionSettings;
+
 typedef struct stream_settings {
 	char name[255];
 	int enabled;
@@ -109,12 +302,33 @@ typedef struct {
 	Binding bindings[MAX_BINDINGS];
 	uint32_t num_bindings;
 
+	int osd_groups[MAX_OSD_GROUPS];
+	uint32_t num_osd_groups;
+
+	PrivacyMask privacy_masks[MAX_PRIVACY_MASKS];
+	uint32_t num_privacy_masks;
+
+	EncoderRoi encoder_rois[MAX_ENCODER_ROIS];
+	uint32_t num_encoder_rois;
+
+	AudioSettings audio;
+
+	NightVisionSettings night_vision;
+
+	MotionSettings motion;
+
+	AdaptiveRateSettings adaptive_rate;
+
+	CalibrationSettings calibration;
+
 	uint32_t flip_vertical;
 	uint32_t flip_horizontal;
 	uint32_t show_timestamp;
 	uint32_t timestamp_24h;
 	uint32_t timestamp_location;
 	uint32_t enable_audio;
+	uint32_t show_perf_hud;
+	uint32_t perf_hud_location;
 
 
 } CameraConfig;
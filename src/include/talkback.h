@@ -0,0 +1,39 @@
+#ifndef TALKBACK_H
+#define TALKBACK_H
+
+#include "streamsettings.h"
+
+// Talkback audio is sent to this UNIX datagram socket. Every datagram is
+// an AudioPacketHeader (see audioencoder.h) followed by PT_PCM (16 bit
+// little endian), PT_G711A or PT_G711U samples, mono at
+// TALKBACK_SAMPLE_RATE. The header timestamp is the CLOCK_REALTIME time in
+// microseconds at which the first sample was recorded.
+#define TALKBACK_SOCKET_PATH        "/tmp/videocapture_talkback.sock"
+
+#define TALKBACK_AO_DEVICE          0
+#define TALKBACK_AO_CHANNEL         0
+#define TALKBACK_SAMPLE_RATE        8000
+// 20 ms frames to the speaker
+#define TALKBACK_SAMPLES_PER_FRAME  160
+#define TALKBACK_VOLUME             70
+#define TALKBACK_RING_SIZE          8192
+// Limits for the jitter buffer depth, in milliseconds
+#define TALKBACK_MIN_DELAY_MS       40
+#define TALKBACK_MAX_DELAY_MS       400
+
+// Counters for the talkback threads, same rules as EncoderStats
+typedef struct talkback_stats {
+	volatile uint32_t packets;
+	volatile uint32_t lost_packets;
+	volatile uint32_t late_packets;
+	volatile uint32_t jitter_us;
+	volatile uint32_t target_delay_ms;
+	volatile uint32_t latency_us;
+	volatile uint32_t max_latency_us;
+} TalkbackStats;
+
+int initialize_talkback(AudioSettings *audio_settings);
+void *talkback_receive_entry_start(void *talkback_thread_params);
+void *talkback_playback_entry_start(void *talkback_thread_params);
+
+#endif /* TALKBACK_H */
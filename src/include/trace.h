@@ -0,0 +1,37 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+// SIGUSR1 starts tracing, the next SIGUSR1 stops it and writes the
+// events to this file in the Chrome trace format (chrome://tracing or
+// ui.perfetto.dev)
+#define TRACE_FILE           "/tmp/videocapture_trace.json"
+// Events kept per thread, a power of two; older ones are overwritten
+#define TRACE_RING_EVENTS    4096
+#define TRACE_MAX_THREADS    32
+#define TRACE_NAME_SIZE      32
+
+extern volatile int trace_enabled;
+
+uint64_t trace_now_us(void);
+void trace_thread_name(const char *format, ...);
+void trace_end(const char *name, uint64_t start_us);
+void trace_request_toggle(void);
+int trace_dump(const char *filename);
+void *trace_entry_start(void *trace_thread_params);
+
+// Wrap a stage with
+//
+//   uint64_t t = trace_begin();
+//   ...
+//   trace_end("GetStream", t);
+//
+// Both are a load and a branch while tracing is off. name must be a
+// string literal, only the pointer is stored.
+static inline uint64_t trace_begin(void)
+{
+  return trace_enabled ? trace_now_us() : 0;
+}
+
+#endif /* TRACE_H */
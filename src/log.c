@@ -22,6 +22,18 @@
 
 #include "log.h"
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+
+/*
+ * Asynchronous mode (log_start_async): log calls format the message into
+ * a record of a bounded lock-free ring (Vyukov's MPMC queue, used here with
+ * many producers and the one writer thread as consumer) and return. The
+ * writer runs the callbacks, so no log call ever waits for stdout, syslog
+ * or a lock. When the ring is full records are dropped and counted.
+ * Before log_start_async and after log_stop_async lines are written
+ * synchronously as before.
+ */
 
 #define MAX_CALLBACKS 32
 
@@ -31,12 +43,31 @@ typedef struct {
   int level;
 } Callback;
 
+typedef struct {
+  uint32_t sequence;
+  int level;
+  int line;
+  const char *file;
+  time_t time;
+  unsigned long thread;
+  char message[LOG_MESSAGE_SIZE];
+} Record;
+
 static struct {
   void *udata;
   log_LockFn lock;
   int level;
   bool quiet;
   Callback callbacks[MAX_CALLBACKS];
+
+  Record ring[LOG_RING_SIZE];
+  uint32_t head;
+  uint32_t tail;
+  uint32_t dropped;
+  volatile int async;
+  volatile int stopping;
+  sem_t pending;
+  pthread_t writer;
 } L;
 
 
@@ -62,7 +93,7 @@ static void stdout_callback(log_Event *ev) {
 #else
   fprintf(
     ev->udata, "%s %-5s %s:%d:%d: ",
-    buf, level_strings[ev->level], ev->file, ev->line, pthread_self());
+    buf, level_strings[ev->level], ev->file, ev->line, (int)ev->thread);
 #endif
   vfprintf(ev->udata, ev->fmt, ev->ap);
   fprintf(ev->udata, "\n");
@@ -85,8 +116,8 @@ static void syslog_callback(log_Event *ev) {
   int syslog_level = logc_to_syslog_level(ev->level);
   char buf[512];
 
-  vsprintf(buf, ev->fmt, ev->ap);
-  syslog (syslog_level, "%d: %s", pthread_self(), buf);
+  vsnprintf(buf, sizeof(buf), ev->fmt, ev->ap);
+  syslog (syslog_level, "%d: %s", (int)ev->thread, buf);
 }
 
 static void lock(void)   {
@@ -178,32 +209,262 @@ static void init_event(log_Event *ev, void *udata) {
 }
 
 
-void log_log(int level, const char *file, int line, const char *fmt, ...) {
+static void dispatch(log_Event *ev, const char *fmt, va_list ap) {
+  if (!L.quiet && ev->level >= L.level) {
+    init_event(ev, stderr);
+    va_copy(ev->ap, ap);
+    stdout_callback(ev);
+    va_end(ev->ap);
+  }
+
+  for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
+    Callback *cb = &L.callbacks[i];
+    if (ev->level >= cb->level) {
+      init_event(ev, cb->udata);
+      va_copy(ev->ap, ap);
+      cb->fn(ev);
+      va_end(ev->ap);
+    }
+  }
+}
+
+
+static void dispatch_record(Record *record, const char *fmt, ...) {
+  struct tm time_info;
+  va_list ap;
   log_Event ev = {
-    .fmt   = fmt,
-    .file  = file,
-    .line  = line,
-    .level = level,
+    .fmt    = fmt,
+    .file   = record->file,
+    .line   = record->line,
+    .level  = record->level,
+    .thread = record->thread,
+    .time   = localtime_r(&record->time, &time_info),
   };
 
-  lock();
+  va_start(ap, fmt);
+  dispatch(&ev, fmt, ap);
+  va_end(ap);
+}
+
+
+static int enqueue(int level, const char *file, int line, const char *fmt, va_list ap,
+                   unsigned int suppressed) {
+  Record *record;
+  uint32_t position, sequence;
+  int length;
+
+  position = __atomic_load_n(&L.head, __ATOMIC_RELAXED);
+  for (;;) {
+    record = &L.ring[position & (LOG_RING_SIZE - 1)];
+    sequence = __atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE);
+
+    if ((int32_t)(sequence - position) == 0) {
+      if (__atomic_compare_exchange_n(&L.head, &position, position + 1, true,
+                                      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        break;
+      }
+    }
+    else if ((int32_t)(sequence - position) < 0) {
+      __atomic_fetch_add(&L.dropped, 1, __ATOMIC_RELAXED);
+      return -1;
+    }
+    else {
+      position = __atomic_load_n(&L.head, __ATOMIC_RELAXED);
+    }
+  }
+
+  record->level = level;
+  record->file = file;
+  record->line = line;
+  record->time = time(NULL);
+  record->thread = (unsigned long)pthread_self();
+  length = vsnprintf(record->message, LOG_MESSAGE_SIZE, fmt, ap);
+  if (suppressed && length >= 0 && length < LOG_MESSAGE_SIZE) {
+    snprintf(record->message + length, LOG_MESSAGE_SIZE - length,
+             " (%u similar messages suppressed)", suppressed);
+  }
+
+  __atomic_store_n(&record->sequence, position + 1, __ATOMIC_RELEASE);
+  sem_post(&L.pending);
+
+  return 0;
+}
+
+
+// Run the callbacks for every queued record. Only the writer thread, or
+// log_stop_async once it is gone, takes records out.
+static void drain(void) {
+  Record *record;
+  uint32_t dropped;
+
+  for (;;) {
+    record = &L.ring[L.tail & (LOG_RING_SIZE - 1)];
+    if (__atomic_load_n(&record->sequence, __ATOMIC_ACQUIRE) != L.tail + 1) {
+      break;
+    }
+
+    // Only contended while log_stop_async switches back
+    lock();
+    dispatch_record(record, "%s", record->message);
+    unlock();
+
+    __atomic_store_n(&record->sequence, L.tail + LOG_RING_SIZE, __ATOMIC_RELEASE);
+    L.tail++;
+  }
+
+  dropped = __atomic_exchange_n(&L.dropped, 0, __ATOMIC_RELAXED);
+  if (dropped) {
+    Record note = { .level = LOGC_WARN, .file = __FILE__, .line = __LINE__,
+                    .time = time(NULL), .thread = (unsigned long)pthread_self() };
+    lock();
+    dispatch_record(&note, "%u log messages dropped, the log ring was full", dropped);
+    unlock();
+  }
+}
+
+
+static void *writer_entry_start(void *unused) {
+  while (!L.stopping) {
+    sem_wait(&L.pending);
+    drain();
+  }
+
+  return NULL;
+}
+
 
+int log_start_async(void) {
+  for (uint32_t i = 0; i < LOG_RING_SIZE; i++) {
+    L.ring[i].sequence = i;
+  }
+  L.head = 0;
+  L.tail = 0;
+  L.dropped = 0;
+  L.stopping = 0;
+
+  if (sem_init(&L.pending, 0, 0) != 0) {
+    return -1;
+  }
+
+  if (pthread_create(&L.writer, NULL, writer_entry_start, NULL) != 0) {
+    sem_destroy(&L.pending);
+    return -1;
+  }
+
+  L.async = 1;
+
+  return 0;
+}
+
+
+// Write out what is still queued and go back to synchronous logging
+void log_stop_async(void) {
+  if (!L.async) {
+    return;
+  }
+
+  L.async = 0;
+  L.stopping = 1;
+  sem_post(&L.pending);
+  pthread_join(L.writer, NULL);
+
+  drain();
+  sem_destroy(&L.pending);
+}
+
+
+// Whether anything would write a message of this level
+static bool wanted(int level) {
   if (!L.quiet && level >= L.level) {
-    init_event(&ev, stderr);
-    va_start(ev.ap, fmt);
-    stdout_callback(&ev);
-    va_end(ev.ap);
+    return true;
   }
 
   for (int i = 0; i < MAX_CALLBACKS && L.callbacks[i].fn; i++) {
-    Callback *cb = &L.callbacks[i];
-    if (level >= cb->level) {
-      init_event(&ev, cb->udata);
-      va_start(ev.ap, fmt);
-      cb->fn(&ev);
-      va_end(ev.ap);
+    if (level >= L.callbacks[i].level) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+static void log_va(int level, const char *file, int line, const char *fmt, va_list ap,
+                   unsigned int suppressed) {
+  char message[LOG_MESSAGE_SIZE];
+  int length;
+  log_Event ev = {
+    .fmt    = fmt,
+    .file   = file,
+    .line   = line,
+    .level  = level,
+    .thread = (unsigned long)pthread_self(),
+  };
+
+  if (!wanted(level)) {
+    return;
+  }
+
+  if (L.async) {
+    enqueue(level, file, line, fmt, ap, suppressed);
+    return;
+  }
+
+  lock();
+
+  if (suppressed) {
+    length = vsnprintf(message, sizeof(message), fmt, ap);
+    if (length >= 0 && length < sizeof(message)) {
+      snprintf(message + length, sizeof(message) - length,
+               " (%u similar messages suppressed)", suppressed);
     }
+    Record record = { .level = level, .file = file, .line = line,
+                      .time = time(NULL), .thread = ev.thread };
+    dispatch_record(&record, "%s", message);
+  }
+  else {
+    dispatch(&ev, fmt, ap);
   }
 
   unlock();
 }
+
+
+void log_log(int level, const char *file, int line, const char *fmt, ...) {
+  va_list ap;
+
+  va_start(ap, fmt);
+  log_va(level, file, line, fmt, ap, 0);
+  va_end(ap);
+}
+
+
+// log_log with rate limiting per call site. The counters are updated
+// without locking; two threads racing on one site can at worst let an
+// extra message through or miscount by one.
+void log_log_site(log_Site *site, int level, const char *file, int line, const char *fmt, ...) {
+  va_list ap;
+  time_t now;
+  unsigned int suppressed = 0;
+
+  if (!wanted(level)) {
+    return;
+  }
+
+  now = time(NULL);
+  if (now - site->window_start >= LOG_RATE_INTERVAL) {
+    suppressed = site->suppressed;
+    site->window_start = now;
+    site->count = 0;
+    site->suppressed = 0;
+  }
+
+  if (++site->count > LOG_RATE_BURST) {
+    site->suppressed++;
+    return;
+  }
+
+  va_start(ap, fmt);
+  log_va(level, file, line, fmt, ap, suppressed);
+  va_end(ap);
+}
@@ -1,4 +1,15 @@
 #include "capture.h"
+#include "privacymask.h"
+#include "encoderroi.h"
+#include "audioencoder.h"
+#include "events.h"
+#include "talkback.h"
+#include "nightvision.h"
+#include "motion.h"
+#include "adaptiverate.h"
+#include "trace.h"
+#include "calibration.h"
+#include "plan.h"
 
 /* volatile might be necessary depending on the system/implementation in use. 
 (see "C11 draft standard n1570: 5.1.2.3") */
@@ -7,6 +18,10 @@ volatile sig_atomic_t sigint_received = 0;
 pthread_mutex_t log_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_mutex_t frame_generator_mutex; 
 
+// Set by --plan: the configuration is loaded and checked, but nothing is
+// set up in the IMP SDK
+static int plan_only = 0;
+
 snd_pcm_t *pcm_handle;
 
 
@@ -22,6 +37,13 @@ void sigint_handler(int sig_num)
   fflush(stdout); 
 }
 
+/* Signal Handler for SIGUSR1, starts and stops tracing */
+void sigusr1_handler(int sig_num)
+{
+  signal(SIGUSR1, sigusr1_handler);
+  trace_request_toggle();
+}
+
 
 void setup_framesource(FrameSource *framesource)
 {
@@ -69,6 +91,12 @@ int setup_encoder(EncoderSetting *encoder_setting)
 {
   int ret;
 
+  // The output thread reads a recording instead of this channel
+  if (encoder_setting->replay_file[0] != '\0') {
+    log_info("Encoder channel %d replays %s", encoder_setting->channel, encoder_setting->replay_file);
+    return 0;
+  }
+
   log_info("Encoder channel attributes for channel %d", encoder_setting->channel);
   print_encoder_channel_attributes(&encoder_setting->chn_attr);
 
@@ -111,19 +139,31 @@ int load_framesources(cJSON *json, CameraConfig *camera_config)
   camera_config->num_framesources = cJSON_GetArraySize(json_framesources);
   log_info("Found %d frame source(s).", camera_config->num_framesources);
 
+  if (camera_config->num_framesources > MAX_FRAMESOURCES) {
+    log_error("Only %d frame sources are supported", MAX_FRAMESOURCES);
+    camera_config->num_framesources = 0;
+    return -1;
+  }
+
   for (i = 0; i < camera_config->num_framesources; ++i) {
     json_stream = cJSON_DetachItemFromArray(json_framesources, 0);
     
     if( populate_framesource(&camera_config->frame_sources[i], json_stream) != 0) {
       log_error("Error parsing frame_sources[%d].", i);
       cJSON_Delete(json_stream);
+      // Only the entries parsed so far are valid
+      camera_config->num_framesources = i;
       return -1;
     }
     print_framesource(&camera_config->frame_sources[i]);
-    setup_framesource(&camera_config->frame_sources[i]);
+    if (!plan_only) {
+      setup_framesource(&camera_config->frame_sources[i]);
+    }
 
     cJSON_Delete(json_stream);
   }
+
+  return 0;
 }
 
 int load_encoders(cJSON *json, CameraConfig *camera_config)
@@ -143,20 +183,30 @@ int load_encoders(cJSON *json, CameraConfig *camera_config)
   camera_config->num_encoders = cJSON_GetArraySize(json_encoders);
   log_info("Found %d encoders.", camera_config->num_encoders);
 
+  if (camera_config->num_encoders > MAX_ENCODERS) {
+    log_error("Only %d encoders are supported", MAX_ENCODERS);
+    camera_config->num_encoders = 0;
+    return -1;
+  }
+
   for (i = 0; i < camera_config->num_encoders; ++i) {
     json_stream = cJSON_DetachItemFromArray(json_encoders, 0);
     
     if( populate_encoder(&camera_config->encoders[i], json_stream) != 0) {
       log_error("Error parsing encoders[%d].", i);
       cJSON_Delete(json_stream);
+      camera_config->num_encoders = i;
       return -1;
     }
     print_encoder(&camera_config->encoders[i]);
-    setup_encoder(&camera_config->encoders[i]);
+    if (!plan_only) {
+      setup_encoder(&camera_config->encoders[i]);
+    }
 
     cJSON_Delete(json_stream);
   }
 
+  return 0;
 }
 
 
@@ -184,6 +234,16 @@ int load_encoders(cJSON *json, CameraConfig *camera_config)
   Encoder:
     { DEV_ID_ENC, Encoding Group (0 to 5), IMP_Encoder_GetStream Channel (0 to 5) };
 */
+// Without motion results adaptive rate would see a quiet scene forever
+// and the encoder ROIs would never follow motion, so they go too
+static void disable_motion_detection(CameraConfig *camera_config)
+{
+  log_warn("Motion detection could not be set up, it stays off%s",
+           camera_config->adaptive_rate.enabled ? " and so does adaptive_rate" : "");
+  camera_config->motion.enabled = 0;
+  camera_config->adaptive_rate.enabled = 0;
+}
+
 int setup_binding(Binding *binding)
 {
   int ret;
@@ -226,20 +286,213 @@ int load_bindings(cJSON *json, CameraConfig *camera_config)
   camera_config->num_bindings = cJSON_GetArraySize(json_bindings);
   log_info("Found %d bindings.", camera_config->num_bindings);
 
+  if (camera_config->num_bindings > MAX_BINDINGS) {
+    log_error("Only %d bindings are supported", MAX_BINDINGS);
+    camera_config->num_bindings = 0;
+    return -1;
+  }
+
   for (i = 0; i < camera_config->num_bindings; ++i) {
     json_stream = cJSON_DetachItemFromArray(json_bindings, 0);
     
     if( populate_binding(&camera_config->bindings[i], json_stream) != 0) {
       log_error("Error parsing num_bindings[%d].", i);
       cJSON_Delete(json_stream);
+      camera_config->num_bindings = i;
       return -1;
     }
+    cJSON_Delete(json_stream);
+  }
+
+  // Motion detection inserts the IVS group into the bindings
+  if (add_motion_binding(camera_config) != 0) {
+    disable_motion_detection(camera_config);
+  }
+
+  for (i = 0; i < camera_config->num_bindings; ++i) {
     print_binding(&camera_config->bindings[i]);
+    if (plan_only) {
+      continue;
+    }
+
+    // A group of replayed channels is never created, see setup_encoder
+    if (camera_config->bindings[i].target.device == DEV_ID_ENC &&
+        plan_encoder_group_replayed(camera_config, camera_config->bindings[i].target.group)) {
+      log_info("Skipping bindings[%d], encoder group %d only replays recordings",
+               i, camera_config->bindings[i].target.group);
+      continue;
+    }
     setup_binding(&camera_config->bindings[i]);
-    cJSON_Delete(json_stream);
   }
+
+  return 0;
+}
+
+/*
+  OSD groups sit between a frame source and the encoders. Group 0 is always
+  created because the timestamp is drawn on it. It is started together with
+  the timestamp region, the other groups are started here.
+*/
+int load_osds(cJSON *json, CameraConfig *camera_config)
+{
+  int i, ret;
+  int num_osds;
+  cJSON *json_osd;
+  cJSON *json_osds;
+  cJSON *group;
+
+  log_info("Loading OSD groups");
+
+  camera_config->osd_groups[0] = 0;
+  camera_config->num_osd_groups = 1;
+
+  json_osds = cJSON_GetObjectItemCaseSensitive(json, "osds");
+  num_osds = 0;
+  if (json_osds != NULL) {
+    num_osds = cJSON_GetArraySize(json_osds);
+  }
+
+  for (i = 0; i < num_osds; ++i) {
+    json_osd = cJSON_GetArrayItem(json_osds, i);
+    group = cJSON_GetObjectItemCaseSensitive(json_osd, "group");
+
+    if (group == NULL) {
+      log_error("Attribute group must be defined for osds[%d]", i);
+      return -1;
+    }
+
+    if (group->valueint == 0) {
+      continue;
+    }
+
+    if (camera_config->num_osd_groups >= MAX_OSD_GROUPS) {
+      log_error("Only %d OSD groups are supported", MAX_OSD_GROUPS);
+      return -1;
+    }
+
+    camera_config->osd_groups[camera_config->num_osd_groups++] = group->valueint;
+  }
+
+  if (plan_only) {
+    return 0;
+  }
+
+  for (i = 0; i < camera_config->num_osd_groups; ++i) {
+    ret = IMP_OSD_CreateGroup(camera_config->osd_groups[i]);
+    if (ret < 0) {
+      log_error("IMP_OSD_CreateGroup(%d) failed", camera_config->osd_groups[i]);
+      return -1;
+    }
+    log_info("Created OSD group %d", camera_config->osd_groups[i]);
+
+    if (camera_config->osd_groups[i] != 0) {
+      ret = IMP_OSD_Start(camera_config->osd_groups[i]);
+      if (ret < 0) {
+        log_error("IMP_OSD_Start(%d) failed", camera_config->osd_groups[i]);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+int load_audio_settings(cJSON *json, CameraConfig *camera_config)
+{
+  cJSON *json_audio;
+
+  log_info("Loading audio settings");
+
+  // The audio section is optional
+  json_audio = cJSON_GetObjectItemCaseSensitive(json, "audio");
+
+  if (populate_audio_settings(&camera_config->audio, json_audio) != 0) {
+    log_error("Error parsing audio settings.");
+    return -1;
+  }
+  print_audio_settings(&camera_config->audio);
+
+  return 0;
+}
+
+int load_night_vision_settings(cJSON *json, CameraConfig *camera_config)
+{
+  cJSON *json_night_vision;
+
+  log_info("Loading night vision settings");
+
+  // The night_vision section is optional
+  json_night_vision = cJSON_GetObjectItemCaseSensitive(json, "night_vision");
+
+  if (populate_night_vision_settings(&camera_config->night_vision, json_night_vision) != 0) {
+    log_error("Error parsing night vision settings.");
+    return -1;
+  }
+  print_night_vision_settings(&camera_config->night_vision);
+
+  return 0;
+}
+
+int load_motion_settings(cJSON *json, CameraConfig *camera_config)
+{
+  cJSON *json_motion;
+
+  log_info("Loading motion settings");
+
+  // The motion section is optional
+  json_motion = cJSON_GetObjectItemCaseSensitive(json, "motion");
+
+  if (populate_motion_settings(&camera_config->motion, json_motion) != 0) {
+    log_error("Error parsing motion settings.");
+    return -1;
+  }
+  print_motion_settings(&camera_config->motion);
+
+  return 0;
+}
+
+int load_adaptive_rate_settings(cJSON *json, CameraConfig *camera_config)
+{
+  cJSON *json_adaptive_rate;
+
+  log_info("Loading adaptive rate settings");
+
+  // The adaptive_rate section is optional
+  json_adaptive_rate = cJSON_GetObjectItemCaseSensitive(json, "adaptive_rate");
+
+  if (populate_adaptive_rate_settings(&camera_config->adaptive_rate, json_adaptive_rate) != 0) {
+    log_error("Error parsing adaptive rate settings.");
+    return -1;
+  }
+  print_adaptive_rate_settings(&camera_config->adaptive_rate);
+
+  if (camera_config->adaptive_rate.enabled && !camera_config->motion.enabled) {
+    log_warn("adaptive_rate needs motion detection, it stays off");
+    camera_config->adaptive_rate.enabled = 0;
+  }
+
+  return 0;
 }
 
+int load_calibration_settings(cJSON *json, CameraConfig *camera_config)
+{
+  cJSON *json_calibration;
+
+  log_info("Loading calibration settings");
+
+  // The calibration section is optional
+  json_calibration = cJSON_GetObjectItemCaseSensitive(json, "calibration");
+
+  if (populate_calibration_settings(&camera_config->calibration, json_calibration) != 0) {
+    log_error("Error parsing calibration settings.");
+    return -1;
+  }
+  print_calibration_settings(&camera_config->calibration);
+
+  return 0;
+}
+
+
 int load_general_settings(cJSON *json, CameraConfig *camera_config)
 {
   int i;
@@ -261,6 +514,8 @@ int load_general_settings(cJSON *json, CameraConfig *camera_config)
   cJSON *timestamp_24h = cJSON_GetObjectItemCaseSensitive(json_general_settings, "timestamp_24h");
   cJSON *timestamp_location = cJSON_GetObjectItemCaseSensitive(json_general_settings, "timestamp_location");
   cJSON *enable_audio = cJSON_GetObjectItemCaseSensitive(json_general_settings, "enable_audio");
+  cJSON *show_perf_hud = cJSON_GetObjectItemCaseSensitive(json_general_settings, "show_perf_hud");
+  cJSON *perf_hud_location = cJSON_GetObjectItemCaseSensitive(json_general_settings, "perf_hud_location");
 
   camera_config->flip_vertical = flip_vertical->valueint;
   camera_config->flip_horizontal = flip_horizontal->valueint;
@@ -281,6 +536,17 @@ int load_general_settings(cJSON *json, CameraConfig *camera_config)
     camera_config->enable_audio = enable_audio->valueint;
   }
 
+  camera_config->show_perf_hud = 0;
+  if (show_perf_hud) {
+    camera_config->show_perf_hud = show_perf_hud->valueint;
+  }
+
+  // Bottom left, out of the way of the default timestamp location
+  camera_config->perf_hud_location = 2;
+  if (perf_hud_location) {
+    camera_config->perf_hud_location = perf_hud_location->valueint;
+  }
+
 
   print_general_settings(camera_config);
 
@@ -288,12 +554,67 @@ int load_general_settings(cJSON *json, CameraConfig *camera_config)
 }
   
 
-void load_configuration(cJSON *json, CameraConfig *camera_config)
+typedef int (*ConfigLoader)(cJSON *json, CameraConfig *camera_config);
+
+// Returns the number of sections that failed to load. Startup stops at the
+// first one since the SDK is already set up from the earlier sections, a
+// plan loads the rest too so it can report all of them.
+int load_configuration(cJSON *json, CameraConfig *camera_config)
 {
-  load_general_settings(json, camera_config);
-  load_framesources(json, camera_config);
-  load_encoders(json, camera_config);
-  load_bindings(json, camera_config);
+  int i;
+  int errors = 0;
+  // In this order, later sections refer to the earlier ones
+  ConfigLoader loaders[] = {
+    load_general_settings,
+    load_audio_settings,
+    load_night_vision_settings,
+    load_motion_settings,
+    load_adaptive_rate_settings,
+    load_calibration_settings,
+    load_framesources,
+    load_encoders,
+    load_osds,
+    load_bindings,
+  };
+
+  for (i = 0; i < sizeof(loaders) / sizeof(loaders[0]); i++) {
+    if (loaders[i](json, camera_config) != 0) {
+      errors++;
+      if (!plan_only) {
+        return errors;
+      }
+    }
+  }
+
+  log_info("Loading privacy masks");
+  if (load_privacy_masks(json, camera_config->privacy_masks, &camera_config->num_privacy_masks) != 0) {
+    errors++;
+    if (!plan_only) {
+      return errors;
+    }
+  }
+  else if (!plan_only) {
+    setup_privacy_masks(camera_config);
+  }
+
+  log_info("Loading encoder ROIs");
+  if (load_encoder_rois(json, camera_config->encoder_rois, &camera_config->num_encoder_rois) != 0) {
+    errors++;
+    if (!plan_only) {
+      return errors;
+    }
+  }
+  else if (!plan_only) {
+    setup_encoder_rois(camera_config);
+  }
+
+  // The HUD is optional, without its region the thread is not started
+  if (camera_config->show_perf_hud && !plan_only && initialize_perf_hud(camera_config) != 0) {
+    log_warn("Performance HUD disabled");
+    camera_config->show_perf_hud = 0;
+  }
+
+  return errors;
 }
 
 
@@ -316,16 +637,57 @@ void start_frame_producer_threads(CameraConfig *camera_config)
   EncoderThreadParams encoder_thread_params[MAX_ENCODERS];
 
   pthread_t audio_thread_id;
+  pthread_t audio_playback_thread_id;
+  pthread_t talkback_receive_thread_id;
+  pthread_t talkback_playback_thread_id;
   pthread_t timestamp_osd_thread_id;
   pthread_t night_vision_thread_id;
+  pthread_t privacy_mask_thread_id;
+  pthread_t encoder_roi_thread_id;
+  pthread_t perf_hud_thread_id;
+  pthread_t events_thread_id;
+  pthread_t motion_thread_id;
+  pthread_t adaptive_rate_thread_id;
+  pthread_t trace_thread_id;
+  pthread_t calibration_thread_id;
+
+
+  log_info("Starting trace thread");
+  ret = pthread_create(&trace_thread_id, NULL, trace_entry_start, NULL);
+  if (ret < 0) {
+    log_error("Error creating trace thread");
+  }
 
+  log_info("Starting events thread");
+  ret = pthread_create(&events_thread_id, NULL, events_entry_start, NULL);
+  if (ret < 0) {
+    log_error("Error creating events thread");
+  }
 
   if(camera_config->enable_audio) {
     log_info("Starting audio thread");
-    ret = pthread_create(&audio_thread_id, NULL, audio_thread_entry_start, NULL);
+    ret = pthread_create(&audio_thread_id, NULL, audio_thread_entry_start, camera_config);
     if (ret < 0) {
       log_error("Error creating audio thread");
     }
+
+    ret = pthread_create(&audio_playback_thread_id, NULL, audio_playback_entry_start, camera_config);
+    if (ret < 0) {
+      log_error("Error creating audio playback thread");
+    }
+
+    if (camera_config->audio.talkback) {
+      log_info("Starting talkback threads");
+      ret = pthread_create(&talkback_receive_thread_id, NULL, talkback_receive_entry_start, camera_config);
+      if (ret < 0) {
+        log_error("Error creating talkback receive thread");
+      }
+
+      ret = pthread_create(&talkback_playback_thread_id, NULL, talkback_playback_entry_start, camera_config);
+      if (ret < 0) {
+        log_error("Error creating talkback playback thread");
+      }
+    }
   }
 
   log_info("Starting timestamp OSD thread");
@@ -341,6 +703,55 @@ void start_frame_producer_threads(CameraConfig *camera_config)
   }
 
 
+  log_info("Starting privacy mask thread");
+  ret = pthread_create(&privacy_mask_thread_id, NULL, privacy_mask_entry_start, camera_config);
+  if (ret < 0) {
+    log_error("Error creating privacy mask thread");
+  }
+
+  log_info("Starting encoder ROI thread");
+  ret = pthread_create(&encoder_roi_thread_id, NULL, encoder_roi_entry_start, camera_config);
+  if (ret < 0) {
+    log_error("Error creating encoder ROI thread");
+  }
+
+
+  if (camera_config->motion.enabled) {
+    log_info("Starting motion thread");
+    ret = pthread_create(&motion_thread_id, NULL, motion_entry_start, camera_config);
+    if (ret < 0) {
+      log_error("Error creating motion thread");
+    }
+  }
+
+
+  if (camera_config->adaptive_rate.enabled) {
+    log_info("Starting adaptive rate thread");
+    ret = pthread_create(&adaptive_rate_thread_id, NULL, adaptive_rate_entry_start, camera_config);
+    if (ret < 0) {
+      log_error("Error creating adaptive rate thread");
+    }
+  }
+
+
+  if (camera_config->show_perf_hud) {
+    log_info("Starting performance HUD thread");
+    ret = pthread_create(&perf_hud_thread_id, NULL, perf_hud_entry_start, camera_config);
+    if (ret < 0) {
+      log_error("Error creating performance HUD thread");
+    }
+  }
+
+
+  if (camera_config->calibration.enabled) {
+    log_info("Starting calibration thread");
+    ret = pthread_create(&calibration_thread_id, NULL, calibration_entry_start, camera_config);
+    if (ret < 0) {
+      log_error("Error creating calibration thread");
+    }
+  }
+
+
   log_info("Starting frame producer threads for each encoder");
 
   for (i = 0; i < camera_config->num_encoders; i++) {
@@ -432,22 +843,39 @@ int main(int argc, const char *argv[])
 
 
 
-  if (argc != 2) {
-    printf("./videocapture <json config file>\n");
+  if (argc == 3 && strcmp(argv[1], "--plan") == 0) {
+    plan_only = 1;
+  }
+  else if (argc != 2) {
+    printf("./videocapture [--plan] <json config file>\n");
     return -1;
   }
 
   signal(SIGINT, sigint_handler);
+  signal(SIGUSR1, sigusr1_handler);
+  // Readers of the audio FIFO can go away at any time, handle that as a
+  // write error instead of being killed.
+  signal(SIGPIPE, SIG_IGN);
 
 
-  // Configure logging
-  log_set_level(LOGC_INFO);
+  // Configure logging, a plan only shows the problems in loading
+  log_set_level(plan_only ? LOGC_WARN : LOGC_INFO);
   log_set_lock(lock_callback, &log_mutex);
   log_init_syslog();
+
+  // From here on log calls only queue their lines for a writer thread.
+  // Every way out, including the exit() calls in the setup code, has to
+  // write out what is queued, or the error that caused it is lost.
+  if (log_start_async() != 0) {
+    log_warn("Unable to start the log writer, logging synchronously");
+  }
+  else {
+    atexit(log_stop_async);
+  }
   
 
   // Reading the JSON file into memory  
-  r = strcpy(filename, argv[1]);
+  r = strcpy(filename, argv[argc - 1]);
   if (r == NULL) {
     log_error("Error copying json config path.");
     return -1;
@@ -482,10 +910,8 @@ int main(int argc, const char *argv[])
   }
   fclose(fp);
 
-  initialize_sensor(&sensor_info);
-
-  if(camera_config.enable_audio) {
-    initialize_audio();
+  if (!plan_only) {
+    initialize_sensor(&sensor_info);
   }
 
   // Parsing the JSON file
@@ -503,20 +929,50 @@ int main(int argc, const char *argv[])
     return -1;
   }
 
+  if (plan_only) {
+    memset(&camera_config, 0, sizeof(CameraConfig));
+    ret = load_configuration(json, &camera_config);
+
+    // Let the queued log lines out before the report
+    log_stop_async();
+    ret = plan_configuration(&camera_config, ret);
+
+    free(file_contents);
+    cJSON_Delete(json);
+    return ret == 0 ? 0 : 1;
+  }
+
   ret = IMP_IVS_CreateGroup(0);
   if (ret < 0) {
     log_error("IMP_IVS_CreateGroup failed.");
     return -1;
   }
 
-  ret = IMP_OSD_CreateGroup(0);
-  if (ret < 0) {
-    log_error("IMP_OSD_CreateGroup(0) failed");
+  if (load_configuration(json, &camera_config) != 0) {
+    log_error("Unable to load the configuration in %s", filename);
+    sensor_cleanup(&sensor_info);
+    free(file_contents);
+    cJSON_Delete(json);
     return -1;
   }
-  
-  load_configuration(json, &camera_config);
+  snprintf(camera_config.calibration.settings_file, sizeof(camera_config.calibration.settings_file), "%s", filename);
+  initialize_events(EVENT_SOCKET_PATH);
+
+  // enable_audio comes from the configuration, so this has to wait for it
+  if(camera_config.enable_audio) {
+    initialize_audio(&camera_config.audio);
+    initialize_audio_encoder(&camera_config.audio);
+
+    // AEC is attached to the running AI channel, so this goes after it
+    if (camera_config.audio.talkback) {
+      initialize_talkback(&camera_config.audio);
+    }
+  }
+
   configure_video_tuning_parameters(&camera_config);
+  if (initialize_motion_detection(&camera_config) != 0) {
+    disable_motion_detection(&camera_config);
+  }
   enable_framesources(&camera_config);
 
 
@@ -541,6 +997,5 @@ err:
   cJSON_Delete(json);
   pthread_mutex_destroy(&frame_generator_mutex); 
 
-
   return 0;
 }
@@ -0,0 +1,433 @@
+#include "capture.h"
+#include "motion.h"
+#include "events.h"
+#include "blockmotion.h"
+#include <imp_ivs.h>
+#include <imp_ivs_move.h>
+
+/*
+
+Motion detection, either with the IVS move algorithm or in software.
+
+The IVS group sits between the low resolution frame source and whatever
+that frame source was bound to, as in the Ingenic reference design, so it
+sees the frames before any OSD is drawn on them. Each ROI from the motion
+section gets its own result; the thread turns those into start / stop
+events per ROI on the event socket.
+
+The software method takes NV12 frames straight from the frame source at
+a few fps and runs the block SAD detector in blockmotion.c on the luma
+plane. It needs no IVS group, and besides the per-ROI events it leaves a
+per-cell activity map in MOTION_MAP_FILE.
+
+src/sim/ivs_sim.c replaces the IVS calls with scripted results so this
+file can be run on a host.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+MotionStatus motion_status;
+
+static IMPIVSInterface *move_interface = NULL;
+
+static BlockMotion block_motion;
+static int block_motion_ready = 0;
+static IMPRect roi_rects[MAX_MOTION_ROIS];
+static uint32_t last_motion[MAX_MOTION_ROIS];
+static uint32_t motion_started[MAX_MOTION_ROIS];
+
+
+static uint32_t monotonic_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+
+// Put the IVS group behind the motion frame source: the frame source is
+// bound to IVS, and everything that was bound to the frame source is
+// bound to IVS instead. Called before the bindings are set up.
+int add_motion_binding(CameraConfig *camera_config)
+{
+  int i;
+  int fs_output = 0;
+  Binding *binding;
+
+  if (!camera_config->motion.enabled || camera_config->motion.method != MOTION_METHOD_IVS) {
+    return 0;
+  }
+
+  if (camera_config->num_bindings >= MAX_BINDINGS) {
+    log_error("No room for the motion detection binding");
+    return -1;
+  }
+
+  for (i = 0; i < camera_config->num_bindings; i++) {
+    binding = &camera_config->bindings[i];
+
+    if (binding->source.device == DEV_ID_FS && binding->source.group == camera_config->motion.framesource) {
+      fs_output = binding->source.output;
+      binding->source.device = DEV_ID_IVS;
+      binding->source.group = MOTION_IVS_GROUP;
+      binding->source.output = 0;
+    }
+  }
+
+  // The frame source to IVS binding has to be made first
+  memmove(&camera_config->bindings[1], &camera_config->bindings[0],
+          camera_config->num_bindings * sizeof(Binding));
+  camera_config->num_bindings++;
+
+  binding = &camera_config->bindings[0];
+  memset(binding, 0, sizeof(Binding));
+  binding->source.device = DEV_ID_FS;
+  binding->source.group = camera_config->motion.framesource;
+  binding->source.output = fs_output;
+  binding->target.device = DEV_ID_IVS;
+  binding->target.group = MOTION_IVS_GROUP;
+  binding->target.output = 0;
+
+  log_info("Motion detection: IVS group %d bound behind frame source %d",
+           MOTION_IVS_GROUP, camera_config->motion.framesource);
+
+  return 0;
+}
+
+
+// Scale a ROI from sensor coordinates to the frame source resolution
+static void motion_roi_rect(MotionRoi *roi, int width, int height, IMPRect *rect)
+{
+  int x0, y0, x1, y1;
+
+  x0 = roi->x * width / SENSOR_WIDTH;
+  y0 = roi->y * height / SENSOR_HEIGHT;
+  x1 = (roi->x + roi->width) * width / SENSOR_WIDTH;
+  y1 = (roi->y + roi->height) * height / SENSOR_HEIGHT;
+
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > width) x1 = width;
+  if (y1 > height) y1 = height;
+
+  // p1 is inclusive
+  rect->p0.x = x0;
+  rect->p0.y = y0;
+  rect->p1.x = x1 - 1;
+  rect->p1.y = y1 - 1;
+}
+
+
+static int initialize_ivs_motion(MotionSettings *motion, int width, int height)
+{
+  int ret, i;
+  IMP_IVS_MoveParam move_param;
+
+  memset(&move_param, 0, sizeof(IMP_IVS_MoveParam));
+  move_param.skipFrameCnt = motion->skip_frames;
+  move_param.frameInfo.width = width;
+  move_param.frameInfo.height = height;
+
+  move_param.roiRectCnt = motion->num_rois;
+  for (i = 0; i < motion->num_rois; i++) {
+    move_param.sense[i] = motion->rois[i].sensitivity;
+    move_param.roiRect[i] = roi_rects[i];
+  }
+
+  move_interface = IMP_IVS_CreateMoveInterface(&move_param);
+  if (move_interface == NULL) {
+    log_error("IMP_IVS_CreateMoveInterface failed");
+    return -1;
+  }
+
+  ret = IMP_IVS_CreateChn(MOTION_IVS_CHANNEL, move_interface);
+  if (ret < 0) {
+    log_error("IMP_IVS_CreateChn(%d) failed", MOTION_IVS_CHANNEL);
+    return -1;
+  }
+
+  ret = IMP_IVS_RegisterChn(MOTION_IVS_GROUP, MOTION_IVS_CHANNEL);
+  if (ret < 0) {
+    log_error("IMP_IVS_RegisterChn(%d, %d) failed", MOTION_IVS_GROUP, MOTION_IVS_CHANNEL);
+    return -1;
+  }
+
+  ret = IMP_IVS_StartRecvPic(MOTION_IVS_CHANNEL);
+  if (ret < 0) {
+    log_error("IMP_IVS_StartRecvPic(%d) failed", MOTION_IVS_CHANNEL);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static int initialize_software_motion(MotionSettings *motion, int width, int height)
+{
+  int ret;
+
+  ret = block_motion_init(&block_motion, width, height, motion->cell_size,
+                          motion->threshold, motion->learn_interval);
+  if (ret < 0) {
+    log_error("Unable to set up %dx%d software motion detection with %d pixel cells",
+              width, height, motion->cell_size);
+    return -1;
+  }
+
+  // Frames can only be taken from a frame source with a depth set
+  ret = IMP_FrameSource_SetFrameDepth(motion->framesource, MOTION_FRAME_DEPTH);
+  if (ret < 0) {
+    log_error("IMP_FrameSource_SetFrameDepth(%d) failed", motion->framesource);
+    block_motion_free(&block_motion);
+    return -1;
+  }
+
+  block_motion_ready = 1;
+  log_info("Software motion detection: %dx%d cells, %s kernel",
+           block_motion.cells_x, block_motion.cells_y, block_motion_kernel_name());
+
+  return 0;
+}
+
+
+int initialize_motion_detection(CameraConfig *camera_config)
+{
+  int i;
+  int width = 0, height = 0;
+  MotionSettings *motion = &camera_config->motion;
+
+  if (!motion->enabled) {
+    return 0;
+  }
+
+  for (i = 0; i < camera_config->num_framesources; i++) {
+    if (camera_config->frame_sources[i].id == motion->framesource) {
+      width = camera_config->frame_sources[i].pic_width;
+      height = camera_config->frame_sources[i].pic_height;
+    }
+  }
+
+  if (width == 0 || height == 0) {
+    log_error("Motion detection frame source %d not found", motion->framesource);
+    return -1;
+  }
+
+  // Without any ROIs the whole picture is one ROI
+  if (motion->num_rois == 0) {
+    motion->rois[0].x = 0;
+    motion->rois[0].y = 0;
+    motion->rois[0].width = SENSOR_WIDTH;
+    motion->rois[0].height = SENSOR_HEIGHT;
+    motion->rois[0].sensitivity = 3;
+    motion->num_rois = 1;
+  }
+
+  for (i = 0; i < motion->num_rois; i++) {
+    motion_roi_rect(&motion->rois[i], width, height, &roi_rects[i]);
+
+    log_info("Motion ROI %d: (%d,%d)-(%d,%d) sensitivity %d", i,
+             roi_rects[i].p0.x, roi_rects[i].p0.y,
+             roi_rects[i].p1.x, roi_rects[i].p1.y,
+             motion->rois[i].sensitivity);
+  }
+
+  if (motion->method == MOTION_METHOD_SOFTWARE) {
+    return initialize_software_motion(motion, width, height);
+  }
+
+  return initialize_ivs_motion(motion, width, height);
+}
+
+
+// Turn the ROIs with motion in this detection into start / stop events.
+// Called after every detection and every timeout.
+static void report_motion(MotionSettings *motion, uint32_t roi_motion, uint32_t now)
+{
+  int i;
+
+  for (i = 0; i < motion->num_rois; i++) {
+    if (roi_motion & (1 << i)) {
+      last_motion[i] = now;
+
+      if (!(motion_status.active_rois & (1 << i))) {
+        motion_started[i] = now;
+        motion_status.active_rois |= 1 << i;
+        publish_event("motion", "\"roi\":%d,\"state\":\"start\"", i);
+      }
+    }
+    else if ((motion_status.active_rois & (1 << i)) && now - last_motion[i] >= motion->hold_ms) {
+      motion_status.active_rois &= ~(1 << i);
+      publish_event("motion", "\"roi\":%d,\"state\":\"stop\",\"duration_ms\":%u",
+                    i, last_motion[i] - motion_started[i]);
+    }
+  }
+
+  if (roi_motion) {
+    motion_status.detections++;
+  }
+  motion_status.updated_ms = now;
+}
+
+
+// Bit n is set when ROI n has at least min_cells active cells. A cell
+// belongs to a ROI when its centre does.
+static uint32_t software_roi_motion(MotionSettings *motion)
+{
+  int i, cx, cy, centre_x, centre_y;
+  int cells[MAX_MOTION_ROIS] = { 0 };
+  uint32_t roi_motion = 0;
+  BlockMotion *bm = &block_motion;
+
+  if (bm->active_cells == 0) {
+    return 0;
+  }
+
+  for (cy = 0; cy < bm->cells_y; cy++) {
+    for (cx = 0; cx < bm->cells_x; cx++) {
+      if (bm->activity[cy * bm->cells_x + cx] <= bm->threshold) {
+        continue;
+      }
+
+      centre_x = cx * bm->cell_size + bm->cell_size / 2;
+      centre_y = cy * bm->cell_size + bm->cell_size / 2;
+
+      for (i = 0; i < motion->num_rois; i++) {
+        if (centre_x >= roi_rects[i].p0.x && centre_x <= roi_rects[i].p1.x &&
+            centre_y >= roi_rects[i].p0.y && centre_y <= roi_rects[i].p1.y) {
+          cells[i]++;
+        }
+      }
+    }
+  }
+
+  for (i = 0; i < motion->num_rois; i++) {
+    if (cells[i] >= motion->min_cells) {
+      roi_motion |= 1 << i;
+    }
+  }
+
+  return roi_motion;
+}
+
+
+// Replace MOTION_MAP_FILE, readers never see a partly written map
+static void write_motion_map(BlockMotion *bm)
+{
+  FILE *fp;
+  char temp_file[sizeof(MOTION_MAP_FILE) + 4];
+
+  snprintf(temp_file, sizeof(temp_file), "%s.tmp", MOTION_MAP_FILE);
+
+  fp = fopen(temp_file, "w");
+  if (fp == NULL) {
+    return;
+  }
+
+  fprintf(fp, "P5\n%d %d\n255\n", bm->cells_x, bm->cells_y);
+  fwrite(bm->activity, 1, bm->cells_x * bm->cells_y, fp);
+  fclose(fp);
+
+  rename(temp_file, MOTION_MAP_FILE);
+}
+
+
+static void software_motion_loop(MotionSettings *motion)
+{
+  int ret;
+  int map_written = 0;
+  uint32_t now, roi_motion;
+  IMPFrameInfo *frame;
+  struct timespec interval;
+
+  interval.tv_sec = 0;
+  interval.tv_nsec = (1000000000 / motion->fps) % 1000000000;
+  if (motion->fps == 1) {
+    interval.tv_sec = 1;
+  }
+
+  while(!sigint_received) {
+    nanosleep(&interval, NULL);
+
+    ret = IMP_FrameSource_GetFrame(motion->framesource, &frame);
+    if (ret < 0) {
+      log_error("IMP_FrameSource_GetFrame(%d) failed", motion->framesource);
+      continue;
+    }
+
+    // NV12 starts with the luma plane, one byte per pixel
+    block_motion_update(&block_motion, (const uint8_t *)frame->virAddr, frame->width);
+    IMP_FrameSource_ReleaseFrame(motion->framesource, frame);
+
+    now = monotonic_ms();
+    roi_motion = software_roi_motion(motion);
+    report_motion(motion, roi_motion, now);
+
+    // Keep the map current while anything moves, and write one more
+    // so it ends up empty
+    if (block_motion.active_cells > 0 || map_written) {
+      write_motion_map(&block_motion);
+    }
+    map_written = block_motion.active_cells > 0;
+  }
+
+  IMP_FrameSource_SetFrameDepth(motion->framesource, 0);
+  block_motion_free(&block_motion);
+}
+
+
+static void ivs_motion_loop(MotionSettings *motion)
+{
+  int ret, i;
+  uint32_t now, roi_motion;
+  IMP_IVS_MoveOutput *result;
+
+  while(!sigint_received) {
+    ret = IMP_IVS_PollingResult(MOTION_IVS_CHANNEL, motion->poll_interval_ms);
+    now = monotonic_ms();
+    roi_motion = 0;
+
+    if (ret == 0) {
+      ret = IMP_IVS_GetResult(MOTION_IVS_CHANNEL, (void **)&result);
+      if (ret < 0) {
+        log_error("IMP_IVS_GetResult failed");
+        continue;
+      }
+
+      for (i = 0; i < motion->num_rois; i++) {
+        if (result->retRoi[i]) {
+          roi_motion |= 1 << i;
+        }
+      }
+
+      IMP_IVS_ReleaseResult(MOTION_IVS_CHANNEL, (void *)result);
+    }
+
+    report_motion(motion, roi_motion, now);
+  }
+
+  IMP_IVS_StopRecvPic(MOTION_IVS_CHANNEL);
+  IMP_IVS_UnRegisterChn(MOTION_IVS_CHANNEL);
+  IMP_IVS_DestroyChn(MOTION_IVS_CHANNEL);
+  IMP_IVS_DestroyMoveInterface(move_interface);
+}
+
+
+// This is the entrypoint for the motion thread. The IVS method waits at
+// most poll_interval_ms for each result, so ROIs that went still are
+// reported on time even when no results arrive; the software method
+// looks at fps frames per second.
+void *motion_entry_start(void *motion_thread_params)
+{
+  CameraConfig *camera_config = (CameraConfig *)motion_thread_params;
+  MotionSettings *motion = &camera_config->motion;
+
+  if (block_motion_ready) {
+    software_motion_loop(motion);
+  }
+  else if (move_interface != NULL) {
+    ivs_motion_loop(motion);
+  }
+
+  return NULL;
+}
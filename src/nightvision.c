@@ -0,0 +1,263 @@
+#include "capture.h"
+#include "nightvision.h"
+#include "events.h"
+#include "trace.h"
+
+/*
+
+Automatic day / night switching from the ISP's own exposure figures.
+
+The brightness of the scene is judged by exposure time * total gain, which
+the AE raises as the light goes down. Night mode starts when it stays above
+night_ev, day mode returns when it stays below day_ev (lower, so the IR
+light switching on does not immediately flip it back) or when the white
+balance shows visible light again. Samples taken while the AE is still
+moving, and the settling time after each switch, are ignored.
+
+All of this runs in the videocapture process from values the IMP already
+has, nothing is forked. Scripts can still force a mode by writing 0 or 1
+to NIGHT_VISION_FILE. Every sample stats it and it is only read when its
+mtime changes; once it is removed the configured mode takes over again.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+
+void night_vision_init(NightVisionState *state, int night)
+{
+  memset(state, 0, sizeof(NightVisionState));
+  state->night = night;
+}
+
+
+// Feed one sample taken elapsed_ms after the previous one. Returns 1 when
+// the mode changes, state->night holds the new mode.
+int night_vision_update(NightVisionState *state, NightVisionSettings *settings,
+                        NightVisionSample *sample, uint32_t elapsed_ms)
+{
+  uint64_t ev;
+  uint32_t difference;
+  int night = state->night;
+
+  ev = ((uint64_t)sample->exposure_us * sample->total_gain) >> 8;
+  state->ev = ev > UINT32_MAX ? UINT32_MAX : ev;
+  state->wb_ratio = sample->bgain ? sample->rgain * 256 / sample->bgain : 0;
+
+  // The AE is still adapting to the last switch
+  if (state->hold_ms > elapsed_ms) {
+    state->hold_ms -= elapsed_ms;
+    state->last_ev = state->ev;
+    return 0;
+  }
+  state->hold_ms = 0;
+
+  // AE still converging, wait for it
+  difference = state->ev > state->last_ev ? state->ev - state->last_ev : state->last_ev - state->ev;
+  state->last_ev = state->ev;
+  if (state->ev == 0 || (uint64_t)difference * 100 > (uint64_t)state->ev * settings->jitter_percent) {
+    state->night_ms = 0;
+    state->day_ms = 0;
+    state->wb_ms = 0;
+    return 0;
+  }
+
+  if (!state->night) {
+    state->night_ms = state->ev > settings->night_ev ? state->night_ms + elapsed_ms : 0;
+
+    if (state->night_ms >= settings->night_delay_ms) {
+      night = 1;
+    }
+  }
+  else {
+    state->day_ms = state->ev < settings->day_ev ? state->day_ms + elapsed_ms : 0;
+    state->wb_ms = settings->day_wb_ratio && state->wb_ratio > settings->day_wb_ratio ?
+                   state->wb_ms + elapsed_ms : 0;
+
+    if (state->day_ms >= settings->day_delay_ms || state->wb_ms >= settings->day_delay_ms) {
+      night = 0;
+    }
+  }
+
+  if (night != state->night) {
+    state->night = night;
+    state->night_ms = 0;
+    state->day_ms = 0;
+    state->wb_ms = 0;
+    state->hold_ms = settings->switch_wait_ms;
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static int read_night_vision_sample(NightVisionSample *sample)
+{
+  IMPISPExpr expr;
+  IMPISPWB wb;
+
+  memset(&expr, 0, sizeof(IMPISPExpr));
+  memset(&wb, 0, sizeof(IMPISPWB));
+
+  if (IMP_ISP_Tuning_GetExpr(&expr) != 0 ||
+      IMP_ISP_Tuning_GetTotalGain(&sample->total_gain) != 0 ||
+      IMP_ISP_Tuning_GetWB(&wb) != 0) {
+    return -1;
+  }
+
+  sample->exposure_us = (uint32_t)expr.g_attr.integration_time * expr.g_attr.one_line_expr_in_us;
+  sample->rgain = wb.rgain;
+  sample->bgain = wb.bgain;
+
+  return 0;
+}
+
+
+static void set_night_vision(int night)
+{
+  int ret;
+  IMPISPRunningMode ispRunningMode = IMPISP_RUNNING_MODE_DAY;
+  IMPISPSceneMode ispSceneMode = IMPISP_SCENE_MODE_AUTO;
+  IMPISPColorfxMode ispColorMode = IMPISP_COLORFX_MODE_AUTO;
+
+  if (night) {
+    ispRunningMode = IMPISP_RUNNING_MODE_NIGHT;
+    ispSceneMode = IMPISP_SCENE_MODE_NIGHT;
+    ispColorMode = IMPISP_COLORFX_MODE_BW;
+  }
+
+  ret = IMP_ISP_Tuning_SetISPRunningMode(ispRunningMode);
+  if (ret) {
+    log_error("ERROR on SetISPRunningMode!");
+  }
+
+  ret = IMP_ISP_Tuning_SetSceneMode(ispSceneMode);
+  if (ret) {
+    log_error("ERROR on SetSceneMode!");
+  }
+
+  ret = IMP_ISP_Tuning_SetColorfxMode(ispColorMode);
+  if (ret) {
+    log_error("ERROR on SetColorfxMode!");
+  }
+}
+
+
+// Returns 0 or 1 from NIGHT_VISION_FILE, -1 when there is no override.
+// Only a stat() per sample, the file is read again when it changes.
+static int read_night_vision_override(void)
+{
+  static time_t last_modified = 0;
+  static ino_t last_inode = 0;
+  static int override = -1;
+  struct stat filestatus;
+  FILE *file;
+  int value;
+
+  if (stat(NIGHT_VISION_FILE, &filestatus) != 0) {
+    last_modified = 0;
+    override = -1;
+    return -1;
+  }
+
+  // mtime only has seconds, so a file changed within the last second or
+  // two may change again unnoticed and is read every time
+  if (filestatus.st_mtime == last_modified && filestatus.st_ino == last_inode &&
+      filestatus.st_mtime < time(NULL) - 1) {
+    return override;
+  }
+
+  file = fopen(NIGHT_VISION_FILE, "r");
+  if (file == NULL) {
+    return -1;
+  }
+
+  if (fscanf(file, "%d", &value) != 1 || value < 0) {
+    value = -1;
+  }
+  fclose(file);
+
+  // A file caught half written is read again with the next sample
+  if (value < 0) {
+    return -1;
+  }
+
+  last_modified = filestatus.st_mtime;
+  last_inode = filestatus.st_ino;
+  override = value != 0;
+
+  return override;
+}
+
+
+// This is the entrypoint for the night vision thread
+void *night_vision_entry_start(void *night_vision_thread_params)
+{
+  int ret, night, override;
+  int overridden = 0;
+  CameraConfig *camera_config = (CameraConfig *)night_vision_thread_params;
+  NightVisionSettings *settings = &camera_config->night_vision;
+  NightVisionState state;
+  NightVisionSample sample;
+  int read_errors = 0;
+  uint64_t trace_stage;
+
+  trace_thread_name("night vision");
+
+  // Auto starts in day mode
+  night_vision_init(&state, settings->mode == NIGHT_VISION_MODE_NIGHT);
+  set_night_vision(state.night);
+  log_info("Night Vision %s", state.night ? "ENABLED" : "DISABLED");
+
+  while(!sigint_received) {
+    usleep(settings->sample_interval_ms * 1000);
+
+    // The override file and the fixed modes go before the automatic one
+    override = read_night_vision_override();
+    if (override >= 0 || settings->mode != NIGHT_VISION_MODE_AUTO) {
+      night = override >= 0 ? override : settings->mode == NIGHT_VISION_MODE_NIGHT;
+
+      if (night != state.night || (override >= 0) != overridden) {
+        set_night_vision(night);
+        log_info("Night Vision %s (%s)", night ? "ENABLED" : "DISABLED",
+                 override >= 0 ? "set by " NIGHT_VISION_FILE : "configured mode");
+        publish_event("night_vision", "\"state\":\"%s\",\"override\":%d",
+                      night ? "night" : "day", override >= 0);
+      }
+      overridden = override >= 0;
+
+      // Auto carries on from this mode once the file is removed
+      night_vision_init(&state, night);
+      continue;
+    }
+    overridden = 0;
+
+    trace_stage = trace_begin();
+    ret = read_night_vision_sample(&sample);
+    trace_end("night vision sample", trace_stage);
+    if (ret != 0) {
+      if (read_errors++ == 0) {
+        log_error("Unable to read the ISP exposure for night vision");
+      }
+      continue;
+    }
+    read_errors = 0;
+
+    if (night_vision_update(&state, settings, &sample, settings->sample_interval_ms)) {
+      trace_stage = trace_begin();
+      set_night_vision(state.night);
+      trace_end("night vision switch", trace_stage);
+
+      log_info("Night Vision %s (ev %u, exposure %u us, gain %u, wb ratio %u)",
+               state.night ? "ENABLED" : "DISABLED", state.ev,
+               sample.exposure_us, sample.total_gain >> 8, state.wb_ratio);
+      publish_event("night_vision", "\"state\":\"%s\",\"ev\":%u,\"exposure_us\":%u,"
+                    "\"gain\":%u,\"wb_ratio\":%u",
+                    state.night ? "night" : "day", state.ev,
+                    sample.exposure_us, sample.total_gain >> 8, state.wb_ratio);
+    }
+  }
+
+  return NULL;
+}
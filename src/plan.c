@@ -0,0 +1,525 @@
+#include "capture.h"
+#include "plan.h"
+#include "motion.h"
+#include <stdarg.h>
+
+/*
+
+Dry run of a configuration: videocapture --plan settings.json parses the
+file like a normal start but sets nothing up in the IMP SDK, then checks
+the graph and prints what it would cost.
+
+Checks, each failure is an error and makes the run exit with 1:
+
+- frame source ids and encoder channels are unique, encoder groups and
+  channels are in the range the SDK has
+- every binding connects things that exist, and every encoder group is
+  fed from a frame source through its bindings
+- frame source outputs are bound in order, output 1 only after output 0
+- one resolution per encoder group, the one of the frame source feeding
+  it
+- the H.264 channels together stay within the encoder throughput
+
+Notes point out things that work but may not be meant, like a binding
+to an encoder group whose channels all replay recordings, which is
+skipped.
+
+Estimates:
+
+- DDR for the frame source buffers (NV12, buffer_size of them) and the
+  encoder stream buffers (buffer_size, or the SDK default of 1.5 times
+  the picture), compared with the rmem= reservation when the kernel
+  command line has one
+- bitrate of every channel, max_bitrate for H.264
+- macroblocks per second of the encoder
+- threads videocapture starts
+
+*/
+
+static int plan_errors;
+
+
+static void plan_error(const char *format, ...)
+{
+  va_list args;
+
+  printf("  error: ");
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+
+  plan_errors++;
+}
+
+
+static void plan_note(const char *format, ...)
+{
+  va_list args;
+
+  printf("  note: ");
+  va_start(args, format);
+  vprintf(format, args);
+  va_end(args);
+  printf("\n");
+}
+
+
+static FrameSource *find_framesource(CameraConfig *camera_config, int id)
+{
+  int i;
+
+  for (i = 0; i < camera_config->num_framesources; i++) {
+    if (camera_config->frame_sources[i].id == id) {
+      return &camera_config->frame_sources[i];
+    }
+  }
+
+  return NULL;
+}
+
+
+// Follow the bindings back from an encoder group to the frame source
+// feeding it, through OSD and IVS groups
+FrameSource *plan_encoder_framesource(CameraConfig *camera_config, EncoderSetting *encoder)
+{
+  int i, hops;
+  int device = DEV_ID_ENC;
+  int group = encoder->group;
+  Binding *binding;
+
+  for (hops = 0; hops < MAX_BINDINGS; hops++) {
+    for (i = 0; i < camera_config->num_bindings; i++) {
+      binding = &camera_config->bindings[i];
+      if (binding->target.device == device && binding->target.group == group) {
+        break;
+      }
+    }
+    if (i == camera_config->num_bindings) {
+      return NULL;
+    }
+
+    device = binding->source.device;
+    group = binding->source.group;
+
+    // IVS passes the frames of the motion frame source through unchanged
+    if (device == DEV_ID_IVS) {
+      device = DEV_ID_FS;
+      group = camera_config->motion.framesource;
+    }
+
+    if (device == DEV_ID_FS) {
+      return find_framesource(camera_config, group);
+    }
+  }
+
+  return NULL;
+}
+
+
+// Encoder groups whose channels all replay recordings are never created,
+// so nothing can be bound to them
+int plan_encoder_group_replayed(CameraConfig *camera_config, int group)
+{
+  int i;
+  int found = 0;
+
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    if (camera_config->encoders[i].group != group) {
+      continue;
+    }
+    if (camera_config->encoders[i].replay_file[0] == '\0') {
+      return 0;
+    }
+    found = 1;
+  }
+
+  return found;
+}
+
+
+static int has_osd_group(CameraConfig *camera_config, int group)
+{
+  int i;
+
+  for (i = 0; i < camera_config->num_osd_groups; i++) {
+    if (camera_config->osd_groups[i] == group) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static int has_encoder_group(CameraConfig *camera_config, int group)
+{
+  int i;
+
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    if (camera_config->encoders[i].group == group) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+static void check_binding_cell(CameraConfig *camera_config, int index, const char *end, BindingParameter *cell)
+{
+  switch (cell->device) {
+    case DEV_ID_FS:
+      if (find_framesource(camera_config, cell->group) == NULL) {
+        plan_error("bindings[%d] %s: there is no frame source %d", index, end, cell->group);
+      }
+      if (cell->output < 0 || cell->output >= PLAN_FS_OUTPUTS) {
+        plan_error("bindings[%d] %s: frame sources have outputs 0 and 1 only", index, end);
+      }
+      break;
+    case DEV_ID_OSD:
+      if (!has_osd_group(camera_config, cell->group)) {
+        plan_error("bindings[%d] %s: OSD group %d is not in osds", index, end, cell->group);
+      }
+      break;
+    case DEV_ID_IVS:
+      if (cell->group != MOTION_IVS_GROUP) {
+        plan_error("bindings[%d] %s: only IVS group %d is created", index, end, MOTION_IVS_GROUP);
+      }
+      break;
+    case DEV_ID_ENC:
+      if (!has_encoder_group(camera_config, cell->group)) {
+        plan_error("bindings[%d] %s: no encoder uses group %d", index, end, cell->group);
+      }
+      else if (plan_encoder_group_replayed(camera_config, cell->group)) {
+        plan_note("bindings[%d] %s: every channel of encoder group %d replays a recording, the binding is skipped",
+                  index, end, cell->group);
+      }
+      break;
+    default:
+      plan_error("bindings[%d] %s: unknown device %d", index, end, cell->device);
+  }
+}
+
+
+static void check_bindings(CameraConfig *camera_config)
+{
+  int i, j;
+  int bound[MAX_FRAMESOURCES][PLAN_FS_OUTPUTS];
+  Binding *binding;
+  FrameSource *framesource;
+
+  memset(bound, 0, sizeof(bound));
+
+  for (i = 0; i < camera_config->num_bindings; i++) {
+    binding = &camera_config->bindings[i];
+
+    check_binding_cell(camera_config, i, "source", &binding->source);
+    check_binding_cell(camera_config, i, "target", &binding->target);
+
+    if (binding->source.device == DEV_ID_ENC) {
+      plan_error("bindings[%d]: an encoder group can't be a source", i);
+    }
+    if (binding->target.device == DEV_ID_FS) {
+      plan_error("bindings[%d]: a frame source can't be a target", i);
+    }
+
+    // A group gets its frames from one place, so in one resolution
+    for (j = 0; j < i; j++) {
+      if (camera_config->bindings[j].target.device == binding->target.device &&
+          camera_config->bindings[j].target.group == binding->target.group) {
+        plan_error("bindings[%d]: group %d is already bound by bindings[%d]",
+                   i, binding->target.group, j);
+      }
+    }
+
+    if (binding->source.device != DEV_ID_FS || binding->source.output < 0 ||
+        binding->source.output >= PLAN_FS_OUTPUTS) {
+      continue;
+    }
+
+    framesource = find_framesource(camera_config, binding->source.group);
+    if (framesource == NULL) {
+      continue;
+    }
+
+    // The outputs of a frame source have to be bound in order
+    if (binding->source.output == 1 && !bound[framesource - camera_config->frame_sources][0]) {
+      plan_error("bindings[%d]: output 1 of frame source %d is bound before output 0",
+                 i, framesource->id);
+    }
+    bound[framesource - camera_config->frame_sources][binding->source.output] = 1;
+  }
+}
+
+
+static void check_framesources(CameraConfig *camera_config)
+{
+  int i, j;
+  FrameSource *framesource;
+
+  for (i = 0; i < camera_config->num_framesources; i++) {
+    framesource = &camera_config->frame_sources[i];
+
+    for (j = 0; j < i; j++) {
+      if (camera_config->frame_sources[j].id == framesource->id) {
+        plan_error("frame source %d is defined twice", framesource->id);
+      }
+    }
+    if (framesource->buffer_size < 1) {
+      plan_error("frame source %d: buffer_size has to be at least 1", framesource->id);
+    }
+    if (framesource->pic_width <= 0 || framesource->pic_height <= 0) {
+      plan_error("frame source %d: no picture size", framesource->id);
+    }
+  }
+}
+
+
+static void check_encoders(CameraConfig *camera_config)
+{
+  int i, j;
+  EncoderSetting *encoder, *other;
+  FrameSource *framesource;
+
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    encoder = &camera_config->encoders[i];
+
+    for (j = 0; j < i; j++) {
+      other = &camera_config->encoders[j];
+      if (other->channel == encoder->channel) {
+        plan_error("encoder channel %d is defined twice", encoder->channel);
+      }
+      if (other->group == encoder->group &&
+          (other->pic_width != encoder->pic_width || other->pic_height != encoder->pic_height)) {
+        plan_error("encoder group %d: channels %d and %d have different resolutions, "
+                   "one group only supports one", encoder->group, other->channel, encoder->channel);
+      }
+    }
+
+    // A replayed channel has no encoder behind it
+    if (encoder->replay_file[0] != '\0') {
+      continue;
+    }
+
+    if (encoder->channel < 0 || encoder->channel >= PLAN_MAX_ENC_CHANNELS) {
+      plan_error("encoder channel %d: channels go from 0 to %d", encoder->channel, PLAN_MAX_ENC_CHANNELS - 1);
+    }
+    if (encoder->group < 0 || encoder->group >= PLAN_MAX_ENC_GROUPS) {
+      plan_error("encoder channel %d: groups go from 0 to %d", encoder->channel, PLAN_MAX_ENC_GROUPS - 1);
+    }
+
+    framesource = plan_encoder_framesource(camera_config, encoder);
+    if (framesource == NULL) {
+      plan_error("encoder channel %d: no frame source is bound to group %d", encoder->channel, encoder->group);
+      continue;
+    }
+
+    if (framesource->pic_width != encoder->pic_width || framesource->pic_height != encoder->pic_height) {
+      plan_error("encoder channel %d: %dx%d, but group %d gets %dx%d from frame source %d",
+                 encoder->channel, encoder->pic_width, encoder->pic_height, encoder->group,
+                 framesource->pic_width, framesource->pic_height, framesource->id);
+    }
+  }
+}
+
+
+static double frame_rate(int numerator, int denominator)
+{
+  return denominator > 0 ? (double)numerator / denominator : 0;
+}
+
+
+// The encoder never runs faster than the frame source feeding it
+static double encoder_frame_rate(CameraConfig *camera_config, EncoderSetting *encoder)
+{
+  double fps = frame_rate(encoder->frame_rate_numerator, encoder->frame_rate_denominator);
+  double fs_fps;
+  FrameSource *framesource = plan_encoder_framesource(camera_config, encoder);
+
+  if (framesource != NULL && encoder->replay_file[0] == '\0') {
+    fs_fps = frame_rate(framesource->frame_rate_numerator, framesource->frame_rate_denominator);
+    if (fs_fps < fps) {
+      fps = fs_fps;
+    }
+  }
+
+  return fps;
+}
+
+
+// Size of the rmem= reservation the IMP SDK allocates from, 0 if unknown
+static uint64_t rmem_bytes(void)
+{
+  FILE *fp;
+  char cmdline[1024];
+  char *rmem, *end;
+  uint64_t size;
+
+  fp = fopen("/proc/cmdline", "r");
+  if (fp == NULL) {
+    return 0;
+  }
+  if (fgets(cmdline, sizeof(cmdline), fp) == NULL) {
+    fclose(fp);
+    return 0;
+  }
+  fclose(fp);
+
+  rmem = strstr(cmdline, "rmem=");
+  if (rmem == NULL) {
+    return 0;
+  }
+
+  size = strtoull(rmem + 5, &end, 0);
+  switch (*end) {
+    case 'G': case 'g': size <<= 30; break;
+    case 'M': case 'm': size <<= 20; break;
+    case 'K': case 'k': size <<= 10; break;
+  }
+
+  return size;
+}
+
+
+// Keep in step with start_frame_producer_threads and log_start_async
+static int count_threads(CameraConfig *camera_config)
+{
+  // main, log writer, trace, events, timestamp OSD, night vision,
+  // privacy mask and encoder ROI
+  int threads = 8;
+
+  if (camera_config->enable_audio) {
+    threads += camera_config->audio.talkback ? 4 : 2;
+  }
+  threads += camera_config->motion.enabled ? 1 : 0;
+  threads += camera_config->adaptive_rate.enabled ? 1 : 0;
+  threads += camera_config->show_perf_hud ? 1 : 0;
+  threads += camera_config->calibration.enabled ? 1 : 0;
+
+  return threads + camera_config->num_encoders;
+}
+
+
+static void print_estimate(CameraConfig *camera_config)
+{
+  int i;
+  int jpeg, motion_frames;
+  uint32_t frame_bytes, buffer_bytes;
+  uint64_t fs_total = 0, encoder_total = 0, rmem;
+  double fps, kbps, total_kbps = 0;
+  uint32_t macroblocks, h264_macroblocks = 0, jpeg_macroblocks = 0;
+  FrameSource *framesource;
+  EncoderSetting *encoder;
+
+  printf("\nFrame sources     fps  buffers     DDR bytes\n");
+  for (i = 0; i < camera_config->num_framesources; i++) {
+    framesource = &camera_config->frame_sources[i];
+    frame_bytes = framesource->pic_width * framesource->pic_height * 3 / 2;
+    buffer_bytes = frame_bytes * framesource->buffer_size;
+    fs_total += buffer_bytes;
+
+    // The software motion detector holds on to frames of its source
+    motion_frames = camera_config->motion.enabled && camera_config->motion.method == MOTION_METHOD_SOFTWARE &&
+                    camera_config->motion.framesource == framesource->id;
+
+    printf("  %-2d %4dx%-4d  %6.2f  %7d  %12u%s\n",
+           framesource->id, framesource->pic_width, framesource->pic_height,
+           frame_rate(framesource->frame_rate_numerator, framesource->frame_rate_denominator),
+           framesource->buffer_size, buffer_bytes,
+           motion_frames && framesource->buffer_size <= MOTION_FRAME_DEPTH ? "  (too few for software motion)" : "");
+  }
+
+  printf("\nEncoders              group     fps    kbit/s  macroblk/s     DDR bytes\n");
+  for (i = 0; i < camera_config->num_encoders; i++) {
+    encoder = &camera_config->encoders[i];
+    jpeg = encoder->chn_attr.encAttr.enType == PT_JPEG;
+    fps = encoder_frame_rate(camera_config, encoder);
+
+    if (jpeg) {
+      kbps = (double)encoder->pic_width * encoder->pic_height * fps * PLAN_JPEG_BITS_PER_PIXEL / 1000;
+    }
+    else {
+      kbps = encoder->chn_attr.rcAttr.attrH264Vbr.maxBitRate;
+    }
+    total_kbps += kbps;
+
+    if (encoder->replay_file[0] != '\0') {
+      printf("  %-2d %-5s %4dx%-4d %3d  %6.2f  %8.0f            -             -  replay\n",
+             encoder->channel, jpeg ? "jpeg" : "h264", encoder->pic_width, encoder->pic_height,
+             encoder->group, fps, kbps);
+      continue;
+    }
+
+    macroblocks = (uint32_t)(((encoder->pic_width + 15) / 16) * ((encoder->pic_height + 15) / 16) * fps);
+    if (jpeg) {
+      jpeg_macroblocks += macroblocks;
+    }
+    else {
+      h264_macroblocks += macroblocks;
+    }
+
+    buffer_bytes = encoder->buffer_size > 0 ? encoder->buffer_size : encoder->pic_width * encoder->pic_height * 3 / 2;
+    encoder_total += buffer_bytes;
+
+    printf("  %-2d %-5s %4dx%-4d %3d  %6.2f  %8.0f%s %11u  %12u%s\n",
+           encoder->channel, jpeg ? "jpeg" : "h264", encoder->pic_width, encoder->pic_height,
+           encoder->group, fps, kbps, jpeg ? "~" : " ", macroblocks, buffer_bytes,
+           encoder->buffer_size > 0 ? "" : "  (default)");
+  }
+
+  printf("\nDDR:         %llu bytes frame sources + %llu bytes encoders = %.1f MB",
+         (unsigned long long)fs_total, (unsigned long long)encoder_total,
+         (fs_total + encoder_total) / 1048576.0);
+  rmem = rmem_bytes();
+  if (rmem > 0) {
+    printf(" of %.1f MB rmem", rmem / 1048576.0);
+  }
+  printf("\n");
+
+  printf("Bitrate:     %.2f Mbit/s (H.264 at max_bitrate, ~ MJPEG guessed)\n", total_kbps / 1000);
+  printf("Encoder:     %u H.264 macroblocks/s, %d%% of %u; %u JPEG macroblocks/s\n",
+         h264_macroblocks, (int)(100.0 * h264_macroblocks / PLAN_H264_MACROBLOCKS_PER_SECOND),
+         PLAN_H264_MACROBLOCKS_PER_SECOND, jpeg_macroblocks);
+  printf("Threads:     %d\n", count_threads(camera_config));
+
+  if (rmem > 0 && fs_total + encoder_total > rmem) {
+    plan_error("the buffers need more DDR than rmem reserves");
+  }
+  if (h264_macroblocks > PLAN_H264_MACROBLOCKS_PER_SECOND) {
+    plan_error("the H.264 channels need more than the encoder can do");
+  }
+}
+
+
+// Returns the number of errors found. load_errors is the number of
+// sections load_configuration could not parse, the graph is only checked
+// when there are none since it would be built from partial entries.
+int plan_configuration(CameraConfig *camera_config, int load_errors)
+{
+  plan_errors = 0;
+
+  printf("Plan for %d frame source(s), %d encoder(s), %d binding(s)\n",
+         camera_config->num_framesources, camera_config->num_encoders, camera_config->num_bindings);
+
+  if (load_errors > 0) {
+    printf("  error: %d section(s) of the configuration could not be loaded, see the log above\n", load_errors);
+    plan_errors += load_errors;
+  }
+  else {
+    check_framesources(camera_config);
+    check_encoders(camera_config);
+    check_bindings(camera_config);
+
+    print_estimate(camera_config);
+  }
+
+  if (plan_errors > 0) {
+    printf("\n%d error(s)\n", plan_errors);
+  }
+  else {
+    printf("\nNo errors\n");
+  }
+
+  return plan_errors;
+}
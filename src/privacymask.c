@@ -0,0 +1,300 @@
+#include "capture.h"
+#include "privacymask.h"
+
+/*
+
+Privacy masks are OSD cover regions. The OSD module fills them in on the
+frames before they reach the encoder, so masking costs no CPU per frame.
+
+A region only has a single rectangle, so every mask gets its own region
+in each OSD group, scaled to the resolution of the frame source bound
+to that group.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+static IMPRgnHandle mask_regions[MAX_PRIVACY_MASKS][MAX_OSD_GROUPS];
+static int mask_regions_initialized = 0;
+
+
+int load_privacy_masks(cJSON *json, PrivacyMask privacy_masks[], uint32_t *num_privacy_masks)
+{
+  int i;
+  int num_masks;
+  cJSON *json_mask;
+  cJSON *json_privacy_masks;
+  // Parsed here first so a bad reload leaves the current masks in place
+  PrivacyMask parsed[MAX_PRIVACY_MASKS];
+
+  // Privacy masks are optional
+  json_privacy_masks = cJSON_GetObjectItemCaseSensitive(json, "privacy_masks");
+  if (json_privacy_masks == NULL) {
+    *num_privacy_masks = 0;
+    return 0;
+  }
+
+  num_masks = cJSON_GetArraySize(json_privacy_masks);
+  if (num_masks > MAX_PRIVACY_MASKS) {
+    log_warn("Found %d privacy masks but only %d are supported.", num_masks, MAX_PRIVACY_MASKS);
+    num_masks = MAX_PRIVACY_MASKS;
+  }
+  log_info("Found %d privacy mask(s).", num_masks);
+
+  for (i = 0; i < num_masks; ++i) {
+    json_mask = cJSON_GetArrayItem(json_privacy_masks, i);
+
+    if (populate_privacy_mask(&parsed[i], json_mask) != 0) {
+      log_error("Error parsing privacy_masks[%d].", i);
+      return -1;
+    }
+    print_privacy_mask(&parsed[i]);
+  }
+
+  memcpy(privacy_masks, parsed, num_masks * sizeof(PrivacyMask));
+  *num_privacy_masks = num_masks;
+
+  return 0;
+}
+
+
+// Work out the resolution of the frames passing through an OSD group by
+// following the binding from the frame source (or IVS) to the group.
+static void osd_group_resolution(CameraConfig *camera_config, int osd_group, int *width, int *height)
+{
+  int i, j;
+  int fs_group;
+  Binding *binding;
+
+  *width = SENSOR_WIDTH;
+  *height = SENSOR_HEIGHT;
+
+  for (i = 0; i < camera_config->num_bindings; i++) {
+    binding = &camera_config->bindings[i];
+
+    if ((binding->source.device != DEV_ID_FS && binding->source.device != DEV_ID_IVS) ||
+        binding->target.device != DEV_ID_OSD ||
+        binding->target.group != osd_group) {
+      continue;
+    }
+
+    // IVS passes the frames of the motion frame source through unchanged
+    fs_group = binding->source.group;
+    if (binding->source.device == DEV_ID_IVS) {
+      fs_group = camera_config->motion.framesource;
+    }
+
+    for (j = 0; j < camera_config->num_framesources; j++) {
+      if (camera_config->frame_sources[j].id == fs_group) {
+        *width = camera_config->frame_sources[j].pic_width;
+        *height = camera_config->frame_sources[j].pic_height;
+        return;
+      }
+    }
+  }
+}
+
+
+// Scale a mask from sensor coordinates to the given resolution. The OSD
+// hardware wants even coordinates, so the rectangle is grown outwards to
+// keep everything that was meant to be hidden covered.
+static void scale_privacy_mask(PrivacyMask *privacy_mask, int width, int height, IMPRect *rect)
+{
+  int x0, y0, x1, y1;
+
+  x0 = (privacy_mask->x * width) / SENSOR_WIDTH;
+  y0 = (privacy_mask->y * height) / SENSOR_HEIGHT;
+  x1 = ((privacy_mask->x + privacy_mask->width) * width + SENSOR_WIDTH - 1) / SENSOR_WIDTH;
+  y1 = ((privacy_mask->y + privacy_mask->height) * height + SENSOR_HEIGHT - 1) / SENSOR_HEIGHT;
+
+  x0 &= ~1;
+  y0 &= ~1;
+  x1 = (x1 + 1) & ~1;
+  y1 = (y1 + 1) & ~1;
+
+  if (x0 < 0) x0 = 0;
+  if (y0 < 0) y0 = 0;
+  if (x1 > width) x1 = width;
+  if (y1 > height) y1 = height;
+
+  // p1 is inclusive
+  rect->p0.x = x0;
+  rect->p0.y = y0;
+  rect->p1.x = x1 - 1;
+  rect->p1.y = y1 - 1;
+}
+
+
+static IMPRgnHandle get_mask_region(int mask_index, int group_index, int osd_group)
+{
+  int ret;
+  IMPRgnHandle region = mask_regions[mask_index][group_index];
+
+  if (region != INVHANDLE) {
+    return region;
+  }
+
+  region = IMP_OSD_CreateRgn(NULL);
+  if (region < 0) {
+    log_error("IMP_OSD_CreateRgn failed for privacy mask %d", mask_index);
+    return INVHANDLE;
+  }
+
+  ret = IMP_OSD_RegisterRgn(region, osd_group, NULL);
+  if (ret < 0) {
+    log_error("IMP_OSD_RegisterRgn failed for privacy mask %d on group %d", mask_index, osd_group);
+    IMP_OSD_DestroyRgn(region);
+    return INVHANDLE;
+  }
+
+  mask_regions[mask_index][group_index] = region;
+
+  return region;
+}
+
+
+// Create, update or hide the cover regions so that they match the masks
+// in camera_config. Can be called again whenever the masks change.
+int setup_privacy_masks(CameraConfig *camera_config)
+{
+  int ret, i, g;
+  int width, height;
+  int osd_group;
+  IMPRgnHandle region;
+  IMPOSDRgnAttr region_attr;
+  PrivacyMask *privacy_mask;
+
+  if (!mask_regions_initialized) {
+    for (i = 0; i < MAX_PRIVACY_MASKS; i++) {
+      for (g = 0; g < MAX_OSD_GROUPS; g++) {
+        mask_regions[i][g] = INVHANDLE;
+      }
+    }
+    mask_regions_initialized = 1;
+  }
+
+  for (g = 0; g < camera_config->num_osd_groups; g++) {
+    osd_group = camera_config->osd_groups[g];
+    osd_group_resolution(camera_config, osd_group, &width, &height);
+
+    for (i = 0; i < MAX_PRIVACY_MASKS; i++) {
+      privacy_mask = &camera_config->privacy_masks[i];
+
+      // Slots past the configured masks are only hidden, never created
+      if (i >= camera_config->num_privacy_masks || !privacy_mask->enabled) {
+        if (mask_regions[i][g] != INVHANDLE) {
+          IMP_OSD_ShowRgn(mask_regions[i][g], osd_group, 0);
+        }
+        continue;
+      }
+
+      region = get_mask_region(i, g, osd_group);
+      if (region == INVHANDLE) {
+        return -1;
+      }
+
+      memset(&region_attr, 0, sizeof(IMPOSDRgnAttr));
+      region_attr.type = OSD_REG_COVER;
+      region_attr.fmt = PIX_FMT_BGRA;
+      region_attr.data.coverData.color = privacy_mask->color;
+      scale_privacy_mask(privacy_mask, width, height, &region_attr.rect);
+
+      ret = IMP_OSD_SetRgnAttr(region, &region_attr);
+      if (ret < 0) {
+        log_error("IMP_OSD_SetRgnAttr failed for privacy mask %d", privacy_mask->id);
+        return -1;
+      }
+
+      ret = IMP_OSD_ShowRgn(region, osd_group, 1);
+      if (ret < 0) {
+        log_error("IMP_OSD_ShowRgn failed for privacy mask %d", privacy_mask->id);
+        return -1;
+      }
+
+      log_info("Privacy mask %d on OSD group %d (%dx%d): (%d,%d)-(%d,%d)",
+               privacy_mask->id, osd_group, width, height,
+               region_attr.rect.p0.x, region_attr.rect.p0.y,
+               region_attr.rect.p1.x, region_attr.rect.p1.y);
+    }
+  }
+
+  return 0;
+}
+
+
+static int reload_privacy_masks(CameraConfig *camera_config, const char *filename)
+{
+  FILE *fp;
+  long file_size;
+  char *file_contents;
+  cJSON *json;
+  int ret;
+
+  fp = fopen(filename, "r");
+  if (fp == NULL) {
+    log_error("Unable to open %s", filename);
+    return -1;
+  }
+
+  fseek(fp, 0, SEEK_END);
+  file_size = ftell(fp);
+  fseek(fp, 0, SEEK_SET);
+
+  file_contents = malloc(file_size + 1);
+  if (file_contents == NULL) {
+    log_error("Memory error: unable to allocate %ld bytes", file_size + 1);
+    fclose(fp);
+    return -1;
+  }
+
+  if (fread(file_contents, 1, file_size, fp) != file_size) {
+    log_error("Unable to read contents of %s", filename);
+    fclose(fp);
+    free(file_contents);
+    return -1;
+  }
+  fclose(fp);
+
+  json = cJSON_ParseWithLength(file_contents, file_size);
+  free(file_contents);
+
+  if (json == NULL) {
+    log_error("Unable to parse privacy masks in %s", filename);
+    return -1;
+  }
+
+  ret = load_privacy_masks(json, camera_config->privacy_masks, &camera_config->num_privacy_masks);
+  cJSON_Delete(json);
+
+  if (ret != 0) {
+    return -1;
+  }
+
+  return setup_privacy_masks(camera_config);
+}
+
+
+// This is the entrypoint for the privacy mask thread. It only looks at
+// the modification time of PRIVACY_MASK_FILE, the file is parsed when it
+// changes.
+void *privacy_mask_entry_start(void *privacy_mask_thread_params)
+{
+  CameraConfig *camera_config = (CameraConfig *)privacy_mask_thread_params;
+  struct stat filestatus;
+  time_t last_modified = 0;
+
+  while(!sigint_received) {
+    if (stat(PRIVACY_MASK_FILE, &filestatus) == 0 && filestatus.st_mtime != last_modified) {
+      last_modified = filestatus.st_mtime;
+      log_info("Reloading privacy masks from %s", PRIVACY_MASK_FILE);
+
+      if (reload_privacy_masks(camera_config, PRIVACY_MASK_FILE) != 0) {
+        log_error("Failed to apply privacy masks from %s", PRIVACY_MASK_FILE);
+      }
+    }
+
+    sleep(1);
+  }
+
+  return NULL;
+}
@@ -0,0 +1,272 @@
+#include "capture.h"
+#include "replay.h"
+#include <sys/mman.h>
+
+/*
+
+Replay of recorded streams in place of an encoder channel. The file is
+mapped and cut into frames the way the encoder hands them out, so the
+output loop cannot tell the difference:
+
+- Annex-B H.264 is split into NAL units, one pack each, and the NAL
+  units into access units. An access unit ends before an AUD, SPS, PPS
+  or SEI, or before a slice with first_mb_in_slice 0, that follows a
+  slice of the current one.
+
+- MJPEG is split into SOI ... EOI frames, one pack each.
+
+Frames are paced at the frame rate of the encoder settings, or handed
+out as fast as they are asked for.
+
+The packs point into the mapping, IMP keeps those in the low 4GB
+(virAddr is 32 bits), so on 64 bit hosts the file is mapped with
+MAP_32BIT. Hosts without it fail when the mapping lands higher.
+
+*/
+
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+
+
+static int64_t replay_now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+int replay_open(ReplaySource *replay, EncoderSetting *encoder_setting)
+{
+  int fd;
+  struct stat filestatus;
+
+  memset(replay, 0, sizeof(ReplaySource));
+  replay->filename = encoder_setting->replay_file;
+  replay->jpeg = strcmp(encoder_setting->payload_type, "PT_JPEG") == 0;
+  replay->fast = encoder_setting->replay_fast;
+  replay->loop = encoder_setting->replay_loop;
+
+  replay->interval_us = 40000;
+  if (encoder_setting->frame_rate_numerator > 0) {
+    replay->interval_us = (int64_t)1000000 * encoder_setting->frame_rate_denominator / encoder_setting->frame_rate_numerator;
+  }
+
+  fd = open(replay->filename, O_RDONLY);
+  if (fd < 0) {
+    log_error("Unable to open replay file %s", replay->filename);
+    return -1;
+  }
+
+  if (fstat(fd, &filestatus) != 0 || filestatus.st_size == 0) {
+    log_error("Replay file %s is empty", replay->filename);
+    close(fd);
+    return -1;
+  }
+  replay->size = filestatus.st_size;
+
+  replay->data = mmap(NULL, replay->size, PROT_READ, MAP_PRIVATE | MAP_32BIT, fd, 0);
+  close(fd);
+  if (replay->data == MAP_FAILED) {
+    log_error("Unable to map replay file %s", replay->filename);
+    replay->data = NULL;
+    return -1;
+  }
+
+  // virAddr would be truncated
+  if ((uintptr_t)replay->data + replay->size > UINT32_MAX) {
+    log_error("Replay file %s is mapped above 4GB, packs cannot address it on this host", replay->filename);
+    replay_close(replay);
+    return -1;
+  }
+
+  replay->start_us = replay_now_us();
+
+  log_info("Replaying %s (%zu bytes, %s) %s", replay->filename, replay->size,
+           replay->jpeg ? "MJPEG" : "H.264", replay->fast ? "as fast as possible" : "at the encoder frame rate");
+
+  return 0;
+}
+
+
+void replay_close(ReplaySource *replay)
+{
+  if (replay->data != NULL) {
+    munmap(replay->data, replay->size);
+    replay->data = NULL;
+  }
+}
+
+
+// Same contract as IMP_Encoder_PollingStream: 0 once the next frame is
+// due, -1 if it is not due within timeout_ms
+int replay_poll(ReplaySource *replay, uint32_t timeout_ms)
+{
+  int64_t delay;
+
+  if (replay->fast) {
+    return 0;
+  }
+
+  delay = replay->start_us + replay->seq * replay->interval_us - replay_now_us();
+  if (delay > (int64_t)timeout_ms * 1000) {
+    usleep(timeout_ms * 1000);
+    return -1;
+  }
+  if (delay > 0) {
+    usleep(delay);
+  }
+
+  return 0;
+}
+
+
+// Offset of the next 00 00 01 at or after position, or size
+static size_t find_start_code(const uint8_t *data, size_t size, size_t position)
+{
+  while (position + 2 < size) {
+    if (data[position + 2] > 1) {
+      position += 3;
+    }
+    else if (data[position] == 0 && data[position + 1] == 0 && data[position + 2] == 1) {
+      return position;
+    }
+    else {
+      position++;
+    }
+  }
+  return size;
+}
+
+
+static int next_h264_frame(ReplaySource *replay, IMPEncoderStream *stream)
+{
+  const uint8_t *data = replay->data;
+  size_t start, payload, next;
+  int nal_type, count = 0, has_slice = 0;
+  IMPEncoderPack *pack = NULL;
+
+  start = find_start_code(data, replay->size, replay->position);
+  if (start > replay->position && data[start - 1] == 0) {
+    start--;
+  }
+
+  while (start < replay->size) {
+    payload = find_start_code(data, replay->size, start) + 3;
+    if (payload >= replay->size) {
+      break;
+    }
+    nal_type = data[payload] & 0x1f;
+
+    // A new access unit starts here
+    if (has_slice) {
+      if (nal_type == IMP_NAL_AUD || nal_type == IMP_NAL_SPS ||
+          nal_type == IMP_NAL_PPS || nal_type == IMP_NAL_SEI) {
+        break;
+      }
+      // first_mb_in_slice is ue(v), 0 is a single 1 bit
+      if ((nal_type == IMP_NAL_SLICE || nal_type == IMP_NAL_SLICE_IDR) &&
+          payload + 1 < replay->size && (data[payload + 1] & 0x80)) {
+        break;
+      }
+    }
+
+    next = find_start_code(data, replay->size, payload);
+    // The zero_byte of a 4 byte start code belongs to the next NAL
+    if (next < replay->size && data[next - 1] == 0) {
+      next--;
+    }
+
+    if (count < REPLAY_MAX_PACKS) {
+      pack = &replay->packs[count++];
+      memset(pack, 0, sizeof(IMPEncoderPack));
+      pack->virAddr = (uint32_t)(uintptr_t)&data[start];
+      pack->dataType.h264Type = nal_type;
+    }
+    pack->length = next - (pack->virAddr - (uint32_t)(uintptr_t)data);
+
+    if (nal_type == IMP_NAL_SLICE || nal_type == IMP_NAL_SLICE_IDR) {
+      has_slice = 1;
+    }
+    start = next;
+  }
+
+  replay->position = start;
+
+  if (count == 0) {
+    return REPLAY_END;
+  }
+
+  stream->pack = replay->packs;
+  stream->packCount = count;
+  return 0;
+}
+
+
+static int next_jpeg_frame(ReplaySource *replay, IMPEncoderStream *stream)
+{
+  const uint8_t *data = replay->data;
+  size_t start = replay->position;
+  size_t end;
+  IMPEncoderPack *pack = &replay->packs[0];
+
+  // SOI
+  while (start + 1 < replay->size && !(data[start] == 0xff && data[start + 1] == 0xd8)) {
+    start++;
+  }
+  if (start + 1 >= replay->size) {
+    replay->position = replay->size;
+    return REPLAY_END;
+  }
+
+  // EOI, 0xff in the entropy coded data is always followed by 0x00
+  for (end = start + 2; end + 1 < replay->size; end++) {
+    if (data[end] == 0xff && data[end + 1] == 0xd9) {
+      break;
+    }
+  }
+  end = end + 1 < replay->size ? end + 2 : replay->size;
+
+  memset(pack, 0, sizeof(IMPEncoderPack));
+  pack->virAddr = (uint32_t)(uintptr_t)&data[start];
+  pack->length = end - start;
+
+  replay->position = end;
+  stream->pack = replay->packs;
+  stream->packCount = 1;
+  return 0;
+}
+
+
+// Returns 0 with the next frame in stream, REPLAY_END at the end of the
+// file unless it loops
+int replay_get_stream(ReplaySource *replay, IMPEncoderStream *stream)
+{
+  int ret, i;
+  int rewound = 0;
+
+  memset(stream, 0, sizeof(IMPEncoderStream));
+
+  while (1) {
+    ret = replay->jpeg ? next_jpeg_frame(replay, stream) : next_h264_frame(replay, stream);
+    if (ret != REPLAY_END) {
+      break;
+    }
+
+    // Give up on files without a single frame in them
+    if (!replay->loop || rewound) {
+      return REPLAY_END;
+    }
+    replay->position = 0;
+    rewound = 1;
+  }
+
+  for (i = 0; i < stream->packCount; i++) {
+    stream->pack[i].timestamp = replay->seq * replay->interval_us;
+  }
+  stream->pack[stream->packCount - 1].frameEnd = 1;
+  stream->seq = replay->seq++;
+
+  return 0;
+}
@@ -0,0 +1,44 @@
+#include "capture.h"
+#include "seitimestamp.h"
+
+/*
+
+Wall clock timestamps in the H.264 stream, so a consumer at the end of
+any path (v4l2loopback, RTSP, a recording) can work out how long ago a
+frame was captured. getimage -p reads them back, see there.
+
+IMP_Encoder_InsertUserData puts the data in a user data SEI in front of
+the next picture the encoder puts out, so it is inserted right after a
+frame is taken and describes the frame after it: capture time of this
+frame plus one frame interval, and the next sequence number. The interval
+is the one measured between the last two frames, so it follows frame rate
+changes; right after a change (adaptive rate going idle or back) one SEI
+is off by the difference. That holds as long as the encoder keeps up with
+the frame source; with a backlog the SEI lands on a frame captured earlier
+and the latencies come out short.
+
+IMP timestamps count from IMP_System_Init, the offset to CLOCK_REALTIME
+is taken again for every frame so that setting the clock (NTP) shows up
+at once.
+
+*/
+
+
+int sei_timestamp_insert(int channel, int64_t frame_timestamp_us, uint32_t seq, uint32_t interval_us)
+{
+  struct timespec now;
+  int64_t capture_us;
+  int length;
+  char user_data[SEI_TIMESTAMP_UUID_SIZE + SEI_TIMESTAMP_MAX_SIZE];
+
+  clock_gettime(CLOCK_REALTIME, &now);
+  capture_us = frame_timestamp_us + interval_us +
+               (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000 - IMP_System_GetTimeStamp();
+
+  memcpy(user_data, SEI_TIMESTAMP_UUID, SEI_TIMESTAMP_UUID_SIZE);
+  length = snprintf(&user_data[SEI_TIMESTAMP_UUID_SIZE], SEI_TIMESTAMP_MAX_SIZE, SEI_TIMESTAMP_FORMAT,
+                    (long long)(capture_us / 1000000), (int)(capture_us % 1000000), seq + 1);
+
+  // Fails when the two user data buffers of the channel are still full
+  return IMP_Encoder_InsertUserData(channel, user_data, SEI_TIMESTAMP_UUID_SIZE + length);
+}
@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "blockmotion.h"
+
+/*
+
+Micro-benchmark for the block SAD detector in blockmotion.c. Runs on
+synthetic luma frames (a noisy gradient with a bright square moving
+across it) and prints the CPU time per frame, the share of one core
+that takes at the motion fps, and whether the square was found. Build and
+run it with
+
+  make blockmotion_bench
+  ./blockmotion_bench [width height [frames [cell_size [fps]]]]
+
+The defaults match the 640x360 motion frame source and the default fps
+of 5 of the software method, which should stay within a few percent of
+one core. Only a run on the camera tells, host figures are far lower.
+
+*/
+
+// CPU time of the process, so other load on the camera does not count
+static double cpu_seconds(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+
+// Background gradient with +-2 levels of noise, and from frame 10 on a
+// 48x48 square that moves 8 pixels per frame
+static void make_frame(uint8_t *luma, int width, int height, int n, uint32_t *seed)
+{
+  int x, y, sx, sy;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++) {
+      *seed = *seed * 1103515245 + 12345;
+      luma[y * width + x] = 64 + (x + y) / 16 + ((*seed >> 16) % 5) - 2;
+    }
+  }
+
+  if (n < 10) {
+    return;
+  }
+
+  sx = ((n - 10) * 8) % (width - 48);
+  sy = height / 3;
+  for (y = sy; y < sy + 48; y++) {
+    memset(luma + y * width + sx, 220, 48);
+  }
+}
+
+
+int main(int argc, char **argv)
+{
+  int width = 640, height = 360, frames = 500, cell_size = 16, fps = 5;
+  int i, found = 0;
+  uint8_t **luma;
+  uint32_t seed = 1;
+  double start, elapsed;
+  BlockMotion bm;
+
+  if (argc >= 3) {
+    width = atoi(argv[1]);
+    height = atoi(argv[2]);
+  }
+  if (argc >= 4) {
+    frames = atoi(argv[3]);
+  }
+  if (argc >= 5) {
+    cell_size = atoi(argv[4]);
+  }
+  if (argc >= 6) {
+    fps = atoi(argv[5]);
+  }
+
+  if (frames < 20 || fps < 1 || block_motion_init(&bm, width, height, cell_size, 10, 4) != 0) {
+    fprintf(stderr, "usage: %s [width height [frames >= 20 [cell_size [fps >= 1]]]]\n", argv[0]);
+    return 1;
+  }
+
+  // Frames are made up front so only the detector is timed
+  luma = malloc(frames * sizeof(uint8_t *));
+  for (i = 0; i < frames; i++) {
+    luma[i] = malloc(width * height);
+    make_frame(luma[i], width, height, i, &seed);
+  }
+
+  start = cpu_seconds();
+  for (i = 0; i < frames; i++) {
+    block_motion_update(&bm, luma[i], width);
+    if (i >= 10 && bm.active_cells > 0) {
+      found++;
+    }
+  }
+  elapsed = cpu_seconds() - start;
+
+  printf("kernel: %s\n", block_motion_kernel_name());
+  printf("frames: %d at %dx%d, %dx%d cells\n", frames, width, height, bm.cells_x, bm.cells_y);
+  printf("cpu time per frame: %.3f ms\n", elapsed * 1000 / frames);
+  printf("cpu at %d fps: %.2f%% of one core\n", fps, elapsed * 100 * fps / frames);
+  printf("max fps: %.0f\n", frames / elapsed);
+  printf("motion found in %d of %d frames with motion\n", found, frames - 10);
+
+  for (i = 0; i < frames; i++) {
+    free(luma[i]);
+  }
+  free(luma);
+  block_motion_free(&bm);
+
+  return 0;
+}
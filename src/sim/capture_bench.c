@@ -0,0 +1,325 @@
+#include "capture.h"
+#include "imp_sim.h"
+#include <errno.h>
+#include <pthread.h>
+#include <sys/resource.h>
+
+/*
+
+Throughput benchmark for the encoder output loop. Runs output_v4l2_frames
+on N channels of the simulated encoder in imp_sim.c, writing into
+/dev/null, a FIFO drained by a reader thread, or a file, and reports for
+each sink:
+
+  fps       frames per second per channel
+  Mbit/s    written, all channels
+  cpu       process CPU time (user + system) per frame
+  p50-max   time from a frame being due to it being released, ms
+  dropped   frames the encoder dropped because they were not read in time
+
+  capture_bench [-n channels] [-t h264|jpeg] [-W width] [-H height]
+                [-f fps] [-b kbps] [-g gop] [-d seconds] [-s null|pipe|file]
+                [-r recording [-x]]
+
+Without -s all three sinks are run one after the other.
+
+With -r every channel replays the recording (see replay.c, -t has to
+match it) at -f fps, or as fast as possible with -x, looping until the
+time is up. There is no encoder then, so no latency or dropped frames.
+
+*/
+
+#define BENCH_MAX_CHANNELS   IMP_SIM_MAX_CHANNELS
+#define BENCH_PATH_PREFIX    "/tmp/capture_bench"
+
+sig_atomic_t sigint_received = 0;
+
+typedef struct {
+  int channels;
+  int jpeg;
+  int width;
+  int height;
+  int fps;
+  int kbps;
+  int gop;
+  int seconds;
+  const char *replay_file;
+  int replay_fast;
+} BenchOptions;
+
+typedef struct {
+  char path[64];
+  int fd;
+  pthread_t thread;
+} PipeReader;
+
+static const char *sink_names[] = { "null", "pipe", "file" };
+
+
+static void *pipe_reader_entry_start(void *pipe_reader_params)
+{
+  PipeReader *reader = pipe_reader_params;
+  char buffer[65536];
+
+  // Blocks until the writer opens its end
+  reader->fd = open(reader->path, O_RDONLY);
+  if (reader->fd < 0) {
+    return NULL;
+  }
+
+  while (read(reader->fd, buffer, sizeof(buffer)) > 0) {
+  }
+
+  close(reader->fd);
+  return NULL;
+}
+
+
+static int compare_uint32(const void *a, const void *b)
+{
+  uint32_t x = *(const uint32_t *)a;
+  uint32_t y = *(const uint32_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+
+static double cpu_seconds(void)
+{
+  struct rusage usage;
+
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+         (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0;
+}
+
+
+static void setup_channel(BenchOptions *options, EncoderSetting *encoder, int channel, const char *path)
+{
+  IMPEncoderCHNAttr attr;
+
+  memset(encoder, 0, sizeof(EncoderSetting));
+  encoder->channel = channel;
+  encoder->group = channel;
+  snprintf(encoder->v4l2_device_path, sizeof(encoder->v4l2_device_path), "%s", path);
+  snprintf(encoder->payload_type, sizeof(encoder->payload_type), options->jpeg ? "PT_JPEG" : "PT_H264");
+  snprintf(encoder->mode, sizeof(encoder->mode), options->jpeg ? "MJPEG" : "ENC_RC_MODE_H264VBR");
+  encoder->frame_rate_numerator = options->fps;
+  encoder->frame_rate_denominator = 1;
+  encoder->max_group_of_pictures = options->gop;
+  encoder->pic_width = options->width;
+  encoder->pic_height = options->height;
+
+  if (options->replay_file != NULL) {
+    snprintf(encoder->replay_file, sizeof(encoder->replay_file), "%s", options->replay_file);
+    encoder->replay_fast = options->replay_fast;
+    encoder->replay_loop = 1;
+    return;
+  }
+
+  memset(&attr, 0, sizeof(IMPEncoderCHNAttr));
+  attr.encAttr.enType = options->jpeg ? PT_JPEG : PT_H264;
+  attr.encAttr.picWidth = options->width;
+  attr.encAttr.picHeight = options->height;
+  attr.rcAttr.rcMode = ENC_RC_MODE_H264VBR;
+  attr.rcAttr.attrH264Vbr.outFrmRate.frmRateNum = options->fps;
+  attr.rcAttr.attrH264Vbr.outFrmRate.frmRateDen = 1;
+  attr.rcAttr.attrH264Vbr.maxGop = options->gop;
+  attr.rcAttr.attrH264Vbr.maxBitRate = options->kbps;
+
+  IMP_Encoder_CreateGroup(channel);
+  IMP_Encoder_CreateChn(channel, &attr);
+  IMP_Encoder_RegisterChn(channel, channel);
+  imp_sim_reset_stats(channel);
+}
+
+
+static int run_sink(BenchOptions *options, int sink)
+{
+  int i, fd;
+  char path[64];
+  pthread_t threads[BENCH_MAX_CHANNELS];
+  EncoderThreadParams params[BENCH_MAX_CHANNELS];
+  EncoderSetting encoders[BENCH_MAX_CHANNELS];
+  PipeReader readers[BENCH_MAX_CHANNELS];
+  ImpSimStats *stats;
+  uint32_t *latencies;
+  uint32_t num_latencies = 0;
+  uint32_t frames = 0, dropped = 0;
+  uint64_t bytes = 0;
+  struct timespec start, end;
+  double elapsed, cpu;
+
+  stats = malloc(sizeof(ImpSimStats));
+  latencies = malloc(options->channels * IMP_SIM_LATENCY_SAMPLES * sizeof(uint32_t));
+  if (stats == NULL || latencies == NULL) {
+    log_error("Unable to allocate the latency samples");
+    return -1;
+  }
+
+  for (i = 0; i < options->channels; i++) {
+    snprintf(path, sizeof(path), "/dev/null");
+
+    if (sink == 1) {
+      snprintf(path, sizeof(path), "%s_%d.fifo", BENCH_PATH_PREFIX, i);
+      unlink(path);
+      if (mkfifo(path, 0600) != 0) {
+        log_error("Unable to create %s", path);
+        return -1;
+      }
+      snprintf(readers[i].path, sizeof(readers[i].path), "%s", path);
+      pthread_create(&readers[i].thread, NULL, pipe_reader_entry_start, &readers[i]);
+    }
+    else if (sink == 2) {
+      snprintf(path, sizeof(path), "%s_%d.out", BENCH_PATH_PREFIX, i);
+      fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+      if (fd < 0) {
+        log_error("Unable to create %s", path);
+        return -1;
+      }
+      close(fd);
+    }
+
+    setup_channel(options, &encoders[i], i, path);
+  }
+
+  sigint_received = 0;
+  cpu = cpu_seconds();
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  for (i = 0; i < options->channels; i++) {
+    params[i].encoder = &encoders[i];
+    pthread_create(&threads[i], NULL, produce_frames, &params[i]);
+  }
+
+  sleep(options->seconds);
+  sigint_received = 1;
+
+  for (i = 0; i < options->channels; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  cpu = cpu_seconds() - cpu;
+  elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1000000000.0;
+
+  for (i = 0; i < options->channels; i++) {
+    frames += encoders[i].stats.frames;
+    bytes += encoders[i].stats.bytes;
+    dropped += encoders[i].stats.dropped_frames;
+
+    if (options->replay_file == NULL) {
+      imp_sim_get_stats(i, stats);
+      memcpy(&latencies[num_latencies], stats->latency_us, stats->num_latencies * sizeof(uint32_t));
+      num_latencies += stats->num_latencies;
+
+      IMP_Encoder_UnRegisterChn(i);
+      IMP_Encoder_DestroyChn(i);
+      IMP_Encoder_DestroyGroup(i);
+    }
+
+    if (sink == 1) {
+      pthread_join(readers[i].thread, NULL);
+    }
+    if (sink != 0) {
+      unlink(encoders[i].v4l2_device_path);
+    }
+  }
+
+  qsort(latencies, num_latencies, sizeof(uint32_t), compare_uint32);
+
+  if (frames == 0) {
+    printf("%-5s  no frames\n", sink_names[sink]);
+  }
+  else if (num_latencies == 0) {
+    printf("%-5s %7.1f %7.2f %9.1f       -       -       -       -        -\n",
+           sink_names[sink],
+           frames / elapsed / options->channels,
+           bytes * 8 / elapsed / 1000000,
+           cpu * 1000000 / frames);
+  }
+  else {
+    printf("%-5s %7.1f %7.2f %9.1f %7.2f %7.2f %7.2f %7.2f %8u\n",
+           sink_names[sink],
+           frames / elapsed / options->channels,
+           bytes * 8 / elapsed / 1000000,
+           cpu * 1000000 / frames,
+           latencies[num_latencies / 2] / 1000.0,
+           latencies[num_latencies * 90 / 100] / 1000.0,
+           latencies[num_latencies * 99 / 100] / 1000.0,
+           latencies[num_latencies - 1] / 1000.0,
+           dropped);
+  }
+
+  free(stats);
+  free(latencies);
+
+  return 0;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int opt, sink;
+  int only_sink = -1;
+  BenchOptions options = { 2, 0, 1920, 1080, 25, 2000, 50, 10, NULL, 0 };
+
+  while ((opt = getopt(argc, argv, "n:t:W:H:f:b:g:d:s:r:x")) != -1) {
+    switch (opt) {
+      case 'n': options.channels = atoi(optarg); break;
+      case 't': options.jpeg = strcmp(optarg, "jpeg") == 0; break;
+      case 'W': options.width = atoi(optarg); break;
+      case 'H': options.height = atoi(optarg); break;
+      case 'f': options.fps = atoi(optarg); break;
+      case 'b': options.kbps = atoi(optarg); break;
+      case 'g': options.gop = atoi(optarg); break;
+      case 'd': options.seconds = atoi(optarg); break;
+      case 'r': options.replay_file = optarg; break;
+      case 'x': options.replay_fast = 1; break;
+      case 's':
+        for (sink = 0; sink < 3; sink++) {
+          if (strcmp(optarg, sink_names[sink]) == 0) {
+            only_sink = sink;
+          }
+        }
+        break;
+      default:
+        fprintf(stderr, "Usage: %s [-n channels] [-t h264|jpeg] [-W width] [-H height] [-f fps]\n"
+                        "          [-b kbps] [-g gop] [-d seconds] [-s null|pipe|file]\n"
+                        "          [-r recording [-x]]\n", argv[0]);
+        return -1;
+    }
+  }
+
+  if (options.channels < 1 || options.channels > BENCH_MAX_CHANNELS ||
+      options.fps < 1 || options.gop < 1 || options.seconds < 1) {
+    fprintf(stderr, "Between 1 and %d channels, fps, gop and seconds at least 1\n", BENCH_MAX_CHANNELS);
+    return -1;
+  }
+
+  // The loop logs every channel start and its FPS, keep the table readable
+  log_set_level(LOGC_ERROR);
+  signal(SIGPIPE, SIG_IGN);
+  IMP_System_Init();
+
+  if (options.replay_file != NULL) {
+    printf("%d x %s replay of %s @ %s, %d s per sink\n",
+           options.channels, options.jpeg ? "jpeg" : "h264", options.replay_file,
+           options.replay_fast ? "full speed" : "native fps", options.seconds);
+  }
+  else {
+    printf("%d x %s %dx%d @ %d fps, %d kbps, gop %d, %d s per sink\n",
+           options.channels, options.jpeg ? "jpeg" : "h264", options.width, options.height,
+           options.fps, options.kbps, options.gop, options.seconds);
+  }
+  printf("sink      fps  Mbit/s  cpu us/fr  p50 ms  p90 ms  p99 ms  max ms  dropped\n");
+
+  for (sink = 0; sink < 3; sink++) {
+    if (only_sink < 0 || only_sink == sink) {
+      run_sink(&options, sink);
+    }
+  }
+
+  IMP_System_Exit();
+
+  return 0;
+}
@@ -0,0 +1,781 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <imp_common.h>
+#include <imp_system.h>
+#include <imp_encoder.h>
+#include <imp_framesource.h>
+#include "imp_sim.h"
+
+/*
+
+Host stand-in for the encoder, frame source and system calls of libimp,
+so the encoder output loop can be run and measured without a camera.
+Build it in place of libimp, like ivs_sim.c.
+
+Every encoder channel produces frames on the clock of its configured
+frame rate, whether or not they are read. A channel holds at most
+IMP_SIM_STREAM_DEPTH frames, older ones are dropped and show up as a gap
+in the stream sequence numbers, as they would on the camera.
+
+Frame sizes follow the maxBitRate (kbps) and maxGop of the H.264 VBR
+attributes given to IMP_Encoder_CreateChn, with IDR frames six times the
+size of P frames and +/-25% noise on every frame. H.264 frames come as
+SPS, PPS and IMP_SIM_SLICES slice packs for an IDR and IMP_SIM_SLICES
+slice packs for a P frame. JPEG frames are a single pack. User data
+from IMP_Encoder_InsertUserData goes in front of the next H.264 frame as
+a user data unregistered SEI pack.
+
+IMP keeps its buffers in the low 4GB (virAddr is 32 bits), so on 64 bit
+hosts they are mapped with MAP_32BIT. Hosts without it fail to create
+channels whose buffers land higher.
+
+*/
+
+#ifndef MAP_32BIT
+#define MAP_32BIT 0
+#endif
+
+// Size of an IDR frame compared to a P frame
+#define SIM_IDR_RATIO          6
+#define SIM_MAX_PACKS          (IMP_SIM_SLICES + 3)
+#define SIM_MAX_USER_DATA      1024
+#define SIM_MAX_FRAMESOURCES   5
+
+typedef struct {
+	int created;
+	int receiving;
+	IMPPayloadType type;
+	uint32_t width;
+	uint32_t height;
+	IMPEncoderFrmRate rate;
+	uint32_t gop;
+	uint32_t kbps;
+
+	uint8_t *buffer;
+	uint32_t buffer_size;
+	IMPEncoderPack packs[SIM_MAX_PACKS];
+
+	// Frame n is due at start_us + n * interval_us
+	int64_t start_us;
+	int64_t interval_us;
+	uint64_t next_frame;
+	uint64_t due_us;
+	uint32_t gop_position;
+	int idr_requested;
+	uint32_t random;
+	uint8_t user_data[SIM_MAX_USER_DATA];
+	uint32_t user_data_length;
+	IMPEncoderUserDataCfg user_data_cfg;
+
+	pthread_mutex_t lock;
+	ImpSimStats stats;
+	uint32_t latency_index;
+} SimChannel;
+
+typedef struct {
+	IMPFSChnAttr attr;
+	int enabled;
+	int depth;
+	int64_t start_us;
+	uint64_t next_frame;
+	uint8_t *pixels;
+	IMPFrameInfo info;
+} SimFrameSource;
+
+static SimChannel channels[IMP_SIM_MAX_CHANNELS];
+static SimFrameSource frame_sources[SIM_MAX_FRAMESOURCES];
+static int64_t base_us = 0;
+
+
+static int64_t sim_now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void sim_sleep_until(int64_t when_us)
+{
+  int64_t delay = when_us - sim_now_us();
+  if (delay > 0) {
+    usleep(delay);
+  }
+}
+
+static void *sim_map(uint32_t size)
+{
+  void *buffer = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS | MAP_32BIT, -1, 0);
+  if (buffer == MAP_FAILED) {
+    return NULL;
+  }
+
+  // virAddr would be truncated
+  if ((uintptr_t)buffer + size > UINT32_MAX) {
+    fprintf(stderr, "imp_sim: buffer mapped above 4GB, virAddr cannot address it on this host\n");
+    munmap(buffer, size);
+    return NULL;
+  }
+
+  return buffer;
+}
+
+static uint32_t sim_random(SimChannel *channel)
+{
+  // xorshift32
+  channel->random ^= channel->random << 13;
+  channel->random ^= channel->random >> 17;
+  channel->random ^= channel->random << 5;
+  return channel->random;
+}
+
+static SimChannel *sim_channel(int encChn)
+{
+  if (encChn < 0 || encChn >= IMP_SIM_MAX_CHANNELS || !channels[encChn].created) {
+    return NULL;
+  }
+  return &channels[encChn];
+}
+
+static int64_t sim_interval_us(IMPEncoderFrmRate *rate)
+{
+  if (rate->frmRateNum == 0) {
+    return 40000;
+  }
+  return (int64_t)1000000 * rate->frmRateDen / rate->frmRateNum;
+}
+
+
+/* System */
+
+int IMP_System_Init(void)
+{
+  base_us = sim_now_us();
+  return 0;
+}
+
+int IMP_System_Exit(void) { return 0; }
+
+int64_t IMP_System_GetTimeStamp(void)
+{
+  return sim_now_us() - base_us;
+}
+
+int IMP_System_RebaseTimeStamp(int64_t basets)
+{
+  base_us = sim_now_us() - basets;
+  return 0;
+}
+
+int IMP_System_Bind(IMPCell *srcCell, IMPCell *dstCell) { return 0; }
+int IMP_System_UnBind(IMPCell *srcCell, IMPCell *dstCell) { return 0; }
+
+
+/* Frame source */
+
+int IMP_FrameSource_CreateChn(int chnNum, IMPFSChnAttr *chn_attr)
+{
+  SimFrameSource *fs;
+
+  if (chnNum < 0 || chnNum >= SIM_MAX_FRAMESOURCES || chn_attr == NULL) {
+    return -1;
+  }
+
+  fs = &frame_sources[chnNum];
+  fs->attr = *chn_attr;
+  fs->pixels = sim_map(chn_attr->picWidth * chn_attr->picHeight * 3 / 2);
+  if (fs->pixels == NULL) {
+    return -1;
+  }
+  memset(fs->pixels, 128, chn_attr->picWidth * chn_attr->picHeight * 3 / 2);
+
+  return 0;
+}
+
+int IMP_FrameSource_DestroyChn(int chnNum)
+{
+  SimFrameSource *fs = &frame_sources[chnNum];
+
+  if (fs->pixels != NULL) {
+    munmap(fs->pixels, fs->attr.picWidth * fs->attr.picHeight * 3 / 2);
+  }
+  memset(fs, 0, sizeof(SimFrameSource));
+  return 0;
+}
+
+int IMP_FrameSource_EnableChn(int chnNum)
+{
+  frame_sources[chnNum].enabled = 1;
+  frame_sources[chnNum].start_us = sim_now_us();
+  frame_sources[chnNum].next_frame = 0;
+  return 0;
+}
+
+int IMP_FrameSource_DisableChn(int chnNum)
+{
+  frame_sources[chnNum].enabled = 0;
+  return 0;
+}
+
+int IMP_FrameSource_GetChnAttr(int chnNum, IMPFSChnAttr *chnAttr)
+{
+  *chnAttr = frame_sources[chnNum].attr;
+  return 0;
+}
+
+int IMP_FrameSource_SetChnAttr(int chnNum, const IMPFSChnAttr *chnAttr)
+{
+  frame_sources[chnNum].attr = *chnAttr;
+  return 0;
+}
+
+int IMP_FrameSource_SetFrameDepth(int chnNum, int depth)
+{
+  frame_sources[chnNum].depth = depth;
+  return 0;
+}
+
+int IMP_FrameSource_GetFrameDepth(int chnNum, int *depth)
+{
+  *depth = frame_sources[chnNum].depth;
+  return 0;
+}
+
+// NV12 frames, mid grey with a bright bar moving across the luma plane
+int IMP_FrameSource_GetFrame(int chnNum, IMPFrameInfo **frame)
+{
+  SimFrameSource *fs = &frame_sources[chnNum];
+  IMPEncoderFrmRate rate;
+  int width = fs->attr.picWidth;
+  int height = fs->attr.picHeight;
+  int bar = width / 8;
+  int x, y, position;
+
+  if (!fs->enabled || fs->pixels == NULL || fs->depth <= 0) {
+    return -1;
+  }
+
+  rate.frmRateNum = fs->attr.outFrmRateNum;
+  rate.frmRateDen = fs->attr.outFrmRateDen;
+  sim_sleep_until(fs->start_us + fs->next_frame * sim_interval_us(&rate));
+
+  position = (fs->next_frame * 4) % (width - bar);
+  for (y = 0; y < height; y++) {
+    memset(fs->pixels + y * width, 128, width);
+    for (x = position; x < position + bar; x++) {
+      fs->pixels[y * width + x] = 235;
+    }
+  }
+
+  memset(&fs->info, 0, sizeof(IMPFrameInfo));
+  fs->info.index = fs->next_frame;
+  fs->info.width = width;
+  fs->info.height = height;
+  fs->info.pixfmt = PIX_FMT_NV12;
+  fs->info.size = width * height * 3 / 2;
+  fs->info.virAddr = (uint32_t)(uintptr_t)fs->pixels;
+  fs->info.timeStamp = IMP_System_GetTimeStamp();
+  fs->next_frame++;
+
+  *frame = &fs->info;
+  return 0;
+}
+
+int IMP_FrameSource_ReleaseFrame(int chnNum, IMPFrameInfo *frame) { return 0; }
+
+
+/* Encoder */
+
+int IMP_Encoder_CreateGroup(int encGroup) { return 0; }
+int IMP_Encoder_DestroyGroup(int encGroup) { return 0; }
+int IMP_Encoder_RegisterChn(int encGroup, int encChn) { return 0; }
+int IMP_Encoder_UnRegisterChn(int encChn) { return 0; }
+
+int IMP_Encoder_CreateChn(int encChn, const IMPEncoderCHNAttr *attr)
+{
+  SimChannel *channel;
+  uint32_t i;
+
+  if (encChn < 0 || encChn >= IMP_SIM_MAX_CHANNELS || attr == NULL) {
+    return -1;
+  }
+
+  channel = &channels[encChn];
+  memset(channel, 0, sizeof(SimChannel));
+  channel->type = attr->encAttr.enType;
+  channel->width = attr->encAttr.picWidth;
+  channel->height = attr->encAttr.picHeight;
+  channel->rate = attr->rcAttr.attrH264Vbr.outFrmRate;
+  channel->gop = attr->rcAttr.attrH264Vbr.maxGop > 0 ? attr->rcAttr.attrH264Vbr.maxGop : 1;
+  channel->kbps = attr->rcAttr.attrH264Vbr.maxBitRate;
+  channel->user_data_cfg = attr->encAttr.userData;
+  channel->random = 0x9e3779b9 + encChn;
+
+  // The IMP rule for bufSize, 1.5 times the picture
+  channel->buffer_size = attr->encAttr.bufSize;
+  if (channel->buffer_size < channel->width * channel->height * 3 / 2) {
+    channel->buffer_size = channel->width * channel->height * 3 / 2;
+  }
+
+  channel->buffer = sim_map(channel->buffer_size);
+  if (channel->buffer == NULL) {
+    return -1;
+  }
+
+  // Coded data is noise without 0x00 or 0xff bytes, so it never holds a
+  // start code or JPEG marker. Only those are filled in per frame.
+  for (i = 0; i < channel->buffer_size; i++) {
+    channel->buffer[i] = 0x80 | (sim_random(channel) & 0x7e);
+  }
+
+  pthread_mutex_init(&channel->lock, NULL);
+  channel->created = 1;
+
+  return 0;
+}
+
+int IMP_Encoder_DestroyChn(int encChn)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  munmap(channel->buffer, channel->buffer_size);
+  pthread_mutex_destroy(&channel->lock);
+  channel->created = 0;
+
+  return 0;
+}
+
+int IMP_Encoder_GetChnAttr(int encChn, IMPEncoderCHNAttr * const attr)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  memset(attr, 0, sizeof(IMPEncoderCHNAttr));
+  attr->encAttr.enType = channel->type;
+  attr->encAttr.bufSize = channel->buffer_size;
+  attr->encAttr.picWidth = channel->width;
+  attr->encAttr.picHeight = channel->height;
+  attr->rcAttr.rcMode = ENC_RC_MODE_H264VBR;
+  attr->rcAttr.attrH264Vbr.outFrmRate = channel->rate;
+  attr->rcAttr.attrH264Vbr.maxGop = channel->gop;
+  attr->rcAttr.attrH264Vbr.maxBitRate = channel->kbps;
+
+  return 0;
+}
+
+int IMP_Encoder_StartRecvPic(int encChn)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  channel->interval_us = sim_interval_us(&channel->rate);
+  channel->start_us = sim_now_us() + channel->interval_us;
+  channel->next_frame = 0;
+  channel->gop_position = 0;
+  channel->receiving = 1;
+
+  return 0;
+}
+
+int IMP_Encoder_StopRecvPic(int encChn)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  channel->receiving = 0;
+  return 0;
+}
+
+// Frames that were due but not read yet
+static uint64_t sim_pending(SimChannel *channel, int64_t now)
+{
+  uint64_t due;
+
+  if (!channel->receiving || now < channel->start_us) {
+    return 0;
+  }
+
+  due = (now - channel->start_us) / channel->interval_us + 1;
+  return due > channel->next_frame ? due - channel->next_frame : 0;
+}
+
+int IMP_Encoder_Query(int encChn, IMPEncoderCHNStat *stat)
+{
+  SimChannel *channel = sim_channel(encChn);
+  uint64_t pending;
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  pending = sim_pending(channel, sim_now_us());
+  if (pending > IMP_SIM_STREAM_DEPTH) {
+    pending = IMP_SIM_STREAM_DEPTH;
+  }
+
+  memset(stat, 0, sizeof(IMPEncoderCHNStat));
+  stat->registered = 1;
+  stat->work_done = channel->receiving ? 0 : 1;
+  stat->leftStreamFrames = pending;
+  stat->leftStreamBytes = pending * channel->kbps * 125 * channel->interval_us / 1000000;
+
+  return 0;
+}
+
+int IMP_Encoder_PollingStream(int encChn, uint32_t timeoutMsec)
+{
+  SimChannel *channel = sim_channel(encChn);
+  int64_t due;
+
+  if (channel == NULL || !channel->receiving) {
+    return -1;
+  }
+
+  due = channel->start_us + channel->next_frame * channel->interval_us;
+  if (due > sim_now_us() + (int64_t)timeoutMsec * 1000) {
+    usleep(timeoutMsec * 1000);
+    return -1;
+  }
+
+  sim_sleep_until(due);
+  return 0;
+}
+
+static void sim_fill_pack(SimChannel *channel, int index, uint32_t offset, uint32_t length,
+                          IMPEncoderH264NaluType nal_type)
+{
+  IMPEncoderPack *pack = &channel->packs[index];
+  uint8_t *data = channel->buffer + offset;
+
+  if (channel->type == PT_JPEG) {
+    // SOI ... EOI
+    data[0] = 0xff;
+    data[1] = 0xd8;
+    data[length - 2] = 0xff;
+    data[length - 1] = 0xd9;
+  }
+  else {
+    data[0] = 0;
+    data[1] = 0;
+    data[2] = 0;
+    data[3] = 1;
+    data[4] = (nal_type == IMP_NAL_SLICE ? 0x40 : 0x60) | nal_type;
+  }
+
+  memset(pack, 0, sizeof(IMPEncoderPack));
+  pack->virAddr = (uint32_t)(uintptr_t)data;
+  pack->length = length;
+  pack->timestamp = channel->due_us - base_us;
+  pack->dataType.h264Type = nal_type;
+}
+
+// Put noise back over the markers of the last frame, packs move around
+// from frame to frame
+static void sim_clear_markers(SimChannel *channel)
+{
+  IMPEncoderPack *pack;
+  uint8_t *data;
+  int i;
+
+  for (i = 0; i < SIM_MAX_PACKS; i++) {
+    pack = &channel->packs[i];
+    if (pack->length == 0) {
+      continue;
+    }
+    data = (uint8_t *)(uintptr_t)pack->virAddr;
+    if (pack->dataType.h264Type == IMP_NAL_SEI) {
+      memset(data, 0x80, pack->length);
+    }
+    memset(data, 0x80, 5);
+    memset(data + pack->length - 2, 0x80, 2);
+    pack->length = 0;
+  }
+}
+
+// SEI payload type 5 with the pending user data, returns its length
+static uint32_t sim_fill_sei(SimChannel *channel, int index)
+{
+  uint8_t *data = channel->buffer;
+  uint32_t length = 6;
+  uint32_t remaining = channel->user_data_length;
+
+  data[5] = 5;
+  while (remaining >= 255) {
+    data[length++] = 255;
+    remaining -= 255;
+  }
+  data[length++] = remaining;
+  memcpy(&data[length], channel->user_data, channel->user_data_length);
+  length += channel->user_data_length;
+  data[length++] = 0x80;
+
+  sim_fill_pack(channel, index, 0, length, IMP_NAL_SEI);
+  channel->user_data_length = 0;
+
+  return length;
+}
+
+int IMP_Encoder_GetStream(int encChn, IMPEncoderStream *stream, bool blockFlag)
+{
+  SimChannel *channel = sim_channel(encChn);
+  uint64_t pending, dropped;
+  uint32_t average, size, slice, offset;
+  int idr, i, count;
+
+  if (channel == NULL || !channel->receiving) {
+    return -1;
+  }
+
+  pending = sim_pending(channel, sim_now_us());
+  if (pending == 0) {
+    if (!blockFlag) {
+      return -1;
+    }
+    IMP_Encoder_PollingStream(encChn, 1000);
+    pending = 1;
+  }
+
+  // The stream buffer is full, the oldest frames are gone
+  if (pending > IMP_SIM_STREAM_DEPTH) {
+    dropped = pending - IMP_SIM_STREAM_DEPTH;
+    channel->next_frame += dropped;
+    channel->gop_position += dropped;
+    pthread_mutex_lock(&channel->lock);
+    channel->stats.dropped += dropped;
+    pthread_mutex_unlock(&channel->lock);
+  }
+
+  channel->due_us = channel->start_us + channel->next_frame * channel->interval_us;
+
+  idr = channel->idr_requested || channel->gop_position % channel->gop == 0;
+  if (idr) {
+    channel->gop_position = 0;
+    channel->idr_requested = 0;
+  }
+
+  // Bytes per frame over a GOP, split between one IDR and gop - 1 P frames
+  average = (uint64_t)channel->kbps * 125 * channel->interval_us / 1000000;
+  if (channel->type == PT_JPEG) {
+    size = average;
+  }
+  else {
+    size = (uint64_t)average * channel->gop / (channel->gop - 1 + SIM_IDR_RATIO);
+    if (idr) {
+      size *= SIM_IDR_RATIO;
+    }
+  }
+  size = size * 3 / 4 + sim_random(channel) % (size / 2 + 1);
+
+  if (size < 64 * SIM_MAX_PACKS) {
+    size = 64 * SIM_MAX_PACKS;
+  }
+  if (size > channel->buffer_size) {
+    size = channel->buffer_size;
+  }
+
+  sim_clear_markers(channel);
+
+  count = 0;
+  offset = 0;
+  if (channel->type == PT_JPEG) {
+    sim_fill_pack(channel, count++, 0, size, IMP_NAL_UNKNOWN);
+  }
+  else {
+    if (channel->user_data_length > 0) {
+      offset = sim_fill_sei(channel, count++);
+      size = size > offset + 64 * SIM_MAX_PACKS ? size - offset : 64 * SIM_MAX_PACKS;
+    }
+    if (idr) {
+      sim_fill_pack(channel, count++, offset, 16, IMP_NAL_SPS);
+      sim_fill_pack(channel, count++, offset + 16, 8, IMP_NAL_PPS);
+      offset += 24;
+      size -= 24;
+    }
+
+    slice = size / IMP_SIM_SLICES;
+    for (i = 0; i < IMP_SIM_SLICES; i++) {
+      sim_fill_pack(channel, count++, offset,
+                    i == IMP_SIM_SLICES - 1 ? size - slice * i : slice,
+                    idr ? IMP_NAL_SLICE_IDR : IMP_NAL_SLICE);
+      // first_mb_in_slice, ue(v): 0 (a 1 bit) for the first slice only,
+      // so the stream splits into the right pictures when parsed
+      channel->buffer[offset + 5] = i == 0 ? 0xc0 : 0x40;
+      offset += slice;
+    }
+  }
+  channel->packs[count - 1].frameEnd = 1;
+
+  memset(stream, 0, sizeof(IMPEncoderStream));
+  stream->pack = channel->packs;
+  stream->packCount = count;
+  stream->seq = channel->next_frame;
+
+  channel->next_frame++;
+  channel->gop_position++;
+
+  pthread_mutex_lock(&channel->lock);
+  channel->stats.idr_frames += idr;
+  pthread_mutex_unlock(&channel->lock);
+
+  return 0;
+}
+
+// The latency of a frame runs from when it was due to when it is
+// released, so it covers everything the reader did with it
+int IMP_Encoder_ReleaseStream(int encChn, IMPEncoderStream *stream)
+{
+  SimChannel *channel = sim_channel(encChn);
+  uint32_t i;
+  uint64_t bytes = 0;
+  int64_t latency;
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  for (i = 0; i < stream->packCount; i++) {
+    bytes += stream->pack[i].length;
+  }
+  latency = sim_now_us() - channel->due_us;
+
+  pthread_mutex_lock(&channel->lock);
+  channel->stats.frames++;
+  channel->stats.bytes += bytes;
+  channel->stats.latency_us[channel->latency_index++ % IMP_SIM_LATENCY_SAMPLES] = latency > 0 ? latency : 0;
+  if (channel->stats.num_latencies < IMP_SIM_LATENCY_SAMPLES) {
+    channel->stats.num_latencies++;
+  }
+  pthread_mutex_unlock(&channel->lock);
+
+  return 0;
+}
+
+int IMP_Encoder_RequestIDR(int encChn)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  channel->idr_requested = 1;
+  return 0;
+}
+
+int IMP_Encoder_FlushStream(int encChn)
+{
+  return IMP_Encoder_RequestIDR(encChn);
+}
+
+// The next frame is due one new interval from now
+int IMP_Encoder_SetChnFrmRate(int encChn, const IMPEncoderFrmRate *pstFps)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL || pstFps->frmRateNum == 0 || pstFps->frmRateDen == 0) {
+    return -1;
+  }
+
+  channel->rate = *pstFps;
+  channel->interval_us = sim_interval_us(&channel->rate);
+  channel->start_us = sim_now_us() + channel->interval_us - channel->next_frame * channel->interval_us;
+
+  return 0;
+}
+
+int IMP_Encoder_GetChnFrmRate(int encChn, IMPEncoderFrmRate *pstFps)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  *pstFps = channel->rate;
+  return 0;
+}
+
+int IMP_Encoder_SetGOPSize(int encChn, const IMPEncoderGOPSizeCfg *pstGOPSizeCfg)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL || pstGOPSizeCfg->gopsize <= 0) {
+    return -1;
+  }
+
+  channel->gop = pstGOPSizeCfg->gopsize;
+  return 0;
+}
+
+int IMP_Encoder_GetGOPSize(int encChn, IMPEncoderGOPSizeCfg *pstGOPSizeCfg)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  if (channel == NULL) {
+    return -1;
+  }
+
+  pstGOPSizeCfg->gopsize = channel->gop;
+  return 0;
+}
+
+int IMP_Encoder_SetChnROI(int encChn, const IMPEncoderROICfg *pstVencRoiCfg)
+{
+  return sim_channel(encChn) != NULL && pstVencRoiCfg->u32Index < 8 ? 0 : -1;
+}
+
+int IMP_Encoder_InsertUserData(int encChn, void *userData, uint32_t userDataLen)
+{
+  SimChannel *channel = sim_channel(encChn);
+
+  // Like the SDK only with buffers set up in the channel attributes,
+  // and one buffer here where the SDK has up to two
+  if (channel == NULL || userData == NULL || userDataLen == 0 || userDataLen > SIM_MAX_USER_DATA ||
+      channel->user_data_cfg.maxUserDataCnt == 0 || userDataLen > channel->user_data_cfg.maxUserDataSize ||
+      channel->user_data_length > 0) {
+    return -1;
+  }
+
+  memcpy(channel->user_data, userData, userDataLen);
+  channel->user_data_length = userDataLen;
+
+  return 0;
+}
+
+
+void imp_sim_get_stats(int channel, ImpSimStats *stats)
+{
+  SimChannel *sim = &channels[channel];
+
+  pthread_mutex_lock(&sim->lock);
+  memcpy(stats, &sim->stats, sizeof(ImpSimStats));
+  pthread_mutex_unlock(&sim->lock);
+}
+
+void imp_sim_reset_stats(int channel)
+{
+  SimChannel *sim = &channels[channel];
+
+  pthread_mutex_lock(&sim->lock);
+  memset(&sim->stats, 0, sizeof(ImpSimStats));
+  sim->latency_index = 0;
+  pthread_mutex_unlock(&sim->lock);
+}
@@ -0,0 +1,27 @@
+#ifndef IMP_SIM_H
+#define IMP_SIM_H
+
+#include <stdint.h>
+
+// Frames the simulated encoder holds for the reader before it starts
+// dropping the oldest ones, like the stream buffer of a real channel
+#define IMP_SIM_STREAM_DEPTH      3
+// Slices, and so packs, per coded H.264 picture
+#define IMP_SIM_SLICES            4
+// Latency samples kept per channel
+#define IMP_SIM_LATENCY_SAMPLES   8192
+#define IMP_SIM_MAX_CHANNELS      8
+
+typedef struct {
+	uint32_t frames;
+	uint32_t dropped;
+	uint32_t idr_frames;
+	uint64_t bytes;
+	uint32_t num_latencies;
+	uint32_t latency_us[IMP_SIM_LATENCY_SAMPLES];
+} ImpSimStats;
+
+void imp_sim_get_stats(int channel, ImpSimStats *stats);
+void imp_sim_reset_stats(int channel);
+
+#endif /* IMP_SIM_H */
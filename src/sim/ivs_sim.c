@@ -0,0 +1,140 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <imp_ivs.h>
+#include <imp_ivs_move.h>
+
+/*
+
+Host stand-in for the IVS calls used by motion.c, so the motion thread
+and its events can be exercised without a camera. It is linked in place
+of libimp, together with imp_sim.c for the frame source calls, by the
+motion_bench target (motion_bench.c).
+
+Results follow a script in IVS_SIM_SCRIPT: comma separated
+"<roi>:<start ms>-<end ms>" windows, counted from IMP_IVS_StartRecvPic,
+in which that ROI reports motion. IVS_SIM_FPS sets the frame rate
+(default 25, also used when it is 0 or not a number); one result is
+produced every skipFrameCnt + 1 frames.
+
+*/
+
+#define IVS_SIM_MAX_WINDOWS   32
+
+typedef struct {
+  int roi;
+  long start_ms;
+  long end_ms;
+} SimWindow;
+
+static IMP_IVS_MoveParam sim_param;
+static IMPIVSInterface sim_interface;
+static IMP_IVS_MoveOutput sim_output;
+static SimWindow sim_windows[IVS_SIM_MAX_WINDOWS];
+static int sim_num_windows = 0;
+static long sim_start_ms = 0;
+static long sim_next_result_ms = 0;
+static long sim_interval_ms = 40;
+
+
+static long sim_now_ms(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000L + now.tv_nsec / 1000000;
+}
+
+static void sim_load_script(void)
+{
+  const char *script = getenv("IVS_SIM_SCRIPT");
+  const char *fps_env = getenv("IVS_SIM_FPS");
+  int fps = fps_env ? atoi(fps_env) : 0;
+  SimWindow *window;
+
+  sim_num_windows = 0;
+  while (script && *script && sim_num_windows < IVS_SIM_MAX_WINDOWS) {
+    window = &sim_windows[sim_num_windows];
+    if (sscanf(script, "%d:%ld-%ld", &window->roi, &window->start_ms, &window->end_ms) == 3) {
+      sim_num_windows++;
+    }
+    script = strchr(script, ',');
+    if (script) script++;
+  }
+
+  // Unset, 0 or not a number is 25 fps
+  if (fps <= 0) fps = 25;
+  sim_interval_ms = 1000 / fps * (sim_param.skipFrameCnt + 1);
+  if (sim_interval_ms <= 0) sim_interval_ms = 40;
+}
+
+int IMP_IVS_CreateGroup(int GrpNum) { return 0; }
+int IMP_IVS_DestroyGroup(int GrpNum) { return 0; }
+int IMP_IVS_CreateChn(int ChnNum, IMPIVSInterface *handler) { return handler ? 0 : -1; }
+int IMP_IVS_DestroyChn(int ChnNum) { return 0; }
+int IMP_IVS_RegisterChn(int GrpNum, int ChnNum) { return 0; }
+int IMP_IVS_UnRegisterChn(int ChnNum) { return 0; }
+int IMP_IVS_StopRecvPic(int ChnNum) { return 0; }
+
+IMPIVSInterface *IMP_IVS_CreateMoveInterface(IMP_IVS_MoveParam *param)
+{
+  if (param->roiRectCnt < 0 || param->roiRectCnt > IMP_IVS_MOVE_MAX_ROI_CNT) {
+    return NULL;
+  }
+  sim_param = *param;
+  memset(&sim_interface, 0, sizeof(sim_interface));
+  sim_interface.param = &sim_param;
+  sim_interface.paramSize = sizeof(sim_param);
+  sim_interface.pixfmt = PIX_FMT_NV12;
+  return &sim_interface;
+}
+
+void IMP_IVS_DestroyMoveInterface(IMPIVSInterface *moveInterface)
+{
+}
+
+int IMP_IVS_StartRecvPic(int ChnNum)
+{
+  sim_load_script();
+  sim_start_ms = sim_now_ms();
+  sim_next_result_ms = sim_start_ms + sim_interval_ms;
+  return 0;
+}
+
+int IMP_IVS_PollingResult(int ChnNum, int timeoutMs)
+{
+  long now = sim_now_ms();
+
+  if (sim_next_result_ms > now + timeoutMs) {
+    usleep(timeoutMs * 1000);
+    return -1;
+  }
+  if (sim_next_result_ms > now) {
+    usleep((sim_next_result_ms - now) * 1000);
+  }
+  return 0;
+}
+
+int IMP_IVS_GetResult(int ChnNum, void **result)
+{
+  int i;
+  long t = sim_next_result_ms - sim_start_ms;
+
+  memset(&sim_output, 0, sizeof(sim_output));
+  for (i = 0; i < sim_num_windows; i++) {
+    if (sim_windows[i].roi >= 0 && sim_windows[i].roi < sim_param.roiRectCnt &&
+        t >= sim_windows[i].start_ms && t < sim_windows[i].end_ms) {
+      sim_output.retRoi[sim_windows[i].roi] = 1;
+    }
+  }
+  sim_next_result_ms += sim_interval_ms;
+
+  *result = &sim_output;
+  return 0;
+}
+
+int IMP_IVS_ReleaseResult(int ChnNum, void *result)
+{
+  return 0;
+}
@@ -0,0 +1,244 @@
+#include "capture.h"
+#include "motion.h"
+#include "events.h"
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+
+Event latency benchmark for the IVS motion thread. Runs motion.c against
+the scripted IVS results of ivs_sim.c, subscribes to the event socket like
+a recorder would and prints every motion event with the time it arrived,
+counted from the start of detection, and how late it was:
+
+  start     arrival minus the start of the scripted window
+  stop      arrival minus the end of the scripted window, so it includes
+            hold_ms
+
+  motion_bench [-s script] [-f fps] [-k skip_frames] [-p poll_ms]
+               [-o hold_ms] [-d seconds]
+
+The script has the IVS_SIM_SCRIPT format, "<roi>:<start ms>-<end ms>,...",
+with two ROIs, the left and right half of the picture.
+
+*/
+
+#define BENCH_SOCKET_PATH     "/tmp/motion_bench.sock"
+#define BENCH_MAX_WINDOWS     32
+
+sig_atomic_t sigint_received = 0;
+
+typedef struct {
+  int roi;
+  long start_ms;
+  long end_ms;
+} BenchWindow;
+
+static BenchWindow windows[BENCH_MAX_WINDOWS];
+static int num_windows = 0;
+static struct timespec bench_start;
+static int events_received = 0;
+
+
+static long elapsed_ms(void)
+{
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - bench_start.tv_sec) * 1000L + (now.tv_nsec - bench_start.tv_nsec) / 1000000;
+}
+
+
+// Same format as ivs_sim.c reads
+static void parse_script(const char *script)
+{
+  BenchWindow *window;
+
+  num_windows = 0;
+  while (script && *script && num_windows < BENCH_MAX_WINDOWS) {
+    window = &windows[num_windows];
+    if (sscanf(script, "%d:%ld-%ld", &window->roi, &window->start_ms, &window->end_ms) == 3) {
+      num_windows++;
+    }
+    script = strchr(script, ',');
+    if (script) script++;
+  }
+}
+
+
+// The scripted window of this ROI closest before t for the given edge
+static BenchWindow *find_window(int roi, int start, long t)
+{
+  int i;
+  long edge;
+  BenchWindow *found = NULL;
+
+  for (i = 0; i < num_windows; i++) {
+    edge = start ? windows[i].start_ms : windows[i].end_ms;
+    if (windows[i].roi == roi && edge <= t &&
+        (found == NULL || edge > (start ? found->start_ms : found->end_ms))) {
+      found = &windows[i];
+    }
+  }
+
+  return found;
+}
+
+
+static void *subscriber_entry_start(void *subscriber_params)
+{
+  int fd = *(int *)subscriber_params;
+  int roi, start;
+  long t;
+  char line[512];
+  const char *member;
+  BenchWindow *window;
+  FILE *events = fdopen(fd, "r");
+
+  if (events == NULL) {
+    return NULL;
+  }
+
+  while (fgets(line, sizeof(line), events) != NULL) {
+    t = elapsed_ms();
+    line[strcspn(line, "\n")] = '\0';
+    events_received++;
+
+    member = strstr(line, "\"roi\":");
+    if (member == NULL || sscanf(member, "\"roi\":%d", &roi) != 1) {
+      printf("%7ld           %s\n", t, line);
+      continue;
+    }
+
+    start = strstr(line, "\"state\":\"start\"") != NULL;
+    window = find_window(roi, start, t);
+    if (window == NULL) {
+      printf("%7ld        -  %s\n", t, line);
+    }
+    else {
+      printf("%7ld  %7ld  %s\n", t, t - (start ? window->start_ms : window->end_ms), line);
+    }
+  }
+
+  fclose(events);
+  return NULL;
+}
+
+
+static int subscribe(void)
+{
+  int fd;
+  struct sockaddr_un address;
+
+  fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", BENCH_SOCKET_PATH);
+
+  if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  return fd;
+}
+
+
+int main(int argc, char *argv[])
+{
+  int opt, fd;
+  int seconds = 5;
+  const char *script = "0:1000-3000,1:2000-2500";
+  const char *fps = "25";
+  pthread_t events_thread, subscriber_thread, motion_thread;
+  static CameraConfig camera_config;
+  MotionSettings *motion = &camera_config.motion;
+
+  motion->enabled = 1;
+  motion->method = MOTION_METHOD_IVS;
+  motion->framesource = 1;
+  motion->skip_frames = 2;
+  motion->poll_interval_ms = 200;
+  motion->hold_ms = 500;
+
+  while ((opt = getopt(argc, argv, "s:f:k:p:o:d:")) != -1) {
+    switch (opt) {
+      case 's': script = optarg; break;
+      case 'f': fps = optarg; break;
+      case 'k': motion->skip_frames = atoi(optarg); break;
+      case 'p': motion->poll_interval_ms = atoi(optarg); break;
+      case 'o': motion->hold_ms = atoi(optarg); break;
+      case 'd': seconds = atoi(optarg); break;
+      default:
+        fprintf(stderr, "Usage: %s [-s script] [-f fps] [-k skip_frames] [-p poll_ms]\n"
+                        "          [-o hold_ms] [-d seconds]\n", argv[0]);
+        return -1;
+    }
+  }
+
+  if (seconds < 1 || atoi(fps) < 1 || motion->skip_frames < 0 || motion->poll_interval_ms < 1) {
+    fprintf(stderr, "seconds, fps and poll_ms at least 1, skip_frames at least 0\n");
+    return -1;
+  }
+
+  parse_script(script);
+  setenv("IVS_SIM_SCRIPT", script, 1);
+  setenv("IVS_SIM_FPS", fps, 1);
+
+  // Left and right half of the picture
+  motion->num_rois = 2;
+  motion->rois[0] = (MotionRoi){ 0, 0, SENSOR_WIDTH / 2, SENSOR_HEIGHT, 3 };
+  motion->rois[1] = (MotionRoi){ SENSOR_WIDTH / 2, 0, SENSOR_WIDTH / 2, SENSOR_HEIGHT, 3 };
+  camera_config.num_framesources = 1;
+  camera_config.frame_sources[0].id = motion->framesource;
+  camera_config.frame_sources[0].pic_width = 640;
+  camera_config.frame_sources[0].pic_height = 360;
+
+  // Only the table
+  log_set_level(LOGC_WARN);
+  signal(SIGPIPE, SIG_IGN);
+
+  if (initialize_events(BENCH_SOCKET_PATH) != 0) {
+    return -1;
+  }
+  pthread_create(&events_thread, NULL, events_entry_start, NULL);
+
+  fd = subscribe();
+  if (fd < 0) {
+    fprintf(stderr, "Unable to subscribe to %s\n", BENCH_SOCKET_PATH);
+    return -1;
+  }
+  pthread_create(&subscriber_thread, NULL, subscriber_entry_start, &fd);
+
+  printf("script %s, %s fps, skip %d, poll %d ms, hold %d ms, %d s\n",
+         script, fps, motion->skip_frames, motion->poll_interval_ms, motion->hold_ms, seconds);
+  printf("   t ms  late ms  event\n");
+
+  // Give the events thread time to accept the subscriber
+  usleep(100000);
+
+  // The script runs from IMP_IVS_StartRecvPic, which is called here
+  clock_gettime(CLOCK_MONOTONIC, &bench_start);
+  if (initialize_motion_detection(&camera_config) != 0) {
+    return -1;
+  }
+  pthread_create(&motion_thread, NULL, motion_entry_start, &camera_config);
+
+  sleep(seconds);
+  sigint_received = 1;
+  pthread_join(motion_thread, NULL);
+
+  // Ends the subscriber, the events thread stays in accept
+  shutdown(fd, SHUT_RDWR);
+  pthread_join(subscriber_thread, NULL);
+  unlink(BENCH_SOCKET_PATH);
+
+  printf("%d event(s), %u detection(s)\n", events_received, motion_status.detections);
+
+  return 0;
+}
@@ -0,0 +1,122 @@
+#include "capture.h"
+#include "spsrewrite.h"
+
+/*
+
+SPS rewriting for low latency playback. The SPS the T20 encoder writes
+has no VUI, so a decoder knows neither the frame rate nor how many frames
+it has to hold back for reordering, and players assume the worst and
+buffer several frames before showing the first one.
+
+With sps_vui set the output loop passes every SPS pack through here and
+gets it back with VUI parameters added:
+
+- timing_info from the configured frame rate (not marked fixed, the
+  adaptive rate thread changes it)
+- bitstream_restriction with max_num_reorder_frames = 0 and
+  max_dec_frame_buffering = 1 (or the number of reference frames), which
+  is true for the P-only stream the encoder makes
+
+The rest of the SPS is written back as it was parsed, with h264bitstream.
+The encoder repeats the same SPS with every IDR, so it is only parsed
+again when it changes.
+
+*/
+
+
+int sps_rewriter_init(SpsRewriter *rewriter, EncoderSetting *encoder_setting)
+{
+  memset(rewriter, 0, sizeof(SpsRewriter));
+
+  // Two ticks per frame, one per field
+  rewriter->num_units_in_tick = encoder_setting->frame_rate_denominator;
+  rewriter->time_scale = 2 * encoder_setting->frame_rate_numerator;
+
+  rewriter->h264 = h264_new();
+  if (rewriter->h264 == NULL) {
+    log_error("Unable to allocate the SPS parser");
+    return -1;
+  }
+
+  return 0;
+}
+
+
+// Points output at the rewritten SPS (start code included) and returns
+// its size, or returns -1 to have the original written
+int sps_rewrite(SpsRewriter *rewriter, const uint8_t *data, int size, const uint8_t **output)
+{
+  int nal_start, nal_end, length;
+  uint8_t nal[SPS_REWRITE_MAX_SIZE];
+  sps_t *sps;
+
+  if (size > SPS_REWRITE_MAX_SIZE) {
+    return -1;
+  }
+
+  if (size == rewriter->input_size && memcmp(data, rewriter->input, size) == 0) {
+    *output = rewriter->output;
+    return rewriter->output_size;
+  }
+
+  // find_nal_unit takes a writable buffer
+  memcpy(nal, data, size);
+  if (find_nal_unit(nal, size, &nal_start, &nal_end) <= 0) {
+    return -1;
+  }
+
+  if (read_nal_unit(rewriter->h264, &nal[nal_start], nal_end - nal_start) < 0 ||
+      rewriter->h264->nal->nal_unit_type != NAL_UNIT_TYPE_SPS) {
+    return -1;
+  }
+
+  sps = rewriter->h264->sps;
+  if (!sps->vui_parameters_present_flag) {
+    memset(&sps->vui, 0, sizeof(sps->vui));
+    sps->vui_parameters_present_flag = 1;
+  }
+
+  sps->vui.timing_info_present_flag = 1;
+  sps->vui.num_units_in_tick = rewriter->num_units_in_tick;
+  sps->vui.time_scale = rewriter->time_scale;
+  sps->vui.fixed_frame_rate_flag = 0;
+
+  // The defaults for everything but the frame buffering
+  sps->vui.bitstream_restriction_flag = 1;
+  sps->vui.motion_vectors_over_pic_boundaries_flag = 1;
+  sps->vui.max_bytes_per_pic_denom = 2;
+  sps->vui.max_bits_per_mb_denom = 1;
+  sps->vui.log2_max_mv_length_horizontal = 15;
+  sps->vui.log2_max_mv_length_vertical = 15;
+  sps->vui.num_reorder_frames = 0;
+  sps->vui.max_dec_frame_buffering = sps->num_ref_frames > 1 ? sps->num_ref_frames : 1;
+
+  // Start code of the original, then the NAL unit
+  memcpy(rewriter->output, data, nal_start);
+  length = write_nal_unit(rewriter->h264, &rewriter->output[nal_start], SPS_REWRITE_MAX_SIZE - nal_start);
+  // A NAL unit that does not start with an SPS header is not passed on
+  if (length < 2 || length > SPS_REWRITE_MAX_SIZE - nal_start ||
+      (rewriter->output[nal_start] & 0x9f) != NAL_UNIT_TYPE_SPS) {
+    log_error("Unable to write the rewritten SPS, %d bytes", length);
+    rewriter->input_size = 0;
+    return -1;
+  }
+
+  memcpy(rewriter->input, data, size);
+  rewriter->input_size = size;
+  rewriter->output_size = nal_start + length;
+
+  log_info("SPS rewritten with VUI, %d bytes instead of %d", rewriter->output_size, size);
+
+  *output = rewriter->output;
+  return rewriter->output_size;
+}
+
+
+void sps_rewriter_free(SpsRewriter *rewriter)
+{
+  if (rewriter->h264 != NULL) {
+    h264_free(rewriter->h264);
+    rewriter->h264 = NULL;
+  }
+}
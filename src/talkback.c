@@ -0,0 +1,361 @@
+#include "capture.h"
+#include "talkback.h"
+#include "audioencoder.h"
+#include "audioring.h"
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+/*
+
+Talkback: audio from a local socket played on the camera speaker.
+
+The receive thread decodes every datagram into talkback_ring. The
+playback thread feeds IMP_AO_SendFrame from the ring through a resampler
+that is steered towards an adaptive target depth, so network jitter is
+absorbed without letting the delay grow. The target follows the
+interarrival jitter of the packets (RFC 3550 estimator) and stays between
+TALKBACK_MIN_DELAY_MS and TALKBACK_MAX_DELAY_MS.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+TalkbackStats talkback_stats;
+
+static int talkback_socket = -1;
+static AudioRing talkback_ring;
+
+// CLOCK_REALTIME timestamp of the newest sample in the ring, for the
+// latency measurement
+static volatile int64_t talkback_newest_timestamp_us = 0;
+
+
+static int64_t realtime_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return (int64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int16_t alaw_to_linear(uint8_t value)
+{
+  int t, segment;
+
+  value ^= 0x55;
+  t = (value & 0x0f) << 4;
+  segment = (value & 0x70) >> 4;
+  switch (segment) {
+    case 0:
+      t += 8;
+      break;
+    case 1:
+      t += 0x108;
+      break;
+    default:
+      t += 0x108;
+      t <<= segment - 1;
+  }
+  return (value & 0x80) ? t : -t;
+}
+
+static int16_t ulaw_to_linear(uint8_t value)
+{
+  int t;
+
+  value = ~value;
+  t = ((value & 0x0f) << 3) + 0x84;
+  t <<= (value & 0x70) >> 4;
+  return (value & 0x80) ? (0x84 - t) : (t - 0x84);
+}
+
+
+int initialize_talkback(AudioSettings *audio_settings)
+{
+  int ret;
+  struct sockaddr_un address;
+  IMPAudioIOAttr ao_settings;
+
+  log_info("Initializing talkback");
+
+  if (audio_ring_init(&talkback_ring, TALKBACK_RING_SIZE) != 0) {
+    log_error("Unable to allocate the talkback ring buffer");
+    return -1;
+  }
+
+  memset(&ao_settings, 0, sizeof(IMPAudioIOAttr));
+  ao_settings.samplerate = TALKBACK_SAMPLE_RATE;
+  ao_settings.bitwidth = AUDIO_BIT_WIDTH_16;
+  ao_settings.soundmode = AUDIO_SOUND_MODE_MONO;
+  ao_settings.frmNum = 4;
+  ao_settings.numPerFrm = TALKBACK_SAMPLES_PER_FRAME;
+  ao_settings.chnCnt = 1;
+
+  ret = IMP_AO_SetPubAttr(TALKBACK_AO_DEVICE, &ao_settings);
+  if (ret != 0) {
+    log_error("IMP_AO_SetPubAttr failed");
+    return -1;
+  }
+
+  ret = IMP_AO_Enable(TALKBACK_AO_DEVICE);
+  if (ret != 0) {
+    log_error("Error enabling the audio output device %d", TALKBACK_AO_DEVICE);
+    return -1;
+  }
+
+  ret = IMP_AO_EnableChn(TALKBACK_AO_DEVICE, TALKBACK_AO_CHANNEL);
+  if (ret != 0) {
+    log_error("Error enabling audio output channel");
+    return -1;
+  }
+
+  ret = IMP_AO_SetVol(TALKBACK_AO_DEVICE, TALKBACK_AO_CHANNEL, TALKBACK_VOLUME);
+  if (ret != 0) {
+    log_error("Error setting the audio output volume");
+  }
+
+  // Use what goes to the speaker as the echo reference for the microphone
+  if (audio_settings->aec) {
+    ret = IMP_AI_EnableAec(audio_settings->device_id, audio_settings->channel_id, TALKBACK_AO_DEVICE, TALKBACK_AO_CHANNEL);
+    if (ret != 0) {
+      log_error("IMP_AI_EnableAec failed");
+    }
+    else {
+      log_info("Echo cancellation enabled");
+    }
+  }
+
+  talkback_socket = socket(AF_UNIX, SOCK_DGRAM, 0);
+  if (talkback_socket < 0) {
+    log_error("Unable to create talkback socket");
+    return -1;
+  }
+
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s", TALKBACK_SOCKET_PATH);
+  unlink(TALKBACK_SOCKET_PATH);
+
+  if (bind(talkback_socket, (struct sockaddr *)&address, sizeof(address)) < 0) {
+    log_error("Unable to bind talkback socket %s", TALKBACK_SOCKET_PATH);
+    close(talkback_socket);
+    talkback_socket = -1;
+    return -1;
+  }
+
+  log_info("Talkback listening on %s", TALKBACK_SOCKET_PATH);
+
+  return 0;
+}
+
+
+// This is the entrypoint for the talkback receive thread
+void *talkback_receive_entry_start(void *talkback_thread_params)
+{
+  int i, length, num_samples;
+  uint8_t packet[sizeof(AudioPacketHeader) + 4096];
+  int16_t samples[4096];
+  AudioPacketHeader *header = (AudioPacketHeader *)packet;
+  uint8_t *payload = packet + sizeof(AudioPacketHeader);
+  int64_t arrival_us, last_arrival_us = 0, last_timestamp_us = 0;
+  int64_t transit_difference;
+  uint32_t expected_seq = 0;
+  int have_packet = 0;
+  double jitter_us = 0;
+
+  if (talkback_socket < 0) {
+    return NULL;
+  }
+
+  while(!sigint_received) {
+    length = recv(talkback_socket, packet, sizeof(packet), 0);
+    if (length < 0) {
+      if (errno != EINTR) {
+        log_error("Error receiving talkback audio");
+        sleep(1);
+      }
+      continue;
+    }
+
+    arrival_us = realtime_us();
+
+    if (length < sizeof(AudioPacketHeader) || header->magic != AUDIO_PACKET_MAGIC ||
+        header->length > length - sizeof(AudioPacketHeader)) {
+      log_warn("Ignoring malformed talkback packet");
+      continue;
+    }
+
+    switch (header->payload_type) {
+      case PT_PCM:
+        num_samples = header->length / sizeof(int16_t);
+        memcpy(samples, payload, num_samples * sizeof(int16_t));
+        break;
+      case PT_G711A:
+        num_samples = header->length;
+        for (i = 0; i < num_samples; i++) {
+          samples[i] = alaw_to_linear(payload[i]);
+        }
+        break;
+      case PT_G711U:
+        num_samples = header->length;
+        for (i = 0; i < num_samples; i++) {
+          samples[i] = ulaw_to_linear(payload[i]);
+        }
+        break;
+      default:
+        log_warn("Unsupported talkback payload type %d", header->payload_type);
+        continue;
+    }
+
+    talkback_stats.packets++;
+
+    if (have_packet) {
+      if (header->seq != expected_seq) {
+        if ((int32_t)(header->seq - expected_seq) < 0) {
+          // Arrived after later audio was already queued
+          talkback_stats.late_packets++;
+          continue;
+        }
+        talkback_stats.lost_packets += header->seq - expected_seq;
+      }
+
+      // Interarrival jitter, RFC 3550 section 6.4.1
+      transit_difference = (arrival_us - last_arrival_us) - (header->timestamp - last_timestamp_us);
+      if (transit_difference < 0) {
+        transit_difference = -transit_difference;
+      }
+      jitter_us += (transit_difference - jitter_us) / 16;
+      talkback_stats.jitter_us = jitter_us;
+    }
+
+    have_packet = 1;
+    expected_seq = header->seq + 1;
+    last_arrival_us = arrival_us;
+    last_timestamp_us = header->timestamp;
+
+    audio_ring_write(&talkback_ring, samples, num_samples);
+    talkback_newest_timestamp_us = header->timestamp +
+      (int64_t)num_samples * 1000000 / TALKBACK_SAMPLE_RATE;
+  }
+
+  return NULL;
+}
+
+
+// This is the entrypoint for the talkback playback thread
+void *talkback_playback_entry_start(void *talkback_thread_params)
+{
+  int ret;
+  int playing = 0;
+  int16_t frame[TALKBACK_SAMPLES_PER_FRAME];
+  uint32_t produced;
+  int32_t target, buffered, error, ppm;
+  int32_t min_target = TALKBACK_SAMPLE_RATE / 1000 * TALKBACK_MIN_DELAY_MS;
+  int32_t max_target = TALKBACK_SAMPLE_RATE / 1000 * TALKBACK_MAX_DELAY_MS;
+  uint32_t queued;
+  int64_t newest_us, latency_us;
+  time_t last_report = time(NULL);
+  IMPAudioFrame audio_frame;
+  IMPAudioOChnState ao_state;
+  AudioResampler resampler;
+
+  if (talkback_socket < 0) {
+    return NULL;
+  }
+
+  audio_resampler_init(&resampler, &talkback_ring);
+
+  while(!sigint_received) {
+    // Twice the jitter plus a frame covers nearly all of the arrival spread
+    target = TALKBACK_SAMPLES_PER_FRAME +
+             (int64_t)talkback_stats.jitter_us * 2 * TALKBACK_SAMPLE_RATE / 1000000;
+    if (target < min_target) target = min_target;
+    if (target > max_target) target = max_target;
+    talkback_stats.target_delay_ms = target * 1000 / TALKBACK_SAMPLE_RATE;
+
+    buffered = audio_ring_fill(&talkback_ring) + audio_resampler_buffered(&resampler);
+
+    // Wait for the jitter buffer to fill at the start of every talk spurt
+    if (!playing) {
+      if (buffered < target) {
+        usleep(5000);
+        continue;
+      }
+      playing = 1;
+    }
+
+    // Too much audio queued, drop the excess instead of building delay
+    if (buffered > max_target) {
+      int16_t discard[TALKBACK_SAMPLES_PER_FRAME];
+      while (audio_ring_fill(&talkback_ring) > target) {
+        audio_ring_read(&talkback_ring, discard, TALKBACK_SAMPLES_PER_FRAME);
+      }
+      buffered = audio_ring_fill(&talkback_ring) + audio_resampler_buffered(&resampler);
+    }
+
+    // Small errors are played out a little faster or slower (up to 5%)
+    error = buffered - target;
+    ppm = (int64_t)error * 1000000 / (TALKBACK_SAMPLE_RATE * 2);
+    if (ppm > 50000) ppm = 50000;
+    if (ppm < -50000) ppm = -50000;
+    audio_resampler_set_ppm(&resampler, ppm);
+
+    produced = audio_resample(&resampler, frame, TALKBACK_SAMPLES_PER_FRAME);
+    if (produced == 0) {
+      // Talk spurt is over
+      playing = 0;
+      continue;
+    }
+    if (produced < TALKBACK_SAMPLES_PER_FRAME) {
+      memset(&frame[produced], 0, (TALKBACK_SAMPLES_PER_FRAME - produced) * sizeof(int16_t));
+    }
+
+    memset(&audio_frame, 0, sizeof(IMPAudioFrame));
+    audio_frame.bitwidth = AUDIO_BIT_WIDTH_16;
+    audio_frame.soundmode = AUDIO_SOUND_MODE_MONO;
+    audio_frame.virAddr = (uint32_t *)frame;
+    audio_frame.len = sizeof(frame);
+
+    // Blocks while the AO buffer is full, which paces this thread
+    ret = IMP_AO_SendFrame(TALKBACK_AO_DEVICE, TALKBACK_AO_CHANNEL, &audio_frame, BLOCK);
+    if (ret != 0) {
+      log_error("IMP_AO_SendFrame failed");
+      continue;
+    }
+
+    // Mouth to speaker: age of the newest received sample plus everything
+    // queued in front of it in the ring and the AO buffers
+    queued = 0;
+    if (IMP_AO_QueryChnStat(TALKBACK_AO_DEVICE, TALKBACK_AO_CHANNEL, &ao_state) == 0) {
+      queued = ao_state.chnBusyNum * TALKBACK_SAMPLES_PER_FRAME;
+    }
+    queued += audio_ring_fill(&talkback_ring) + audio_resampler_buffered(&resampler);
+
+    // Nothing to measure before the first packet. A sender clock ahead of
+    // ours gives a negative age, which counts as none.
+    newest_us = talkback_newest_timestamp_us;
+    if (newest_us != 0) {
+      latency_us = realtime_us() - newest_us + (int64_t)queued * 1000000 / TALKBACK_SAMPLE_RATE;
+      talkback_stats.latency_us = latency_us > 0 ? latency_us : 0;
+      if (talkback_stats.latency_us > talkback_stats.max_latency_us) {
+        talkback_stats.max_latency_us = talkback_stats.latency_us;
+      }
+    }
+
+    if (time(NULL) - last_report >= AUDIO_REPORT_INTERVAL) {
+      log_info("Talkback latency %u ms (max %u ms), jitter %u ms, buffer %u ms, "
+               "packets %u, lost %u, late %u",
+               talkback_stats.latency_us / 1000,
+               talkback_stats.max_latency_us / 1000,
+               talkback_stats.jitter_us / 1000,
+               talkback_stats.target_delay_ms,
+               talkback_stats.packets,
+               talkback_stats.lost_packets,
+               talkback_stats.late_packets);
+      talkback_stats.max_latency_us = 0;
+      last_report = time(NULL);
+    }
+  }
+
+  return NULL;
+}
@@ -0,0 +1,240 @@
+#include "capture.h"
+#include "trace.h"
+#include <stdarg.h>
+
+/*
+
+Pipeline tracing. Every thread that records an event gets its own ring of
+TRACE_RING_EVENTS complete events (name, start, duration), written only
+by that thread, so recording takes no lock. The trace thread switches
+tracing on and off when SIGUSR1 arrives and, when it goes off, writes all
+rings to TRACE_FILE as Chrome trace JSON with one track per thread.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+typedef struct trace_event {
+	const char *name;
+	uint64_t start_us;
+	uint32_t duration_us;
+} TraceEvent;
+
+typedef struct trace_ring {
+	char name[TRACE_NAME_SIZE];
+	volatile uint32_t head;
+	TraceEvent events[TRACE_RING_EVENTS];
+} TraceRing;
+
+volatile int trace_enabled = 0;
+
+static volatile sig_atomic_t toggle_requested = 0;
+static TraceRing *rings[TRACE_MAX_THREADS];
+static int num_rings = 0;
+
+static __thread TraceRing *thread_ring = NULL;
+static __thread char thread_name[TRACE_NAME_SIZE];
+
+
+uint64_t trace_now_us(void)
+{
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+
+// Name the track of the calling thread in the trace
+void trace_thread_name(const char *format, ...)
+{
+  va_list ap;
+
+  va_start(ap, format);
+  vsnprintf(thread_name, sizeof(thread_name), format, ap);
+  va_end(ap);
+
+  if (thread_ring != NULL) {
+    memcpy(thread_ring->name, thread_name, sizeof(thread_name));
+  }
+}
+
+
+// Rings are only created once a thread records something while tracing
+// is on, and live until the process exits
+static TraceRing *get_thread_ring(void)
+{
+  int index;
+  TraceRing *ring;
+
+  if (thread_ring != NULL) {
+    return thread_ring;
+  }
+
+  index = __atomic_fetch_add(&num_rings, 1, __ATOMIC_RELAXED);
+  if (index >= TRACE_MAX_THREADS) {
+    return NULL;
+  }
+
+  ring = calloc(1, sizeof(TraceRing));
+  if (ring == NULL) {
+    return NULL;
+  }
+
+  if (thread_name[0] == '\0') {
+    snprintf(thread_name, sizeof(thread_name), "thread %d", index);
+  }
+  memcpy(ring->name, thread_name, sizeof(thread_name));
+
+  __atomic_store_n(&rings[index], ring, __ATOMIC_RELEASE);
+  thread_ring = ring;
+
+  return ring;
+}
+
+
+void trace_end(const char *name, uint64_t start_us)
+{
+  TraceRing *ring;
+  TraceEvent *event;
+  uint32_t head;
+
+  if (start_us == 0 || !trace_enabled) {
+    return;
+  }
+
+  ring = get_thread_ring();
+  if (ring == NULL) {
+    return;
+  }
+
+  head = ring->head;
+  event = &ring->events[head & (TRACE_RING_EVENTS - 1)];
+  event->name = name;
+  event->start_us = start_us;
+  event->duration_us = trace_now_us() - start_us;
+
+  __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+}
+
+
+// Safe to call from a signal handler
+void trace_request_toggle(void)
+{
+  toggle_requested = 1;
+}
+
+
+int trace_dump(const char *filename)
+{
+  FILE *fp;
+  int i, count;
+  int first = 1;
+  char temp_file[256];
+  uint32_t head, n;
+  TraceRing *ring;
+  TraceEvent *event;
+
+  snprintf(temp_file, sizeof(temp_file), "%s.tmp", filename);
+
+  fp = fopen(temp_file, "w");
+  if (fp == NULL) {
+    log_error("Unable to open %s", temp_file);
+    return -1;
+  }
+
+  count = num_rings < TRACE_MAX_THREADS ? num_rings : TRACE_MAX_THREADS;
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+
+  for (i = 0; i < count; i++) {
+    ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    if (ring == NULL) {
+      continue;
+    }
+
+    fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}",
+            first ? "" : ",\n", getpid(), i + 1, ring->name);
+    first = 0;
+
+    head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    n = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+    for (; n != head; n++) {
+      event = &ring->events[n & (TRACE_RING_EVENTS - 1)];
+      fprintf(fp, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%d,\"tid\":%d,\"ts\":%llu,\"dur\":%u}",
+              event->name, getpid(), i + 1,
+              (unsigned long long)event->start_us, event->duration_us);
+    }
+  }
+
+  fprintf(fp, "\n]}\n");
+  fclose(fp);
+
+  if (rename(temp_file, filename) != 0) {
+    log_error("Unable to rename %s to %s", temp_file, filename);
+    return -1;
+  }
+
+  return 0;
+}
+
+
+static void start_tracing(void)
+{
+  int i;
+  TraceRing *ring;
+
+  // Start every ring empty, so the dump only covers this session
+  for (i = 0; i < num_rings && i < TRACE_MAX_THREADS; i++) {
+    ring = __atomic_load_n(&rings[i], __ATOMIC_ACQUIRE);
+    if (ring != NULL) {
+      ring->head = 0;
+    }
+  }
+
+  trace_enabled = 1;
+  log_info("Tracing started, send SIGUSR1 again to stop it and write %s", TRACE_FILE);
+}
+
+
+static void stop_tracing(void)
+{
+  trace_enabled = 0;
+
+  // Let events that were being recorded finish
+  usleep(10000);
+
+  if (trace_dump(TRACE_FILE) == 0) {
+    log_info("Tracing stopped, trace written to %s", TRACE_FILE);
+  }
+}
+
+
+// This is the entrypoint for the trace thread. It only acts on SIGUSR1,
+// the handler just sets a flag.
+void *trace_entry_start(void *trace_thread_params)
+{
+  trace_thread_name("trace");
+
+  while(!sigint_received) {
+    usleep(100000);
+
+    if (!toggle_requested) {
+      continue;
+    }
+    toggle_requested = 0;
+
+    if (trace_enabled) {
+      stop_tracing();
+    }
+    else {
+      start_tracing();
+    }
+  }
+
+  if (trace_enabled) {
+    stop_tracing();
+  }
+
+  return NULL;
+}
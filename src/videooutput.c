@@ -0,0 +1,420 @@
+#include "capture.h"
+#include "frameactivity.h"
+#include "events.h"
+#include "trace.h"
+#include "replay.h"
+#include "calibration.h"
+#include "seitimestamp.h"
+#include "spsrewrite.h"
+#include <errno.h>
+
+/*
+
+The encoder output loop. Each encoder channel gets a thread that takes
+the encoded frames from IMP and writes them, one write per frame, to its
+v4l2loopback device.
+
+With replay_file set the frames come from a recording (see replay.c)
+instead of the encoder, everything after that is the same. With sps_vui
+set the SPS packs are swapped for rewritten ones (see spsrewrite.c) as
+the frame is put together.
+
+The output does not have to be a V4L2 device: anything that is not one
+(a file, a FIFO, /dev/null) gets the raw stream instead, which is what
+the host benchmark in src/sim relies on.
+
+*/
+
+extern sig_atomic_t sigint_received;
+
+
+// This is the entrypoint for the threads
+void *produce_frames(void *encoder_thread_params_ptr)
+{
+  int ret, i;
+  EncoderThreadParams *encoder_thread_params = encoder_thread_params_ptr;
+
+  // Unpack the EncoderThreadParams
+  EncoderSetting *encoder = encoder_thread_params->encoder;
+
+  log_info("Starting thread for encoder");
+
+  output_v4l2_frames(encoder);
+
+}
+
+int output_v4l2_frames(EncoderSetting *encoder_setting)
+{
+  int ret;
+  int stream_packets;
+  int i;
+  int total;
+  char *v4l2_device_path = encoder_setting->v4l2_device_path;
+  int video_width = encoder_setting->pic_width;
+  int video_height = encoder_setting->pic_height;
+
+  int frames_written = 0;
+  float current_fps = 0;
+  float elapsed_seconds = 0;
+  struct timeval tval_before, tval_after, tval_result;
+  float delay_in_seconds = 0;
+  float adjusted_delay_in_seconds = 0;
+
+
+  struct v4l2_capability vid_caps;
+  struct v4l2_format vid_format;
+
+  IMPEncoderStream stream;
+  EncoderStats *stats = &encoder_setting->stats;
+  uint32_t expected_seq = 0;
+  int have_seq = 0;
+  int64_t last_timestamp = 0;
+  uint32_t last_seq = 0;
+  uint32_t frame_interval_us;
+  FrameActivity frame_activity;
+  int activity_result;
+  int intra;
+  uint64_t trace_frame, trace_stage;
+  int replay = encoder_setting->replay_file[0] != '\0';
+  ReplaySource replay_source;
+  SpsRewriter sps_rewriter;
+  const uint8_t *pack_data;
+  int pack_length;
+
+  uint8_t *stream_chunk;
+  uint8_t *temp_chunk;
+
+
+  // h264 NAL unit stuff
+
+  // h264_stream_t *h = h264_new();
+  // int nal_start, nal_end;
+  // uint8_t* buf;
+  // int len;
+
+
+
+
+  frame_activity_init(&frame_activity);
+  if (encoder_setting->activity_detection && strcmp(encoder_setting->payload_type, "PT_H264") != 0) {
+    log_warn("Activity detection only works on H.264 channels, not on channel %d", encoder_setting->channel);
+    encoder_setting->activity_detection = 0;
+  }
+  if (encoder_setting->sei_timestamps && (strcmp(encoder_setting->payload_type, "PT_H264") != 0 || replay)) {
+    log_warn("SEI timestamps only work on encoded H.264 channels, not on channel %d", encoder_setting->channel);
+    encoder_setting->sei_timestamps = 0;
+  }
+  if (encoder_setting->sps_vui && strcmp(encoder_setting->payload_type, "PT_H264") != 0) {
+    log_warn("SPS rewriting only works on H.264 channels, not on channel %d", encoder_setting->channel);
+    encoder_setting->sps_vui = 0;
+  }
+  if (encoder_setting->sps_vui && sps_rewriter_init(&sps_rewriter, encoder_setting) != 0) {
+    encoder_setting->sps_vui = 0;
+  }
+
+  delay_in_seconds = (1.0 * encoder_setting->frame_rate_denominator) / encoder_setting->frame_rate_numerator;
+  log_info("Delay in seconds: %f", delay_in_seconds);
+
+
+
+
+
+
+  log_info("Opening V4L2 device: %s ", v4l2_device_path);
+  int v4l2_fd = open(v4l2_device_path, O_WRONLY, 0777);
+
+  if (v4l2_fd < 0) {
+    log_error("Failed to open V4L2 device: %s", v4l2_device_path);
+    return -1;
+  }
+
+
+  // ret = ioctl(v4l2_fd, VIDIOC_QUERYCAP, &vid_caps);
+
+  memset(&vid_format, 0, sizeof(vid_format));
+  vid_format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+  vid_format.fmt.pix.width = video_width;
+  vid_format.fmt.pix.height = video_height;
+
+  if (strcmp(encoder_setting->payload_type, "PT_H264") == 0) {
+    vid_format.fmt.pix.pixelformat = V4L2_PIX_FMT_H264;
+    vid_format.fmt.pix.sizeimage = 0;
+    vid_format.fmt.pix.field = V4L2_FIELD_NONE;
+    vid_format.fmt.pix.bytesperline = 0;
+    vid_format.fmt.pix.colorspace = V4L2_PIX_FMT_YUV420;
+  }
+  else if(strcmp(encoder_setting->payload_type, "PT_JPEG") == 0) {
+    vid_format.fmt.pix.pixelformat = V4L2_PIX_FMT_JPEG;
+    // TODO: Is this correct? Doc says needs to be set to maximum size of image
+    vid_format.fmt.pix.sizeimage = 0; 
+    vid_format.fmt.pix.field = V4L2_FIELD_NONE;
+    vid_format.fmt.pix.bytesperline = 0;
+    vid_format.fmt.pix.colorspace = V4L2_COLORSPACE_JPEG;
+  }
+  else {
+    log_error("Unknown payload type: %s", encoder_setting->payload_type);
+    return -1;
+  }
+
+
+  ret = ioctl(v4l2_fd, VIDIOC_S_FMT, &vid_format);
+  if (ret < 0 && errno == ENOTTY) {
+    log_warn("%s is not a V4L2 device, writing the raw stream to it", v4l2_device_path);
+  }
+  else if (ret < 0) {
+    log_error("Unable to set V4L2 device video format: %d", ret);
+    return -1;
+  }
+  else {
+    ret = ioctl(v4l2_fd, VIDIOC_STREAMON, &vid_format);
+    if (ret < 0) {
+      log_error("Unable to perform VIDIOC_STREAMON: %d", ret);
+      return -1;
+    }
+
+    log_info("V4L2 device opened and setup complete: VIDIOC_STREAMON");
+  }
+  
+
+  log_info("Sleeping 2 seconds before starting to send frames...");
+
+
+  trace_thread_name("encoder %d", encoder_setting->channel);
+
+  if (replay) {
+    ret = replay_open(&replay_source, encoder_setting);
+  }
+  else {
+    ret = IMP_Encoder_StartRecvPic(encoder_setting->channel);
+  }
+  if (ret < 0) {
+    log_error("Unable to start receiving frames on channel %d.", encoder_setting->channel);
+    return -1;
+  }
+
+  // Every set number of frames calculate out how many frames per second we are getting
+  current_fps = 0;
+  frames_written = 0;
+  gettimeofday(&tval_before, NULL);
+
+
+  // int samples_file;
+  // samples_file = fopen("/tmp/samples.pcm", "w");
+
+  clock_t start, end;
+  double cpu_time_used;
+
+
+  while(!sigint_received) {
+    start = clock();
+
+    // Video Frames
+    if (frames_written == 200) {
+      gettimeofday(&tval_after, NULL);
+      timersub(&tval_after, &tval_before, &tval_result);
+
+      elapsed_seconds =  (long int)tval_result.tv_sec + ((long int)tval_result.tv_usec / 1000000);
+
+      current_fps = 200 / elapsed_seconds;
+      log_info("Current FPS: %.2f / Channel %d", current_fps, encoder_setting->channel);
+
+      // if (strcmp(v4l2_device_path, "/dev/video3") == 0) {
+      //   log_info("Obtained %d 16-bit samples from this specific audio frame", num_samples);
+      // }
+
+      // IMPEncoderCHNStat encoder_status;
+
+      // IMP_Encoder_Query(encoder_setting->channel, &encoder_status);
+
+      // log_info("Registered: %u", encoder_status.registered);
+      // log_info("Work done (0 is running, 1 is not running): %u", encoder_status.work_done);
+      // log_info("Number of images to be encoded: %u", encoder_status.leftPics);
+      // log_info("Number of bytes remaining in the stream buffer: %u", encoder_status.leftStreamBytes);
+
+      frames_written = 0;
+      gettimeofday(&tval_before, NULL);
+    }
+
+
+    trace_stage = trace_begin();
+    if (replay) {
+      ret = replay_poll(&replay_source, 1000);
+    }
+    else {
+      ret = IMP_Encoder_PollingStream(encoder_setting->channel, 1000);
+    }
+    trace_end("PollingStream", trace_stage);
+    if (ret < 0) {
+      log_error("Timeout while polling for stream on channel %d.", encoder_setting->channel);
+      stats->poll_timeouts++;
+      continue;
+    }
+
+    // Everything between the encoder having a frame and handing it back
+    trace_frame = trace_begin();
+
+    // Get H264 Stream on channel and enable a blocking call
+    trace_stage = trace_begin();
+    if (replay) {
+      ret = replay_get_stream(&replay_source, &stream);
+    }
+    else {
+      ret = IMP_Encoder_GetStream(encoder_setting->channel, &stream, 1);
+    }
+    trace_end("GetStream", trace_stage);
+    if (ret == REPLAY_END && replay) {
+      log_info("Replay of %s on channel %d finished", encoder_setting->replay_file, encoder_setting->channel);
+      break;
+    }
+    if (ret < 0) {
+      log_error("IMP_Encoder_GetStream() failed");
+      return -1;
+    }
+
+    stream_packets = stream.packCount;
+
+    // The encoder numbers frames, a gap means frames were lost before we got them
+    if (have_seq && stream.seq != expected_seq) {
+      stats->dropped_frames += stream.seq - expected_seq;
+    }
+    expected_seq = stream.seq + 1;
+    have_seq = 1;
+
+    // As early as possible, so it is queued before the next picture. The
+    // next frame is expected one measured frame interval later, which
+    // follows adaptive rate changes and is not thrown off by lost frames.
+    if (encoder_setting->sei_timestamps && stream_packets > 0) {
+      frame_interval_us = 1000000 * delay_in_seconds;
+      if (last_timestamp != 0 && stream.seq != last_seq &&
+          stream.pack[0].timestamp > last_timestamp) {
+        frame_interval_us = (stream.pack[0].timestamp - last_timestamp) / (stream.seq - last_seq);
+      }
+      last_timestamp = stream.pack[0].timestamp;
+      last_seq = stream.seq;
+
+      if (sei_timestamp_insert(encoder_setting->channel, stream.pack[0].timestamp, stream.seq,
+                               frame_interval_us) != 0) {
+        log_warn("Unable to insert the SEI timestamp on channel %d", encoder_setting->channel);
+      }
+    }
+
+    trace_stage = trace_begin();
+    intra = 0;
+    total = 0;
+    stream_chunk = malloc(1);
+    if (stream_chunk == NULL) {
+      log_error("Malloc returned NULL.");
+      return -1;
+    }
+
+    for (i = 0; i < stream_packets; i++) {
+      log_debug("Processing packet %d of size %d.", total, i, stream.pack[i].length);
+
+      pack_data = (const uint8_t *)stream.pack[i].virAddr;
+      pack_length = stream.pack[i].length;
+      if (encoder_setting->sps_vui && stream.pack[i].dataType.h264Type == IMP_NAL_SPS) {
+        ret = sps_rewrite(&sps_rewriter, pack_data, pack_length, &pack_data);
+        if (ret > 0) {
+          pack_length = ret;
+        }
+      }
+
+      temp_chunk = realloc(stream_chunk, total + pack_length);
+
+      if (temp_chunk == NULL) {
+        log_error("realloc returned NULL for request of size: %d", total);
+        return -1;
+      }
+
+      log_debug("Allocated an additional %d bytes for packet %d.", total + pack_length, i);
+
+      // Allocating worked
+      stream_chunk = temp_chunk;
+      temp_chunk = NULL;
+
+      memcpy(&stream_chunk[total], pack_data, pack_length);
+      total = total + pack_length;
+
+      if (stream.pack[i].dataType.h264Type == IMP_NAL_SLICE_IDR) {
+        intra = 1;
+      }
+
+      log_debug("Total size of chunk after concatenating: %d bytes.", total);
+    }
+
+    trace_end("assemble", trace_stage);
+
+    // Write out to the V4L2 device (for example /dev/video0)
+    trace_stage = trace_begin();
+    ret = write(v4l2_fd, (void *)stream_chunk, total);
+    trace_end("write", trace_stage);
+    if (ret != total) {
+      log_error("Stream write error: %s", ret);
+      return -1;
+    }
+  
+    free(stream_chunk);
+
+    trace_stage = trace_begin();
+    if (!replay) {
+      IMP_Encoder_ReleaseStream(encoder_setting->channel, &stream);
+    }
+    trace_end("ReleaseStream", trace_stage);
+    trace_end("frame", trace_frame);
+
+    frames_written = frames_written + 1;
+    stats->frames++;
+    stats->bytes += total;
+    calibration_record_frame(encoder_setting->channel, total, intra);
+
+    if (encoder_setting->activity_detection) {
+      activity_result = frame_activity_update(&frame_activity, total, intra);
+
+      if (activity_result & FRAME_ACTIVITY_STARTED) {
+        publish_event("activity", "\"channel\":%d,\"state\":\"start\",\"z\":%.1f",
+                      encoder_setting->channel, frame_activity.z);
+      }
+      if (activity_result & FRAME_ACTIVITY_STOPPED) {
+        publish_event("activity", "\"channel\":%d,\"state\":\"stop\",\"peak_z\":%.1f",
+                      encoder_setting->channel, frame_activity.event_peak_z);
+      }
+      if (activity_result & FRAME_ACTIVITY_SCENE_CHANGE) {
+        publish_event("scene_change", "\"channel\":%d,\"bytes\":%d", encoder_setting->channel, total);
+        if (encoder_setting->scene_change_idr && !replay) {
+          IMP_Encoder_RequestIDR(encoder_setting->channel);
+        }
+      }
+    }
+
+    end = clock();
+    cpu_time_used = ((double) (end - start)) / CLOCKS_PER_SEC;
+
+    adjusted_delay_in_seconds = delay_in_seconds - cpu_time_used;
+
+    // Replay paces itself in replay_poll()
+    if (!replay) {
+      usleep(1000 * 1000 * delay_in_seconds);
+    }
+
+  }
+
+
+  close(v4l2_fd);
+
+  if (encoder_setting->sps_vui) {
+    sps_rewriter_free(&sps_rewriter);
+  }
+
+  if (replay) {
+    replay_close(&replay_source);
+    return 0;
+  }
+
+  ret = IMP_Encoder_StopRecvPic(encoder_setting->channel);
+  if (ret < 0) {
+    log_error("IMP_Encoder_StopRecvPic(%d) failed", encoder_setting->channel);
+    return -1;
+  }
+
+  return 0;
+}